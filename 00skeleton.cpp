@@ -8,8 +8,27 @@
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+
 #include <iostream>
 
+#include <time.h>
+unsigned long long raw_time()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (unsigned long long)t.tv_sec * (unsigned long long)1000000000 + (unsigned long long)t.tv_nsec;
+}
+unsigned long long glwtGetNanoTime()
+{
+   static unsigned long long base = 0;
+   if(base == 0)
+      base = raw_time();
+   return raw_time() - base;
+}
+
 struct UserData {
     bool running;
 };
@@ -33,10 +52,14 @@ static void key_callback(GLWTWindow *window, int down, int keysym, int scancode,
         ((UserData*)userdata)->running = false;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
    
     UserData userdata;
     userdata.running = true;
@@ -50,7 +73,7 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
     glwt_config.api_version_major = 3;
     glwt_config.api_version_minor = 3;
     
@@ -93,32 +116,39 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
     
     // creation and initialization of stuff goes here
 
     while(userdata.running)
     {   
+        bench.begin_frame();
+
         // update events 
         glwtEventHandle(0);
         
         // drawing etc goes here
         // ...
        
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
-        {
-            userdata.running = false;       
-        }
-        
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window);       
     }
 
 
+    bench.shutdown();
+    profiler.shutdown();
+
     glwtWindowDestroy(window);
     glwtQuit();
     return 0;
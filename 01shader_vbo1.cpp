@@ -8,10 +8,28 @@
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+
 #include <iostream>
 #include <string>
 #include <vector>
 
+#include <time.h>
+unsigned long long raw_time()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (unsigned long long)t.tv_sec * (unsigned long long)1000000000 + (unsigned long long)t.tv_nsec;
+}
+unsigned long long glwtGetNanoTime()
+{
+   static unsigned long long base = 0;
+   if(base == 0)
+      base = raw_time();
+   return raw_time() - base;
+}
 
 struct UserData {
     bool running;
@@ -70,10 +88,14 @@ bool check_program_link_status(GLuint obj)
     return true;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
    
     UserData userdata;
     userdata.running = true;
@@ -87,7 +109,7 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
     glwt_config.api_version_major = 3;
     glwt_config.api_version_minor = 3;
     
@@ -130,9 +152,11 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
 
     // shader source code
     std::string vertex_source =
@@ -233,6 +257,8 @@ int main()
 
     while(userdata.running)
     {
+        bench.begin_frame();
+
         // update events
         glwtEventHandle(0);
                     
@@ -248,13 +274,13 @@ int main()
         // draw
         glDrawArrays(GL_TRIANGLES, 0, 6);
        
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
-        {
-            userdata.running = false;       
-        }
-        
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window);      
     }
@@ -270,6 +296,9 @@ int main()
     glDeleteShader(fragment_shader);
     glDeleteProgram(shader_program);
     
+    bench.shutdown();
+    profiler.shutdown();
+
     glwtWindowDestroy(window);
     glwtQuit();
     return 0;
@@ -2,15 +2,42 @@
  * 
  * apply a texture to the fullscreen quad of "Indexed VBO"
  * 
+ * the texture is generated and uploaded in the background by the
+ * texture loader, the quad is drawn once it is done.
+ * --texture-size N makes the texture N*N instead of the window size,
+ * --bc1 stores it compressed.
+ * 
  * Autor: Jakob Progsch
  */
 
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "texture_loader.hpp"
+#include "options.hpp"
+
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstdlib>
+
+#include <time.h>
+unsigned long long raw_time()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (unsigned long long)t.tv_sec * (unsigned long long)1000000000 + (unsigned long long)t.tv_nsec;
+}
+unsigned long long glwtGetNanoTime()
+{
+   static unsigned long long base = 0;
+   if(base == 0)
+      base = raw_time();
+   return raw_time() - base;
+}
 
 struct UserData {
     bool running;
@@ -69,10 +96,14 @@ bool check_program_link_status(GLuint obj)
     return true;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
    
     UserData userdata;
     userdata.running = true;
@@ -86,7 +117,7 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
     glwt_config.api_version_major = 3;
     glwt_config.api_version_minor = 3;
     
@@ -129,9 +160,11 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
 
     // shader source code
     std::string vertex_source =
@@ -243,44 +276,61 @@ int main()
     // "unbind" vao
     glBindVertexArray(0);
 
-    // texture handle
-    GLuint texture;
+    // the loader generates textures on its own thread
+    TextureLoader loader;
+    loader.start();
     
-    // generate texture
-    glGenTextures(1, &texture);
-
-    // bind the texture
-    glBindTexture(GL_TEXTURE_2D, texture);
-
-    // create some image data
-    std::vector<GLubyte> image(4*width*height);
-    for(int j = 0;j<height;++j)
-        for(int i = 0;i<width;++i)
-        {
-            size_t index = j*width + i;
-            image[4*index + 0] = 0xFF*(j/10%2)*(i/10%2); // R
-            image[4*index + 1] = 0xFF*(j/13%2)*(i/13%2); // G
-            image[4*index + 2] = 0xFF*(j/17%2)*(i/17%2); // B
-            image[4*index + 3] = 0xFF;                   // A
-        }
+    int texture_width = int_option(argc, argv, "--texture-size", width);
+    int texture_height = int_option(argc, argv, "--texture-size", height);
+    bool compress = has_flag(argc, argv, "--bc1");
+    if(compress && !loader.compressed_supported())
+        std::cerr << "BC1 textures are not supported, using rgba8" << std::endl;
+    
+    // create some image data, the loader calls this with ranges of rows
+    // from several threads
+    unsigned long long load_start = glwtGetNanoTime();
+    GLuint texture = loader.load(texture_width, texture_height, TextureFormat::rgba8(), true, compress,
+        [=](int begin, int end, void *data) {
+            GLubyte *image = (GLubyte*)data;
+            for(int j = begin;j<end;++j)
+                for(int i = 0;i<texture_width;++i)
+                {
+                    size_t index = size_t(j)*texture_width + i;
+                    image[4*index + 0] = 0xFF*(j/10%2)*(i/10%2); // R
+                    image[4*index + 1] = 0xFF*(j/13%2)*(i/13%2); // G
+                    image[4*index + 2] = 0xFF*(j/17%2)*(i/17%2); // B
+                    image[4*index + 3] = 0xFF;                   // A
+                }
+        });
     
-    // set texture parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    // set texture parameters, load leaves the texture bound
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    
-    // set texture content
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &image[0]);
+    bool loaded = false;
     
     while(userdata.running)
     {
+        bench.begin_frame();
+
         // update events
         glwtEventHandle(0);
+        
+        // upload finished textures
+        loader.update();
             
         // clear first
         glClear(GL_COLOR_BUFFER_BIT);
         
+        if(!loaded && loader.ready(texture))
+        {
+            loaded = true;
+            if(!bench.benchmarking())
+                std::cout << texture_width << "x" << texture_height << " texture loaded after "
+                          << (glwtGetNanoTime()-load_start)*1.e-6 << " ms" << std::endl;
+        }
+        
         // use the shader program
         glUseProgram(shader_program);
 
@@ -294,22 +344,24 @@ int main()
         // bind the vao
         glBindVertexArray(vao);
         
-        // draw
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        // draw once there is something to show
+        if(loaded)
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
        
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
-        {
-            userdata.running = false;       
-        }
-        
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window);       
     }
     
     // delete the created objects
     
+    loader.stop();
     glDeleteTextures(1, &texture);
     
     glDeleteVertexArrays(1, &vao);
@@ -322,6 +374,9 @@ int main()
     glDeleteShader(fragment_shader);
     glDeleteProgram(shader_program);
 
+    bench.shutdown();
+    profiler.shutdown();
+
     glwtWindowDestroy(window);
     glwtQuit();
     return 0;
@@ -2,6 +2,16 @@
  * 
  * render the cube from the perspective example to a texture and
  * apply fxaa antialiasing to it.
+ * The offscreen target follows the window size and can be rendered at
+ * a fraction of it, fxaa then also upscales the image to the window.
+ * --render-scale P sets a fixed scale in percent, --target-ms N adapts
+ * the scale between --min-scale P (default 50) and 100 percent so the
+ * gpu frame time stays around N milliseconds.
+ * With --compute (needs GL 4.3) fxaa runs in two compute passes. The
+ * first loads luma tiles into shared memory, copies the pixels without
+ * a local contrast edge and appends the others to a list. The second
+ * runs the edge search only for the listed pixels through an indirect
+ * dispatch sized by the first pass. C switches between both paths.
  * 
  * Autor: Jakob Progsch
  */
@@ -9,6 +19,12 @@
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "shader_program.hpp"
+#include "options.hpp"
+
 //glm is used to create perspective and transform matrices
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -17,6 +33,9 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
 
 #include <time.h>
 unsigned long long raw_time()
@@ -36,6 +55,9 @@ unsigned long long glwtGetNanoTime()
 struct UserData {
     bool running;
     bool fxaa;
+    bool compute;
+    bool resized;
+    int width, height;
 };
 
 static void error_callback(const char *msg, void *userdata)
@@ -50,6 +72,15 @@ static void close_callback(GLWTWindow *window, void *userdata)
     ((UserData*)userdata)->running = false;
 }
 
+static void resize_callback(GLWTWindow *window, int width, int height, void *void_userdata)
+{
+    (void)window;
+    UserData *userdata = (UserData*)void_userdata;
+    userdata->width = width;
+    userdata->height = height;
+    userdata->resized = true;
+}
+
 static void key_callback(GLWTWindow *window, int down, int keysym, int scancode, int mod, void *void_userdata)
 {
     (void)window; (void)scancode; (void)mod;
@@ -59,49 +90,87 @@ static void key_callback(GLWTWindow *window, int down, int keysym, int scancode,
     
     if(keysym == GLWT_KEY_SPACE && down)
         userdata->fxaa = !userdata->fxaa;
+    
+    if(keysym == GLWT_KEY_C && down)
+        userdata->compute = !userdata->compute;
 }
 
-// helper to check and display for shader compiler errors
-bool check_shader_compile_status(GLuint obj)
-{
-    GLint status;
-    glGetShaderiv(obj, GL_COMPILE_STATUS, &status);
-    if(status == GL_FALSE)
+// offscreen color texture and depth renderbuffer the scene is rendered
+// to. the attachments are reallocated whenever the requested size
+// changes, the object names stay the same
+struct RenderTarget {
+    RenderTarget() : width(0), height(0), texture(0), rbf(0), fbo(0) { }
+    
+    // returns true if the attachments had to be reallocated
+    bool resize(int new_width, int new_height)
     {
-        GLint length;
-        glGetShaderiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetShaderInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;
+        if(new_width == width && new_height == height)
+            return false;
+        width = new_width;
+        height = new_height;
+        
+        if(fbo == 0)
+        {
+            glGenTextures(1, &texture);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glGenRenderbuffers(1, &rbf);
+            glGenFramebuffers(1, &fbo);
+        }
+        
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        
+        glBindRenderbuffer(GL_RENDERBUFFER, rbf);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rbf);
+        return true;
     }
-    return true;
-}
-
-// helper to check and display for shader linker error
-bool check_program_link_status(GLuint obj)
-{
-    GLint status;
-    glGetProgramiv(obj, GL_LINK_STATUS, &status);
-    if(status == GL_FALSE)
+    
+    void destroy()
     {
-        GLint length;
-        glGetProgramiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetProgramInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;   
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteRenderbuffers(1, &rbf);
+        glDeleteTextures(1, &texture);
+        fbo = rbf = texture = 0;
+        width = height = 0;
     }
-    return true;
-}
+    
+    int width, height;
+    GLuint texture, rbf, fbo;
+};
 
-int main()
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
    
     UserData userdata;
     userdata.running = true;
+    userdata.resized = false;
+    userdata.width = width;
+    userdata.height = height;
+    
+    // fraction of the window size the scene is rendered at
+    int min_scale = glm::clamp(int_option(argc, argv, "--min-scale", 50), 10, 100);
+    float render_scale = glm::clamp(int_option(argc, argv, "--render-scale", 100), min_scale, 100)/100.0f;
+    
+    // a target frame time turns on the dynamic scale
+    int target_ms = int_option(argc, argv, "--target-ms", 0);
+    
+    // the compute fxaa needs GL 4.3
+    bool compute = has_flag(argc, argv, "--compute");
+    userdata.compute = compute;
     
     GLWTConfig glwt_config;
     glwt_config.red_bits = 8;
@@ -112,8 +181,8 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
-    glwt_config.api_version_major = 3;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
+    glwt_config.api_version_major = compute ? 4 : 3;
     glwt_config.api_version_minor = 3;
     
     GLWTAppCallbacks app_callbacks;
@@ -129,7 +198,7 @@ int main()
     GLWTWindowCallbacks win_callbacks;
     win_callbacks.close_callback = close_callback;
     win_callbacks.expose_callback = 0;
-    win_callbacks.resize_callback = 0;
+    win_callbacks.resize_callback = resize_callback;
     win_callbacks.show_callback = 0;
     win_callbacks.focus_callback = 0;
     win_callbacks.key_callback = key_callback,
@@ -155,9 +224,11 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
 
     // shader source code
     std::string vertex_source =
@@ -181,50 +252,9 @@ int main()
         "   FragColor.a = dot(fcolor.rgb, vec3(0.299, 0.587, 0.114));\n"
         "}\n";
    
-    // program and shader handles
-    GLuint shader_program, vertex_shader, fragment_shader;
-    
-    
-    // we need these to properly pass the strings
-    const char *source;
-    int length;
-
-    // create and compiler vertex shader
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = vertex_source.c_str();
-    length = vertex_source.size();
-    glShaderSource(vertex_shader, 1, &source, &length); 
-    glCompileShader(vertex_shader);
-    if(!check_shader_compile_status(vertex_shader))
-    {
-        return 1;
-    }
- 
-    // create and compiler fragment shader
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = fragment_source.c_str();
-    length = fragment_source.size();
-    glShaderSource(fragment_shader, 1, &source, &length);   
-    glCompileShader(fragment_shader);
-    if(!check_shader_compile_status(fragment_shader))
-    {
-        return 1;
-    }
-    
-    // create program
-    shader_program = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, fragment_shader);
-    
-    // link the program and check for errors
-    glLinkProgram(shader_program);
-    check_program_link_status(shader_program);
-    
-    // obtain location of projection uniform
-    GLint ViewProjection_location = glGetUniformLocation(shader_program, "ViewProjection");
-    
+    // the programs are all linked at once after the fxaa sources below
+    ShaderProgram shader_program;
+    shader_program.add(GL_VERTEX_SHADER, vertex_source).add(GL_FRAGMENT_SHADER, fragment_source);
     
     // vao and vbo handle
     GLuint vao, vbo, ibo;
@@ -342,12 +372,9 @@ int main()
     // #define FXAA_GLSL_130 1
     // #define FXAA_QUALITY__PRESET 13
     
-    std::string post_effect_fragment_source =
-        "#version 330\n"
-        "uniform sampler2D texture;\n"
-        "in vec2 ftexcoord;\n"
-        "layout(location = 0) out vec4 FragColor;\n"
-        "\n"
+    // the fxaa function is shared by the fragment shader and the
+    // compute path
+    std::string fxaa_source =
         "float FxaaLuma(vec4 rgba) {\n"
         "    return rgba.w;\n"
         "}\n"
@@ -530,7 +557,15 @@ int main()
         "    \n"
         "    return vec4(textureLod(tex, posM, 0.0).xyz, rgbyM.w);\n"
         "}\n"
-        "\n"
+        "\n";
+
+    std::string post_effect_fragment_source =
+        "#version 330\n"
+        "uniform sampler2D texture;\n"
+        "in vec2 ftexcoord;\n"
+        "layout(location = 0) out vec4 FragColor;\n"
+        "\n" +
+        fxaa_source +
         "void main() {    \n"
         "    FragColor = FxaaPixelShader(\n"
         "                    ftexcoord,\n"
@@ -542,44 +577,121 @@ int main()
         "                );\n"
         "}\n";
    
-    // program and shader handles
-    GLuint post_effect_shader_program, post_effect_vertex_shader, post_effect_fragment_shader;
-
-    // create and compiler vertex shader
-    post_effect_vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = post_effect_vertex_source.c_str();
-    length = post_effect_vertex_source.size();
-    glShaderSource(post_effect_vertex_shader, 1, &source, &length); 
-    glCompileShader(post_effect_vertex_shader);
-    if(!check_shader_compile_status(post_effect_vertex_shader))
+    ShaderProgram post_effect_shader_program;
+    post_effect_shader_program.add(GL_VERTEX_SHADER, post_effect_vertex_source);
+    post_effect_shader_program.add(GL_FRAGMENT_SHADER, post_effect_fragment_source);
+    
+    // compute fxaa objects
+    ShaderProgram classify_program, edge_program;
+    GLuint edge_buffer = 0, dispatch_buffer = 0;
+    GLuint resolve_texture = 0, resolve_fbo = 0;
+    
+    // indirect dispatch arguments followed by the number of edge pixels.
+    // the edge groups are laid out in rows of up to 1024 groups
+    // since a dispatch only guarantees 65535 groups per dimension
+    const GLuint dispatch_reset[4] = { 0, 0, 1, 0 };
+    
+    if(compute)
     {
-        return 1;
+        // the early exit test of FxaaPixelShader on a tile of luma
+        // values. the lumas are fetched at texel centers with clamped
+        // coordinates which matches the clamped offset fetches in the
+        // fragment shader. each group reserves space for its edge
+        // pixels with one global atomic and keeps the group counts of
+        // the second pass large enough for the reserved range
+        std::string classify_source =
+            "#version 430\n"
+            "layout(local_size_x = 16, local_size_y = 16) in;\n"
+            "uniform sampler2D scene;\n"
+            "layout(rgba8, binding = 0) writeonly uniform image2D result;\n"
+            "layout(std430, binding = 0) writeonly buffer EdgeList { uint edge[]; };\n"
+            "layout(std430, binding = 1) buffer Dispatch { uint groups_x, groups_y, groups_z, edge_count; };\n"
+            "shared float luma[18*18];\n"
+            "shared uint group_count, group_base;\n"
+            "void main() {\n"
+            "   ivec2 size = textureSize(scene, 0);\n"
+            "   ivec2 origin = ivec2(gl_WorkGroupID.xy)*16 - 1;\n"
+            "   int first = int(gl_LocalInvocationIndex);\n"
+            "   if(first == 0) group_count = 0u;\n"
+            "   for(int i = first;i<18*18;i += 256) {\n"
+            "       ivec2 c = clamp(origin + ivec2(i%18, i/18), ivec2(0), size-1);\n"
+            "       luma[i] = texelFetch(scene, c, 0).a;\n"
+            "   }\n"
+            "   barrier();\n"
+            
+            "   ivec2 p = ivec2(gl_LocalInvocationID.xy) + 1;\n"
+            "   ivec2 pixel = origin + p;\n"
+            "   bool inside = all(lessThan(pixel, size));\n"
+            "   int i = p.y*18 + p.x;\n"
+            "   float lumaM = luma[i];\n"
+            "   float rangeMax = max(max(lumaM, max(luma[i-1], luma[i+1])), max(luma[i-18], luma[i+18]));\n"
+            "   float rangeMin = min(min(lumaM, min(luma[i-1], luma[i+1])), min(luma[i-18], luma[i+18]));\n"
+            "   bool is_edge = inside && rangeMax-rangeMin >= max(0.0625, rangeMax*0.166);\n"
+            "   uint slot = 0u;\n"
+            "   if(is_edge)\n"
+            "       slot = atomicAdd(group_count, 1u);\n"
+            "   else if(inside)\n"
+            "       imageStore(result, pixel, texelFetch(scene, pixel, 0));\n"
+            "   barrier();\n"
+            
+            "   if(first == 0 && group_count > 0u) {\n"
+            "       group_base = atomicAdd(edge_count, group_count);\n"
+            "       uint needed = (group_base+group_count+63u)/64u;\n"
+            "       atomicMax(groups_x, min(needed, 1024u));\n"
+            "       atomicMax(groups_y, (needed+1023u)/1024u);\n"
+            "   }\n"
+            "   barrier();\n"
+            "   if(is_edge)\n"
+            "       edge[group_base+slot] = uint(pixel.x) | (uint(pixel.y) << 16);\n"
+            "}\n";
+        
+        std::string edge_source =
+            "#version 430\n"
+            "layout(local_size_x = 64) in;\n"
+            "uniform sampler2D scene;\n"
+            "layout(rgba8, binding = 0) writeonly uniform image2D result;\n"
+            "layout(std430, binding = 0) readonly buffer EdgeList { uint edge[]; };\n"
+            "layout(std430, binding = 1) readonly buffer Dispatch { uint groups_x, groups_y, groups_z, edge_count; };\n"
+            "\n" +
+            fxaa_source +
+            "void main() {\n"
+            "   uint id = (gl_WorkGroupID.y*gl_NumWorkGroups.x + gl_WorkGroupID.x)*64u + gl_LocalInvocationID.x;\n"
+            "   if(id >= edge_count) return;\n"
+            "   ivec2 pixel = ivec2(edge[id] & 0xffffu, edge[id] >> 16);\n"
+            "   vec2 rcp_frame = 1.0/vec2(textureSize(scene, 0));\n"
+            "   imageStore(result, pixel, FxaaPixelShader((vec2(pixel)+0.5)*rcp_frame, scene, rcp_frame, 0.75, 0.166, 0.0625));\n"
+            "}\n";
+        
+        classify_program.add(GL_COMPUTE_SHADER, classify_source);
+        edge_program.add(GL_COMPUTE_SHADER, edge_source);
+        
+        glGenBuffers(1, &dispatch_buffer);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, dispatch_buffer);
+        glBufferData(GL_DISPATCH_INDIRECT_BUFFER, sizeof(dispatch_reset), dispatch_reset, GL_DYNAMIC_DRAW);
+        
+        // these three follow the size of the render target
+        glGenBuffers(1, &edge_buffer);
+        
+        glGenTextures(1, &resolve_texture);
+        glBindTexture(GL_TEXTURE_2D, resolve_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        
+        glGenFramebuffers(1, &resolve_fbo);
     }
- 
-    // create and compiler fragment shader
-    post_effect_fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = post_effect_fragment_source.c_str();
-    length = post_effect_fragment_source.size();
-    glShaderSource(post_effect_fragment_shader, 1, &source, &length);   
-    glCompileShader(post_effect_fragment_shader);
-    if(!check_shader_compile_status(post_effect_fragment_shader))
+    
+    // compile and link everything at once
+    bool linked = compute ? link_programs({&shader_program, &post_effect_shader_program, &classify_program, &edge_program})
+                          : link_programs({&shader_program, &post_effect_shader_program});
+    if(!linked)
     {
         return 1;
     }
     
-    // create program
-    post_effect_shader_program = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(post_effect_shader_program, post_effect_vertex_shader);
-    glAttachShader(post_effect_shader_program, post_effect_fragment_shader);
-    
-    // link the program and check for errors
-    glLinkProgram(post_effect_shader_program);
-    check_program_link_status(post_effect_shader_program);
-    
-    // get texture uniform location
-    GLint post_effect_texture_location = glGetUniformLocation(post_effect_shader_program, "texture");
+    GLint ViewProjection_location = shader_program.uniform("ViewProjection");
+    GLint post_effect_texture_location = post_effect_shader_program.uniform("texture");
+    GLint classify_scene_location = classify_program.uniform("scene");
+    GLint edge_scene_location = edge_program.uniform("scene");
     
     // vao and vbo handle
     GLuint post_effect_vao, post_effect_vbo, post_effect_ibo;
@@ -628,72 +740,74 @@ int main()
     // "unbind" vao
     glBindVertexArray(0);
     
-    // texture handle
-    GLuint texture;
+    // the scene render target, allocated in the loop
+    RenderTarget target;
     
-    // generate texture
-    glGenTextures(1, &texture);
-
-    // bind the texture
-    glBindTexture(GL_TEXTURE_2D, texture);
-     
-    // set texture parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-     
-    // set texture content
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-
-
-    // renderbuffer handle
-    GLuint rbf;
+    // the scale the target was last allocated with. it only follows
+    // render_scale in 5% steps so the attachments aren't reallocated
+    // every frame
+    float applied_scale = render_scale;
     
-    // generate renderbuffers
-    glGenRenderbuffers(1, &rbf);
-       
-    glBindRenderbuffer(GL_RENDERBUFFER, rbf);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
-
-    // framebuffer handle
-    GLuint fbo;
-        
-    // generate framebuffer
-    glGenFramebuffers(1, &fbo);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-        
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rbf);
-   
+    unsigned long long last_report = glwtGetNanoTime();
+    GLuint edge_count = 0;
   
     userdata.fxaa = true;
     while(userdata.running)
     {   
+        bench.begin_frame();
+
         // get the time in seconds
         float t = glwtGetNanoTime()*1.e-9f;
         
         // update events
         glwtEventHandle(0);
         
+        // the offscreen benchmark framebuffer keeps its size
+        if(userdata.resized && bench.framebuffer() == 0)
+        {
+            width = std::max(1, userdata.width);
+            height = std::max(1, userdata.height);
+        }
+        userdata.resized = false;
+        
+        // scale the pixel count with the ratio of target and measured
+        // frame time. the times are a few frames old so the correction
+        // is damped
+        ScopeStats frame = profiler.stats("frame");
+        if(target_ms > 0 && frame.samples > 0 && frame.last > 0)
+            render_scale = glm::clamp(render_scale*float(std::pow(target_ms/frame.last, 0.25)), min_scale/100.0f, 1.0f);
+        if(std::fabs(render_scale-applied_scale) >= 0.05f || render_scale == 1.0f)
+            applied_scale = render_scale;
+        
+        if(target.resize(std::max(1, int(width*applied_scale+0.5f)), std::max(1, int(height*applied_scale+0.5f))) && compute)
+        {
+            // the edge list has room for every pixel
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, edge_buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint)*target.width*target.height, 0, GL_DYNAMIC_COPY);
+            
+            glBindTexture(GL_TEXTURE_2D, resolve_texture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, target.width, target.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+            
+            glBindFramebuffer(GL_FRAMEBUFFER, resolve_fbo);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, resolve_texture, 0);
+        }
+        
+        profiler.push_gpu("scene");
         
         glEnable(GL_DEPTH_TEST);
         
-        // bind target framebuffer
-        if(userdata.fxaa)
-            glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-        else
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        // the scene always goes to the render target
+        glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+        glViewport(0, 0, target.width, target.height);
             
         // clear first
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
         // use the shader program
-        glUseProgram(shader_program);
+        glUseProgram(shader_program.id());
         
         // calculate ViewProjection matrix
-        glm::mat4 Projection = glm::perspective(90.0f, 4.0f / 3.0f, 0.1f, 100.f);
+        glm::mat4 Projection = glm::perspective(90.0f, float(width) / float(height), 0.1f, 100.f);
         
         // translate the world/view position
         glm::mat4 View = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -5.0f));
@@ -712,21 +826,58 @@ int main()
         // draw
         glDrawElements(GL_TRIANGLES, 6*6, GL_UNSIGNED_INT, 0);
         
+        profiler.pop();
+        
+        profiler.push_gpu("resolve");
+        
         // apply post processing only when fxaa is on
-        if(userdata.fxaa)
+        if(userdata.fxaa && compute && userdata.compute)
+        {
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, target.texture);
+            glBindImageTexture(0, resolve_texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, edge_buffer);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, dispatch_buffer);
+            
+            // start with an empty list
+            glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, dispatch_buffer);
+            glBufferSubData(GL_DISPATCH_INDIRECT_BUFFER, 0, sizeof(dispatch_reset), dispatch_reset);
+            
+            glUseProgram(classify_program.id());
+            glUniform1i(classify_scene_location, 0);
+            glDispatchCompute((target.width+15)/16, (target.height+15)/16, 1);
+            
+            // the second pass reads the list and its dispatch size
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+            
+            glUseProgram(edge_program.id());
+            glUniform1i(edge_scene_location, 0);
+            glDispatchComputeIndirect(0);
+            
+            // the blit reads the image and the next frame resets the
+            // dispatch arguments
+            glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+            
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, resolve_fbo);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, bench.framebuffer());
+            glBlitFramebuffer(0, 0, target.width, target.height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+            glBindFramebuffer(GL_FRAMEBUFFER, bench.framebuffer());
+        }
+        else if(userdata.fxaa)
         {
             // bind the "screen frambuffer"
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glBindFramebuffer(GL_FRAMEBUFFER, bench.framebuffer());
+            glViewport(0, 0, width, height);
             
             // we are not 3d rendering so no depth test
             glDisable(GL_DEPTH_TEST);
             
             // use the shader program
-            glUseProgram(post_effect_shader_program);
+            glUseProgram(post_effect_shader_program.id());
             
             // bind texture to texture unit 0
             glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, texture);
+            glBindTexture(GL_TEXTURE_2D, target.texture);
             
             // set uniforms
             glUniform1i(post_effect_texture_location, 0);
@@ -734,42 +885,78 @@ int main()
             // bind the vao
             glBindVertexArray(post_effect_vao);
 
-            // draw
+            // draw, the linear filtering scales the target up
             glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-        }            
-       
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
+        }
+        else
         {
-            userdata.running = false;       
+            // otherwise just copy and scale the target to the screen
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, bench.framebuffer());
+            glBlitFramebuffer(0, 0, target.width, target.height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+            glBindFramebuffer(GL_FRAMEBUFFER, bench.framebuffer());
         }
         
+        profiler.pop();
+        
+        if(!bench.benchmarking() && glwtGetNanoTime()-last_report > 1000000000ull)
+        {
+            // reading the edge count back waits for the gpu, that's
+            // fine once per second
+            bool compute_fxaa = userdata.fxaa && compute && userdata.compute;
+            if(compute_fxaa)
+            {
+                glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, dispatch_buffer);
+                glGetBufferSubData(GL_DISPATCH_INDIRECT_BUFFER, 3*sizeof(GLuint), sizeof(GLuint), &edge_count);
+            }
+            std::cout << "render scale " << int(applied_scale*100+0.5f) << "% (" << target.width << "x" << target.height
+                      << "), scene " << profiler.stats("scene").avg << " ms, resolve "
+                      << profiler.stats("resolve").avg << " ms";
+            if(compute_fxaa)
+                std::cout << " (" << 100.0*edge_count/(target.width*target.height) << "% edge pixels)";
+            std::cout << ", frame " << frame.avg << " ms" << std::endl;
+            last_report = glwtGetNanoTime();
+        }
+       
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window);       
     }
     
     // delete the created objects
     
+    target.destroy();
+    
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &vbo);
     glDeleteBuffers(1, &ibo);
     
-    glDetachShader(shader_program, vertex_shader);	
-    glDetachShader(shader_program, fragment_shader);
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
-    glDeleteProgram(shader_program);
+    shader_program.destroy();
     
     glDeleteVertexArrays(1, &post_effect_vao);
     glDeleteBuffers(1, &post_effect_vbo);
     glDeleteBuffers(1, &post_effect_ibo);
     
-    glDetachShader(post_effect_shader_program, post_effect_vertex_shader);	
-    glDetachShader(post_effect_shader_program, post_effect_fragment_shader);
-    glDeleteShader(post_effect_vertex_shader);
-    glDeleteShader(post_effect_fragment_shader);
-    glDeleteProgram(post_effect_shader_program);
+    post_effect_shader_program.destroy();
+    classify_program.destroy();
+    edge_program.destroy();
+    
+    if(compute)
+    {
+        glDeleteFramebuffers(1, &resolve_fbo);
+        glDeleteTextures(1, &resolve_texture);
+        glDeleteBuffers(1, &edge_buffer);
+        glDeleteBuffers(1, &dispatch_buffer);
+    }
+
+    bench.shutdown();
+    profiler.shutdown();
 
     glwtWindowDestroy(window);
     glwtQuit();
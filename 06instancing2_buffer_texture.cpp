@@ -10,6 +10,10 @@
  
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
+
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
  
 //glm is used to create perspective and transform matrices
 #include <glm/glm.hpp>
@@ -92,10 +96,14 @@ bool check_program_link_status(GLuint obj)
     return true;
 }
  
-int main()
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
    
     UserData userdata;
     userdata.running = true;
@@ -109,7 +117,7 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
     glwt_config.api_version_major = 3;
     glwt_config.api_version_minor = 3;
     
@@ -152,9 +160,11 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
  
     // shader source code
     std::string vertex_source =
@@ -356,6 +366,8 @@ int main()
  
     while(userdata.running)
     {   
+        bench.begin_frame();
+
         // get the time in seconds
         float t = glwtGetNanoTime()*1.e-9f;
         
@@ -399,13 +411,13 @@ int main()
         // the additional parameter indicates how many instances to render
         glDrawElementsInstanced(GL_TRIANGLES, 6*6, GL_UNSIGNED_INT, 0, 8);
        
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
-        {
-            userdata.running = false;       
-        }
-        
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window);       
     }
@@ -426,6 +438,9 @@ int main()
     glDeleteProgram(shader_program);
     
 
+    bench.shutdown();
+    profiler.shutdown();
+
     glwtWindowDestroy(window);
     glwtQuit();
     return 0;
@@ -3,12 +3,29 @@
  * create 8 instances of the cube from the perspective example
  * the per instance data is passed with a uniform buffer object
  * 
+ * --animated replaces the static model matrices with a grid of moving
+ * instances (--instances N, default 1024). their position, rotation and
+ * scale are stored as half floats in 16 bytes per instance instead of a
+ * 64 byte matrix. a pool of worker threads computes the next frame
+ * while the current one is uploaded through a fence synced ring buffer
+ * (see thread_pool.hpp).
+ * 
  * Autor: Jakob Progsch
  */
 
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "gl_state.hpp"
+#include "stream_buffer.hpp"
+#include "thread_pool.hpp"
+#include "half_float.hpp"
+#include "options.hpp"
+#include "shader_program.hpp"
+
 //glm is used to create perspective and transform matrices
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -17,6 +34,11 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 
 #include <time.h>
 unsigned long long raw_time()
@@ -56,44 +78,50 @@ static void key_callback(GLWTWindow *window, int down, int keysym, int scancode,
         ((UserData*)userdata)->running = false;
 }
 
-// helper to check and display for shader compiler errors
-bool check_shader_compile_status(GLuint obj)
+// packs two halves the way unpackHalf2x16 expects them
+GLuint pack_halves(float a, float b)
 {
-    GLint status;
-    glGetShaderiv(obj, GL_COMPILE_STATUS, &status);
-    if(status == GL_FALSE)
-    {
-        GLint length;
-        glGetShaderiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetShaderInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;
-    }
-    return true;
+    return GLuint(float_to_half(a)) | (GLuint(float_to_half(b)) << 16);
 }
 
-// helper to check and display for shader linker error
-bool check_program_link_status(GLuint obj)
+// writes the animated instances [begin, end) at time t, each as four
+// pairs of halves: position xy, position z and scale, rotation xy,
+// rotation zw
+void update_instances(float t, int side, int begin, int end, GLuint *out)
 {
-    GLint status;
-    glGetProgramiv(obj, GL_LINK_STATUS, &status);
-    if(status == GL_FALSE)
+    for(int i = begin;i<end;++i)
     {
-        GLint length;
-        glGetProgramiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetProgramInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;   
+        // the golden ratio spreads the phases of neighbours
+        float phase = std::fmod(0.618034f*i, 1.0f);
+        float x = (i%side - 0.5f*(side-1))*3.0f;
+        float z = (i/side - 0.5f*(side-1))*3.0f;
+        float y = 0.5f*std::sin(2.0f*t + 6.283185f*phase);
+        float scale = 0.6f + 0.2f*std::sin(t + 6.283185f*phase);
+        
+        // spin around a per instance axis, the quaternion holds the
+        // sine and cosine of half the angle
+        glm::vec3 axis = glm::normalize(glm::vec3(std::sin(20.0f*phase), 1.0f, std::cos(20.0f*phase)));
+        float half_angle = (0.5f + phase)*t;
+        glm::vec3 q = std::sin(half_angle)*axis;
+        
+        out[4*i+0] = pack_halves(x, y);
+        out[4*i+1] = pack_halves(z, scale);
+        out[4*i+2] = pack_halves(q.x, q.y);
+        out[4*i+3] = pack_halves(q.z, std::cos(half_angle));
     }
-    return true;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    // unpackHalf2x16 needs GLSL 4.20
+    bool animated = has_flag(argc, argv, "--animated");
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
    
     UserData userdata;
     userdata.running = true;
@@ -107,9 +135,9 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
-    glwt_config.api_version_major = 3;
-    glwt_config.api_version_minor = 3;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
+    glwt_config.api_version_major = animated ? 4 : 3;
+    glwt_config.api_version_minor = animated ? 2 : 3;
     
     GLWTAppCallbacks app_callbacks;
     app_callbacks.error_callback = error_callback;
@@ -150,9 +178,11 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
 
     // shader source code
     std::string vertex_source =
@@ -168,6 +198,38 @@ int main()
         "   fcolor = vcolor;\n"
         "   gl_Position = ViewProjection*Model[gl_InstanceID]*vposition;\n"
         "}\n";
+    
+    // the animated instances have to fit into one uniform block
+    int instances = 8;
+    if(animated)
+    {
+        GLint max_block_size = 0;
+        glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &max_block_size);
+        instances = std::max(1, std::min(int_option(argc, argv, "--instances", 1024), max_block_size/16));
+        
+        vertex_source =
+            "#version 420\n"
+            "#define INSTANCES " + std::to_string(instances) + "\n"
+            "uniform mat4 ViewProjection;\n"
+            "layout(std140) uniform Instances {\n"
+            "   uvec4 instance[INSTANCES];\n"
+            "};\n"
+            "layout(location = 0) in vec4 vposition;\n"
+            "layout(location = 1) in vec4 vcolor;\n"
+            "out vec4 fcolor;\n"
+            "vec3 rotate(vec4 q, vec3 v) {\n"
+            "   return v + 2.0*cross(q.xyz, cross(q.xyz, v) + q.w*v);\n"
+            "}\n"
+            "void main() {\n"
+            "   uvec4 data = instance[gl_InstanceID];\n"
+            "   vec2 xy = unpackHalf2x16(data.x);\n"
+            "   vec2 zs = unpackHalf2x16(data.y);\n"
+            // the rotation lost some precision in the conversion
+            "   vec4 q = normalize(vec4(unpackHalf2x16(data.z), unpackHalf2x16(data.w)));\n"
+            "   fcolor = vcolor;\n"
+            "   gl_Position = ViewProjection*vec4(rotate(q, zs.y*vposition.xyz) + vec3(xy, zs.x), 1);\n"
+            "}\n";
+    }
         
     std::string fragment_source =
         "#version 330\n"
@@ -177,51 +239,41 @@ int main()
         "   FragColor = fcolor;\n"
         "}\n";
    
-    // program and shader handles
-    GLuint shader_program, vertex_shader, fragment_shader;
-    
-    // we need these to properly pass the strings
-    const char *source;
-    int length;
-
-    // create and compiler vertex shader
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = vertex_source.c_str();
-    length = vertex_source.size();
-    glShaderSource(vertex_shader, 1, &source, &length); 
-    glCompileShader(vertex_shader);
-    if(!check_shader_compile_status(vertex_shader))
-    {
-        return 1;
-    }
- 
-    // create and compiler fragment shader
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = fragment_source.c_str();
-    length = fragment_source.size();
-    glShaderSource(fragment_shader, 1, &source, &length);   
-    glCompileShader(fragment_shader);
-    if(!check_shader_compile_status(fragment_shader))
+    // compile and link the program, see shader_program.hpp
+    ShaderProgram shader_program;
+    shader_program.add(GL_VERTEX_SHADER, vertex_source).add(GL_FRAGMENT_SHADER, fragment_source);
+    if(!shader_program.link())
     {
         return 1;
     }
-    
-    // create program
-    shader_program = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, fragment_shader);
-    
-    // link the program and check for errors
-    glLinkProgram(shader_program);
-    check_program_link_status(shader_program);
 
     // obtain location of the uniform block
     GLuint Matrices_binding = 0;
-    GLint uniform_block_index = glGetUniformBlockIndex(shader_program, "Matrices");
+    GLint uniform_block_index = glGetUniformBlockIndex(shader_program.id(), animated ? "Instances" : "Matrices");
     // assign the block binding
-    glUniformBlockBinding(shader_program, uniform_block_index, Matrices_binding);
+    glUniformBlockBinding(shader_program.id(), uniform_block_index, Matrices_binding);
+    
+    // the animated mode passes the ViewProjection as plain uniform
+    GLint ViewProjection_location = shader_program.uniform("ViewProjection");
+    
+    // the animated instances are updated for the next frame while the
+    // current ones are uploaded, the ring buffer holds the uploads of
+    // the frames in flight
+    GLsizeiptr instance_bytes = 4*sizeof(GLuint)*instances;
+    int side = std::max(1, int(std::ceil(std::sqrt(float(instances)))));
+    std::vector<GLuint> packed[2];
+    int front = 0;
+    StreamBuffer stream;
+    // the render thread keeps drawing, so it doesn't get a share
+    ThreadPool pool;
+    if(animated)
+    {
+        pool.start(std::max(1, int(std::thread::hardware_concurrency())-1));
+        packed[0].resize(4*instances);
+        packed[1].resize(4*instances);
+        update_instances(0.0f, side, 0, instances, &packed[front][0]);
+        stream.init(GL_UNIFORM_BUFFER, instance_bytes);
+    }
     
     // create uniform buffer
     GLuint ubo;
@@ -340,67 +392,128 @@ int main()
     
     // we are drawing 3d objects so we want depth testing
     glEnable(GL_DEPTH_TEST);
+    
+    // the same program, buffer and vao are bound every frame, the state
+    // cache only issues them once
+    GLState gl;
+    unsigned long long last_report = glwtGetNanoTime();
 
     while(userdata.running)
     {   
+        bench.begin_frame();
+        gl.begin_frame();
+
         // get the time in seconds
         float t = glwtGetNanoTime()*1.e-9f;
         
         // update events
         glwtEventHandle(0);
         
+        // compute the instances of the next frame in the background
+        if(animated)
+        {
+            GLuint *next = &packed[1-front][0];
+            pool.begin([=](int begin, int end) { update_instances(t, side, begin, end, next); }, instances);
+        }
+        
         // clear first
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
         // use the shader program
-        glUseProgram(shader_program);
+        gl.use_program(shader_program.id());
+        
+        // the camera moves back far enough to see the whole grid of
+        // animated instances
+        float distance = animated ? 5.0f + 1.5f*side : 5.0f;
         
         // calculate ViewProjection matrix
-        glm::mat4 Projection = glm::perspective(90.0f, 4.0f / 3.0f, 0.1f, 100.f);
+        glm::mat4 Projection = glm::perspective(90.0f, 4.0f / 3.0f, 0.1f, std::max(100.f, 4.0f*distance));
         
         // translate the world/view position
-        glm::mat4 View = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -5.0f));
+        glm::mat4 View = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -distance));
         
         // make the camera rotate around the origin
         View = glm::rotate(View, 90.0f*t, glm::vec3(1.0f, 1.0f, 1.0f)); 
         
         glm::mat4 ViewProjection = Projection*View;
         
-        // set the ViewProjection in the uniform buffer
-        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
-        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(float)*4*4, glm::value_ptr(ViewProjection));
-        glBindBufferRange(GL_UNIFORM_BUFFER, Matrices_binding, ubo, 0, sizeof(float)*4*4*9);
+        if(animated)
+        {
+            // stream the instances computed during the last frame
+            profiler.push_cpu("upload");
+            std::memcpy(stream.begin_write(), &packed[front][0], instance_bytes);
+            GLintptr offset = stream.end_write();
+            profiler.pop();
+            gl.bind_buffer_range(GL_UNIFORM_BUFFER, Matrices_binding, stream.buffer(), offset, instance_bytes);
+            glUniformMatrix4fv(ViewProjection_location, 1, GL_FALSE, glm::value_ptr(ViewProjection));
+        }
+        else
+        {
+            // set the ViewProjection in the uniform buffer
+            gl.bind_buffer(GL_UNIFORM_BUFFER, ubo);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(float)*4*4, glm::value_ptr(ViewProjection));
+            gl.bind_buffer_range(GL_UNIFORM_BUFFER, Matrices_binding, ubo, 0, sizeof(float)*4*4*9);
+        }
         
         // bind the vao
-        glBindVertexArray(vao);
+        gl.bind_vertex_array(vao);
 
         // draw
         // the additional parameter indicates how many instances to render
-        glDrawElementsInstanced(GL_TRIANGLES, 6*6, GL_UNSIGNED_INT, 0, 8);
-       
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
+        glDrawElementsInstanced(GL_TRIANGLES, 6*6, GL_UNSIGNED_INT, 0, instances);
+        gl.count_draw();
+        
+        if(animated)
         {
-            userdata.running = false;       
+            stream.fence();
+            
+            // the next frame draws what the workers computed
+            profiler.push_cpu("update wait");
+            pool.wait();
+            profiler.pop();
+            front = 1-front;
         }
         
+        // display the state call counters once per second
+        if(!bench.benchmarking() && glwtGetNanoTime()-last_report > 1000000000ull)
+        {
+            if(animated)
+                std::cout << instances << " animated instances, " << instance_bytes << " bytes per frame ("
+                          << instances*sizeof(glm::mat4) << " as matrices), upload "
+                          << profiler.stats("upload", false).avg << " ms, update wait "
+                          << profiler.stats("update wait", false).avg << " ms, " << stream.stalls() << " stalls" << std::endl;
+            GLState::Counters counters = gl.frame_counters();
+            std::cout << counters.draws << " draws, " << counters.issued << " state calls issued, "
+                      << counters.elided << " elided" << std::endl;
+            last_report = glwtGetNanoTime();
+        }
+       
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window);       
     }
     
+    pool.stop();
+    
     // delete the created objects
         
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &vbo);
     glDeleteBuffers(1, &ibo);
+    glDeleteBuffers(1, &ubo);
+    stream.destroy();
     
-    glDetachShader(shader_program, vertex_shader);	
-    glDetachShader(shader_program, fragment_shader);
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
-    glDeleteProgram(shader_program);
+    shader_program.destroy();
     
+    bench.shutdown();
+    profiler.shutdown();
+
     glwtWindowDestroy(window);
     glwtQuit();
     return 0;
@@ -0,0 +1,649 @@
+/* OpenGL example code - instancing benchmark
+ *
+ * draws a configurable number of instances of the cube from the
+ * perspective example and compares the ways the previous instancing
+ * examples store the per instance data: a vertex buffer with divisor,
+ * a texture buffer, a uniform buffer that is drawn in pages of one
+ * uniform block each and a shader storage buffer.
+ * optionally a compute shader frustum culls the instances first and
+ * compacts the visible ones into a second buffer, the draws then read
+ * their instance counts from an indirect buffer.
+ *
+ * --instances N     number of cubes (default 100000)
+ * --storage NAME    attrib, tbo, ubo or ssbo (default ssbo)
+ * --cull            start with the culling pass enabled
+ *
+ * 1-4 select the storage, C toggles the culling pass.
+ */
+
+#include <GLXW/glxw.h>
+#include <GLWT/glwt.h>
+
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "asset_cache.hpp"
+#include "shader_program.hpp"
+#include "math_util.hpp"
+#include "options.hpp"
+
+//glm is used to create perspective and transform matrices
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <cctype>
+#include <algorithm>
+
+#include <time.h>
+unsigned long long raw_time()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (unsigned long long)t.tv_sec * (unsigned long long)1000000000 + (unsigned long long)t.tv_nsec;
+}
+unsigned long long glwtGetNanoTime()
+{
+   static unsigned long long base = 0;
+   if(base == 0)
+      base = raw_time();
+   return raw_time() - base;
+}
+
+// the ways to store the per instance data
+enum Storage {
+    STORAGE_ATTRIB,
+    STORAGE_TBO,
+    STORAGE_UBO,
+    STORAGE_SSBO,
+    STORAGE_COUNT
+};
+
+static const char *storage_names[STORAGE_COUNT] = { "attrib", "tbo", "ubo", "ssbo" };
+
+struct UserData {
+    bool running;
+    int storage;
+    bool cull;
+};
+
+static void error_callback(const char *msg, void *userdata)
+{
+    std::cerr << msg << std::endl;
+    ((UserData*)userdata)->running = false;
+}
+
+static void close_callback(GLWTWindow *window, void *userdata)
+{
+    (void)window;
+    ((UserData*)userdata)->running = false;
+}
+
+static void key_callback(GLWTWindow *window, int down, int keysym, int scancode, int mod, void *void_userdata)
+{
+    (void)window; (void)scancode; (void)mod;
+    UserData *userdata = (UserData*)void_userdata;
+    if(keysym == GLWT_KEY_ESCAPE)
+        userdata->running = false;
+
+    if(keysym >= GLWT_KEY_1 && keysym < GLWT_KEY_1+STORAGE_COUNT && down)
+        userdata->storage = keysym-GLWT_KEY_1;
+
+    if(keysym == GLWT_KEY_C && down)
+        userdata->cull = !userdata->cull;
+}
+
+int main(int argc, char *argv[])
+{
+    int width = 640;
+    int height = 480;
+
+    int instances = std::max(1, int_option(argc, argv, "--instances", 100000));
+
+    UserData userdata;
+    userdata.running = true;
+    userdata.storage = STORAGE_SSBO;
+    userdata.cull = has_flag(argc, argv, "--cull");
+
+    std::string storage_name = string_option(argc, argv, "--storage", "ssbo");
+    for(int i = 0;i<STORAGE_COUNT;++i)
+        if(storage_name == storage_names[i])
+            userdata.storage = i;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
+
+    GLWTConfig glwt_config;
+    glwt_config.red_bits = 8;
+    glwt_config.green_bits = 8;
+    glwt_config.blue_bits = 8;
+    glwt_config.alpha_bits = 8;
+    glwt_config.depth_bits = 24;
+    glwt_config.stencil_bits = 8;
+    glwt_config.samples = 0;
+    glwt_config.sample_buffers = 0;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
+    // storage buffers, compute shaders and the separate vertex
+    // attribute format need GL 4.3
+    glwt_config.api_version_major = 4;
+    glwt_config.api_version_minor = 3;
+
+    GLWTAppCallbacks app_callbacks;
+    app_callbacks.error_callback = error_callback;
+    app_callbacks.userdata = &userdata;
+
+    if(glwtInit(&glwt_config, &app_callbacks) != 0)
+    {
+        std::cerr << "failed to init GLWT" << std::endl;
+        return 1;
+    }
+
+    GLWTWindowCallbacks win_callbacks;
+    win_callbacks.close_callback = close_callback;
+    win_callbacks.expose_callback = 0;
+    win_callbacks.resize_callback = 0;
+    win_callbacks.show_callback = 0;
+    win_callbacks.focus_callback = 0;
+    win_callbacks.key_callback = key_callback,
+    win_callbacks.motion_callback = 0;
+    win_callbacks.button_callback = 0;
+    win_callbacks.mouseover_callback = 0;
+    win_callbacks.userdata = &userdata;
+
+    // create a window
+    GLWTWindow *window = glwtWindowCreate("", width, height, &win_callbacks, 0);
+    if(window == 0)
+    {
+        std::cerr << "failed to open window" << std::endl;
+        glwtQuit();
+        return 1;
+    }
+
+    if (glxwInit())
+    {
+        std::cerr << "failed to init GLXW" << std::endl;
+        glwtWindowDestroy(window);
+        glwtQuit();
+        return 1;
+    }
+
+    glwtWindowShow(window, bench.show_window());
+    glwtMakeCurrent(window);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
+
+    // a page is as many instances as fit into one uniform block. the
+    // page offsets have to respect the uniform buffer alignment
+    GLint max_block_size = 0, ubo_alignment = 0;
+    glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &max_block_size);
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_alignment);
+    int page_bytes = std::min(max_block_size, 65536);
+    page_bytes -= page_bytes % std::max(ubo_alignment, GLint(sizeof(glm::vec4)));
+    int page_size = page_bytes/sizeof(glm::vec4);
+    int pages = (instances+page_size-1)/page_size;
+
+    // the buffers are padded to whole pages so the last page can be
+    // bound with the full block size
+    int padded = pages*page_size;
+
+    // shader source code, the storage is selected with a define. every
+    // instance is stored as a vec4 of position and scale
+    std::string vertex_source =
+        "uniform mat4 ViewProjection;\n" // the projection matrix uniform
+        "layout(location = 0) in vec4 vposition;\n"
+        "layout(location = 1) in vec4 vcolor;\n"
+        "#if defined(STORAGE_ATTRIB)\n"
+        "layout(location = 2) in vec4 vinstance;\n"
+        "#elif defined(STORAGE_TBO)\n"
+        "uniform samplerBuffer instance_texture;\n"
+        "#elif defined(STORAGE_UBO)\n"
+        "layout(std140, binding = 0) uniform Instances { vec4 instance[PAGE_SIZE]; };\n"
+        "#else\n"
+        "layout(std430, binding = 0) readonly buffer Instances { vec4 instance[]; };\n"
+        "#endif\n"
+        "out vec4 fcolor;\n"
+        "void main() {\n"
+        "#if defined(STORAGE_ATTRIB)\n"
+        "   vec4 data = vinstance;\n"
+        "#elif defined(STORAGE_TBO)\n"
+        "   vec4 data = texelFetch(instance_texture, gl_InstanceID);\n"
+        "#else\n"
+        // the ubo pages are bound so the instance id counts from the
+        // start of the page
+        "   vec4 data = instance[gl_InstanceID];\n"
+        "#endif\n"
+        "   fcolor = vcolor;\n"
+        "   gl_Position = ViewProjection*vec4(data.w*vposition.xyz + data.xyz, 1);\n"
+        "}\n";
+
+    std::string fragment_source =
+        "#version 430\n"
+        "in vec4 fcolor;\n"
+        "layout(location = 0) out vec4 FragColor;\n"
+        "void main() {\n"
+        "   FragColor = fcolor;\n"
+        "}\n";
+
+    // culls the instances against the frustum planes and appends the
+    // visible ones to the compacted buffer. each group reserves its
+    // range with a single global atomic
+    std::string cull_source =
+        "#version 430\n"
+        "layout(local_size_x = 256) in;\n"
+        "layout(std430, binding = 0) readonly buffer Source { vec4 source[]; };\n"
+        "layout(std430, binding = 1) writeonly buffer Visible { vec4 visible[]; };\n"
+        "layout(std430, binding = 2) buffer Counter { uint visible_count; };\n"
+        "uniform uint InstanceCount;\n"
+        "uniform vec4 FrustumPlanes[6];\n"
+        "shared uint group_count, group_base;\n"
+        "void main() {\n"
+        "   uint id = gl_GlobalInvocationID.x;\n"
+        "   if(gl_LocalInvocationIndex == 0u) group_count = 0u;\n"
+        "   barrier();\n"
+        "   bool inside = id < InstanceCount;\n"
+        "   vec4 data = inside ? source[id] : vec4(0);\n"
+        // bounding sphere of the scaled cube
+        "   float radius = 1.7320508*data.w;\n"
+        "   for(int i = 0;i<6;++i)\n"
+        "       inside = inside && dot(FrustumPlanes[i].xyz, data.xyz)+FrustumPlanes[i].w > -radius;\n"
+        "   uint slot = 0u;\n"
+        "   if(inside)\n"
+        "       slot = atomicAdd(group_count, 1u);\n"
+        "   barrier();\n"
+        "   if(gl_LocalInvocationIndex == 0u && group_count > 0u)\n"
+        "       group_base = atomicAdd(visible_count, group_count);\n"
+        "   barrier();\n"
+        "   if(inside)\n"
+        "       visible[group_base+slot] = data;\n"
+        "}\n";
+
+    // writes one indirect draw command per page of the compacted buffer
+    std::string commands_source =
+        "#version 430\n"
+        "layout(local_size_x = 64) in;\n"
+        "struct Command { uint count, instance_count, first_index; int base_vertex; uint base_instance; };\n"
+        "layout(std430, binding = 2) readonly buffer Counter { uint visible_count; };\n"
+        "layout(std430, binding = 3) writeonly buffer Commands { Command command[]; };\n"
+        "uniform uint PageSize;\n"
+        "uniform uint PageCount;\n"
+        "void main() {\n"
+        "   uint page = gl_GlobalInvocationID.x;\n"
+        "   if(page >= PageCount) return;\n"
+        "   uint first = page*PageSize;\n"
+        "   uint count = visible_count > first ? min(visible_count-first, PageSize) : 0u;\n"
+        "   command[page] = Command(6u*6u, count, 0u, 0, 0u);\n"
+        "}\n";
+
+    ShaderProgram programs[STORAGE_COUNT];
+    for(int i = 0;i<STORAGE_COUNT;++i)
+    {
+        std::string define = storage_names[i];
+        std::transform(define.begin(), define.end(), define.begin(), ::toupper);
+        std::string header = "#version 430\n"
+            "#define STORAGE_" + define + "\n"
+            "#define PAGE_SIZE " + std::to_string(page_size) + "\n";
+        programs[i].add(GL_VERTEX_SHADER, header + vertex_source);
+        programs[i].add(GL_FRAGMENT_SHADER, fragment_source);
+    }
+
+    ShaderProgram cull_program, commands_program;
+    cull_program.add(GL_COMPUTE_SHADER, cull_source);
+    commands_program.add(GL_COMPUTE_SHADER, commands_source);
+
+    // compile and link everything at once
+    if(!link_programs({&programs[0], &programs[1], &programs[2], &programs[3], &cull_program, &commands_program}))
+    {
+        return 1;
+    }
+
+    // obtain the uniform locations
+    GLint ViewProjection_locations[STORAGE_COUNT];
+    for(int i = 0;i<STORAGE_COUNT;++i)
+        ViewProjection_locations[i] = programs[i].uniform("ViewProjection");
+    GLint InstanceCount_location = cull_program.uniform("InstanceCount");
+    GLint FrustumPlanes_location = cull_program.uniform("FrustumPlanes");
+    GLint PageSize_location = commands_program.uniform("PageSize");
+    GLint PageCount_location = commands_program.uniform("PageCount");
+
+    // the texture buffer is always read from unit 0
+    glUseProgram(programs[STORAGE_TBO].id());
+    glUniform1i(programs[STORAGE_TBO].uniform("instance_texture"), 0);
+
+
+    // vao and vbo handles
+    GLuint vao, vbo, ibo;
+
+    // generate and bind the vao
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+
+    // generate and bind the vertex buffer object
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+    // data for a cube
+    GLfloat vertexData[] = {
+    //  X     Y     Z           R     G     B
+    // face 0:
+       1.0f, 1.0f, 1.0f,       1.0f, 0.0f, 0.0f, // vertex 0
+      -1.0f, 1.0f, 1.0f,       1.0f, 0.0f, 0.0f, // vertex 1
+       1.0f,-1.0f, 1.0f,       1.0f, 0.0f, 0.0f, // vertex 2
+      -1.0f,-1.0f, 1.0f,       1.0f, 0.0f, 0.0f, // vertex 3
+
+    // face 1:
+       1.0f, 1.0f, 1.0f,       0.0f, 1.0f, 0.0f, // vertex 0
+       1.0f,-1.0f, 1.0f,       0.0f, 1.0f, 0.0f, // vertex 1
+       1.0f, 1.0f,-1.0f,       0.0f, 1.0f, 0.0f, // vertex 2
+       1.0f,-1.0f,-1.0f,       0.0f, 1.0f, 0.0f, // vertex 3
+
+    // face 2:
+       1.0f, 1.0f, 1.0f,       0.0f, 0.0f, 1.0f, // vertex 0
+       1.0f, 1.0f,-1.0f,       0.0f, 0.0f, 1.0f, // vertex 1
+      -1.0f, 1.0f, 1.0f,       0.0f, 0.0f, 1.0f, // vertex 2
+      -1.0f, 1.0f,-1.0f,       0.0f, 0.0f, 1.0f, // vertex 3
+
+    // face 3:
+       1.0f, 1.0f,-1.0f,       1.0f, 1.0f, 0.0f, // vertex 0
+       1.0f,-1.0f,-1.0f,       1.0f, 1.0f, 0.0f, // vertex 1
+      -1.0f, 1.0f,-1.0f,       1.0f, 1.0f, 0.0f, // vertex 2
+      -1.0f,-1.0f,-1.0f,       1.0f, 1.0f, 0.0f, // vertex 3
+
+    // face 4:
+      -1.0f, 1.0f, 1.0f,       0.0f, 1.0f, 1.0f, // vertex 0
+      -1.0f, 1.0f,-1.0f,       0.0f, 1.0f, 1.0f, // vertex 1
+      -1.0f,-1.0f, 1.0f,       0.0f, 1.0f, 1.0f, // vertex 2
+      -1.0f,-1.0f,-1.0f,       0.0f, 1.0f, 1.0f, // vertex 3
+
+    // face 5:
+       1.0f,-1.0f, 1.0f,       1.0f, 0.0f, 1.0f, // vertex 0
+      -1.0f,-1.0f, 1.0f,       1.0f, 0.0f, 1.0f, // vertex 1
+       1.0f,-1.0f,-1.0f,       1.0f, 0.0f, 1.0f, // vertex 2
+      -1.0f,-1.0f,-1.0f,       1.0f, 0.0f, 1.0f, // vertex 3
+    }; // 6 faces with 4 vertices with 6 components (floats)
+
+    // fill with data
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*6*4*6, vertexData, GL_STATIC_DRAW);
+
+
+    // set up generic attrib pointers
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), (char*)0 + 0*sizeof(GLfloat));
+
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), (char*)0 + 3*sizeof(GLfloat));
+
+    // the instance attribute gets its buffer from binding 2, that way
+    // the source and the compacted buffer can be swapped without
+    // respecifying the attribute
+    glEnableVertexAttribArray(2);
+    glVertexAttribFormat(2, 4, GL_FLOAT, GL_FALSE, 0);
+    glVertexAttribBinding(2, 2);
+    glVertexBindingDivisor(2, 1);
+
+
+    // generate and bind the index buffer object
+    glGenBuffers(1, &ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+
+    GLuint indexData[] = {
+        // face 0:
+        0,1,2,      // first triangle
+        2,1,3,      // second triangle
+        // face 1:
+        4,5,6,      // first triangle
+        6,5,7,      // second triangle
+        // face 2:
+        8,9,10,     // first triangle
+        10,9,11,    // second triangle
+        // face 3:
+        12,13,14,   // first triangle
+        14,13,15,   // second triangle
+        // face 4:
+        16,17,18,   // first triangle
+        18,17,19,   // second triangle
+        // face 5:
+        20,21,22,   // first triangle
+        22,21,23,   // second triangle
+    };
+
+    // fill with data
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*6*2*3, indexData, GL_STATIC_DRAW);
+
+    // "unbind" vao
+    glBindVertexArray(0);
+
+
+    // place the instances on a cubic grid around the origin
+    int side = std::max(1, int(std::ceil(std::cbrt(double(instances)))));
+    const float spacing = 4.0f;
+    std::vector<glm::vec4> instanceData(padded);
+    parallel_for(instances, [&](int begin, int end) {
+        for(int i = begin;i<end;++i)
+        {
+            int x = i%side;
+            int y = (i/side)%side;
+            int z = i/(side*side);
+            float scale = 0.3f + 0.5f*(hash(i) & 0xffff)/65535.0f;
+            instanceData[i] = glm::vec4((x-0.5f*(side-1))*spacing, (y-0.5f*(side-1))*spacing, (z-0.5f*(side-1))*spacing, scale);
+        }
+    });
+
+    // the source instances and the compacted visible ones. either of
+    // them can be bound as vertex, texture, uniform or storage buffer
+    GLuint instance_buffers[2];
+    glGenBuffers(2, instance_buffers);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffers[0]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4)*padded, &instanceData[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffers[1]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec4)*padded, 0, GL_DYNAMIC_COPY);
+    std::vector<glm::vec4>().swap(instanceData);
+
+    // a buffer texture for each of them
+    GLuint instance_textures[2];
+    glGenTextures(2, instance_textures);
+    for(int i = 0;i<2;++i)
+    {
+        glBindTexture(GL_TEXTURE_BUFFER, instance_textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instance_buffers[i]);
+    }
+
+    // GL 4.3 only guarantees 65536 texels, one per instance here
+    GLint max_texels;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+    bool tbo_supported = max_texels >= padded;
+    if(!tbo_supported)
+        std::cerr << "buffer textures are limited to " << max_texels << " texels, tbo storage disabled" << std::endl;
+
+    // number of visible instances and the indirect draw commands, one
+    // for each page of the uniform buffer storage or a single one for
+    // the other storages
+    GLuint counter_buffer, command_buffer;
+    const GLuint counter_reset = 0;
+    glGenBuffers(1, &counter_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, counter_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), &counter_reset, GL_DYNAMIC_DRAW);
+
+    glGenBuffers(1, &command_buffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, 5*sizeof(GLuint)*pages, 0, GL_DYNAMIC_COPY);
+
+    // the barrier each storage needs before reading the compacted buffer
+    const GLbitfield storage_barriers[STORAGE_COUNT] = {
+        GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT,
+        GL_TEXTURE_FETCH_BARRIER_BIT,
+        GL_UNIFORM_BARRIER_BIT,
+        GL_SHADER_STORAGE_BARRIER_BIT
+    };
+
+    // the camera sits between the instances closest to the center
+    glm::vec3 eye(side%2 == 0 ? 0.0f : 0.5f*spacing);
+    float far_plane = 2.0f*side*spacing;
+
+    // we are drawing 3d objects so we want depth testing
+    glEnable(GL_DEPTH_TEST);
+
+    unsigned long long last_report = glwtGetNanoTime();
+
+    while(userdata.running)
+    {
+        bench.begin_frame();
+
+        // get the time in seconds
+        float t = glwtGetNanoTime()*1.e-9f;
+
+        // update events
+        glwtEventHandle(0);
+
+        if(!tbo_supported && userdata.storage == STORAGE_TBO)
+            userdata.storage = STORAGE_SSBO;
+        int storage = userdata.storage;
+        bool cull = userdata.cull;
+
+        // clear first
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // calculate ViewProjection matrix
+        glm::mat4 Projection = glm::perspective(90.0f, 4.0f / 3.0f, 0.1f, far_plane);
+
+        // make the camera look around
+        glm::mat4 View = glm::rotate(glm::mat4(1.0f), 20.0f*t, glm::vec3(1.0f, 1.0f, 1.0f));
+        View = glm::translate(View, -eye);
+
+        glm::mat4 ViewProjection = Projection*View;
+
+        // ubo storage is drawn one page at a time
+        int draw_pages = storage == STORAGE_UBO ? pages : 1;
+        int draw_page_size = storage == STORAGE_UBO ? page_size : instances;
+
+        if(cull)
+        {
+            profiler.push_gpu("cull");
+
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, counter_buffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &counter_reset);
+
+            glm::vec4 planes[6];
+            frustum_planes(ViewProjection, planes);
+            glUseProgram(cull_program.id());
+            glUniform1ui(InstanceCount_location, instances);
+            glUniform4fv(FrustumPlanes_location, 6, glm::value_ptr(planes[0]));
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instance_buffers[0]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, instance_buffers[1]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, counter_buffer);
+            glDispatchCompute((instances+255)/256, 1, 1);
+
+            // the commands need the final count
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            glUseProgram(commands_program.id());
+            glUniform1ui(PageSize_location, draw_page_size);
+            glUniform1ui(PageCount_location, draw_pages);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, command_buffer);
+            glDispatchCompute((draw_pages+63)/64, 1, 1);
+
+            glMemoryBarrier(GL_COMMAND_BARRIER_BIT | storage_barriers[storage]);
+
+            profiler.pop();
+        }
+
+        profiler.push_gpu("draw");
+
+        // use the shader program of the storage
+        glUseProgram(programs[storage].id());
+
+        // set the matrix uniform
+        glUniformMatrix4fv(ViewProjection_locations[storage], 1, GL_FALSE, glm::value_ptr(ViewProjection));
+
+        // bind the vao
+        glBindVertexArray(vao);
+
+        // bind the instances. the instance attribute is enabled in the
+        // vao, so it always needs a buffer even if the shader ignores it
+        GLuint data = instance_buffers[cull ? 1 : 0];
+        glBindVertexBuffer(2, data, 0, sizeof(glm::vec4));
+        if(storage == STORAGE_TBO)
+        {
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_BUFFER, instance_textures[cull ? 1 : 0]);
+        }
+        else if(storage == STORAGE_SSBO)
+        {
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, data);
+        }
+
+        if(cull)
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+
+        // draw
+        for(int page = 0;page<draw_pages;++page)
+        {
+            if(storage == STORAGE_UBO)
+                glBindBufferRange(GL_UNIFORM_BUFFER, 0, data, page*page_bytes, page_bytes);
+
+            if(cull)
+                glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (char*)0 + 5*sizeof(GLuint)*page);
+            else
+                glDrawElementsInstanced(GL_TRIANGLES, 6*6, GL_UNSIGNED_INT, 0, std::min(draw_page_size, instances-page*draw_page_size));
+        }
+
+        profiler.pop();
+
+        if(!bench.benchmarking() && glwtGetNanoTime()-last_report > 1000000000ull)
+        {
+            std::cout << storage_names[storage] << ", " << instances << " instances";
+            if(cull)
+            {
+                // reading the count back waits for the gpu, which is
+                // fine once per second
+                GLuint visible = 0;
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, counter_buffer);
+                glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &visible);
+                std::cout << ", " << visible << " visible, cull " << profiler.stats("cull").avg << " ms";
+            }
+            std::cout << ", draw " << profiler.stats("draw").avg << " ms, frame "
+                      << profiler.stats("frame").avg << " ms" << std::endl;
+            last_report = glwtGetNanoTime();
+        }
+
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
+        // finally swap buffers
+        glwtSwapBuffers(window);
+    }
+
+    // delete the created objects
+
+    glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &vbo);
+    glDeleteBuffers(1, &ibo);
+    glDeleteBuffers(2, instance_buffers);
+    glDeleteBuffers(1, &counter_buffer);
+    glDeleteBuffers(1, &command_buffer);
+
+    glDeleteTextures(2, instance_textures);
+
+    for(int i = 0;i<STORAGE_COUNT;++i)
+        programs[i].destroy();
+    cull_program.destroy();
+    commands_program.destroy();
+
+
+    bench.shutdown();
+    profiler.shutdown();
+
+    glwtWindowDestroy(window);
+    glwtQuit();
+    return 0;
+}
@@ -3,6 +3,15 @@
  * Uses a geometry shader to expand points to billboard quads.
  * The billboards are then blended while drawing to create a galaxy
  * made of particles.
+ * With --sort depth or --sort morton (needs GL 4.3) the particles are
+ * sorted on the gpu before drawing (see gpu_sort.hpp). Depth order
+ * allows blending them back to front instead of additively.
+ * Alternatively (start with --billboards or toggle with B) the quads
+ * are generated in the vertex shader instead. Each particle is drawn
+ * as six vertices which fetch its position from a buffer texture by
+ * gl_VertexID. Both paths are timed and printed once per second.
+ * The galaxy is generated on all cores and cached on disk (see
+ * asset_cache.hpp).
  * 
  * Autor: Jakob Progsch
  */
@@ -10,6 +19,14 @@
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "shader_program.hpp"
+#include "gpu_sort.hpp"
+#include "asset_cache.hpp"
+#include "options.hpp"
+
 //glm is used to create perspective and transform matrices
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -19,6 +36,7 @@
 #include <string>
 #include <vector>
 #include <cstdlib>
+#include <algorithm>
 
 #include <time.h>
 unsigned long long raw_time()
@@ -37,6 +55,7 @@ unsigned long long glwtGetNanoTime()
 
 struct UserData {
     bool running;
+    bool billboards;
 };
 
 static void error_callback(const char *msg, void *userdata)
@@ -53,52 +72,66 @@ static void close_callback(GLWTWindow *window, void *userdata)
 
 static void key_callback(GLWTWindow *window, int down, int keysym, int scancode, int mod, void *userdata)
 {
-    (void)window; (void)down; (void)scancode; (void)mod;
+    (void)window; (void)scancode; (void)mod;
     if(keysym == GLWT_KEY_ESCAPE)
         ((UserData*)userdata)->running = false;
+    if(keysym == GLWT_KEY_B && down)
+        ((UserData*)userdata)->billboards = !((UserData*)userdata)->billboards;
 }
 
-// helper to check and display for shader compiler errors
-bool check_shader_compile_status(GLuint obj)
+// uniform random number in [0,1]. the k-th number of particle i
+// only depends on i and k, so the particles can be generated in any
+// order and on any number of threads
+float uniform_random(unsigned i, unsigned k)
 {
-    GLint status;
-    glGetShaderiv(obj, GL_COMPILE_STATUS, &status);
-    if(status == GL_FALSE)
-    {
-        GLint length;
-        glGetShaderiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetShaderInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;
-    }
-    return true;
+    unsigned x = i*16u + k;
+    x ^= x >> 16; x *= 0x7feb352du;
+    x ^= x >> 15; x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x/4294967295.0f;
 }
 
-// helper to check and display for shader linker error
-bool check_program_link_status(GLuint obj)
+// creates a galaxylike distribution of points
+void generate_galaxy(int begin, int end, GLfloat *vertexData)
 {
-    GLint status;
-    glGetProgramiv(obj, GL_LINK_STATUS, &status);
-    if(status == GL_FALSE)
+    for(int i = begin;i<end;++i)
     {
-        GLint length;
-        glGetProgramiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetProgramInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;   
+        unsigned k = 0;
+        int arm = 3*uniform_random(i, k++);
+        float alpha = 1/(0.1f+std::pow(uniform_random(i, k++),0.7f))-1/1.1f;
+        float r = 4.0f*alpha;
+        alpha += arm*2.0f*3.1416f/3.0f;
+        
+        vertexData[3*i+0] = r*std::sin(alpha);
+        vertexData[3*i+1] = 0;
+        vertexData[3*i+2] = r*std::cos(alpha);
+        
+        for(int c = 0;c<3;++c)
+        {
+            float spread = c == 1 ? 2.0f-0.1f*alpha : 4.0f-0.2f*alpha;
+            float sum = 0;
+            for(int j = 0;j<4;++j)
+                sum += uniform_random(i, k++);
+            vertexData[3*i+c] += spread*(2-sum);
+        }
     }
-    return true;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
+    
+    // sorting needs compute shaders
+    int sort_mode = GPUSort::parse_mode(argc, argv);
    
     UserData userdata;
     userdata.running = true;
+    userdata.billboards = has_flag(argc, argv, "--billboards");
     
     GLWTConfig glwt_config;
     glwt_config.red_bits = 8;
@@ -109,8 +142,8 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
-    glwt_config.api_version_major = 3;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
+    glwt_config.api_version_major = sort_mode != GPUSort::NONE ? 4 : 3;
     glwt_config.api_version_minor = 3;
     
     GLWTAppCallbacks app_callbacks;
@@ -152,9 +185,11 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
 
     // shader source code
     
@@ -199,62 +234,59 @@ int main()
         "   float s = 0.2*(1/(1+15.*dot(txcoord, txcoord))-1/16.);\n"
         "   FragColor = s*vec4(1,0.9,0.6,1);\n"
         "}\n";
-   
-    // program and shader handles
-    GLuint shader_program, vertex_shader, geometry_shader, fragment_shader;
-    
-    // we need these to properly pass the strings
-    const char *source;
-    int length;
-
-    // create and compiler vertex shader
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = vertex_source.c_str();
-    length = vertex_source.size();
-    glShaderSource(vertex_shader, 1, &source, &length); 
-    glCompileShader(vertex_shader);
-    if(!check_shader_compile_status(vertex_shader))
-    {
-        return 1;
-    }
     
-    // create and compiler geometry shader
-    geometry_shader = glCreateShader(GL_GEOMETRY_SHADER);
-    source = geometry_source.c_str();
-    length = geometry_source.size();
-    glShaderSource(geometry_shader, 1, &source, &length); 
-    glCompileShader(geometry_shader);
-    if(!check_shader_compile_status(geometry_shader))
-    {
-        return 1;
-    }
- 
-    // create and compiler fragment shader
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = fragment_source.c_str();
-    length = fragment_source.size();
-    glShaderSource(fragment_shader, 1, &source, &length);   
-    glCompileShader(fragment_shader);
-    if(!check_shader_compile_status(fragment_shader))
+    // the billboard vertex shader replaces the vertex and geometry
+    // shader. the positions are fetched three floats at a time since
+    // GL 3.3 has no RGB buffer texture format. when sorted the particle
+    // index is looked up in the sort order first
+    std::string billboard_source =
+        "#version 330\n"
+        "uniform mat4 View;\n"
+        "uniform mat4 Projection;\n"
+        "uniform samplerBuffer positions;\n"
+        "uniform usamplerBuffer order;\n"
+        "uniform bool sorted;\n"
+        "out vec2 txcoord;\n"
+        "const vec2 quad_offsets[6] = vec2[](\n"
+        "   vec2(-1,-1),vec2( 1,-1),vec2( 1, 1),\n"
+        "   vec2(-1,-1),vec2( 1, 1),vec2(-1, 1)\n"
+        ");\n"
+        "void main() {\n"
+        "   int particle = gl_VertexID/6;\n"
+        "   if(sorted)\n"
+        "       particle = int(texelFetch(order, particle).r);\n"
+        "   vec4 pos = View*vec4(texelFetch(positions, 3*particle+0).r,\n"
+        "                        texelFetch(positions, 3*particle+1).r,\n"
+        "                        texelFetch(positions, 3*particle+2).r, 1);\n"
+        "   txcoord = quad_offsets[gl_VertexID%6];\n"
+        "   gl_Position = Projection*(pos+vec4(txcoord,0,0));\n"
+        "}\n";
+   
+    // the billboard program shares the fragment shader, both are
+    // compiled and linked at once (see shader_program.hpp)
+    ShaderProgram shader_program, billboard_program;
+    shader_program.add(GL_VERTEX_SHADER, vertex_source)
+                  .add(GL_GEOMETRY_SHADER, geometry_source)
+                  .add(GL_FRAGMENT_SHADER, fragment_source);
+    billboard_program.add(GL_VERTEX_SHADER, billboard_source)
+                     .add(GL_FRAGMENT_SHADER, fragment_source);
+    if(!link_programs({&shader_program, &billboard_program}))
     {
         return 1;
     }
     
-    // create program
-    shader_program = glCreateProgram();
+    // obtain location of projection uniform
+    GLint View_location = shader_program.uniform("View");
+    GLint Projection_location = shader_program.uniform("Projection");
     
-    // attach shaders
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, geometry_shader);
-    glAttachShader(shader_program, fragment_shader);
+    GLint billboard_View_location = billboard_program.uniform("View");
+    GLint billboard_Projection_location = billboard_program.uniform("Projection");
+    GLint billboard_sorted_location = billboard_program.uniform("sorted");
     
-    // link the program and check for errors
-    glLinkProgram(shader_program);
-    check_program_link_status(shader_program);
-    
-    // obtain location of projection uniform
-    GLint View_location = glGetUniformLocation(shader_program, "View");
-    GLint Projection_location = glGetUniformLocation(shader_program, "Projection");
+    // the samplers read from texture units 0 and 1
+    glUseProgram(billboard_program.id());
+    glUniform1i(billboard_program.uniform("positions"), 0);
+    glUniform1i(billboard_program.uniform("order"), 1);
     
     
     // vao and vbo handle
@@ -270,29 +302,49 @@ int main()
     
     const int particles = 128*1024;
 
-    // create a galaxylike distribution of points
-    std::vector<GLfloat> vertexData(particles*3);
+    // generate the galaxy in parallel or map it from the cache
+    unsigned long long generation_start = glwtGetNanoTime();
+    AssetKey galaxy_key("07galaxy");
+    galaxy_key.add(particles).add(1); // bump when changing generate_galaxy
+    CachedAsset galaxy;
+    bool cached = galaxy.load_or_generate(galaxy_key, sizeof(GLfloat)*3*particles, [&](void *data) {
+        parallel_for(particles, [&](int begin, int end) {
+            generate_galaxy(begin, end, (GLfloat*)data);
+        });
+    });
+    const GLfloat *vertexData = (const GLfloat*)galaxy.data();
+    std::cout << (cached ? "loaded" : "generated") << " galaxy in " << (glwtGetNanoTime()-generation_start)*1.e-6 << " ms" << std::endl;
+
+    // fill with data
+    glBufferData(GL_ARRAY_BUFFER, galaxy.size(), vertexData, GL_STATIC_DRAW);
+
+    // optional sort of the particles before drawing
+    GPUSort sorter;
+    if(sort_mode != GPUSort::NONE && !sorter.init(particles))
+    {
+        return 1;
+    }
+    
+    // bounds of the galaxy for the morton codes
+    GLfloat sort_lo[3] = { vertexData[0], vertexData[1], vertexData[2] };
+    GLfloat sort_hi[3] = { vertexData[0], vertexData[1], vertexData[2] };
     for(int i = 0;i<particles;++i)
     {
-        int arm = 3*(std::rand()/float(RAND_MAX));
-        float alpha = 1/(0.1f+std::pow(std::rand()/float(RAND_MAX),0.7f))-1/1.1f;
-        float r = 4.0f*alpha;
-        alpha += arm*2.0f*3.1416f/3.0f;
-        
-        vertexData[3*i+0] = r*std::sin(alpha);
-        vertexData[3*i+1] = 0;
-        vertexData[3*i+2] = r*std::cos(alpha);
-        
-        vertexData[3*i+0] += (4.0f-0.2*alpha)*(2-(std::rand()/float(RAND_MAX)+std::rand()/float(RAND_MAX)+
-                                                  std::rand()/float(RAND_MAX)+std::rand()/float(RAND_MAX)));
-        vertexData[3*i+1] += (2.0f-0.1*alpha)*(2-(std::rand()/float(RAND_MAX)+std::rand()/float(RAND_MAX)+
-                                                  std::rand()/float(RAND_MAX)+std::rand()/float(RAND_MAX)));
-        vertexData[3*i+2] += (4.0f-0.2*alpha)*(2-(std::rand()/float(RAND_MAX)+std::rand()/float(RAND_MAX)+
-                                                  std::rand()/float(RAND_MAX)+std::rand()/float(RAND_MAX)));
+        for(int k = 0;k<3;++k)
+        {
+            sort_lo[k] = std::min(sort_lo[k], vertexData[3*i+k]);
+            sort_hi[k] = std::max(sort_hi[k], vertexData[3*i+k]);
+        }
     }
-
-    // fill with data
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*vertexData.size(), &vertexData[0], GL_STATIC_DRAW);
+    
+    // the galaxy doesn't move, so the morton order only has to be
+    // computed once. the depth order changes with the view every frame
+    if(sort_mode == GPUSort::MORTON)
+    {
+        glm::mat4 identity(1.0f);
+        sorter.sort(vbo, 3, 0, sort_mode, glm::value_ptr(identity), sort_lo, sort_hi);
+    }
+    galaxy.close();
                     
            
     // set up generic attrib pointers
@@ -302,6 +354,32 @@ int main()
     
     // "unbind" vao
     glBindVertexArray(0);
+    
+    // the billboards don't use any attributes, but drawing still
+    // needs a vao
+    GLuint billboard_vao;
+    glGenVertexArrays(1, &billboard_vao);
+    
+    // buffer textures to fetch the positions and the sort order from
+    GLuint textures[2];
+    glGenTextures(2, textures);
+    glBindTexture(GL_TEXTURE_BUFFER, textures[0]);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, vbo);
+    if(sort_mode != GPUSort::NONE)
+    {
+        glBindTexture(GL_TEXTURE_BUFFER, textures[1]);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, sorter.indices());
+    }
+    
+    // GL 3.3 only guarantees 65536 texels
+    GLint max_texels;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+    bool billboards_supported = max_texels >= 3*particles;
+    if(!billboards_supported)
+    {
+        std::cerr << "buffer textures are limited to " << max_texels << " texels, billboards disabled" << std::endl;
+        userdata.billboards = false;
+    }
 
     
     // we are blending so no depth testing
@@ -311,20 +389,39 @@ int main()
     glEnable(GL_BLEND);
     //  and set the blend function to result = 1*source + 1*destination
     glBlendFunc(GL_ONE, GL_ONE);
+    
+    if(sort_mode == GPUSort::DEPTH)
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    
+    unsigned long long last_report = glwtGetNanoTime();
+    bool billboards = !userdata.billboards;
 
     while(userdata.running)
     {   
+        bench.begin_frame();
+
         // get the time in seconds
         float t = glwtGetNanoTime()*1.e-9f;
         
         // update events
         glwtEventHandle(0);
         
+        if(!billboards_supported)
+            userdata.billboards = false;
+        if(billboards != userdata.billboards)
+        {
+            billboards = userdata.billboards;
+            if(billboards)
+                std::cout << "generating billboards in the vertex shader" << std::endl;
+            else
+                std::cout << "generating billboards in the geometry shader" << std::endl;
+        }
+        
         // clear first
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
         // use the shader program
-        glUseProgram(shader_program);
+        glUseProgram(shader_program.id());
         
         // calculate ViewProjection matrix
         glm::mat4 Projection = glm::perspective(90.0f, 4.0f / 3.0f, 0.1f, 100.f);
@@ -336,24 +433,76 @@ int main()
         View = glm::rotate(View, 30.0f*std::sin(0.1f*t), glm::vec3(1.0f, 0.0f, 0.0f)); 
         View = glm::rotate(View, -22.5f*t, glm::vec3(0.0f, 1.0f, 0.0f)); 
         
+        if(sort_mode == GPUSort::DEPTH)
+        {
+            profiler.push_gpu("sort");
+            sorter.sort(vbo, 3, 0, sort_mode, glm::value_ptr(View), sort_lo, sort_hi);
+            profiler.pop();
+            glUseProgram(shader_program.id());
+        }
         
-        // set the uniform
-        glUniformMatrix4fv(View_location, 1, GL_FALSE, glm::value_ptr(View)); 
-        glUniformMatrix4fv(Projection_location, 1, GL_FALSE, glm::value_ptr(Projection)); 
         
-        // bind the vao
-        glBindVertexArray(vao);
+        const char *draw_scope = billboards ? "billboards" : "geometry shader";
+        profiler.push_gpu(draw_scope);
+        if(billboards)
+        {
+            glUseProgram(billboard_program.id());
+            
+            // set the uniforms
+            glUniformMatrix4fv(billboard_View_location, 1, GL_FALSE, glm::value_ptr(View)); 
+            glUniformMatrix4fv(billboard_Projection_location, 1, GL_FALSE, glm::value_ptr(Projection)); 
+            glUniform1i(billboard_sorted_location, sort_mode != GPUSort::NONE);
+            
+            // bind the buffer textures
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[0]);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[1]);
+            glActiveTexture(GL_TEXTURE0);
+            
+            // draw six vertices per particle
+            glBindVertexArray(billboard_vao);
+            glDrawArrays(GL_TRIANGLES, 0, 6*particles);
+        }
+        else
+        {
+            // set the uniform
+            glUniformMatrix4fv(View_location, 1, GL_FALSE, glm::value_ptr(View)); 
+            glUniformMatrix4fv(Projection_location, 1, GL_FALSE, glm::value_ptr(Projection)); 
+            
+            // bind the vao
+            glBindVertexArray(vao);
 
-        // draw
-        glDrawArrays(GL_POINTS, 0, particles);
+            // draw
+            if(sort_mode != GPUSort::NONE)
+            {
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sorter.indices());
+                glDrawElements(GL_POINTS, particles, GL_UNSIGNED_INT, 0);
+            }
+            else
+            {
+                glDrawArrays(GL_POINTS, 0, particles);
+            }
+        }
+        profiler.pop();
        
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
+        // display the draw and sort cost once per second
+        if(!bench.benchmarking() && glwtGetNanoTime()-last_report > 1000000000ull)
         {
-            userdata.running = false;       
+            std::cout << draw_scope << " " << profiler.stats(draw_scope).avg << " ms, ";
+            if(sort_mode == GPUSort::DEPTH)
+                std::cout << "sort " << profiler.stats("sort").avg << " ms, ";
+            std::cout << "frame " << profiler.stats("frame").avg << " ms" << std::endl;
+            last_report = glwtGetNanoTime();
         }
-        
+       
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window);       
     }
@@ -362,15 +511,18 @@ int main()
         
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &vbo);
+    glDeleteVertexArrays(1, &billboard_vao);
+    glDeleteTextures(2, textures);
     
-    glDetachShader(shader_program, vertex_shader);	
-    glDetachShader(shader_program, geometry_shader);	
-    glDetachShader(shader_program, fragment_shader);
-    glDeleteShader(vertex_shader);
-    glDeleteShader(geometry_shader);
-    glDeleteShader(fragment_shader);
-    glDeleteProgram(shader_program);
+    billboard_program.destroy();
+    shader_program.destroy();
     
+    if(sort_mode != GPUSort::NONE)
+        sorter.destroy();
+    
+    bench.shutdown();
+    profiler.shutdown();
+
     glwtWindowDestroy(window);
     glwtQuit();
     return 0;
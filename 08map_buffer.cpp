@@ -4,6 +4,26 @@
  * The particles are animated on the cpu and uploaded every frame by
  * mapping vbos. Multiple vbos are used to triple buffer the particle
  * data.
+ * Alternatively (start with --stream or toggle with space) the
+ * particles are streamed through a single ring buffer that stays
+ * mapped. The interpolated positions are then written straight into
+ * the mapped memory (see stream_buffer.hpp).
+ * The physics run on all cores and with SSE where available. The
+ * particle and thread counts can be set with --particles N and
+ * --threads N.
+ * The physics tick on their own thread at a fixed rate (--tick-rate N,
+ * default 60) independent of the frame rate (see frame_scheduler.hpp).
+ * Every frame the positions of the last two ticks are interpolated into
+ * the buffer that is drawn, split across the same threads. Only the
+ * positions are handed from tick to tick, the velocities stay with the
+ * physics thread.
+ * With --sort depth or --sort morton (needs GL 4.3) the particles are
+ * sorted on the gpu before drawing (see gpu_sort.hpp). Depth order
+ * allows blending them back to front instead of additively.
+ * With --billboards (toggle with B) the quads are generated in the
+ * vertex shader from gl_VertexID instead of in the geometry shader,
+ * fetching the positions from a buffer texture. Both paths are timed
+ * and printed once per second.
  * 
  * Autor: Jakob Progsch
  */
@@ -11,6 +31,17 @@
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "shader_program.hpp"
+#include "gpu_sort.hpp"
+#include "stream_buffer.hpp"
+#include "frame_scheduler.hpp"
+#include "thread_pool.hpp"
+#include "math_util.hpp"
+#include "options.hpp"
+
 //glm is used to create perspective and transform matrices
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -21,6 +52,14 @@
 #include <vector>
 #include <cstdlib>
 #include <cmath>
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define PARTICLES_SSE
+#endif
 
 #include <time.h>
 unsigned long long raw_time()
@@ -39,6 +78,8 @@ unsigned long long glwtGetNanoTime()
 
 struct UserData {
     bool running;
+    bool stream;
+    bool billboards;
 };
 
 static void error_callback(const char *msg, void *userdata)
@@ -55,52 +96,201 @@ static void close_callback(GLWTWindow *window, void *userdata)
 
 static void key_callback(GLWTWindow *window, int down, int keysym, int scancode, int mod, void *userdata)
 {
-    (void)window; (void)down; (void)scancode; (void)mod;
+    (void)window; (void)scancode; (void)mod;
     if(keysym == GLWT_KEY_ESCAPE)
         ((UserData*)userdata)->running = false;
+    if(keysym == GLWT_KEY_SPACE && down)
+        ((UserData*)userdata)->stream = !((UserData*)userdata)->stream;
+    if(keysym == GLWT_KEY_B && down)
+        ((UserData*)userdata)->billboards = !((UserData*)userdata)->billboards;
+}
+
+// the particles are stored as structure of arrays so the integrator
+// can process four of them at once. the positions are what every tick
+// publishes for drawing, the velocities are only needed by the physics
+struct Positions {
+    std::vector<float> x, y, z;
+};
+
+struct Velocities {
+    std::vector<float> x, y, z;
+};
+
+// spheres for the particles to bounce off and physical parameters
+struct Physics {
+    static const int spheres = 3;
+    float center[spheres][3];
+    float radius[spheres];
+    float g[3];
+    float dt;
+    float bounce; // inelastic: 1.0f, elastic: 2.0f
+};
+
+// places particle i at a random starting position in a cube
+inline void respawn(Positions &p, Velocities &v, int i, unsigned seed)
+{
+    p.x[i] =  0.0f + 5.0f*(0.5f-hash(3*i+0, i, seed));
+    p.y[i] = 20.0f + 5.0f*(0.5f-hash(3*i+1, i, seed));
+    p.z[i] =  0.0f + 5.0f*(0.5f-hash(3*i+2, i, seed));
+    v.x[i] = v.y[i] = v.z[i] = 0.0f;
 }
 
-// helper to check and display for shader compiler errors
-bool check_shader_compile_status(GLuint obj)
+// moves particles [begin, end) by one time step from the positions in
+// to out, the velocities are updated in place
+void integrate_scalar(const Positions &in, Positions &out, Velocities &v, const Physics &phys, unsigned seed, int begin, int end)
 {
-    GLint status;
-    glGetShaderiv(obj, GL_COMPILE_STATUS, &status);
-    if(status == GL_FALSE)
+    for(int i = begin;i<end;++i)
     {
-        GLint length;
-        glGetShaderiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetShaderInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;
+        float px = in.x[i], py = in.y[i], pz = in.z[i];
+        float vx = v.x[i], vy = v.y[i], vz = v.z[i];
+        
+        // resolve sphere collisions, comparing the squared distance
+        // avoids the sqrt
+        for(int j = 0;j<Physics::spheres;++j)
+        {
+            float dx = px-phys.center[j][0];
+            float dy = py-phys.center[j][1];
+            float dz = pz-phys.center[j][2];
+            float dist2 = dx*dx + dy*dy + dz*dz;
+            float vdot = dx*vx + dy*vy + dz*vz;
+            if(dist2<phys.radius[j]*phys.radius[j] && vdot<0.0f)
+            {
+                float s = phys.bounce*vdot/dist2;
+                vx -= s*dx;
+                vy -= s*dy;
+                vz -= s*dz;
+            }
+        }
+        
+        // euler iteration
+        vx += phys.dt*phys.g[0];
+        vy += phys.dt*phys.g[1];
+        vz += phys.dt*phys.g[2];
+        out.x[i] = px + phys.dt*vx;
+        out.y[i] = py + phys.dt*vy;
+        out.z[i] = pz + phys.dt*vz;
+        v.x[i] = vx;
+        v.y[i] = vy;
+        v.z[i] = vz;
+        
+        // reset particles that fall out to a starting position
+        if(out.y[i]<-30.0f)
+            respawn(out, v, i, seed);
     }
-    return true;
 }
 
-// helper to check and display for shader linker error
-bool check_program_link_status(GLuint obj)
+#ifdef PARTICLES_SSE
+// same as integrate_scalar with four particles at a time. begin has to
+// be a multiple of four, the remainder is done by integrate_scalar
+void integrate_sse(const Positions &in, Positions &out, Velocities &v, const Physics &phys, unsigned seed, int begin, int end)
 {
-    GLint status;
-    glGetProgramiv(obj, GL_LINK_STATUS, &status);
-    if(status == GL_FALSE)
+    __m128 center[Physics::spheres][3], radius2[Physics::spheres];
+    for(int j = 0;j<Physics::spheres;++j)
+    {
+        for(int k = 0;k<3;++k)
+            center[j][k] = _mm_set1_ps(phys.center[j][k]);
+        radius2[j] = _mm_set1_ps(phys.radius[j]*phys.radius[j]);
+    }
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 bounce = _mm_set1_ps(phys.bounce);
+    const __m128 dt = _mm_set1_ps(phys.dt);
+    const __m128 gx = _mm_set1_ps(phys.dt*phys.g[0]);
+    const __m128 gy = _mm_set1_ps(phys.dt*phys.g[1]);
+    const __m128 gz = _mm_set1_ps(phys.dt*phys.g[2]);
+    const __m128 floor = _mm_set1_ps(-30.0f);
+    
+    int simd_end = begin + (end-begin)/4*4;
+    for(int i = begin;i<simd_end;i+=4)
     {
-        GLint length;
-        glGetProgramiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetProgramInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;   
+        __m128 px = _mm_loadu_ps(&in.x[i]);
+        __m128 py = _mm_loadu_ps(&in.y[i]);
+        __m128 pz = _mm_loadu_ps(&in.z[i]);
+        __m128 vx = _mm_loadu_ps(&v.x[i]);
+        __m128 vy = _mm_loadu_ps(&v.y[i]);
+        __m128 vz = _mm_loadu_ps(&v.z[i]);
+        
+        for(int j = 0;j<Physics::spheres;++j)
+        {
+            __m128 dx = _mm_sub_ps(px, center[j][0]);
+            __m128 dy = _mm_sub_ps(py, center[j][1]);
+            __m128 dz = _mm_sub_ps(pz, center[j][2]);
+            __m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            __m128 vdot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, vx), _mm_mul_ps(dy, vy)), _mm_mul_ps(dz, vz));
+            
+            // lanes that don't collide get s = 0, this also masks
+            // out the division by zero at the center
+            __m128 hit = _mm_and_ps(_mm_cmplt_ps(dist2, radius2[j]), _mm_cmplt_ps(vdot, zero));
+            __m128 s = _mm_and_ps(hit, _mm_div_ps(_mm_mul_ps(bounce, vdot), dist2));
+            vx = _mm_sub_ps(vx, _mm_mul_ps(s, dx));
+            vy = _mm_sub_ps(vy, _mm_mul_ps(s, dy));
+            vz = _mm_sub_ps(vz, _mm_mul_ps(s, dz));
+        }
+        
+        vx = _mm_add_ps(vx, gx);
+        vy = _mm_add_ps(vy, gy);
+        vz = _mm_add_ps(vz, gz);
+        px = _mm_add_ps(px, _mm_mul_ps(dt, vx));
+        py = _mm_add_ps(py, _mm_mul_ps(dt, vy));
+        pz = _mm_add_ps(pz, _mm_mul_ps(dt, vz));
+        
+        _mm_storeu_ps(&out.x[i], px);
+        _mm_storeu_ps(&out.y[i], py);
+        _mm_storeu_ps(&out.z[i], pz);
+        _mm_storeu_ps(&v.x[i], vx);
+        _mm_storeu_ps(&v.y[i], vy);
+        _mm_storeu_ps(&v.z[i], vz);
+        
+        // respawns are rare, handle them per particle
+        int fallen = _mm_movemask_ps(_mm_cmplt_ps(py, floor));
+        for(int k = 0;fallen != 0 && k<4;++k)
+            if(fallen & (1<<k))
+                respawn(out, v, i+k, seed);
     }
-    return true;
+    integrate_scalar(in, out, v, phys, seed, simd_end, end);
+}
+#endif
+
+void integrate(const Positions &in, Positions &out, Velocities &v, const Physics &phys, unsigned seed, int begin, int end)
+{
+#ifdef PARTICLES_SSE
+    integrate_sse(in, out, v, phys, seed, begin, end);
+#else
+    integrate_scalar(in, out, v, phys, seed, begin, end);
+#endif
 }
 
-int main()
+// writes the positions of particles [begin, end) between two ticks to
+// out. a particle that respawned jumps up, that one is drawn at its new
+// position instead of somewhere along the way
+void interpolate(const Positions &a, const Positions &b, float alpha, glm::vec3 *out, int begin, int end)
+{
+    for(int i = begin;i<end;++i)
+    {
+        if(b.y[i]-a.y[i] > 10.0f)
+            out[i] = glm::vec3(b.x[i], b.y[i], b.z[i]);
+        else
+            out[i] = glm::vec3(a.x[i] + alpha*(b.x[i]-a.x[i]),
+                               a.y[i] + alpha*(b.y[i]-a.y[i]),
+                               a.z[i] + alpha*(b.z[i]-a.z[i]));
+    }
+}
+
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
+    
+    // sorting needs compute shaders
+    int sort_mode = GPUSort::parse_mode(argc, argv);
    
     UserData userdata;
     userdata.running = true;
+    userdata.stream = has_flag(argc, argv, "--stream");
+    userdata.billboards = has_flag(argc, argv, "--billboards");
     
     GLWTConfig glwt_config;
     glwt_config.red_bits = 8;
@@ -111,8 +301,8 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
-    glwt_config.api_version_major = 3;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
+    glwt_config.api_version_major = sort_mode != GPUSort::NONE ? 4 : 3;
     glwt_config.api_version_minor = 3;
     
     GLWTAppCallbacks app_callbacks;
@@ -154,9 +344,11 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
 
     // shader source code
     
@@ -201,77 +393,92 @@ int main()
         "   float s = 0.2*(1/(1+15.*dot(txcoord, txcoord))-1/16.);\n"
         "   FragColor = s*vec4(0.3,0.3,1.0,1);\n"
         "}\n";
-   
-    // program and shader handles
-    GLuint shader_program, vertex_shader, geometry_shader, fragment_shader;
-    
-    // we need these to properly pass the strings
-    const char *source;
-    int length;
-
-    // create and compiler vertex shader
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = vertex_source.c_str();
-    length = vertex_source.size();
-    glShaderSource(vertex_shader, 1, &source, &length); 
-    glCompileShader(vertex_shader);
-    if(!check_shader_compile_status(vertex_shader))
-    {
-        return 1;
-    }
     
-    // create and compiler geometry shader
-    geometry_shader = glCreateShader(GL_GEOMETRY_SHADER);
-    source = geometry_source.c_str();
-    length = geometry_source.size();
-    glShaderSource(geometry_shader, 1, &source, &length); 
-    glCompileShader(geometry_shader);
-    if(!check_shader_compile_status(geometry_shader))
-    {
-        return 1;
-    }
- 
-    // create and compiler fragment shader
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = fragment_source.c_str();
-    length = fragment_source.size();
-    glShaderSource(fragment_shader, 1, &source, &length);   
-    glCompileShader(fragment_shader);
-    if(!check_shader_compile_status(fragment_shader))
+    // the billboard vertex shader replaces the vertex and geometry
+    // shader. the positions are fetched three floats at a time since
+    // GL 3.3 has no RGB buffer texture format. first is the offset of
+    // the particles in the buffer in floats, when streaming that is the
+    // start of the current region
+    std::string billboard_source =
+        "#version 330\n"
+        "uniform mat4 View;\n"
+        "uniform mat4 Projection;\n"
+        "uniform samplerBuffer positions;\n"
+        "uniform usamplerBuffer order;\n"
+        "uniform bool sorted;\n"
+        "uniform int first;\n"
+        "out vec2 txcoord;\n"
+        "const vec2 quad_offsets[6] = vec2[](\n"
+        "   vec2(-1,-1),vec2( 1,-1),vec2( 1, 1),\n"
+        "   vec2(-1,-1),vec2( 1, 1),vec2(-1, 1)\n"
+        ");\n"
+        "void main() {\n"
+        "   int particle = gl_VertexID/6;\n"
+        "   if(sorted)\n"
+        "       particle = int(texelFetch(order, particle).r);\n"
+        "   int base = first+3*particle;\n"
+        "   vec4 pos = View*vec4(texelFetch(positions, base+0).r,\n"
+        "                        texelFetch(positions, base+1).r,\n"
+        "                        texelFetch(positions, base+2).r, 1);\n"
+        "   txcoord = quad_offsets[gl_VertexID%6];\n"
+        "   gl_Position = Projection*(pos+0.2*vec4(txcoord,0,0));\n"
+        "}\n";
+   
+    // the billboard program shares the fragment shader, both are
+    // compiled and linked at once (see shader_program.hpp)
+    ShaderProgram shader_program, billboard_program;
+    shader_program.add(GL_VERTEX_SHADER, vertex_source)
+                  .add(GL_GEOMETRY_SHADER, geometry_source)
+                  .add(GL_FRAGMENT_SHADER, fragment_source);
+    billboard_program.add(GL_VERTEX_SHADER, billboard_source)
+                     .add(GL_FRAGMENT_SHADER, fragment_source);
+    if(!link_programs({&shader_program, &billboard_program}))
     {
         return 1;
     }
     
-    // create program
-    shader_program = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, geometry_shader);
-    glAttachShader(shader_program, fragment_shader);
+    // obtain location of projection uniform
+    GLint View_location = shader_program.uniform("View");
+    GLint Projection_location = shader_program.uniform("Projection");
     
-    // link the program and check for errors
-    glLinkProgram(shader_program);
-    check_program_link_status(shader_program);
+    GLint billboard_View_location = billboard_program.uniform("View");
+    GLint billboard_Projection_location = billboard_program.uniform("Projection");
+    GLint billboard_sorted_location = billboard_program.uniform("sorted");
+    GLint billboard_first_location = billboard_program.uniform("first");
     
-    // obtain location of projection uniform
-    GLint View_location = glGetUniformLocation(shader_program, "View");
-    GLint Projection_location = glGetUniformLocation(shader_program, "Projection");
+    // the samplers read from texture units 0 and 1
+    glUseProgram(billboard_program.id());
+    glUniform1i(billboard_program.uniform("positions"), 0);
+    glUniform1i(billboard_program.uniform("order"), 1);
 
 
     
-    const int particles = 128*1024;
+    const int particles = std::max(1, int_option(argc, argv, "--particles", 128*1024));
 
     // randomly place particles in a cube
+    Positions state;
+    state.x.resize(particles); state.y.resize(particles); state.z.resize(particles);
+    Velocities velocities;
+    velocities.x.resize(particles); velocities.y.resize(particles); velocities.z.resize(particles);
+    
+    // positions in the vertex format, this is what gets copied to the
+    // vbos when not streaming
     std::vector<glm::vec3> vertexData(particles);
-    std::vector<glm::vec3> velocity(particles);
     for(int i = 0;i<particles;++i)
     {
-        vertexData[i] = glm::vec3(0.5f-float(std::rand())/RAND_MAX,
-                                  0.5f-float(std::rand())/RAND_MAX,
-                                  0.5f-float(std::rand())/RAND_MAX);
-        vertexData[i] = glm::vec3(0.0f,20.0f,0.0f) + 5.0f*vertexData[i];
+        respawn(state, velocities, i, 0);
+        vertexData[i] = glm::vec3(state.x[i], state.y[i], state.z[i]);
     }
+    
+    // the main thread does part of the work too
+    int threadcount = int_option(argc, argv, "--threads", std::max(1u, std::thread::hardware_concurrency()));
+    ThreadPool pool;
+    pool.start(std::max(0, threadcount-1));
+    std::cout << particles << " particles on " << std::max(1, threadcount) << " threads";
+#ifdef PARTICLES_SSE
+    std::cout << " with sse";
+#endif
+    std::cout << std::endl;
 
     
     int buffercount = 3;
@@ -294,8 +501,67 @@ int main()
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), (char*)0 + 0*sizeof(GLfloat));
     }
 
+    // the ring buffer for the streaming mode, it holds one copy of the
+    // particles per frame in flight
+    StreamBuffer stream;
+    stream.init(GL_ARRAY_BUFFER, sizeof(glm::vec3)*vertexData.size(), buffercount);
+    
+    // the attrib pointer of this vao is moved to the current region
+    // every frame
+    GLuint stream_vao;
+    glGenVertexArrays(1, &stream_vao);
+    glBindVertexArray(stream_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.buffer());
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), (char*)0 + 0*sizeof(GLfloat));
+
     // "unbind" vao
     glBindVertexArray(0);
+
+    // optional sort of the particles before drawing
+    GPUSort sorter;
+    if(sort_mode != GPUSort::NONE && !sorter.init(particles))
+    {
+        return 1;
+    }
+    
+    // the particles stay within these bounds, they are only used for
+    // the morton codes
+    const GLfloat sort_lo[3] = { -30.0f, -30.0f, -30.0f };
+    const GLfloat sort_hi[3] = {  30.0f,  30.0f,  30.0f };
+    
+    // the billboards don't use any attributes, but drawing still
+    // needs a vao
+    GLuint billboard_vao;
+    glGenVertexArrays(1, &billboard_vao);
+    
+    // buffer textures to fetch the positions from, one per vbo and one
+    // for the whole ring buffer followed by one for the sort order
+    GLuint textures[buffercount+2];
+    glGenTextures(buffercount+2, textures);
+    for(int i = 0;i<buffercount;++i)
+    {
+        glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, vbo[i]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, textures[buffercount]);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, stream.buffer());
+    if(sort_mode != GPUSort::NONE)
+    {
+        glBindTexture(GL_TEXTURE_BUFFER, textures[buffercount+1]);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, sorter.indices());
+    }
+    
+    // GL 3.3 only guarantees 65536 texels, the ring buffer is the
+    // largest of the buffers
+    GLint max_texels;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+    bool billboards_supported = max_texels >= GLint(stream.region_size()/sizeof(GLfloat)*buffercount);
+    if(!billboards_supported)
+    {
+        std::cerr << "buffer textures are limited to " << max_texels << " texels, billboards disabled" << std::endl;
+        userdata.billboards = false;
+    }
     
     // we are blending so no depth testing
     glDisable(GL_DEPTH_TEST);
@@ -304,86 +570,140 @@ int main()
     glEnable(GL_BLEND);
     //  and set the blend function to result = 1*source + 1*destination
     glBlendFunc(GL_ONE, GL_ONE);
+    
+    if(sort_mode == GPUSort::DEPTH)
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    
+    unsigned long long last_report = glwtGetNanoTime();
 
     // define spheres for the particles to bounce off
-    const int spheres = 3;
-    glm::vec3 center[spheres];
-    float radius[spheres];
-    center[0] = glm::vec3(0,12,1);
-    radius[0] = 3;
-    center[1] = glm::vec3(-3,0,0);
-    radius[1] = 7;
-    center[2] = glm::vec3(5,-10,0);
-    radius[2] = 12;
-
-    // physical parameters
-    float dt = 1.0f/60.0f;
-    glm::vec3 g(0.0f, -9.81f, 0.0f);
-    float bounce = 1.2f; // inelastic: 1.0f, elastic: 2.0f
+    Physics physics;
+    const float center[Physics::spheres][3] = { {0,12,1}, {-3,0,0}, {5,-10,0} };
+    const float radius[Physics::spheres] = { 3, 7, 12 };
+    for(int j = 0;j<Physics::spheres;++j)
+    {
+        for(int k = 0;k<3;++k)
+            physics.center[j][k] = center[j][k];
+        physics.radius[j] = radius[j];
+    }
+
+    // physical parameters, dt is set by the simulation
+    physics.dt = 0.0f;
+    physics.g[0] = 0.0f; physics.g[1] = -9.81f; physics.g[2] = 0.0f;
+    physics.bounce = 1.2f;
+
+    // the physics tick on their own thread, which splits every tick
+    // across the pool. the tick number seeds the respawns
+    unsigned tick = 0;
+    FixedStepSimulation<Positions, int> simulation;
+    simulation.start(state, std::max(1, int_option(argc, argv, "--tick-rate", 60)),
+                     [&](const Positions &previous, Positions &next, const int &input, double dt) {
+        (void)input;
+        physics.dt = float(dt);
+        unsigned seed = ++tick;
+        std::function<void(int, int)> step = [&](int begin, int end) {
+            integrate(previous, next, velocities, physics, seed, begin, end);
+        };
+        pool.run(step, particles);
+    });
 
     int current_buffer=0;
+    bool streaming = !userdata.stream;
+    bool billboards = !userdata.billboards;
     while(userdata.running)
     {   
+        bench.begin_frame();
+
         // get the time in seconds
         float t = glwtGetNanoTime()*1.e-9f;
         
         // update events
         glwtEventHandle(0);
         
-        // update physics
-        for(int i = 0;i<particles;++i)
+        if(streaming != userdata.stream)
         {
-            // resolve sphere collisions
-            for(int j = 0;j<spheres;++j)
-            {
-                glm::vec3 diff = vertexData[i]-center[j];
-                float dist = glm::length(diff);
-                if(dist<radius[j] && glm::dot(diff, velocity[i])<0.0f)
-                    velocity[i] -= bounce*diff/(dist*dist)*glm::dot(diff, velocity[i]);
-            }
-            // euler iteration
-            velocity[i] += dt*g;
-            vertexData[i] += dt*velocity[i];
-            // reset particles that fall out to a starting position
-            if(vertexData[i].y<-30.0)
-            {
-                vertexData[i] = glm::vec3(
-                                    0.5f-float(std::rand())/RAND_MAX,
-                                    0.5f-float(std::rand())/RAND_MAX,
-                                    0.5f-float(std::rand())/RAND_MAX
-                                );
-                vertexData[i] = glm::vec3(0.0f,20.0f,0.0f) + 5.0f*vertexData[i];
-                velocity[i] = glm::vec3(0,0,0);
-            }
+            streaming = userdata.stream;
+            if(!streaming)
+                std::cout << "orphaning and copying into vbos" << std::endl;
+            else if(stream.persistent())
+                std::cout << "streaming through a persistently mapped buffer" << std::endl;
+            else
+                std::cout << "streaming through an unsynchronized mapped buffer" << std::endl;
+        }
+        
+        if(!billboards_supported)
+            userdata.billboards = false;
+        if(billboards != userdata.billboards)
+        {
+            billboards = userdata.billboards;
+            if(billboards)
+                std::cout << "generating billboards in the vertex shader" << std::endl;
+            else
+                std::cout << "generating billboards in the geometry shader" << std::endl;
         }
         
-        // bind a buffer to upload to
-        glBindBuffer(GL_ARRAY_BUFFER, vbo[(current_buffer+buffercount-1)%buffercount]);
+        // when streaming the positions are written to the mapped region,
+        // wait for the gpu to be done with it first
+        glm::vec3 *out = &vertexData[0];
+        if(streaming)
+        {
+            profiler.push_cpu("wait");
+            out = reinterpret_cast<glm::vec3*>(stream.begin_write());
+            profiler.pop();
+        }
         
-        // explicitly invalidate the buffer
-        glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3)*vertexData.size(), 0, GL_DYNAMIC_DRAW);
-
-        // map the buffer
-        glm::vec3 *mapped = 
-            reinterpret_cast<glm::vec3*>(
-                glMapBufferRange(GL_ARRAY_BUFFER, 0,
-                    sizeof(glm::vec3)*vertexData.size(),
-                    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT
-                )
-            );
-            
-        // copy data into the mapped memory
-        std::copy(vertexData.begin(), vertexData.end(), mapped);
+        // interpolate the newest ticks on the pool, the physics thread
+        // waits its turn if it wants the pool at the same time
+        profiler.push_cpu("interpolate");
+        const Positions *previous, *current;
+        float alpha = simulation.acquire(previous, current);
+        std::function<void(int, int)> blend = [&](int begin, int end) {
+            interpolate(*previous, *current, alpha, out, begin, end);
+        };
+        pool.run(blend, particles);
+        profiler.pop();
         
-        // unmap the buffer
-        glUnmapBuffer(GL_ARRAY_BUFFER);
+        if(streaming)
+        {
+            // point the attribute at the region we just wrote
+            GLintptr offset = stream.end_write();
+            glBindVertexArray(stream_vao);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), (char*)0 + offset);
+        }
+        else
+        {
+            profiler.push_cpu("upload");
+            
+            // bind a buffer to upload to
+            glBindBuffer(GL_ARRAY_BUFFER, vbo[(current_buffer+buffercount-1)%buffercount]);
+            
+            // explicitly invalidate the buffer
+            glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3)*vertexData.size(), 0, GL_DYNAMIC_DRAW);
+
+            // map the buffer
+            glm::vec3 *mapped = 
+                reinterpret_cast<glm::vec3*>(
+                    glMapBufferRange(GL_ARRAY_BUFFER, 0,
+                        sizeof(glm::vec3)*vertexData.size(),
+                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT
+                    )
+                );
+                
+            // copy data into the mapped memory
+            std::copy(vertexData.begin(), vertexData.end(), mapped);
+            
+            // unmap the buffer
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            
+            profiler.pop();
+        }
 
         
         // clear first
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
         // use the shader program
-        glUseProgram(shader_program);
+        glUseProgram(shader_program.id());
         
         // calculate ViewProjection matrix
         glm::mat4 Projection = glm::perspective(90.0f, 4.0f / 3.0f, 0.1f, 100.f);
@@ -395,23 +715,84 @@ int main()
         View = glm::rotate(View, 30.0f, glm::vec3(1.0f, 0.0f, 0.0f)); 
         View = glm::rotate(View, -22.5f*t, glm::vec3(0.0f, 1.0f, 0.0f)); 
         
-        // set the uniform
-        glUniformMatrix4fv(View_location, 1, GL_FALSE, glm::value_ptr(View)); 
-        glUniformMatrix4fv(Projection_location, 1, GL_FALSE, glm::value_ptr(Projection)); 
+        if(sort_mode != GPUSort::NONE)
+        {
+            profiler.push_gpu("sort");
+            // sort the buffer that is drawn this frame
+            if(streaming)
+                sorter.sort(stream.buffer(), 3, stream.offset()/sizeof(GLfloat), sort_mode, glm::value_ptr(View), sort_lo, sort_hi);
+            else
+                sorter.sort(vbo[current_buffer], 3, 0, sort_mode, glm::value_ptr(View), sort_lo, sort_hi);
+            profiler.pop();
+            glUseProgram(shader_program.id());
+        }
         
-        // bind the current vao
-        glBindVertexArray(vao[current_buffer]);
+        const char *draw_scope = billboards ? "billboards" : "geometry shader";
+        profiler.push_gpu(draw_scope);
+        if(billboards)
+        {
+            glUseProgram(billboard_program.id());
+            
+            // set the uniforms
+            glUniformMatrix4fv(billboard_View_location, 1, GL_FALSE, glm::value_ptr(View)); 
+            glUniformMatrix4fv(billboard_Projection_location, 1, GL_FALSE, glm::value_ptr(Projection)); 
+            glUniform1i(billboard_sorted_location, sort_mode != GPUSort::NONE);
+            glUniform1i(billboard_first_location, streaming ? GLint(stream.offset()/sizeof(GLfloat)) : 0);
+            
+            // bind the buffer textures of the current buffer
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[streaming ? buffercount : current_buffer]);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[buffercount+1]);
+            glActiveTexture(GL_TEXTURE0);
+            
+            // draw six vertices per particle
+            glBindVertexArray(billboard_vao);
+            glDrawArrays(GL_TRIANGLES, 0, 6*particles);
+        }
+        else
+        {
+            // set the uniform
+            glUniformMatrix4fv(View_location, 1, GL_FALSE, glm::value_ptr(View)); 
+            glUniformMatrix4fv(Projection_location, 1, GL_FALSE, glm::value_ptr(Projection)); 
+            
+            // bind the current vao
+            glBindVertexArray(streaming ? stream_vao : vao[current_buffer]);
 
-        // draw
-        glDrawArrays(GL_POINTS, 0, particles);
+            // draw
+            if(sort_mode != GPUSort::NONE)
+            {
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sorter.indices());
+                glDrawElements(GL_POINTS, particles, GL_UNSIGNED_INT, 0);
+            }
+            else
+            {
+                glDrawArrays(GL_POINTS, 0, particles);
+            }
+        }
+        profiler.pop();
+        
+        // the region can be reused once this draw is done
+        if(streaming)
+            stream.fence();
        
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
+        // display the draw and sort cost once per second
+        if(!bench.benchmarking() && glwtGetNanoTime()-last_report > 1000000000ull)
         {
-            userdata.running = false;       
+            std::cout << draw_scope << " " << profiler.stats(draw_scope).avg << " ms, ";
+            if(sort_mode != GPUSort::NONE)
+                std::cout << "sort " << profiler.stats("sort").avg << " ms, ";
+            std::cout << "frame " << profiler.stats("frame").avg << " ms" << std::endl;
+            last_report = glwtGetNanoTime();
         }
-        
+       
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window);
         
@@ -419,19 +800,27 @@ int main()
         current_buffer = (current_buffer + 1) % buffercount;       
     }
     
+    simulation.stop();
+    pool.stop();
+    
     // delete the created objects
         
     glDeleteVertexArrays(buffercount, vao);
     glDeleteBuffers(buffercount, vbo);
+    glDeleteVertexArrays(1, &stream_vao);
+    stream.destroy();
+    glDeleteVertexArrays(1, &billboard_vao);
+    glDeleteTextures(buffercount+2, textures);
+    
+    billboard_program.destroy();
+    shader_program.destroy();
     
-    glDetachShader(shader_program, vertex_shader);  
-    glDetachShader(shader_program, geometry_shader);    
-    glDetachShader(shader_program, fragment_shader);
-    glDeleteShader(vertex_shader);
-    glDeleteShader(geometry_shader);
-    glDeleteShader(fragment_shader);
-    glDeleteProgram(shader_program);
+    if(sort_mode != GPUSort::NONE)
+        sorter.destroy();
     
+    bench.shutdown();
+    profiler.shutdown();
+
     glwtWindowDestroy(window);
     glwtQuit();
     return 0;
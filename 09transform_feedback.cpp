@@ -3,6 +3,18 @@
  * This example simulates the same particle system as the buffer mapping
  * example. Instead of updating particles on the cpu and uploading
  * the update is done on the gpu with transform feedback.
+ * With --compute (needs GL 4.3) the simulation runs in a compute shader
+ * instead. It updates the particles in place in shader storage buffers
+ * and supports many colliders by sorting them into a uniform grid. For
+ * a few colliders the shader just walks them through shared memory.
+ * The particle and collider counts can be set with --particles N and
+ * --colliders N (only the compute path uses more than three).
+ * With --sort depth or --sort morton (needs GL 4.3) the particles are
+ * sorted on the gpu before drawing (see gpu_sort.hpp). Depth order
+ * allows blending them back to front instead of additively.
+ * Both backends step the particles at a fixed rate (--tick-rate N,
+ * default 60) independent of the frame rate. Every frame runs as many
+ * ticks as are due since the last one.
  * 
  * Autor: Jakob Progsch
  */
@@ -10,6 +22,13 @@
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "shader_program.hpp"
+#include "gpu_sort.hpp"
+#include "options.hpp"
+
 //glm is used to create perspective and transform matrices
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -20,6 +39,7 @@
 #include <vector>
 #include <cstdlib>
 #include <cmath>
+#include <algorithm>
 
 #include <time.h>
 unsigned long long raw_time()
@@ -59,44 +79,81 @@ static void key_callback(GLWTWindow *window, int down, int keysym, int scancode,
         ((UserData*)userdata)->running = false;
 }
 
-// helper to check and display for shader compiler errors
-bool check_shader_compile_status(GLuint obj)
+// uniform grid over the colliders. the colliders overlapping cell c are
+// items[start[c]] to items[start[c+1]-1]
+struct ColliderGrid {
+    glm::vec3 origin;
+    glm::vec3 inv_cell_size;
+    glm::ivec3 size;
+    std::vector<GLuint> start;
+    std::vector<GLuint> items;
+};
+
+// sorts spheres given as (center, radius) into a grid with about one
+// cell per collider
+void build_collider_grid(const std::vector<glm::vec4> &spheres, ColliderGrid &grid)
 {
-    GLint status;
-    glGetShaderiv(obj, GL_COMPILE_STATUS, &status);
-    if(status == GL_FALSE)
+    glm::vec3 lo(spheres[0]), hi(spheres[0]);
+    for(size_t i = 0;i<spheres.size();++i)
     {
-        GLint length;
-        glGetShaderiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetShaderInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;
+        lo = glm::min(lo, glm::vec3(spheres[i])-spheres[i].w);
+        hi = glm::max(hi, glm::vec3(spheres[i])+spheres[i].w);
     }
-    return true;
-}
-
-// helper to check and display for shader linker error
-bool check_program_link_status(GLuint obj)
-{
-    GLint status;
-    glGetProgramiv(obj, GL_LINK_STATUS, &status);
-    if(status == GL_FALSE)
+    glm::vec3 extent = glm::max(hi-lo, glm::vec3(1.0e-3f));
+    float cell = std::pow(extent.x*extent.y*extent.z/spheres.size(), 1.0f/3.0f);
+    for(int k = 0;k<3;++k)
+        grid.size[k] = std::max(1, std::min(64, int(std::ceil(extent[k]/cell))));
+    grid.origin = lo;
+    grid.inv_cell_size = glm::vec3(grid.size)/extent;
+    
+    // count the colliders per cell, turn that into offsets and fill in
+    int cells = grid.size.x*grid.size.y*grid.size.z;
+    grid.start.assign(cells+1, 0);
+    for(int pass = 0;pass<2;++pass)
     {
-        GLint length;
-        glGetProgramiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetProgramInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;   
+        std::vector<GLuint> fill(grid.start.begin(), grid.start.end()-1);
+        for(size_t i = 0;i<spheres.size();++i)
+        {
+            glm::ivec3 a(glm::floor((glm::vec3(spheres[i])-spheres[i].w-grid.origin)*grid.inv_cell_size));
+            glm::ivec3 b(glm::floor((glm::vec3(spheres[i])+spheres[i].w-grid.origin)*grid.inv_cell_size));
+            a = glm::clamp(a, glm::ivec3(0), grid.size-1);
+            b = glm::clamp(b, glm::ivec3(0), grid.size-1);
+            for(int z = a.z;z<=b.z;++z)
+            for(int y = a.y;y<=b.y;++y)
+            for(int x = a.x;x<=b.x;++x)
+            {
+                int c = (z*grid.size.y+y)*grid.size.x+x;
+                if(pass == 0)
+                    ++grid.start[c+1];
+                else
+                    grid.items[fill[c]++] = i;
+            }
+        }
+        if(pass == 0)
+        {
+            for(int c = 0;c<cells;++c)
+                grid.start[c+1] += grid.start[c];
+            grid.items.resize(grid.start[cells]);
+        }
     }
-    return true;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
+    
+    // sorting needs compute shaders
+    int sort_mode = GPUSort::parse_mode(argc, argv);
+    
+    // the compute backend needs GL 4.3
+    bool compute = has_flag(argc, argv, "--compute");
+    const int particles = std::max(1, int_option(argc, argv, "--particles", 128*1024));
+    const int collidercount = std::max(3, int_option(argc, argv, "--colliders", 3));
    
     UserData userdata;
     userdata.running = true;
@@ -110,8 +167,8 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
-    glwt_config.api_version_major = 3;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
+    glwt_config.api_version_major = (compute || sort_mode != GPUSort::NONE) ? 4 : 3;
     glwt_config.api_version_minor = 3;
     
     GLWTAppCallbacks app_callbacks;
@@ -153,9 +210,11 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
 
     // shader source code
     
@@ -201,61 +260,19 @@ int main()
         "   FragColor = s*vec4(0.3,0.3,1.0,1);\n"
         "}\n";
    
-    // program and shader handles
-    GLuint shader_program, vertex_shader, geometry_shader, fragment_shader;
-    
-    // we need these to properly pass the strings
-    const char *source;
-    int length;
-
-    // create and compiler vertex shader
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = vertex_source.c_str();
-    length = vertex_source.size();
-    glShaderSource(vertex_shader, 1, &source, &length); 
-    glCompileShader(vertex_shader);
-    if(!check_shader_compile_status(vertex_shader))
-    {
-        return 1;
-    }
-    
-    // create and compiler geometry shader
-    geometry_shader = glCreateShader(GL_GEOMETRY_SHADER);
-    source = geometry_source.c_str();
-    length = geometry_source.size();
-    glShaderSource(geometry_shader, 1, &source, &length); 
-    glCompileShader(geometry_shader);
-    if(!check_shader_compile_status(geometry_shader))
-    {
-        return 1;
-    }
- 
-    // create and compiler fragment shader
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = fragment_source.c_str();
-    length = fragment_source.size();
-    glShaderSource(fragment_shader, 1, &source, &length);   
-    glCompileShader(fragment_shader);
-    if(!check_shader_compile_status(fragment_shader))
+    // compile and link the program, see shader_program.hpp
+    ShaderProgram shader_program;
+    shader_program.add(GL_VERTEX_SHADER, vertex_source)
+                  .add(GL_GEOMETRY_SHADER, geometry_source)
+                  .add(GL_FRAGMENT_SHADER, fragment_source);
+    if(!shader_program.link())
     {
         return 1;
     }
     
-    // create program
-    shader_program = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, geometry_shader);
-    glAttachShader(shader_program, fragment_shader);
-    
-    // link the program and check for errors
-    glLinkProgram(shader_program);
-    check_program_link_status(shader_program);
-    
     // obtain location of projection uniform
-    GLint View_location = glGetUniformLocation(shader_program, "View");
-    GLint Projection_location = glGetUniformLocation(shader_program, "Projection");
+    GLint View_location = shader_program.uniform("View");
+    GLint Projection_location = shader_program.uniform("Projection");
 
 
 
@@ -298,48 +315,217 @@ int main()
         "   }\n"
         "}\n";
    
-    // program and shader handles
-    GLuint transform_shader_program, transform_vertex_shader;
-
-    // create and compiler vertex shader
-    transform_vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = transform_vertex_source.c_str();
-    length = transform_vertex_source.size();
-    glShaderSource(transform_vertex_shader, 1, &source, &length); 
-    glCompileShader(transform_vertex_shader);
-    if(!check_shader_compile_status(transform_vertex_shader))
+    // the transform feedback output has to be specified before linking
+    ShaderProgram transform_shader_program;
+    transform_shader_program.add(GL_VERTEX_SHADER, transform_vertex_source)
+                            .feedback_varyings({"outposition", "outvelocity"}, GL_INTERLEAVED_ATTRIBS);
+    if(!transform_shader_program.link())
     {
         return 1;
     }
 
-    // create program
-    transform_shader_program = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(transform_shader_program, transform_vertex_shader);
-    
-    // specify transform feedback output
-    const char *varyings[] = {"outposition", "outvelocity"};
-    glTransformFeedbackVaryings(transform_shader_program, 2, varyings, GL_INTERLEAVED_ATTRIBS);
-    
-    // link the program and check for errors
-    glLinkProgram(transform_shader_program);
-    check_program_link_status(transform_shader_program);
-
-    GLint center_location = glGetUniformLocation(transform_shader_program, "center");
-    GLint radius_location = glGetUniformLocation(transform_shader_program, "radius");
-    GLint g_location = glGetUniformLocation(transform_shader_program, "g");
-    GLint dt_location = glGetUniformLocation(transform_shader_program, "dt");
-    GLint bounce_location = glGetUniformLocation(transform_shader_program, "bounce");
-    GLint seed_location = glGetUniformLocation(transform_shader_program, "seed");
+    GLint center_location = transform_shader_program.uniform("center");
+    GLint radius_location = transform_shader_program.uniform("radius");
+    GLint g_location = transform_shader_program.uniform("g");
+    GLint dt_location = transform_shader_program.uniform("dt");
+    GLint bounce_location = transform_shader_program.uniform("bounce");
+    GLint seed_location = transform_shader_program.uniform("seed");
 
 
-   
-    const int particles = 128*1024;
 
+    // define spheres for the particles to bounce off as center and
+    // radius. the transform feedback shader only handles the first
+    // three, the others are scattered randomly for the compute backend
+    std::vector<glm::vec4> spheres;
+    spheres.push_back(glm::vec4(0,12,1, 3));
+    spheres.push_back(glm::vec4(-3,0,0, 7));
+    spheres.push_back(glm::vec4(5,-10,0, 12));
+    for(int i = 3;i<collidercount;++i)
+    {
+        spheres.push_back(glm::vec4(
+                            50.0f*(float(std::rand())/RAND_MAX-0.5f),
+                            40.0f*float(std::rand())/RAND_MAX-25.0f,
+                            50.0f*(float(std::rand())/RAND_MAX-0.5f),
+                            0.5f+2.0f*float(std::rand())/RAND_MAX
+                        ));
+    }
+    
+    // with up to this many colliders the compute shader tests all of
+    // them, loading one tile at a time into shared memory. above that
+    // it only tests the ones in the grid cell of the particle
+    const int tile_size = 256;
+    bool use_grid = compute && collidercount > tile_size;
+    
+    // compute backend objects
+    ShaderProgram compute_program;
+    GLuint position_buffer = 0, velocity_buffer = 0, collider_buffer = 0;
+    GLuint cell_start_buffer = 0, cell_item_buffer = 0;
+    GLuint compute_vao = 0;
+    GLint compute_particles_location = -1, compute_colliders_location = -1;
+    GLint compute_g_location = -1, compute_dt_location = -1, compute_bounce_location = -1, compute_seed_location = -1;
+    GLint grid_origin_location = -1, grid_inv_cell_size_location = -1, grid_size_location = -1;
+    
+    if(compute)
+    {
+        // particles are updated in place, positions and velocities are
+        // separate so the positions can be used as vertex attribute
+        std::string compute_source =
+            "#version 430\n"
+            "layout(local_size_x = 256) in;\n"
+            "layout(std430, binding = 0) buffer Positions { vec4 position[]; };\n"
+            "layout(std430, binding = 1) buffer Velocities { vec4 velocity[]; };\n"
+            "layout(std430, binding = 2) readonly buffer Colliders { vec4 collider[]; };\n"
+            "#ifdef GRID\n"
+            "layout(std430, binding = 3) readonly buffer CellStart { uint cell_start[]; };\n"
+            "layout(std430, binding = 4) readonly buffer CellItems { uint cell_item[]; };\n"
+            "uniform vec3 grid_origin;\n"
+            "uniform vec3 grid_inv_cell_size;\n"
+            "uniform ivec3 grid_size;\n"
+            "#else\n"
+            "shared vec4 tile[256];\n"
+            "#endif\n"
+            "uniform int particles;\n"
+            "uniform int colliders;\n"
+            "uniform vec3 g;\n"
+            "uniform float dt;\n"
+            "uniform float bounce;\n"
+            "uniform int seed;\n"
+            
+            "float hash(int x, int id) {\n"
+            "   x = x*1235167 + id*948737 + seed*9284365;\n"
+            "   x = (x >> 13) ^ x;\n"
+            "   return ((x * (x * x * 60493 + 19990303) + 1376312589) & 0x7fffffff)/float(0x7fffffff-1);\n"
+            "}\n"
+            
+            "vec3 collide(vec3 pos, vec3 vel, vec4 sphere) {\n"
+            "   vec3 diff = pos-sphere.xyz;\n"
+            "   float dist2 = dot(diff, diff);\n"
+            "   float vdot = dot(diff, vel);\n"
+            "   if(dist2<sphere.w*sphere.w && vdot<0.0)\n"
+            "       vel -= bounce*diff*vdot/dist2;\n"
+            "   return vel;\n"
+            "}\n"
+            
+            "void main() {\n"
+            // two dimensional dispatch for more than 65535 groups
+            "   int id = int(gl_GlobalInvocationID.x + gl_GlobalInvocationID.y*gl_NumWorkGroups.x*gl_WorkGroupSize.x);\n"
+            "   bool active = id < particles;\n"
+            "   vec3 pos = active ? position[id].xyz : vec3(0);\n"
+            "   vec3 vel = active ? velocity[id].xyz : vec3(0);\n"
+            "#ifdef GRID\n"
+            "   ivec3 cell = ivec3(floor((pos-grid_origin)*grid_inv_cell_size));\n"
+            "   if(active && all(greaterThanEqual(cell, ivec3(0))) && all(lessThan(cell, grid_size))) {\n"
+            "       int c = (cell.z*grid_size.y+cell.y)*grid_size.x+cell.x;\n"
+            "       for(uint k = cell_start[c];k<cell_start[c+1];++k)\n"
+            "           vel = collide(pos, vel, collider[cell_item[k]]);\n"
+            "   }\n"
+            "#else\n"
+            // all invocations take part in loading the tiles, even the
+            // ones past the end of the particles
+            "   for(int base = 0;base<colliders;base += 256) {\n"
+            "       int l = int(gl_LocalInvocationID.x);\n"
+            "       if(base+l < colliders)\n"
+            "           tile[l] = collider[base+l];\n"
+            "       barrier();\n"
+            "       int n = min(256, colliders-base);\n"
+            "       for(int k = 0;k<n;++k)\n"
+            "           vel = collide(pos, vel, tile[k]);\n"
+            "       barrier();\n"
+            "   }\n"
+            "#endif\n"
+            "   if(!active)\n"
+            "       return;\n"
+            "   vel += dt*g;\n"
+            "   pos += dt*vel;\n"
+            "   if(pos.y < -30.0)\n"
+            "   {\n"
+            "       vel = vec3(0,0,0);\n"
+            "       pos = 0.5-vec3(hash(3*id+0, id),hash(3*id+1, id),hash(3*id+2, id));\n"
+            "       pos = vec3(0,20,0) + 5.0*pos;\n"
+            "   }\n"
+            "   position[id] = vec4(pos, 1);\n"
+            "   velocity[id] = vec4(vel, 0);\n"
+            "}\n";
+        
+        // select the collider variant by inserting a define after the
+        // version line
+        if(use_grid)
+            compute_source.insert(compute_source.find('\n')+1, "#define GRID\n");
+        
+        compute_program.add(GL_COMPUTE_SHADER, compute_source);
+        if(!compute_program.link())
+        {
+            return 1;
+        }
+        
+        compute_particles_location = compute_program.uniform("particles");
+        compute_colliders_location = compute_program.uniform("colliders");
+        compute_g_location = compute_program.uniform("g");
+        compute_dt_location = compute_program.uniform("dt");
+        compute_bounce_location = compute_program.uniform("bounce");
+        compute_seed_location = compute_program.uniform("seed");
+        grid_origin_location = compute_program.uniform("grid_origin");
+        grid_inv_cell_size_location = compute_program.uniform("grid_inv_cell_size");
+        grid_size_location = compute_program.uniform("grid_size");
+        
+        // start all particles below the floor so the first step spawns
+        // them, that way the initial positions are generated on the
+        // gpu as well
+        const GLfloat below[4] = { 0.0f, -100.0f, 0.0f, 1.0f };
+        const GLfloat zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        
+        glGenBuffers(1, &position_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, position_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLfloat)*4*particles, 0, GL_DYNAMIC_COPY);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_RGBA32F, GL_RGBA, GL_FLOAT, below);
+        
+        glGenBuffers(1, &velocity_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, velocity_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLfloat)*4*particles, 0, GL_DYNAMIC_COPY);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_RGBA32F, GL_RGBA, GL_FLOAT, zero);
+        
+        glGenBuffers(1, &collider_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, collider_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec4)*spheres.size(), &spheres[0], GL_STATIC_DRAW);
+        
+        glUseProgram(compute_program.id());
+        glUniform1i(compute_particles_location, particles);
+        glUniform1i(compute_colliders_location, spheres.size());
+        if(use_grid)
+        {
+            ColliderGrid grid;
+            build_collider_grid(spheres, grid);
+            
+            glGenBuffers(1, &cell_start_buffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, cell_start_buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint)*grid.start.size(), &grid.start[0], GL_STATIC_DRAW);
+            
+            glGenBuffers(1, &cell_item_buffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, cell_item_buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint)*std::max<size_t>(1, grid.items.size()), grid.items.empty() ? 0 : &grid.items[0], GL_STATIC_DRAW);
+            
+            glUniform3fv(grid_origin_location, 1, glm::value_ptr(grid.origin));
+            glUniform3fv(grid_inv_cell_size_location, 1, glm::value_ptr(grid.inv_cell_size));
+            glUniform3iv(grid_size_location, 1, glm::value_ptr(grid.size));
+            
+            std::cout << spheres.size() << " colliders in a " << grid.size.x << "x" << grid.size.y << "x" << grid.size.z << " grid" << std::endl;
+        }
+        else
+        {
+            std::cout << spheres.size() << " colliders in shared memory tiles" << std::endl;
+        }
+        
+        // the positions are drawn directly from the storage buffer
+        glGenVertexArrays(1, &compute_vao);
+        glBindVertexArray(compute_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, position_buffer);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), (char*)0 + 0*sizeof(GLfloat));
+    }
+    
     // randomly place particles in a cube
-    std::vector<glm::vec3> vertexData(2*particles);
-    for(int i = 0;i<particles;++i)
+    std::vector<glm::vec3> vertexData(compute ? 0 : 2*particles);
+    for(int i = 0;i<particles && !compute;++i)
     {
         // initial position
         vertexData[2*i+0] = glm::vec3(
@@ -359,7 +545,8 @@ int main()
     glGenVertexArrays(buffercount, vao);
     glGenBuffers(buffercount, vbo);
     
-    for(int i = 0;i<buffercount;++i)
+    // the transform feedback buffers aren't needed by the compute backend
+    for(int i = 0;i<buffercount && !compute;++i)
     {
         glBindVertexArray(vao[i]);
         
@@ -378,6 +565,18 @@ int main()
 
     // "unbind" vao
     glBindVertexArray(0);
+
+    // optional sort of the particles before drawing
+    GPUSort sorter;
+    if(sort_mode != GPUSort::NONE && !sorter.init(particles))
+    {
+        return 1;
+    }
+    
+    // the particles stay within these bounds, they are only used for
+    // the morton codes
+    const GLfloat sort_lo[3] = { -30.0f, -30.0f, -30.0f };
+    const GLfloat sort_hi[3] = {  30.0f,  30.0f,  30.0f };
     
     // we ar blending so no depth testing
     glDisable(GL_DEPTH_TEST);
@@ -386,64 +585,134 @@ int main()
     glEnable(GL_BLEND);
     //  and set the blend function to result = 1*source + 1*destination
     glBlendFunc(GL_ONE, GL_ONE);
+    
+    if(sort_mode == GPUSort::DEPTH)
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    
+    unsigned long long last_report = glwtGetNanoTime();
 
-    // define spheres for the particles to bounce off
-    const int spheres = 3;
-    glm::vec3 center[spheres];
-    float radius[spheres];
-    center[0] = glm::vec3(0,12,1);
-    radius[0] = 3;
-    center[1] = glm::vec3(-3,0,0);
-    radius[1] = 7;
-    center[2] = glm::vec3(5,-10,0);
-    radius[2] = 12;
+    // the transform feedback shader takes the centers and radii of the
+    // first three spheres as uniforms
+    glm::vec3 center[3];
+    float radius[3];
+    for(int j = 0;j<3;++j)
+    {
+        center[j] = glm::vec3(spheres[j]);
+        radius[j] = spheres[j].w;
+    }
 
     // physical parameters
-    float dt = 1.0f/60.0f;
+    int tick_rate = std::max(1, int_option(argc, argv, "--tick-rate", 60));
+    float dt = 1.0f/tick_rate;
     glm::vec3 g(0.0f, -9.81f, 0.0f);
     float bounce = 1.2f; // inelastic: 1.0f, elastic: 2.0f
 
+    // the ticks that are due are run at the start of every frame. a frame
+    // that is more than five ticks late drops the missed time
+    unsigned long long tick_ns = 1000000000ull/tick_rate;
+    unsigned long long next_tick = glwtGetNanoTime();
+
+    // the transform feedback backend writes vbo[current_buffer] and
+    // advances current_buffer every tick
     int current_buffer=0;
     while(userdata.running)
     {   
+        bench.begin_frame();
+
         // get the time in seconds
-        float t = glwtGetNanoTime()*1.e-9f;
+        unsigned long long now = glwtGetNanoTime();
+        float t = now*1.e-9f;
         
         // update events
         glwtEventHandle(0);
 
+        int ticks = 0;
+        for(;next_tick <= now && ticks < 5;next_tick += tick_ns)
+            ++ticks;
+        if(next_tick <= now)
+            next_tick = now + tick_ns;
 
-        // use the transform shader program
-        glUseProgram(transform_shader_program);
+        profiler.push_gpu("simulate");
+        if(compute)
+        {
+            glUseProgram(compute_program.id());
+            
+            // set the uniforms
+            glUniform3fv(compute_g_location, 1, glm::value_ptr(g));
+            glUniform1f(compute_dt_location, dt);
+            glUniform1f(compute_bounce_location, bounce);
+            
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, position_buffer);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, velocity_buffer);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, collider_buffer);
+            if(use_grid)
+            {
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, cell_start_buffer);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, cell_item_buffer);
+            }
+            
+            // spread the groups over y once there are too many for x
+            int groups = (particles+255)/256;
+            int groups_x = std::min(groups, 65535);
+            for(int i = 0;i<ticks;++i)
+            {
+                glUniform1i(compute_seed_location, std::rand());
+                glDispatchCompute(groups_x, (groups+groups_x-1)/groups_x, 1);
+                
+                // the next tick reads what this one wrote
+                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            }
+            
+            // the positions are read as vertex attributes next
+            glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+        }
+        else
+        {
+            // use the transform shader program
+            glUseProgram(transform_shader_program.id());
 
-        // set the uniforms
-        glUniform3fv(center_location, 3, reinterpret_cast<GLfloat*>(center)); 
-        glUniform1fv(radius_location, 3, reinterpret_cast<GLfloat*>(radius));
-        glUniform3fv(g_location, 1, glm::value_ptr(g));
-        glUniform1f(dt_location, dt);
-        glUniform1f(bounce_location, bounce);
-        glUniform1i(seed_location, std::rand());
+            // set the uniforms
+            glUniform3fv(center_location, 3, reinterpret_cast<GLfloat*>(center)); 
+            glUniform1fv(radius_location, 3, reinterpret_cast<GLfloat*>(radius));
+            glUniform3fv(g_location, 1, glm::value_ptr(g));
+            glUniform1f(dt_location, dt);
+            glUniform1f(bounce_location, bounce);
 
-        // bind the current vao
-        glBindVertexArray(vao[(current_buffer+1)%buffercount]);
+            glEnable(GL_RASTERIZER_DISCARD);
+
+            for(int i = 0;i<ticks;++i)
+            {
+                glUniform1i(seed_location, std::rand());
+
+                // bind the vao of the last tick's output
+                glBindVertexArray(vao[(current_buffer+1)%buffercount]);
 
-        // bind transform feedback target
-        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, vbo[current_buffer]);
+                // bind transform feedback target
+                glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, vbo[current_buffer]);
 
-        glEnable(GL_RASTERIZER_DISCARD);
+                // perform transform feedback
+                glBeginTransformFeedback(GL_POINTS);
+                glDrawArrays(GL_POINTS, 0, particles);
+                glEndTransformFeedback();
 
-        // perform transform feedback
-        glBeginTransformFeedback(GL_POINTS);
-        glDrawArrays(GL_POINTS, 0, particles);
-        glEndTransformFeedback();
+                // advance buffer index
+                current_buffer = (current_buffer + 1) % buffercount;
+            }
 
-        glDisable(GL_RASTERIZER_DISCARD);
+            glDisable(GL_RASTERIZER_DISCARD);
+        }
+        profiler.pop();
+
+        // the buffer the last tick wrote
+        int drawn_buffer = (current_buffer + buffercount - 1) % buffercount;
+        
+        profiler.push_gpu("draw");
         
         // clear first
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
         // use the shader program
-        glUseProgram(shader_program);
+        glUseProgram(shader_program.id());
         
         // calculate ViewProjection matrix
         glm::mat4 Projection = glm::perspective(90.0f, 4.0f / 3.0f, 0.1f, 100.f);
@@ -455,28 +724,53 @@ int main()
         View = glm::rotate(View, 30.0f, glm::vec3(1.0f, 0.0f, 0.0f)); 
         View = glm::rotate(View, -22.5f*t, glm::vec3(0.0f, 1.0f, 0.0f)); 
         
+        if(sort_mode != GPUSort::NONE)
+        {
+            profiler.push_gpu("sort");
+            // sort the buffer that is drawn this frame
+            if(compute)
+                sorter.sort(position_buffer, 4, 0, sort_mode, glm::value_ptr(View), sort_lo, sort_hi);
+            else
+                sorter.sort(vbo[drawn_buffer], 6, 0, sort_mode, glm::value_ptr(View), sort_lo, sort_hi);
+            profiler.pop();
+            glUseProgram(shader_program.id());
+        }
+        
         // set the uniform
         glUniformMatrix4fv(View_location, 1, GL_FALSE, glm::value_ptr(View)); 
         glUniformMatrix4fv(Projection_location, 1, GL_FALSE, glm::value_ptr(Projection)); 
         
         // bind the current vao
-        glBindVertexArray(vao[current_buffer]);
+        glBindVertexArray(compute ? compute_vao : vao[drawn_buffer]);
 
         // draw
-        glDrawArrays(GL_POINTS, 0, particles);
+        if(sort_mode != GPUSort::NONE)
+        {
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sorter.indices());
+            glDrawElements(GL_POINTS, particles, GL_UNSIGNED_INT, 0);
+        }
+        else
+        {
+            glDrawArrays(GL_POINTS, 0, particles);
+        }
+        profiler.pop();
        
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
+        // display the sort cost once per second
+        if(sort_mode != GPUSort::NONE && !bench.benchmarking() && glwtGetNanoTime()-last_report > 1000000000ull)
         {
-            userdata.running = false;       
+            std::cout << "sort " << profiler.stats("sort").avg << " ms, frame " << profiler.stats("frame").avg << " ms" << std::endl;
+            last_report = glwtGetNanoTime();
         }
-        
+       
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window); 
-        
-        // advance buffer index
-        current_buffer = (current_buffer + 1) % buffercount;       
     }
     
     // delete the created objects
@@ -484,18 +778,30 @@ int main()
     glDeleteVertexArrays(buffercount, vao);
     glDeleteBuffers(buffercount, vbo);
     
-    glDetachShader(shader_program, vertex_shader);  
-    glDetachShader(shader_program, geometry_shader);    
-    glDetachShader(shader_program, fragment_shader);
-    glDeleteShader(vertex_shader);
-    glDeleteShader(geometry_shader);
-    glDeleteShader(fragment_shader);
-    glDeleteProgram(shader_program);
-
-    glDetachShader(transform_shader_program, transform_vertex_shader);  
-    glDeleteShader(transform_vertex_shader);
-    glDeleteProgram(transform_shader_program);
+    shader_program.destroy();
     
+    if(sort_mode != GPUSort::NONE)
+        sorter.destroy();
+
+    transform_shader_program.destroy();
+    
+    if(compute)
+    {
+        glDeleteVertexArrays(1, &compute_vao);
+        glDeleteBuffers(1, &position_buffer);
+        glDeleteBuffers(1, &velocity_buffer);
+        glDeleteBuffers(1, &collider_buffer);
+        if(use_grid)
+        {
+            glDeleteBuffers(1, &cell_start_buffer);
+            glDeleteBuffers(1, &cell_item_buffer);
+        }
+        compute_program.destroy();
+    }
+    
+    bench.shutdown();
+    profiler.shutdown();
+
     glwtWindowDestroy(window);
     glwtQuit();
     return 0;
@@ -3,10 +3,45 @@
  * This example renders a "voxel landscape/cave" from the view of a
  * moveable camera. Occlusion queries and conditional rendering are used
  * to cull occluded parts of the world and timer queries are used
- * to measure the performance.
+ * to measure the performance (see profiler.hpp).
+ * The chunks are meshed in parallel by a pool of worker threads and
+ * handed to the render thread through a queue, which uploads a few of
+ * them every frame, so the world fills in around the camera while
+ * rendering is already running.
+ * 
+ * The chunk meshes use a packed 4 byte vertex format and can
+ * optionally be built with greedy meshing, which merges coplanar faces
+ * into larger quads.
+ * 
+ * All chunk meshes live in one shared vertex buffer and are drawn from
+ * the same vertex array with a base vertex each.
+ * Starting with --mdi selects a gpu driven backend instead (requires
+ * OpenGL 4.3). A compute shader frustum culls the chunk bounding boxes and writes the
+ * indirect draw commands and the whole world is drawn with a single
+ * glMultiDrawElementsIndirect call.
+ * Once all chunks are meshed the meshes are written to a cache file
+ * (see asset_cache.hpp), later runs upload them straight from the
+ * mapped file instead of meshing the world again.
+ * Instead of occlusion queries the gpu driven backend can cull with
+ * a hierarchical depth buffer (Hi-Z): the depth of the previous frame
+ * is reduced into a mip pyramid of maximum depths and the culling
+ * shader rejects chunks whose bounding boxes, projected with the view
+ * of that frame, are behind it.
+ * With --paging the world is unbounded. The chunks within
+ * --page-radius N chunks (default 4) of the camera are meshed as it
+ * moves, chunks further away are evicted and their slots and buffers
+ * are reused for the next chunks, so memory stays flat. Chunks that
+ * are empty or solid (including their border) are never meshed and
+ * get no gl objects.
  * 
  * move with WASD keys and mouse use Q and E to "roll"
- * toggle occlusion culling with space
+ * toggle occlusion culling with space (not used by --mdi)
+ * toggle Hi-Z occlusion culling with H (only used by --mdi)
+ * toggle greedy meshing with G
+ * 
+ * The frames can be paced for lower mouse-look latency, see
+ * frame_pacing.hpp (--low-latency and friends). The measured latency
+ * is printed once per second.
  * 
  * Autor: Jakob Progsch
  */
@@ -14,6 +49,17 @@
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "asset_cache.hpp"
+#include "shader_program.hpp"
+#include "gl_state.hpp"
+#include "frame_scheduler.hpp"
+#include "frame_pacing.hpp"
+#include "math_util.hpp"
+#include "options.hpp"
+
 //glm is used to create perspective and transform matrices
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -24,6 +70,16 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <tuple>
+#include <functional>
+#include <utility>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <time.h>
 unsigned long long raw_time()
@@ -43,6 +99,8 @@ unsigned long long glwtGetNanoTime()
 struct UserData {
     bool running;
     bool occlusion_cull;
+    bool hiz_cull;
+    bool greedy_meshing;
     struct {
         float up;
         float right;
@@ -52,6 +110,8 @@ struct UserData {
     struct {
         int x, y;
     } mouse;
+    // time of the first mouse motion not yet seen by a frame
+    unsigned long long motion_time;
 };
 
 static void error_callback(const char *msg, void *userdata)
@@ -75,6 +135,12 @@ static void key_callback(GLWTWindow *window, int down, int keysym, int scancode,
     
     if(keysym == GLWT_KEY_SPACE && down)
         userdata->occlusion_cull = !userdata->occlusion_cull;
+    
+    if(keysym == GLWT_KEY_H && down)
+        userdata->hiz_cull = !userdata->hiz_cull;
+    
+    if(keysym == GLWT_KEY_G && down)
+        userdata->greedy_meshing = !userdata->greedy_meshing;
                 
     switch(keysym)
     {
@@ -105,74 +171,664 @@ static void motion_callback(GLWTWindow *window, int x, int y, int buttons, void
     UserData *userdata = (UserData*)void_userdata;
     userdata->mouse.x = x;
     userdata->mouse.y = y;
+    if(userdata->motion_time == 0)
+        userdata->motion_time = glwtGetNanoTime();
 }
 
 // chunk data structure that contains the information required to
 // render and cull the chunks
 struct Chunk {
-    GLuint vbo, ibo, vao;
-    GLuint bounding_vbo, bounding_ibo, bounding_vao;
     GLuint query;
     int quadcount;
+    int first_vertex; // position in the shared vertex buffer
+    int generation;
+    glm::vec3 offset;
     glm::vec3 center;
 };
 
-// predicate to allow sorting chunks by distance from a point
-class DistancePred {
+// compact chunk vertex: corner position relative to the chunk offset
+// and the index of the face normal (see face_directions)
+struct PackedVertex {
+    GLubyte x, y, z;
+    GLubyte normal;
+};
+
+// the six face directions in the order of the normal indices. corners
+// are given relative to the block center in units of half a block and
+// are in the order expected by the shared quad index buffer
+struct FaceDirection {
+    int axis;
+    int corners[4][3];
+};
+
+static const FaceDirection face_directions[6] = {
+    { 0, {{ 1, 1, 1}, { 1,-1, 1}, { 1, 1,-1}, { 1,-1,-1}} }, // +x
+    { 1, {{ 1, 1, 1}, { 1, 1,-1}, {-1, 1, 1}, {-1, 1,-1}} }, // +y
+    { 2, {{ 1, 1, 1}, {-1, 1, 1}, { 1,-1, 1}, {-1,-1, 1}} }, // +z
+    { 0, {{-1, 1, 1}, {-1, 1,-1}, {-1,-1, 1}, {-1,-1,-1}} }, // -x
+    { 1, {{ 1,-1, 1}, {-1,-1, 1}, { 1,-1,-1}, {-1,-1,-1}} }, // -y
+    { 2, {{ 1, 1,-1}, { 1,-1,-1}, {-1, 1,-1}, {-1,-1,-1}} }, // -z
+};
+
+// front to back drawing order of the chunks. this is kept separate
+// from the chunks so sorting only moves the distances and indices around
+struct ChunkOrder {
+    std::vector<float> distance2; // squared distance from the camera
+    std::vector<int> id;          // index into the chunk container
+};
+
+// makes a newly created chunk part of the drawing order
+void add_chunk_order(int id, ChunkOrder &order)
+{
+    order.distance2.push_back(0.0f);
+    order.id.push_back(id);
+}
+
+// removes evicted chunks from the drawing order in one pass, evicted
+// is indexed by chunk id
+void remove_chunk_order(const std::vector<char> &evicted, ChunkOrder &order)
+{
+    size_t n = 0;
+    for(size_t i = 0;i<order.id.size();++i)
+    {
+        if(evicted[order.id[i]])
+            continue;
+        order.distance2[n] = order.distance2[i];
+        order.id[n] = order.id[i];
+        ++n;
+    }
+    order.distance2.resize(n);
+    order.id.resize(n);
+}
+
+// updates the distances to the camera position and restores the front
+// to back order. insertion sort is linear when the order only changed
+// a little since the last frame, which is the case for a moving camera
+void update_chunk_order(const std::vector<Chunk> &chunks, glm::vec3 position, ChunkOrder &order)
+{
+    size_t n = order.id.size();
+    for(size_t i = 0;i<n;++i)
+    {
+        glm::vec3 diff = chunks[order.id[i]].center - position;
+        order.distance2[i] = glm::dot(diff, diff);
+    }
+    
+    for(size_t i = 1;i<n;++i)
+    {
+        float d = order.distance2[i];
+        int id = order.id[i];
+        size_t j = i;
+        for(;j>0 && order.distance2[j-1]>d;--j)
+        {
+            order.distance2[j] = order.distance2[j-1];
+            order.id[j] = order.id[j-1];
+        }
+        order.distance2[j] = d;
+        order.id[j] = id;
+    }
+}
+
+// predicate to allow sorting chunk offsets by the distance of the
+// chunk centers from a point
+class OffsetDistancePred {
 public:
-    DistancePred(glm::vec3 p) : pos(p) { }
-    bool operator()(const Chunk &a, const Chunk &b)
+    OffsetDistancePred(glm::vec3 p, int chunksize) : pos(p-0.5f*chunksize) { }
+    bool operator()(const glm::vec3 &a, const glm::vec3 &b)
     {
-        return glm::distance(pos, a.center) < glm::distance(pos, b.center);
+        return glm::distance(pos, a) < glm::distance(pos, b);
     }
 private:
     const glm::vec3 pos;
 };
 
+// integer coordinates of a chunk in units of chunks, identifies the
+// chunks of a paged world
+typedef std::tuple<int, int, int> ChunkKey;
+
+// key of the chunk containing the point p
+ChunkKey chunk_key(glm::vec3 p, int chunksize)
+{
+    // chunks span from offset-0.5 to offset+chunksize-0.5
+    glm::vec3 c = (p + 0.5f)/float(chunksize);
+    return ChunkKey(int(std::floor(c.x)), int(std::floor(c.y)), int(std::floor(c.z)));
+}
+
+// squared distance between two chunks in units of chunks
+int chunk_distance2(const ChunkKey &a, const ChunkKey &b)
+{
+    int x = std::get<0>(a)-std::get<0>(b);
+    int y = std::get<1>(a)-std::get<1>(b);
+    int z = std::get<2>(a)-std::get<2>(b);
+    return x*x + y*y + z*z;
+}
+
+// offsets of the chunks within radius chunks of the chunk center
+std::vector<glm::vec3> page_offsets(const ChunkKey &center, int radius, int chunksize)
+{
+    std::vector<glm::vec3> offsets;
+    for(int i = -radius;i<=radius;++i)
+        for(int j = -radius;j<=radius;++j)
+            for(int k = -radius;k<=radius;++k)
+                if(i*i + j*j + k*k <= radius*radius)
+                    offsets.push_back(float(chunksize)*glm::vec3(std::get<0>(center)+i, std::get<1>(center)+j, std::get<2>(center)+k));
+    return offsets;
+}
+
 // world function that defines the voxel data
 float world_function(glm::vec3 pos)
 {
     return glm::perlin(0.1f*(pos+glm::vec3(100,100,100)));
 }
 
-// helper to check and display for shader compiler errors
-bool check_shader_compile_status(GLuint obj)
+// evaluates the world function for count blocks starting at start
+// and advancing along z. all density sampling goes through here so the
+// samples of a whole row are produced in one batch
+void world_function_row(glm::vec3 start, int count, float *out)
+{
+    for(int z = 0;z<count;++z)
+        out[z] = world_function(start + glm::vec3(0, 0, z));
+}
+
+// samples the world function for the blocks of a chunk plus a one block
+// border shared with the neighboring chunks. density is indexed as
+// [(x*(chunksize+2) + y)*(chunksize+2) + z] with x,y,z in [-1,chunksize]
+// shifted by one
+void sample_chunk(glm::vec3 offset, int chunksize, std::vector<float> &density)
+{
+    int padded = chunksize+2;
+    density.resize(padded*padded*padded);
+    for(int x = 0;x<padded;++x)
+        for(int y = 0;y<padded;++y)
+            world_function_row(offset + glm::vec3(x-1, y-1, -1), padded, &density[(x*padded + y)*padded]);
+}
+
+// appends a quad facing in direction face that covers the blocks from
+// lo to hi (inclusive, chunk local)
+void emit_quad(int face, const int lo[3], const int hi[3], std::vector<PackedVertex> &vertexData)
+{
+    const FaceDirection &dir = face_directions[face];
+    for(int c = 0;c<4;++c)
+    {
+        // the corner of a block at half-offset -1 is its own coordinate,
+        // at +1 it is the coordinate of the next block
+        int corner[3];
+        for(int a = 0;a<3;++a)
+            corner[a] = dir.corners[c][a]<0 ? lo[a] : hi[a]+1;
+        PackedVertex v = { GLubyte(corner[0]), GLubyte(corner[1]), GLubyte(corner[2]), GLubyte(face) };
+        vertexData.push_back(v);
+    }
+}
+
+// extracts the faces of the chunk at offset that separate solid from
+// empty blocks. if greedy is set coplanar neighboring faces are merged
+// into larger quads. vertexData is cleared first, and density and mask
+// are used as scratch space, so callers can reuse their allocations
+// from chunk to chunk
+void extract_chunk(glm::vec3 offset, int chunksize, bool greedy,
+                   std::vector<float> &density, std::vector<char> &mask,
+                   std::vector<PackedVertex> &vertexData)
+{
+    sample_chunk(offset, chunksize, density);
+    
+    // strides of the padded density grid
+    const int stride[3] = { (chunksize+2)*(chunksize+2), chunksize+2, 1 };
+    
+    vertexData.clear();
+    float threshold = 0.0f;
+    
+    // chunks that are empty or solid including the border have no faces,
+    // most of a world is either so skip the sweeps for them
+    size_t solid = 0;
+    for(size_t i = 0;i<density.size();++i)
+        solid += density[i]<threshold;
+    if(solid == 0 || solid == density.size())
+        return;
+    
+    // a face is visible if the block is solid and its neighbor isn't
+    mask.resize(chunksize*chunksize);
+    for(int face = 0;face<6;++face)
+    {
+        int d = face_directions[face].axis;
+        int u = (d+1)%3, v = (d+2)%3;
+        int step = face<3 ? stride[d] : -stride[d];
+        
+        // sweep slices perpendicular to the face normal
+        int p[3];
+        for(p[d] = 0;p[d]<chunksize;++p[d])
+        {
+            for(p[v] = 0;p[v]<chunksize;++p[v])
+                for(p[u] = 0;p[u]<chunksize;++p[u])
+                {
+                    const float *b = &density[(p[0]+1)*stride[0] + (p[1]+1)*stride[1] + (p[2]+1)*stride[2]];
+                    mask[p[v]*chunksize + p[u]] = b[0]<threshold && b[step]>=threshold;
+                }
+            
+            for(int iv = 0;iv<chunksize;++iv)
+                for(int iu = 0;iu<chunksize;)
+                {
+                    if(!mask[iv*chunksize + iu])
+                    {
+                        ++iu;
+                        continue;
+                    }
+                    
+                    // grow the quad along u and then along v as long as
+                    // all covered faces are visible
+                    int w = 1, h = 1;
+                    if(greedy)
+                    {
+                        while(iu+w<chunksize && mask[iv*chunksize + iu+w])
+                            ++w;
+                        for(;iv+h<chunksize;++h)
+                        {
+                            int k = 0;
+                            while(k<w && mask[(iv+h)*chunksize + iu+k])
+                                ++k;
+                            if(k<w)
+                                break;
+                        }
+                    }
+                    
+                    // consume the covered faces
+                    for(int j = 0;j<h;++j)
+                        for(int k = 0;k<w;++k)
+                            mask[(iv+j)*chunksize + iu+k] = 0;
+                    
+                    int lo[3], hi[3];
+                    lo[d] = hi[d] = p[d];
+                    lo[u] = iu; hi[u] = iu+w-1;
+                    lo[v] = iv; hi[v] = iv+h-1;
+                    emit_quad(face, lo, hi, vertexData);
+                    iu += w;
+                }
+        }
+    }
+}
+
+// mesh of a chunk as produced by the meshing threads
+struct ChunkMesh {
+    glm::vec3 offset;
+    int generation;
+    std::vector<PackedVertex> vertexData;
+};
+
+// a chunk waiting to be meshed
+struct ChunkJob {
+    glm::vec3 offset;
+    int generation;
+    bool greedy;
+};
+
+// queue that hands chunk offsets to the meshing threads and the finished
+// meshes back to the render thread
+class MeshQueue {
+public:
+    MeshQueue() : stopped(false) { }
+
+    // add a chunk to be meshed
+    void push_job(const ChunkJob &job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(job);
+        job_available.notify_one();
+    }
+
+    // drop all jobs that aren't being worked on yet
+    void clear_jobs()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.clear();
+    }
+
+    // drop the jobs not worked on yet for which outdated returns true
+    void drop_jobs(const std::function<bool(const ChunkJob&)> &outdated)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.erase(std::remove_if(jobs.begin(), jobs.end(), outdated), jobs.end());
+    }
+
+    // blocks until a job is available, returns false once stopped
+    bool pop_job(ChunkJob &job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(!stopped && jobs.empty())
+            job_available.wait(lock);
+        if(stopped)
+            return false;
+        job = jobs.front();
+        jobs.pop_front();
+        return true;
+    }
+
+    // hand a finished mesh to the render thread, the mesh is moved into
+    // the queue so its vertex data isn't copied again
+    void push_result(ChunkMesh &&mesh)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        results.push_back(std::move(mesh));
+    }
+
+    // returns false if there is no finished mesh, never blocks on the workers
+    bool pop_result(ChunkMesh &mesh)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(results.empty())
+            return false;
+        mesh = std::move(results.front());
+        results.pop_front();
+        return true;
+    }
+
+    // wake up all waiting workers and make them exit
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        job_available.notify_all();
+    }
+private:
+    std::mutex mutex;
+    std::condition_variable job_available;
+    std::deque<ChunkJob> jobs;
+    std::deque<ChunkMesh> results;
+    bool stopped;
+};
+
+// main loop of the meshing threads
+void mesh_worker(MeshQueue *queue, int chunksize)
+{
+    // scratch buffers that keep their capacity between chunks so they
+    // don't have to grow from zero every time
+    std::vector<float> density;
+    std::vector<char> mask;
+    std::vector<PackedVertex> scratch;
+    ChunkJob job;
+    while(queue->pop_job(job))
+    {
+        extract_chunk(job.offset, chunksize, job.greedy, density, mask, scratch);
+        // the result gets a single allocation of its exact size, it is
+        // moved from here on
+        ChunkMesh mesh;
+        mesh.offset = job.offset;
+        mesh.generation = job.generation;
+        mesh.vertexData.assign(scratch.begin(), scratch.end());
+        queue->push_result(std::move(mesh));
+    }
+}
+
+// the world cache file starts with the number of chunks followed by a
+// record per chunk and then the vertices of all chunks
+struct CachedChunk {
+    GLfloat offset[3];
+    GLuint first_vertex;
+    GLuint vertexcount;
+};
+
+// key of the cached meshes, everything that changes the meshes has to
+// go in here
+AssetKey world_cache_key(int chunkrange, int chunksize, bool greedy)
+{
+    AssetKey key("10world");
+    key.add(chunkrange).add(chunksize).add(greedy).add(sizeof(PackedVertex));
+    key.add(1); // bump when changing world_function or extract_chunk
+    return key;
+}
+
+// writes the meshes of a whole world to the cache
+void write_world_cache(const AssetKey &key, const std::vector<ChunkMesh> &meshes)
 {
-    GLint status;
-    glGetShaderiv(obj, GL_COMPILE_STATUS, &status);
-    if(status == GL_FALSE)
+    size_t vertexcount = 0;
+    for(size_t i = 0;i<meshes.size();++i)
+        vertexcount += meshes[i].vertexData.size();
+    
+    CachedAsset cache;
+    size_t header = sizeof(GLuint) + sizeof(CachedChunk)*meshes.size();
+    char *data = (char*)cache.create(key, header + sizeof(PackedVertex)*vertexcount);
+    *(GLuint*)data = meshes.size();
+    CachedChunk *records = (CachedChunk*)(data + sizeof(GLuint));
+    PackedVertex *vertices = (PackedVertex*)(data + header);
+    
+    GLuint first = 0;
+    for(size_t i = 0;i<meshes.size();++i)
     {
-        GLint length;
-        glGetShaderiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetShaderInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;
-    }
-    return true;
+        const ChunkMesh &mesh = meshes[i];
+        CachedChunk record = {
+            { mesh.offset.x, mesh.offset.y, mesh.offset.z },
+            first, GLuint(mesh.vertexData.size())
+        };
+        records[i] = record;
+        std::copy(mesh.vertexData.begin(), mesh.vertexData.end(), vertices + first);
+        first += mesh.vertexData.size();
+    }
+    cache.commit();
+}
+
+// creates the gl objects of a chunk. they are placed in the world by
+// place_chunk and the vertex data is uploaded by update_chunk. this
+// has to happen on the thread that owns the context
+void create_chunk(Chunk &chunk)
+{
+    chunk.quadcount = 0;
+    chunk.first_vertex = 0;
+    chunk.generation = -1;
+    
+    // generate the query object for the occlusion query
+    glGenQueries(1, &chunk.query);
 }
 
-// helper to check and display for shader linker error
-bool check_program_link_status(GLuint obj)
+// moves a new or recycled chunk to offset, its old mesh is dropped
+void place_chunk(glm::vec3 offset, int chunksize, Chunk &chunk)
 {
-    GLint status;
-    glGetProgramiv(obj, GL_LINK_STATUS, &status);
-    if(status == GL_FALSE)
+    chunk.quadcount = 0;
+    chunk.generation = -1;
+    
+    // set the center location of the chunk
+    chunk.offset = offset;
+    chunk.center = offset + 0.5f*chunksize;
+}
+
+// per chunk data of the gpu driven backend, laid out to match the
+// std430 ChunkInfo struct of the culling shader
+struct GPUChunk {
+    GLfloat offset[4];
+    GLuint quadcount;
+    GLuint first_vertex;
+    GLuint padding[2];
+};
+
+// layout of the commands read by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// first fit allocator for ranges of the vertex buffer shared by all
+// chunks. the buffer doubles in size when it
+// runs out of space, which replaces the buffer object
+class VertexArena {
+public:
+    void init(int initial_capacity)
+    {
+        capacity = initial_capacity;
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(PackedVertex)*capacity, 0, GL_STATIC_DRAW);
+        Range all = { 0, capacity };
+        free_ranges.push_back(all);
+    }
+    
+    void destroy()
+    {
+        glDeleteBuffers(1, &vbo);
+    }
+    
+    GLuint buffer() const
     {
-        GLint length;
-        glGetProgramiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetProgramInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;   
-    }
-    return true;
+        return vbo;
+    }
+    
+    // returns the first vertex of a range of count vertices
+    int allocate(int count)
+    {
+        if(count == 0)
+            return 0;
+        for(;;)
+        {
+            for(size_t i = 0;i<free_ranges.size();++i)
+            {
+                if(free_ranges[i].count >= count)
+                {
+                    int first = free_ranges[i].first;
+                    free_ranges[i].first += count;
+                    free_ranges[i].count -= count;
+                    if(free_ranges[i].count == 0)
+                        free_ranges.erase(free_ranges.begin()+i);
+                    return first;
+                }
+            }
+            grow();
+        }
+    }
+    
+    // returns a range to the free list, merging it with its neighbors
+    void release(int first, int count)
+    {
+        if(count == 0)
+            return;
+        size_t i = 0;
+        while(i<free_ranges.size() && free_ranges[i].first < first)
+            ++i;
+        Range range = { first, count };
+        free_ranges.insert(free_ranges.begin()+i, range);
+        if(i+1<free_ranges.size() && free_ranges[i].first+free_ranges[i].count == free_ranges[i+1].first)
+        {
+            free_ranges[i].count += free_ranges[i+1].count;
+            free_ranges.erase(free_ranges.begin()+i+1);
+        }
+        if(i>0 && free_ranges[i-1].first+free_ranges[i-1].count == free_ranges[i].first)
+        {
+            free_ranges[i-1].count += free_ranges[i].count;
+            free_ranges.erase(free_ranges.begin()+i);
+        }
+    }
+private:
+    struct Range {
+        int first, count;
+    };
+    
+    // double the capacity, the contents are copied on the gpu
+    void grow()
+    {
+        GLuint new_vbo;
+        glGenBuffers(1, &new_vbo);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, new_vbo);
+        glBufferData(GL_COPY_WRITE_BUFFER, sizeof(PackedVertex)*2*capacity, 0, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_READ_BUFFER, vbo);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(PackedVertex)*capacity);
+        glDeleteBuffers(1, &vbo);
+        vbo = new_vbo;
+        
+        release(capacity, capacity);
+        capacity *= 2;
+    }
+    
+    GLuint vbo;
+    int capacity;
+    std::vector<Range> free_ranges; // sorted by first
+};
+
+// replaces the vertex data of a chunk with a finished mesh of count
+// vertices, either from the meshing threads or from the cache. the
+// vertex data goes into the shared vertex buffer, with the gpu driven
+// backend the chunk info used for culling is updated as well
+void update_chunk(const PackedVertex *vertexData, size_t count, int generation, int id, Chunk &chunk,
+                  VertexArena &arena, GLuint chunk_info_buffer)
+{
+    arena.release(chunk.first_vertex, 4*chunk.quadcount);
+    chunk.quadcount = count/4;
+    chunk.first_vertex = arena.allocate(4*chunk.quadcount);
+    chunk.generation = generation;
+    
+    if(chunk.quadcount > 0)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, arena.buffer());
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(PackedVertex)*chunk.first_vertex, sizeof(PackedVertex)*count, vertexData);
+    }
+    
+    if(chunk_info_buffer == 0)
+        return;
+    GPUChunk info = {
+        { chunk.offset.x, chunk.offset.y, chunk.offset.z, 1.0f },
+        GLuint(chunk.quadcount), GLuint(chunk.first_vertex), { 0, 0 }
+    };
+    glBindBuffer(GL_ARRAY_BUFFER, chunk_info_buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(GPUChunk)*id, sizeof(GPUChunk), &info);
 }
 
-int main()
+// camera state advanced by the simulation thread. only the movement
+// ticks, the rotation follows the mouse on the render thread so looking
+// around isn't held back by a tick
+struct Camera {
+    glm::vec3 position;
+};
+
+// the part of UserData the simulation reads, with the rotation of the
+// frame that handed it over to move along
+struct CameraInput {
+    float up, right, forward;
+    glm::mat4 rotation;
+};
+
+// turns the camera by a mouse movement and the roll keys, called by the
+// render thread right after the events were handled
+void rotate_camera(glm::mat4 &rotation, glm::vec2 mousediff, float roll, float dt)
+{
+    // find up, forward and right vector
+    glm::mat3 rotation3(rotation);
+    glm::vec3 up = glm::transpose(rotation3)*glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 right = glm::transpose(rotation3)*glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 forward = glm::transpose(rotation3)*glm::vec3(0.0f, 0.0f,-1.0f);
+    
+    // apply mouse rotation
+    rotation = glm::rotate(rotation,  0.2f*mousediff.x, up);
+    rotation = glm::rotate(rotation,  0.2f*mousediff.y, right);
+    
+    // roll
+    rotation = glm::rotate(rotation, 180.0f*dt*roll, forward); 
+}
+
+// advances the camera by one tick
+void step_camera(Camera &camera, const CameraInput &input, float dt)
+{
+    // find up, forward and right vector
+    glm::mat3 rotation3(input.rotation);
+    glm::vec3 up = glm::transpose(rotation3)*glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 right = glm::transpose(rotation3)*glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 forward = glm::transpose(rotation3)*glm::vec3(0.0f, 0.0f,-1.0f);
+    
+    // movement
+    camera.position += 10.0f*dt*forward*input.forward;
+    camera.position += 10.0f*dt*right*input.right;
+    camera.position += 10.0f*dt*up*input.up;
+}
+
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+    
+    // the gpu driven backend needs compute shaders and multi draw indirect
+    bool gpu_driven = has_flag(argc, argv, "--mdi");
+
+    // the profiler keeps its timer queries in flight for a few frames
+    // to avoid stalling on getting the results
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
+    FramePacer pacer(argc, argv);
    
     UserData userdata;
     userdata.running = true;
@@ -186,8 +842,8 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
-    glwt_config.api_version_major = 3;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
+    glwt_config.api_version_major = gpu_driven ? 4 : 3;
     glwt_config.api_version_minor = 3;
     
     GLWTAppCallbacks app_callbacks;
@@ -229,22 +885,35 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    pacer.init(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
 
-    // draw shader
+    // draw shader, the gpu driven backend reads the chunk offset from
+    // an instanced attribute selected by the base instance of each draw
+    std::string chunk_offset_source = gpu_driven ?
+        "layout(location = 1) in vec3 ChunkOffset;\n" :
+        "uniform vec3 ChunkOffset;\n";
+    
     std::string vertex_source =
         "#version 330\n"
         "uniform mat4 ViewProjection;\n"
-        "layout(location = 0) in vec4 vposition;\n"
-        "layout(location = 1) in vec3 normal;\n"
+        + chunk_offset_source +
+        "layout(location = 0) in uvec4 vdata;\n"
         "out vec4 fcolor;\n"
+        "const vec3 normals[6] = vec3[](\n"
+        "   vec3( 1, 0, 0),vec3( 0, 1, 0),vec3( 0, 0, 1),\n"
+        "   vec3(-1, 0, 0),vec3( 0,-1, 0),vec3( 0, 0,-1)\n"
+        ");\n"
         "void main() {\n"
+        "   vec3 normal = normals[vdata.w];\n"
         "   float brightness = dot(normal,normalize(vec3(1,2,3)));\n"
         "   brightness = 0.3+((brightness>0)?0.7*brightness:0.3*brightness);\n"
         "   fcolor = vec4(brightness,brightness,brightness,1);\n"
-        "   gl_Position = ViewProjection*vposition;\n"
+        "   vec3 vposition = ChunkOffset + vec3(vdata.xyz) - 0.5;\n"
+        "   gl_Position = ViewProjection*vec4(vposition, 1);\n"
         "}\n";
         
     std::string fragment_source =
@@ -255,57 +924,21 @@ int main()
         "   FragColor = abs(fcolor);\n"
         "}\n";
     
-    // program and shader handles
-    GLuint shader_program, vertex_shader, fragment_shader;
-    
-    // we need these to properly pass the strings
-    const char *source;
-    int length;
-
-    // create and compiler vertex shader
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = vertex_source.c_str();
-    length = vertex_source.size();
-    glShaderSource(vertex_shader, 1, &source, &length); 
-    glCompileShader(vertex_shader);
-    if(!check_shader_compile_status(vertex_shader))
-    {
-        return 1;
-    }
- 
-    // create and compiler fragment shader
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = fragment_source.c_str();
-    length = fragment_source.size();
-    glShaderSource(fragment_shader, 1, &source, &length);   
-    glCompileShader(fragment_shader);
-    if(!check_shader_compile_status(fragment_shader))
-    {
-        return 1;
-    }
-    
-    // create program
-    shader_program = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, fragment_shader);
-    
-    // link the program and check for errors
-    glLinkProgram(shader_program);
-    check_program_link_status(shader_program);
-    
-    // obtain location of projection uniform
-    GLint DrawViewProjection_location = glGetUniformLocation(shader_program, "ViewProjection");
+    // all programs are linked together once the gpu driven ones are
+    // set up below
+    ShaderProgram shader_program;
+    shader_program.add(GL_VERTEX_SHADER, vertex_source).add(GL_FRAGMENT_SHADER, fragment_source);
  
 
-    // trivial shader for occlusion queries
+    // trivial shader for occlusion queries, it draws the bounding box
+    // of the chunk at ChunkOffset
     std::string query_vertex_source =
         "#version 330\n"
         "uniform mat4 ViewProjection;\n"
-        "layout(location = 0) in vec4 vposition;\n"
+        "uniform vec3 ChunkOffset;\n"
+        "layout(location = 0) in vec3 vposition;\n"
         "void main() {\n"
-        "   gl_Position = ViewProjection*vposition;\n"
+        "   gl_Position = ViewProjection*vec4(ChunkOffset + vposition, 1);\n"
         "}\n";
         
     std::string query_fragment_source =
@@ -313,341 +946,649 @@ int main()
         "void main() {\n"
         "}\n";
     
-    // program and shader handles
-    GLuint query_shader_program, query_vertex_shader, query_fragment_shader;
+    ShaderProgram query_shader_program;
+    query_shader_program.add(GL_VERTEX_SHADER, query_vertex_source).add(GL_FRAGMENT_SHADER, query_fragment_source);
 
-    // create and compiler vertex shader
-    query_vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = query_vertex_source.c_str();
-    length = query_vertex_source.size();
-    glShaderSource(query_vertex_shader, 1, &source, &length); 
-    glCompileShader(query_vertex_shader);
-    if(!check_shader_compile_status(query_vertex_shader))
-    {
-        return 1;
-    }
- 
-    // create and compiler fragment shader
-    query_fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = query_fragment_source.c_str();
-    length = query_fragment_source.size();
-    glShaderSource(query_fragment_shader, 1, &source, &length);   
-    glCompileShader(query_fragment_shader);
-    if(!check_shader_compile_status(query_fragment_shader))
+
+    // chunk container and chunk parameters
+    std::vector<Chunk> chunks;
+    ChunkOrder order;
+    int chunkrange = 4;
+    int chunksize = 32;
+    
+    // with --paging the world is unbounded: the chunks within
+    // --page-radius chunks of the camera are meshed as it moves and the
+    // ones further away are evicted. chunks are only evicted one chunk
+    // beyond the radius so moving back and forth over a chunk border
+    // doesn't remesh anything
+    bool paging = has_flag(argc, argv, "--paging");
+    int page_radius = std::max(1, int_option(argc, argv, "--page-radius", 4));
+    int keep_radius = page_radius+1;
+    
+    // larger radii would be cut off by the default far plane
+    float view_distance = std::max(200.0f, float(page_radius*chunksize));
+    
+    // the slots of evicted chunks keep their gl objects and are reused
+    // for the next chunks, so paging doesn't create or delete any
+    std::vector<int> free_slots;
+    std::map<ChunkKey, int> chunk_ids;
+    
+    // chunks known to be empty or solid, they get no slot at all
+    std::set<ChunkKey> empty_chunks;
+    
+    // chunks are uploaded incrementally, at most this many per frame
+    const int uploads_per_frame = 4;
+    
+    // index buffer shared by all chunks. a chunk has at most 3 faces
+    // per block (checkerboard pattern)
+    GLuint quad_ibo;
+    glGenBuffers(1, &quad_ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad_ibo);
+    
+    int maxquads = 3*chunksize*chunksize*chunksize;
+    std::vector<GLuint> indexData(6*maxquads);
+    for(int i = 0;i<maxquads;++i)
     {
-        return 1;
+        indexData[6*i + 0] = 4*i + 0;
+        indexData[6*i + 1] = 4*i + 1;
+        indexData[6*i + 2] = 4*i + 2;
+        indexData[6*i + 3] = 4*i + 2;
+        indexData[6*i + 4] = 4*i + 1;
+        indexData[6*i + 5] = 4*i + 3;
     }
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*indexData.size(), &indexData[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     
-    // create program
-    query_shader_program = glCreateProgram();
+    // upper bound of the chunks resident at once
+    int keep_diameter = 2*keep_radius+1;
+    int chunkcount = paging ? keep_diameter*keep_diameter*keep_diameter : 8*chunkrange*chunkrange*chunkrange;
     
-    // attach shaders
-    glAttachShader(query_shader_program, query_vertex_shader);
-    glAttachShader(query_shader_program, query_fragment_shader);
+    // objects of the gpu driven backend
+    ShaderProgram cull_program, hiz_program;
+    GLuint scene_fbo = 0, scene_color = 0, scene_depth = 0;
+    GLuint hiz_texture = 0;
+    int hiz_levels = 0;
     
-    // link the program and check for errors
-    glLinkProgram(query_shader_program);
-    check_program_link_status(query_shader_program);
+    // the pyramid is only valid if it was built in the previous frame
+    // and is tested with the view projection it was rendered with
+    bool hiz_valid = false;
+    glm::mat4 hiz_view_projection(1.0f);
+    GLuint chunk_info_buffer = 0, draw_order_buffer = 0, command_buffer = 0;
     
-    // obtain location of projection uniform
-    GLint QueryViewProjection_location = glGetUniformLocation(query_shader_program, "ViewProjection");
-
-
-    // chunk container and chunk parameters
-    std::vector<Chunk> chunks;
-    int chunkrange = 4;
-    int chunksize = 32;
+    // all chunk meshes live in one shared vertex buffer and are drawn
+    // from the same vertex array with a base vertex each, so the draws
+    // don't rebind anything. it starts with room for a few average chunks
+    GLuint scene_vao = 0, scene_vao_vbo = 0;
+    VertexArena arena;
+    arena.init(64*chunksize*chunksize*4);
+    glGenVertexArrays(1, &scene_vao);
+    glBindVertexArray(scene_vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad_ibo);
+    glBindVertexArray(0);
     
-    // chunk extraction
-    std::cout << "generating chunks, this may take a while." << std::endl;
+    // the bounding box of a chunk at the origin, the query shader moves
+    // it to the chunk offset
+    GLfloat lo = -0.5f, hi = chunksize-0.5f;
+    GLfloat boxVertexData[8*3];
+    for(int i = 0;i<8;++i)
+    {
+        boxVertexData[3*i+0] = (i&1) ? hi : lo;
+        boxVertexData[3*i+1] = (i&2) ? hi : lo;
+        boxVertexData[3*i+2] = (i&4) ? hi : lo;
+    }
+    GLuint boxIndexData[] = {
+        0, 2, 4, 4, 2, 6,  1, 3, 5, 5, 3, 7,
+        0, 1, 4, 4, 1, 5,  2, 3, 6, 6, 3, 7,
+        0, 1, 2, 2, 1, 3,  4, 5, 6, 6, 5, 7,
+    };
+    GLuint box_vao, box_vbo, box_ibo;
+    glGenVertexArrays(1, &box_vao);
+    glBindVertexArray(box_vao);
+    glGenBuffers(1, &box_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, box_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(boxVertexData), boxVertexData, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), (char*)0);
+    glGenBuffers(1, &box_ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, box_ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(boxIndexData), boxIndexData, GL_STATIC_DRAW);
+    glBindVertexArray(0);
     
-    // iterate over all chunks we want to extract        
-    for(int i = -chunkrange;i<chunkrange;++i)
-        for(int j = -chunkrange;j<chunkrange;++j)
-            for(int k = -chunkrange;k<chunkrange;++k)
+    if(gpu_driven)
     {
+        // the culling shader tests the chunk bounding boxes against the
+        // frustum planes and writes one draw command per chunk in front
+        // to back order. culled chunks get an instance count of zero.
+        // the pyramid holds the depth of the previous frame, so the boxes
+        // are projected with the view projection of that frame
+        std::string cull_source =
+            "#version 430\n"
+            "layout(local_size_x = 64) in;\n"
+            "uniform uint ChunkCount;\n"
+            "uniform float ChunkSize;\n"
+            "uniform vec4 FrustumPlanes[6];\n"
+            "uniform mat4 HiZViewProjection;\n"
+            "uniform bool UseHiZ;\n"
+            "uniform sampler2D HiZ;\n"
+            "struct ChunkInfo {\n"
+            "   vec4 offset;\n"
+            "   uint quadcount;\n"
+            "   uint first_vertex;\n"
+            "   uint padding0, padding1;\n"
+            "};\n"
+            "struct DrawCommand {\n"
+            "   uint count;\n"
+            "   uint instanceCount;\n"
+            "   uint firstIndex;\n"
+            "   uint baseVertex;\n"
+            "   uint baseInstance;\n"
+            "};\n"
+            "layout(std430, binding = 0) readonly buffer ChunkInfos { ChunkInfo chunks[]; };\n"
+            "layout(std430, binding = 1) readonly buffer DrawOrder { uint draw_order[]; };\n"
+            "layout(std430, binding = 2) writeonly buffer DrawCommands { DrawCommand commands[]; };\n"
+            "bool occluded(vec3 lo, vec3 hi) {\n"
+            "   vec3 wmin = vec3(1), wmax = vec3(0);\n"
+            "   for(int c = 0;c<8;++c) {\n"
+            "       vec3 corner = mix(lo, hi, vec3(c&1, (c>>1)&1, (c>>2)&1));\n"
+            "       vec4 clip = HiZViewProjection*vec4(corner, 1);\n"
+            "       if(clip.w <= 0) return false;\n" // box reaches behind the camera
+            "       vec3 window = 0.5*clip.xyz/clip.w + 0.5;\n"
+            "       wmin = min(wmin, window);\n"
+            "       wmax = max(wmax, window);\n"
+            "   }\n"
+            "   wmin.xy = clamp(wmin.xy, 0, 1);\n"
+            "   wmax.xy = clamp(wmax.xy, 0, 1);\n"
+            // pick the level at which the box covers at most 2x2 texels
+            "   vec2 extent = (wmax.xy-wmin.xy)*textureSize(HiZ, 0);\n"
+            "   int levels = textureQueryLevels(HiZ);\n"
+            "   int level = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1)))), 0, levels-1);\n"
+            "   ivec2 size = textureSize(HiZ, level);\n"
+            "   ivec2 a = clamp(ivec2(wmin.xy*size), ivec2(0), size-1);\n"
+            "   ivec2 b = clamp(ivec2(wmax.xy*size), ivec2(0), size-1);\n"
+            "   float depth = 0;\n"
+            "   for(int y = a.y;y<=b.y;++y)\n"
+            "       for(int x = a.x;x<=b.x;++x)\n"
+            "           depth = max(depth, texelFetch(HiZ, ivec2(x,y), level).r);\n"
+            "   return wmin.z > depth;\n"
+            "}\n"
+            "void main() {\n"
+            "   uint i = gl_GlobalInvocationID.x;\n"
+            "   if(i >= ChunkCount) return;\n"
+            "   uint id = draw_order[i];\n"
+            "   ChunkInfo chunk = chunks[id];\n"
+            "   vec3 lo = chunk.offset.xyz - 0.5;\n"
+            "   vec3 hi = lo + ChunkSize;\n"
+            "   bool visible = chunk.quadcount > 0;\n"
+            "   for(int p = 0;p<6 && visible;++p) {\n"
+            "       vec4 plane = FrustumPlanes[p];\n"
+            "       vec3 corner = mix(lo, hi, greaterThan(plane.xyz, vec3(0)));\n"
+            "       visible = dot(plane.xyz, corner) + plane.w >= 0;\n"
+            "   }\n"
+            "   if(visible && UseHiZ)\n"
+            "       visible = !occluded(lo, hi);\n"
+            "   commands[i].count = 6*chunk.quadcount;\n"
+            "   commands[i].instanceCount = visible ? 1 : 0;\n"
+            "   commands[i].firstIndex = 0;\n"
+            "   commands[i].baseVertex = chunk.first_vertex;\n"
+            "   commands[i].baseInstance = id;\n"
+            "}\n";
         
-        Chunk chunk;
+        cull_program.add(GL_COMPUTE_SHADER, cull_source);
         
-        // chunk data
+        // the Hi-Z reduction shader writes one level of the pyramid. each
+        // destination texel takes the maximum of the source texels it
+        // covers, which includes an extra row or column for odd sizes
+        std::string hiz_source =
+            "#version 430\n"
+            "layout(local_size_x = 8, local_size_y = 8) in;\n"
+            "uniform sampler2D Source;\n"
+            "uniform int SourceLevel;\n"
+            "layout(r32f, binding = 0) writeonly uniform image2D Destination;\n"
+            "void main() {\n"
+            "   ivec2 p = ivec2(gl_GlobalInvocationID.xy);\n"
+            "   ivec2 size = imageSize(Destination);\n"
+            "   if(any(greaterThanEqual(p, size))) return;\n"
+            "   ivec2 source_size = textureSize(Source, SourceLevel);\n"
+            "   ivec2 lo = (p*source_size)/size;\n"
+            "   ivec2 hi = ((p+1)*source_size + size - 1)/size;\n"
+            "   float depth = 0;\n"
+            "   for(int y = lo.y;y<hi.y;++y)\n"
+            "       for(int x = lo.x;x<hi.x;++x)\n"
+            "           depth = max(depth, texelFetch(Source, ivec2(x,y), SourceLevel).r);\n"
+            "   imageStore(Destination, p, vec4(depth));\n"
+            "}\n";
         
-        // generate and bind the vao
-        glGenVertexArrays(1, &chunk.vao);
-        glBindVertexArray(chunk.vao);
+        hiz_program.add(GL_COMPUTE_SHADER, hiz_source);
         
-        // generate and bind the vertex buffer object
-        glGenBuffers(1, &chunk.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
-        
-        std::vector<glm::vec3> vertexData;
-        glm::vec3 offset = static_cast<float>(chunksize) * glm::vec3(i,j,k);
-        float threshold = 0.0f;
-        // iterate over all blocks within the chunk
-        for(int x = 0;x<chunksize;++x)
-            for(int y = 0;y<chunksize;++y)
-                for(int z = 0;z<chunksize;++z)
-                {
-                    glm::vec3 pos = glm::vec3(x,y,z) + offset;
-                    // insert quads if current block is solid and neighbors are not
-                    if(world_function(pos)<threshold)
-                    {
-                        if(world_function(pos+glm::vec3(1,0,0))>=threshold)
-                        {
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1, 1, 1));
-                            vertexData.push_back(glm::vec3( 1, 0, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1,-1, 1));
-                            vertexData.push_back(glm::vec3( 1, 0, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1, 1,-1));
-                            vertexData.push_back(glm::vec3( 1, 0, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1,-1,-1));
-                            vertexData.push_back(glm::vec3( 1, 0, 0));
-                        }
-                        if(world_function(pos+glm::vec3(0,1,0))>=threshold)
-                        {
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1, 1, 1));
-                            vertexData.push_back(glm::vec3( 0, 1, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1, 1,-1));
-                            vertexData.push_back(glm::vec3( 0, 1, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1, 1, 1));
-                            vertexData.push_back(glm::vec3( 0, 1, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1, 1,-1));
-                            vertexData.push_back(glm::vec3( 0, 1, 0));
-                        }
-                        if(world_function(pos+glm::vec3(0,0,1))>=threshold)
-                        {
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1, 1, 1));
-                            vertexData.push_back(glm::vec3( 0, 0, 1));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1, 1, 1));
-                            vertexData.push_back(glm::vec3( 0, 0, 1));
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1,-1, 1));
-                            vertexData.push_back(glm::vec3( 0, 0, 1));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1,-1, 1));
-                            vertexData.push_back(glm::vec3( 0, 0, 1));
-                        }
-                        if(world_function(pos-glm::vec3(1,0,0))>=threshold)
-                        {
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1, 1, 1));
-                            vertexData.push_back(glm::vec3(-1, 0, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1, 1,-1));
-                            vertexData.push_back(glm::vec3(-1, 0, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1,-1, 1));
-                            vertexData.push_back(glm::vec3(-1, 0, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1,-1,-1));
-                            vertexData.push_back(glm::vec3(-1, 0, 0));
-                        }
-                        if(world_function(pos-glm::vec3(0,1,0))>=threshold)
-                        {
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1,-1, 1));
-                            vertexData.push_back(glm::vec3( 0,-1, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1,-1, 1));
-                            vertexData.push_back(glm::vec3( 0,-1, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1,-1,-1));
-                            vertexData.push_back(glm::vec3( 0,-1, 0));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1,-1,-1));
-                            vertexData.push_back(glm::vec3( 0,-1, 0));
-                        }
-                        if(world_function(pos-glm::vec3(0,0,1))>=threshold)
-                        {
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1, 1,-1));
-                            vertexData.push_back(glm::vec3( 0, 0,-1));
-                            vertexData.push_back(pos+0.5f*glm::vec3( 1,-1,-1));
-                            vertexData.push_back(glm::vec3( 0, 0,-1));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1, 1,-1));
-                            vertexData.push_back(glm::vec3( 0, 0,-1));
-                            vertexData.push_back(pos+0.5f*glm::vec3(-1,-1,-1));
-                            vertexData.push_back(glm::vec3( 0, 0,-1));
-                        }
-                    }
-                }
-        // upload
-        glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3)*vertexData.size(), &vertexData[0], GL_STATIC_DRAW);
-                        
-               
-        // set up generic attrib pointers
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), (char*)0 + 0*sizeof(GLfloat));
-     
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), (char*)0 + 3*sizeof(GLfloat));
+        // the scene is rendered into an fbo so its depth can be read back
+        glGenRenderbuffers(1, &scene_color);
+        glBindRenderbuffer(GL_RENDERBUFFER, scene_color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
         
+        glGenTextures(1, &scene_depth);
+        glBindTexture(GL_TEXTURE_2D, scene_depth);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         
-        // generate and bind the index buffer object
-        glGenBuffers(1, &chunk.ibo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk.ibo);
-        
-        chunk.quadcount = vertexData.size()/8;
-        std::vector<GLuint> indexData(6*chunk.quadcount);
-        for(int i = 0;i<chunk.quadcount;++i)
+        glGenFramebuffers(1, &scene_fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, scene_fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, scene_color);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, scene_depth, 0);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
         {
-            indexData[6*i + 0] = 4*i + 0;
-            indexData[6*i + 1] = 4*i + 1;
-            indexData[6*i + 2] = 4*i + 2;
-            indexData[6*i + 3] = 4*i + 2;
-            indexData[6*i + 4] = 4*i + 1;
-            indexData[6*i + 5] = 4*i + 3;
+            std::cerr << "scene framebuffer incomplete" << std::endl;
+            return 1;
         }
+        glBindFramebuffer(GL_FRAMEBUFFER, bench.framebuffer());
         
-        // upload
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*indexData.size(), &indexData[0], GL_STATIC_DRAW);
-
-
-        // chunk bounding box
-
-        // generate and bind the vao
-        glGenVertexArrays(1, &chunk.bounding_vao);
-        glBindVertexArray(chunk.bounding_vao);
+        // the depth pyramid, level 0 has the size of the framebuffer
+        hiz_levels = 1;
+        while((std::max(width, height)>>hiz_levels) > 0)
+            ++hiz_levels;
+        glGenTextures(1, &hiz_texture);
+        glBindTexture(GL_TEXTURE_2D, hiz_texture);
+        glTexStorage2D(GL_TEXTURE_2D, hiz_levels, GL_R32F, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
         
-        // generate and bind the vertex buffer object
-        glGenBuffers(1, &chunk.bounding_vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, chunk.bounding_vbo);
-                
-        // data for the bounding cube
-        GLfloat boundingVertexData[] = {
-        //  X                           Y                           Z 
-        // face 0:
-            offset.x+chunksize-0.5f,    offset.y+chunksize-0.5f,    offset.z+chunksize-0.5f,
-            offset.x-0.5f,              offset.y+chunksize-0.5f,    offset.z+chunksize-0.5f,
-            offset.x+chunksize-0.5f,    offset.y-0.5f,              offset.z+chunksize-0.5f,
-            offset.x-0.5f,              offset.y-0.5f,              offset.z+chunksize-0.5f,
-
-        // face 1:
-            offset.x+chunksize-0.5f,    offset.y+chunksize-0.5f,    offset.z+chunksize-0.5f,
-            offset.x+chunksize-0.5f,    offset.y-0.5f,              offset.z+chunksize-0.5f,
-            offset.x+chunksize-0.5f,    offset.y+chunksize-0.5f,    offset.z-0.5f,
-            offset.x+chunksize-0.5f,    offset.y-0.5f,              offset.z-0.5f,
-
-        // face 2:
-            offset.x+chunksize-0.5f,    offset.y+chunksize-0.5f,    offset.z+chunksize-0.5f,
-            offset.x+chunksize-0.5f,    offset.y+chunksize-0.5f,    offset.z-0.5f,
-            offset.x-0.5f,              offset.y+chunksize-0.5f,    offset.z+chunksize-0.5f,
-            offset.x-0.5f,              offset.y+chunksize-0.5f,    offset.z-0.5f,
-          
-        // face 3:
-            offset.x+chunksize-0.5f,    offset.y+chunksize-0.5f,    offset.z-0.5f,
-            offset.x+chunksize-0.5f,    offset.y-0.5f,              offset.z-0.5f,
-            offset.x-0.5f,              offset.y+chunksize-0.5f,    offset.z-0.5f,
-            offset.x-0.5f,              offset.y-0.5f,              offset.z-0.5f,
-
-        // face 4:
-            offset.x-0.5f,              offset.y+chunksize-0.5f,    offset.z+chunksize-0.5f,
-            offset.x-0.5f,              offset.y+chunksize-0.5f,    offset.z-0.5f,
-            offset.x-0.5f,              offset.y-0.5f,              offset.z+chunksize-0.5f,
-            offset.x-0.5f,              offset.y-0.5f,              offset.z-0.5f,
-
-        // face 5:
-            offset.x+chunksize-0.5f,    offset.y-0.5f,              offset.z+chunksize-0.5f,
-            offset.x-0.5f,              offset.y-0.5f,              offset.z+chunksize-0.5f,
-            offset.x+chunksize-0.5f,    offset.y-0.5f,              offset.z-0.5f,
-            offset.x-0.5f,              offset.y-0.5f,              offset.z-0.5f,
-        }; // 6 faces with 4 vertices with 6 components (floats)
-
-        // fill with data
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*6*4*3, boundingVertexData, GL_STATIC_DRAW);
-                        
-               
-        // set up generic attrib pointers
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), (char*)0 + 0*sizeof(GLfloat));
-        
-        // generate and bind the index buffer object
-        glGenBuffers(1, &chunk.bounding_ibo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk.bounding_ibo);
-                
-        GLuint boundingIndexData[] = {
-             0, 1, 2, 2, 1, 3, 4, 5, 6, 6, 5, 7, 8, 9,10,10, 9,11,
-            12,13,14,14,13,15,16,17,18,18,17,19,20,21,22,22,21,23,
-        };
-
-        // fill with data
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*6*2*3, boundingIndexData, GL_STATIC_DRAW);
+        // per chunk info, also used as the instanced chunk offset attribute
+        glGenBuffers(1, &chunk_info_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, chunk_info_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GPUChunk)*chunkcount, 0, GL_STATIC_DRAW);
         
-        // generate the query object for the occlusion query
-        glGenQueries(1, &chunk.query);
+        // front to back order of the chunks, updated every frame
+        glGenBuffers(1, &draw_order_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, draw_order_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint)*chunkcount, 0, GL_STREAM_DRAW);
         
-        // set the center location of the chunk
-        chunk.center = offset + 0.5f*chunksize;
+        // indirect draw commands written by the culling shader
+        glGenBuffers(1, &command_buffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand)*chunkcount, 0, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
         
-        // add to container
-        chunks.push_back(chunk);
+        // the chunk offsets are read per instance from the chunk info
+        glBindVertexArray(scene_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, chunk_info_buffer);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GPUChunk), (char*)0);
+        glVertexAttribDivisor(1, 1);
+        glBindVertexArray(0);
     }
     
-    // "unbind" vao
-    glBindVertexArray(0);
+    bool linked = gpu_driven ? link_programs({&shader_program, &query_shader_program, &cull_program, &hiz_program})
+                             : link_programs({&shader_program, &query_shader_program});
+    if(!linked)
+    {
+        return 1;
+    }
+    
+    GLint DrawViewProjection_location = shader_program.uniform("ViewProjection");
+    GLint ChunkOffset_location = shader_program.uniform("ChunkOffset");
+    GLint QueryViewProjection_location = query_shader_program.uniform("ViewProjection");
+    GLint BoxOffset_location = query_shader_program.uniform("ChunkOffset");
+    
+    GLint ChunkCount_location = cull_program.uniform("ChunkCount");
+    GLint ChunkSize_location = cull_program.uniform("ChunkSize");
+    GLint FrustumPlanes_location = cull_program.uniform("FrustumPlanes");
+    GLint HiZViewProjection_location = cull_program.uniform("HiZViewProjection");
+    GLint UseHiZ_location = cull_program.uniform("UseHiZ");
+    GLint HiZ_location = cull_program.uniform("HiZ");
+    
+    GLint Source_location = hiz_program.uniform("Source");
+    GLint SourceLevel_location = hiz_program.uniform("SourceLevel");
+    
+    // collect the chunks we want to extract
+    std::vector<glm::vec3> offsets;
+    ChunkKey page_center = chunk_key(glm::vec3(0.0f), chunksize);
+    if(paging)
+        offsets = page_offsets(page_center, page_radius, chunksize);
+    else
+        for(int i = -chunkrange;i<chunkrange;++i)
+            for(int j = -chunkrange;j<chunkrange;++j)
+                for(int k = -chunkrange;k<chunkrange;++k)
+                    offsets.push_back(static_cast<float>(chunksize) * glm::vec3(i,j,k));
+    
+    // the camera starts at the origin so mesh the chunks close to it first
+    std::sort(offsets.begin(), offsets.end(), OffsetDistancePred(glm::vec3(0.0f), chunksize));
+    
+    // every remesh of the world gets a new generation so results from
+    // older requests can be told apart
+    int generation = 0;
+    bool greedy = true;
+    userdata.greedy_meshing = greedy;
+    
+    MeshQueue mesh_queue;
+    
+    // the meshes of the current generation are written to the cache
+    // once all of them are done, unless they came from the cache
+    CachedAsset world_cache;
+    std::vector<ChunkMesh> cache_meshes;
+    bool write_cache = false;
+    unsigned long long generation_start = 0;
+    
+    // number of meshes requested for the current generation and how
+    // many of them arrived
+    size_t expected_meshes = 0, meshed = 0;
+    
+    // chunks of the current generation that are queued, being meshed or
+    // waiting to be uploaded, so they aren't requested twice
+    std::set<ChunkKey> requested;
+    
+    // hands the chunks in offsets to the meshing threads, except for the
+    // ones that are empty, already requested or already have a mesh of
+    // this generation
+    auto request_chunks = [&]() {
+        for(size_t i = 0;i<offsets.size();++i)
+        {
+            ChunkKey key = chunk_key(offsets[i], chunksize);
+            if(empty_chunks.count(key) || requested.count(key))
+                continue;
+            std::map<ChunkKey, int>::iterator found = chunk_ids.find(key);
+            if(found != chunk_ids.end() && chunks[found->second].generation == generation)
+                continue;
+            ChunkJob job = { offsets[i], generation, greedy };
+            mesh_queue.push_job(job);
+            requested.insert(key);
+            ++expected_meshes;
+        }
+    };
+    
+    // maps the meshes of the current mode from the cache or requests
+    // all chunks. a paged world isn't cached
+    auto request_world = [&]() {
+        // the requests of older generations are superseded
+        mesh_queue.clear_jobs();
+        requested.clear();
+        expected_meshes = meshed = 0;
+        cache_meshes.clear();
+        write_cache = false;
+        generation_start = glwtGetNanoTime();
+        if(!paging && world_cache.open(world_cache_key(chunkrange, chunksize, greedy)))
+            return;
+        write_cache = !paging && CachedAsset::enabled();
+        request_chunks();
+    };
+    request_world();
+    
+    // start one meshing thread per core
+    unsigned workercount = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for(unsigned i = 0;i<workercount;++i)
+        workers.push_back(std::thread(mesh_worker, &mesh_queue, chunksize));
+    
+    if(!world_cache.cached())
+        std::cout << "generating " << offsets.size() << " chunks on " << workercount << " threads." << std::endl;
+
+    // evicts chunks, their slots keep the gl objects for the next chunks
+    // and the shared vertex buffer gets their ranges back
+    auto evict_chunks = [&](const std::vector<int> &ids) {
+        if(ids.empty())
+            return;
+        std::vector<char> evicted(chunks.size(), 0);
+        for(size_t i = 0;i<ids.size();++i)
+        {
+            Chunk &chunk = chunks[ids[i]];
+            arena.release(chunk.first_vertex, 4*chunk.quadcount);
+            chunk.quadcount = 0;
+            chunk.first_vertex = 0;
+            chunk.generation = -1;
+            ChunkKey key = chunk_key(chunk.offset, chunksize);
+            chunk_ids.erase(key);
+            requested.erase(key);
+            evicted[ids[i]] = 1;
+            free_slots.push_back(ids[i]);
+        }
+        remove_chunk_order(evicted, order);
+    };
+
+    unsigned long long last_report = glwtGetNanoTime();
 
-    // timer query setup
-    // use multiple queries to avoid stalling on getting the results
-    const int querycount = 5;
-    GLuint queries[querycount];
-    int current_query = 0;
-    glGenQueries(querycount, queries);
+    // state cache and draw recording for the cpu driven path
+    GLState gl;
+    CommandBucket bucket;
     
     // we are drawing 3d objects so we want depth testing
     glEnable(GL_DEPTH_TEST);
 
-    // camera position and orientation
-    glm::vec3 position;
-    glm::mat4 rotation = glm::mat4(1.0f);
-    
-    float t = glwtGetNanoTime()*1.e-9f;
     userdata.occlusion_cull = true;
+    userdata.hiz_cull = true;
     userdata.move.forward = 0;
     userdata.move.right = 0;
     userdata.move.up = 0;
     userdata.move.roll = 0;
     userdata.mouse.x = 0;
     userdata.mouse.y = 0;
+    userdata.motion_time = 0;
+    
+    // the camera moves on its own thread at a fixed rate and turns on
+    // this one every frame
+    Camera initial_camera;
+    glm::mat4 rotation(1.0f);
+    int mousex = userdata.mouse.x, mousey = userdata.mouse.y;
+    unsigned long long last_frame = glwtGetNanoTime();
+    FixedStepSimulation<Camera, CameraInput> simulation;
+    simulation.start(initial_camera, std::max(1, int_option(argc, argv, "--tick-rate", 120)),
+                     [](const Camera &previous, Camera &camera, const CameraInput &input, double dt) {
+        camera = previous;
+        step_camera(camera, input, dt);
+    });
     
-    int mousex = userdata.mouse.x;
-    int mousey = userdata.mouse.y;
     while(userdata.running)
     {   
-        // calculate timestep
-        float new_t = glwtGetNanoTime()*1.e-9f;
-        float dt = new_t - t;
-        t = new_t;
+        // remesh the world if the meshing mode was changed
+        if(userdata.greedy_meshing != greedy)
+        {
+            greedy = userdata.greedy_meshing;
+            ++generation;
+            request_world();
+            std::cout << (greedy ? "greedy" : "per face") << " meshing" << std::endl;
+        }
+        
+        // wait for the gpu to catch up and sleep until the frame is due
+        pacer.begin_frame();
+        bench.begin_frame();
+        
+        profiler.push_cpu("upload");
+        
+        // uploads a mesh, returns false if it is outdated or the chunk was
+        // paged out while it was meshed. empty meshes free the chunk
+        auto upload_mesh = [&](glm::vec3 offset, int mesh_generation, const PackedVertex *vertexData, size_t count) {
+            ChunkKey key = chunk_key(offset, chunksize);
+            
+            // uploaded or rejected, either way the request is done. the
+            // requests of older generations were cleared already
+            if(mesh_generation == generation)
+                requested.erase(key);
+            
+            if(paging && chunk_distance2(key, page_center) > keep_radius*keep_radius)
+                return false;
+            
+            // results can arrive out of order across remeshes
+            std::map<ChunkKey, int>::iterator found = chunk_ids.find(key);
+            if(found != chunk_ids.end() && mesh_generation < chunks[found->second].generation)
+                return false;
+            
+            if(count == 0)
+            {
+                if(found != chunk_ids.end())
+                    evict_chunks(std::vector<int>(1, found->second));
+                empty_chunks.insert(key);
+                return true;
+            }
+            
+            // find the chunk or place it in a free slot if this is its
+            // first mesh. slots are only created when none is free
+            int c;
+            if(found != chunk_ids.end())
+            {
+                c = found->second;
+            }
+            else
+            {
+                if(free_slots.empty())
+                {
+                    c = chunks.size();
+                    chunks.push_back(Chunk());
+                    create_chunk(chunks[c]);
+                }
+                else
+                {
+                    c = free_slots.back();
+                    free_slots.pop_back();
+                }
+                place_chunk(offset, chunksize, chunks[c]);
+                chunk_ids[key] = c;
+                add_chunk_order(c, order);
+            }
+            
+            update_chunk(vertexData, count, mesh_generation, c, chunks[c], arena, chunk_info_buffer);
+            return true;
+        };
+        
+        // cached meshes are uploaded all at once straight from the
+        // mapped file
+        if(world_cache.cached())
+        {
+            const char *data = (const char*)world_cache.data();
+            GLuint count = *(const GLuint*)data;
+            const CachedChunk *records = (const CachedChunk*)(data + sizeof(GLuint));
+            const PackedVertex *vertices = (const PackedVertex*)(records + count);
+            for(GLuint i = 0;i<count;++i)
+            {
+                glm::vec3 offset(records[i].offset[0], records[i].offset[1], records[i].offset[2]);
+                upload_mesh(offset, generation, vertices + records[i].first_vertex, records[i].vertexcount);
+            }
+            world_cache.close();
+            std::cout << "loaded " << count << " chunks from the cache in " << (glwtGetNanoTime()-generation_start)*1.e-9 << " s" << std::endl;
+        }
+        
+        // upload a few of the chunks the workers finished
+        ChunkMesh mesh;
+        for(int u = 0;u<uploads_per_frame && mesh_queue.pop_result(mesh);++u)
+        {
+            const PackedVertex *vertexData = mesh.vertexData.empty() ? 0 : &mesh.vertexData[0];
+            if(!upload_mesh(mesh.offset, mesh.generation, vertexData, mesh.vertexData.size()))
+                continue;
+            
+            if(mesh.generation == generation)
+                ++meshed;
+            if(!paging && mesh.generation == 0 && meshed == expected_meshes)
+                std::cout << "generated all chunks in " << (glwtGetNanoTime()-generation_start)*1.e-9 << " s" << std::endl;
+            
+            // keep the meshes of this generation for the cache, this is
+            // the last use of mesh before the next pop replaces it
+            if(write_cache && mesh.generation == generation)
+            {
+                cache_meshes.push_back(std::move(mesh));
+                if(cache_meshes.size() == expected_meshes)
+                {
+                    write_world_cache(world_cache_key(chunkrange, chunksize, greedy), cache_meshes);
+                    cache_meshes.clear();
+                    write_cache = false;
+                }
+            }
+        }
+        
+        profiler.pop();
+        
+        // the shared vertex buffer may have been replaced while growing
+        if(scene_vao_vbo != arena.buffer())
+        {
+            scene_vao_vbo = arena.buffer();
+            glBindVertexArray(scene_vao);
+            glBindBuffer(GL_ARRAY_BUFFER, scene_vao_vbo);
+            glEnableVertexAttribArray(0);
+            glVertexAttribIPointer(0, 4, GL_UNSIGNED_BYTE, sizeof(PackedVertex), (char*)0);
+        }
+        
+        // "unbind" vao
+        glBindVertexArray(0);
 
         // update events
         glwtEventHandle(0);
 
-        // update mouse differential
-        int tmpx = userdata.mouse.x;
-        int tmpy = userdata.mouse.y;
-        glm::vec2 mousediff(tmpx-mousex, tmpy-mousey);
-        mousex = tmpx;
-        mousey = tmpy;
-        
-        // find up, forward and right vector
-        glm::mat3 rotation3(rotation);
-        glm::vec3 up = glm::transpose(rotation3)*glm::vec3(0.0f, 1.0f, 0.0f);
-        glm::vec3 right = glm::transpose(rotation3)*glm::vec3(1.0f, 0.0f, 0.0f);
-        glm::vec3 forward = glm::transpose(rotation3)*glm::vec3(0.0f, 0.0f,-1.0f);
-        
-        // apply mouse rotation
-        rotation = glm::rotate(rotation,  0.2f*mousediff.x, up);
-        rotation = glm::rotate(rotation,  0.2f*mousediff.y, right);
-        
-        // roll
-        rotation = glm::rotate(rotation, 180.0f*dt*userdata.move.roll, forward); 
- 
+        // turn by the mouse movement since the last frame. the motion is
+        // drawn by this frame, so the latency is measured from it here
+        unsigned long long now = glwtGetNanoTime();
+        float frame_dt = (now-last_frame)*1.e-9f;
+        last_frame = now;
+        glm::vec2 mousediff(userdata.mouse.x-mousex, userdata.mouse.y-mousey);
+        mousex = userdata.mouse.x;
+        mousey = userdata.mouse.y;
+        rotate_camera(rotation, mousediff, userdata.move.roll, frame_dt);
+        pacer.input_sampled(userdata.motion_time);
+        userdata.motion_time = 0;
+
+        // hand the input to the simulation and interpolate the newest
+        // camera positions for drawing
+        CameraInput input = { userdata.move.up, userdata.move.right, userdata.move.forward, rotation };
+        simulation.set_input(input);
+        const Camera *previous_camera, *current_camera;
+        float alpha = simulation.acquire(previous_camera, current_camera);
+        glm::vec3 position = glm::mix(previous_camera->position, current_camera->position, alpha);
         
-        // movement
-        position += 10.0f*dt*forward*userdata.move.forward;
-        position += 10.0f*dt*right*userdata.move.right;
-        position += 10.0f*dt*up*userdata.move.up;
+        // page the world when the camera enters another chunk
+        if(paging && chunk_key(position, chunksize) != page_center)
+        {
+            page_center = chunk_key(position, chunksize);
+            int keep2 = keep_radius*keep_radius;
+            std::vector<int> far;
+            for(std::map<ChunkKey, int>::iterator c = chunk_ids.begin();c!=chunk_ids.end();++c)
+                if(chunk_distance2(c->first, page_center) > keep2)
+                    far.push_back(c->second);
+            evict_chunks(far);
+            for(std::set<ChunkKey>::iterator c = empty_chunks.begin();c!=empty_chunks.end();)
+            {
+                if(chunk_distance2(*c, page_center) > keep2)
+                    c = empty_chunks.erase(c);
+                else
+                    ++c;
+            }
+            
+            // requests that fell out of range are dropped, the ones being
+            // meshed right now are rejected when they arrive
+            for(std::set<ChunkKey>::iterator c = requested.begin();c!=requested.end();)
+            {
+                if(chunk_distance2(*c, page_center) > keep2)
+                    c = requested.erase(c);
+                else
+                    ++c;
+            }
+            mesh_queue.drop_jobs([&](const ChunkJob &job) {
+                return chunk_distance2(chunk_key(job.offset, chunksize), page_center) > keep2;
+            });
+            
+            // the closest chunks are meshed first
+            offsets = page_offsets(page_center, page_radius, chunksize);
+            std::sort(offsets.begin(), offsets.end(), OffsetDistancePred(position, chunksize));
+            request_chunks();
+        }
         
         
         // calculate ViewProjection matrix
-        glm::mat4 Projection = glm::perspective(90.0f, 4.0f / 3.0f, 0.1f, 200.f);
+        glm::mat4 Projection = glm::perspective(90.0f, 4.0f / 3.0f, 0.1f, view_distance);
         glm::mat4 View = rotation*glm::translate(glm::mat4(1.0f), -position);
         glm::mat4 ViewProjection = Projection*View;
 
 
+        // the code above binds vertex arrays directly, the cache starts
+        // over every frame
+        gl.begin_frame();
+        gl.invalidate();
+
         // set matrices for both shaders
-        glUseProgram(query_shader_program);
+        gl.use_program(query_shader_program.id());
         glUniformMatrix4fv(QueryViewProjection_location, 1, GL_FALSE, glm::value_ptr(ViewProjection)); 
-        glUseProgram(shader_program);
+        gl.use_program(shader_program.id());
         glUniformMatrix4fv(DrawViewProjection_location, 1, GL_FALSE, glm::value_ptr(ViewProjection));
         
+        // the gpu driven backend renders into its own framebuffer
+        if(gpu_driven)
+            glBindFramebuffer(GL_FRAMEBUFFER, scene_fbo);
+        
         // set clear color to sky blue
         glClearColor(0.5f,0.8f,1.0f,1.0f);
         
@@ -655,129 +1596,222 @@ int main()
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         // sort chunks by distance
-        std::sort(chunks.begin(), chunks.end(), DistancePred(position));
+        profiler.push_cpu("order");
+        update_chunk_order(chunks, position, order);
+        profiler.pop();
         
         size_t i = 0;
         float maxdist = chunksize;
+        float mindist2 = float(chunksize)*chunksize;
 
-        // start timer query
-        glBeginQuery(GL_TIME_ELAPSED, queries[current_query]);
-        
-        // peel chunks
-        while(i!=chunks.size())
+        if(gpu_driven)
         {
-            size_t j = i;
-            if(userdata.occlusion_cull)
+            // upload the current front to back order
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, draw_order_buffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint)*order.id.size(), order.id.empty() ? 0 : &order.id[0]);
+            
+            // cull and build the draw commands
+            profiler.push_gpu("cull");
+            glm::vec4 planes[6];
+            frustum_planes(ViewProjection, planes);
+            glUseProgram(cull_program.id());
+            glUniform1ui(ChunkCount_location, order.id.size());
+            glUniform1f(ChunkSize_location, chunksize);
+            glUniform4fv(FrustumPlanes_location, 6, glm::value_ptr(planes[0]));
+            glUniformMatrix4fv(HiZViewProjection_location, 1, GL_FALSE, glm::value_ptr(hiz_view_projection));
+            
+            // test against the pyramid of the previous frame
+            glUniform1i(UseHiZ_location, userdata.hiz_cull && hiz_valid);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, hiz_texture);
+            glUniform1i(HiZ_location, 0);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, chunk_info_buffer);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, draw_order_buffer);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, command_buffer);
+            glDispatchCompute((order.id.size()+63)/64, 1, 1);
+            
+            // make the commands visible to the indirect draw
+            glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+            profiler.pop();
+            
+            // draw all chunks at once
+            profiler.push_gpu("draw");
+            glEnable(GL_CULL_FACE);
+            glUseProgram(shader_program.id());
+            glBindVertexArray(scene_vao);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, order.id.size(), 0);
+            profiler.pop();
+            
+            // build the depth pyramid for the next frame
+            hiz_valid = userdata.hiz_cull;
+            hiz_view_projection = ViewProjection;
+            if(hiz_valid)
             {
-                // start occlusion queries and render for the current slice
-                glDisable(GL_CULL_FACE);
-                
-                // we don't want the queries to actually render something
-                glDepthMask(GL_FALSE);
-                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-                glUseProgram(query_shader_program);
-                for(;j<chunks.size() && glm::distance(chunks[j].center, position)<maxdist;++j)
+                GPUScope scope(profiler, "hiz");
+                glUseProgram(hiz_program.id());
+                glUniform1i(Source_location, 0);
+                glActiveTexture(GL_TEXTURE0);
+                for(int level = 0;level<hiz_levels;++level)
                 {
-                    // frustum culling
-                    glm::vec4 projected = ViewProjection*glm::vec4(chunks[j].center,1);
-                    if( (glm::distance(chunks[j].center,position) > chunksize) &&
-                        (std::max(std::abs(projected.x), std::abs(projected.y)) > projected.w+chunksize))
-                        continue;
-                    
-                    // begin occlusion query
-                    glBeginQuery(GL_ANY_SAMPLES_PASSED, chunks[j].query);
-                    
-                    // draw bounding box
-                    glBindVertexArray(chunks[j].bounding_vao);
-                    glDrawElements(GL_TRIANGLES, 6*6, GL_UNSIGNED_INT, 0);
-                    
-                    // end occlusion query
-                    glEndQuery(GL_ANY_SAMPLES_PASSED);
+                    // level 0 is a copy of the depth buffer, the others
+                    // reduce the level above
+                    glBindTexture(GL_TEXTURE_2D, level == 0 ? scene_depth : hiz_texture);
+                    glUniform1i(SourceLevel_location, level == 0 ? 0 : level-1);
+                    glBindImageTexture(0, hiz_texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+                    int w = std::max(1, width>>level);
+                    int h = std::max(1, height>>level);
+                    glDispatchCompute((w+7)/8, (h+7)/8, 1);
+                    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
                 }
-                j = i;
             }
-
-            // render the current slice
-            glEnable(GL_CULL_FACE);
             
-            // turn rendering back on
-            glDepthMask(GL_TRUE);
-            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-            glUseProgram(shader_program);
-            for(;j<chunks.size() && glm::distance(chunks[j].center, position)<maxdist;++j)
+            // show the result
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, scene_fbo);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, bench.framebuffer());
+            glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            glBindFramebuffer(GL_FRAMEBUFFER, bench.framebuffer());
+        }
+        else
+        {
+            // peel chunks, each shell gets two layers of the bucket so its
+            // queries are submitted before its draws and both before the
+            // next shell. within a layer the draws are grouped by state
+            DrawState query_state(query_shader_program.id(), box_vao);
+            // we don't want the queries to actually render something
+            query_state.cull_face = false;
+            query_state.depth_write = false;
+            query_state.color_write = false;
+            DrawState draw_state(shader_program.id(), scene_vao);
+            bool occlusion_cull = userdata.occlusion_cull;
+            unsigned layer = 0;
+            while(i!=order.id.size())
             {
-                // frustum culling
-                glm::vec4 projected = ViewProjection*glm::vec4(chunks[j].center,1);
-                if( (glm::distance(chunks[j].center,position) > chunksize) &&
-                    (std::max(std::abs(projected.x), std::abs(projected.y)) > projected.w+chunksize))
-                    continue;
-                
-                // begin conditional render
-                if(userdata.occlusion_cull)
-                    glBeginConditionalRender(chunks[j].query, GL_QUERY_BY_REGION_WAIT);
+                float maxdist2 = maxdist*maxdist;
+                size_t j = i;
+                if(occlusion_cull)
+                {
+                    // record occlusion queries for the current slice
+                    for(;j<order.id.size() && order.distance2[j]<maxdist2;++j)
+                    {
+                        const Chunk &chunk = chunks[order.id[j]];
+                    
+                        // frustum culling
+                        glm::vec4 projected = ViewProjection*glm::vec4(chunk.center,1);
+                        if( (order.distance2[j] > mindist2) &&
+                            (std::max(std::abs(projected.x), std::abs(projected.y)) > projected.w+chunksize))
+                            continue;
+                    
+                        // draw bounding box inside the query
+                        DrawCommand box(GL_TRIANGLES, 6*6);
+                        box.index_type = GL_UNSIGNED_INT;
+                        box.query = chunk.query;
+                        box.uniform_location = BoxOffset_location;
+                        std::copy(glm::value_ptr(chunk.offset), glm::value_ptr(chunk.offset)+3, box.uniform);
+                        bucket.add(layer, query_state, box);
+                    }
+                    j = i;
+                }
+
+                // record the current slice
+                for(;j<order.id.size() && order.distance2[j]<maxdist2;++j)
+                {
+                    const Chunk &chunk = chunks[order.id[j]];
                 
-                // draw chunk
-                glBindVertexArray(chunks[j].vao);
-                glDrawElements(GL_TRIANGLES, 6*chunks[j].quadcount, GL_UNSIGNED_INT, 0);
+                    // frustum culling
+                    glm::vec4 projected = ViewProjection*glm::vec4(chunk.center,1);
+                    if( (order.distance2[j] > mindist2) &&
+                        (std::max(std::abs(projected.x), std::abs(projected.y)) > projected.w+chunksize))
+                        continue;
                 
-                // end conditional render
-                if(userdata.occlusion_cull)
-                    glEndConditionalRender();
+                    // draw chunk, conditional on its query
+                    DrawCommand draw(GL_TRIANGLES, 6*chunk.quadcount);
+                    draw.index_type = GL_UNSIGNED_INT;
+                    draw.base_vertex = chunk.first_vertex;
+                    if(occlusion_cull)
+                    {
+                        draw.condition = chunk.query;
+                        draw.condition_mode = GL_QUERY_BY_REGION_WAIT;
+                    }
+                    draw.uniform_location = ChunkOffset_location;
+                    std::copy(glm::value_ptr(chunk.offset), glm::value_ptr(chunk.offset)+3, draw.uniform);
+                    bucket.add(layer+1, draw_state, draw);
+                }
+                i = j;
+                maxdist += 2*chunksize;
+                layer += 2;
             }
-            i = j;
-            maxdist += 2*chunksize;
+            bucket.submit(gl);
         }
         
-        // end timer query
-        glEndQuery(GL_TIME_ELAPSED);
-        
-        // display timer query results from querycount frames before
-        if(GL_TRUE == glIsQuery(queries[(current_query+1)%querycount]))
+        // display the timer statistics once per second
+        if(!bench.benchmarking() && glwtGetNanoTime()-last_report > 1000000000ull)
         {
-            GLuint64 result;
-            glGetQueryObjectui64v(queries[(current_query+1)%querycount], GL_QUERY_RESULT, &result);
-            std::cout << result*1.e-6 << " ms/frame" << std::endl;
+            ScopeStats frame = profiler.stats("frame");
+            std::cout << frame.avg << " ms/frame (min " << frame.min << ", p99 " << frame.p99 << ")" << std::endl;
+            GLState::Counters counters = gl.frame_counters();
+            std::cout << counters.draws << " draws, " << counters.issued << " state calls issued, "
+                      << counters.elided << " elided" << std::endl;
+            std::cout << order.id.size() << " chunks resident, " << free_slots.size() << " free slots, "
+                      << empty_chunks.size() << " empty or solid chunks skipped" << std::endl;
+            LatencyStats latency = pacer.latency();
+            if(latency.samples > 0)
+                std::cout << "mouse to gpu done " << latency.avg << " ms (max " << latency.max << "), "
+                          << pacer.frames_in_flight() << " frames in flight, swap interval " << pacer.swap_interval()
+                          << (pacer.jit_sleep() ? ", jit sleep" : "") << std::endl;
+            last_report = glwtGetNanoTime();
         }
-        // advance query counter
-        current_query = (current_query + 1)%querycount;
         
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
-        {
-            userdata.running = false;       
-        }
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
         
         // finally swap buffers
-        glwtSwapBuffers(window);       
+        pacer.swap(window);
     }
     
+    simulation.stop();
+    
+    // stop the meshing threads, unfinished chunks are discarded
+    mesh_queue.stop();
+    for(size_t i = 0;i<workers.size();++i)
+        workers[i].join();
+    
     // delete the created objects
     
     for(size_t i = 0;i<chunks.size();++i)
     {    
-        glDeleteVertexArrays(1, &chunks[i].vao);
-        glDeleteBuffers(1, &chunks[i].vbo);
-        glDeleteBuffers(1, &chunks[i].ibo);
-        glDeleteVertexArrays(1, &chunks[i].bounding_vao);
-        glDeleteBuffers(1, &chunks[i].bounding_vbo);
-        glDeleteBuffers(1, &chunks[i].bounding_ibo);
         glDeleteQueries(1, &chunks[i].query);
     }
     
-    glDeleteQueries(querycount, queries);
+    glDeleteBuffers(1, &quad_ibo);
+    glDeleteVertexArrays(1, &scene_vao);
+    arena.destroy();
+    glDeleteVertexArrays(1, &box_vao);
+    glDeleteBuffers(1, &box_vbo);
+    glDeleteBuffers(1, &box_ibo);
     
-    glDetachShader(shader_program, vertex_shader);	
-    glDetachShader(shader_program, fragment_shader);
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
-    glDeleteProgram(shader_program);
-
-    glDetachShader(query_shader_program, query_vertex_shader);	
-    glDetachShader(query_shader_program, query_fragment_shader);
-    glDeleteShader(query_vertex_shader);
-    glDeleteShader(query_fragment_shader);
-    glDeleteProgram(query_shader_program);
+    if(gpu_driven)
+    {
+        glDeleteBuffers(1, &chunk_info_buffer);
+        glDeleteBuffers(1, &draw_order_buffer);
+        glDeleteBuffers(1, &command_buffer);
+        glDeleteFramebuffers(1, &scene_fbo);
+        glDeleteRenderbuffers(1, &scene_color);
+        glDeleteTextures(1, &scene_depth);
+        glDeleteTextures(1, &hiz_texture);
+    }
+    cull_program.destroy();
+    hiz_program.destroy();
+    pacer.shutdown();
+    bench.shutdown();
+    profiler.shutdown();
+    
+    shader_program.destroy();
+    query_shader_program.destroy();
     
     glwtWindowDestroy(window);
     glwtQuit();
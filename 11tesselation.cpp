@@ -2,11 +2,38 @@
  * 
  * This example shows the usage of tesselation for terrain LOD.
  * The terrain is given as a texture of 3d samples (generalized
- * heightfield) and gets rendered without use of a vbo/vao. Instead
- * sample coordinates are generated from InstanceID and VertexID.
+ * heightfield). It is split into square patches by a quadtree on the
+ * cpu: nodes closer to the viewer than a multiple of their size are
+ * split and nodes outside the view frustum are dropped. The remaining
+ * patches are streamed to an instance buffer together with an
+ * indirect draw command and the sample coordinates are generated from
+ * the instance data and VertexID.
  * Tessellation is used to dynamically change the amount of vertices
- * depending on distance from the viewer.
+ * depending on distance from the viewer. The edge levels are powers
+ * of two and a patch next to a patch twice its size uses half the
+ * level of the larger edge on that side, so the vertices on the
+ * shared edge line up and there are no cracks.
+ * The levels either follow the distance only or (toggle with T) aim
+ * for edges of a fixed length in pixels on screen (--edge-pixels N,
+ * default 8). In the screen space mode a controller scales the levels
+ * down whenever the number of generated triangles, measured with
+ * GL_PRIMITIVES_GENERATED queries, goes over --triangle-budget N.
+ * toggle tessellation with space, the quadtree (against a fixed
+ * 64x64 grid of patches) with L and screen space levels with T
  * This example requires at least OpenGL 4.0
+ * The displacement texture is generated on all cores and cached on
+ * disk (see asset_cache.hpp).
+ * The texture can be stored as rgb32f (default), rgb16f or as an r16
+ * heightmap where the x and y of a sample are its texture coordinate
+ * (--terrain-format rgb32f|rgb16f|r16). It has a full mip chain and
+ * the evaluation shader picks the level from the distance to the
+ * viewer, so distant patches read from the smaller levels. The level
+ * only depends on the position, so patches sharing an edge also
+ * sample it from the same level. The resolution is
+ * set with --terrain-size N.
+ * The frames can be paced for lower mouse-look latency, see
+ * frame_pacing.hpp (--low-latency and friends). The measured latency
+ * is printed once per second.
  * 
  * Autor: Jakob Progsch
  */
@@ -14,6 +41,18 @@
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "asset_cache.hpp"
+#include "stream_buffer.hpp"
+#include "frame_scheduler.hpp"
+#include "half_float.hpp"
+#include "frame_pacing.hpp"
+#include "math_util.hpp"
+#include "options.hpp"
+#include "shader_program.hpp"
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp> 
@@ -22,6 +61,10 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
 
 #include <time.h>
 unsigned long long raw_time()
@@ -41,6 +84,8 @@ unsigned long long glwtGetNanoTime()
 struct UserData {
     bool running;
     bool tesselation;
+    bool quadtree;
+    bool screen_space;
     struct {
         float up;
         float right;
@@ -50,6 +95,8 @@ struct UserData {
     struct {
         int x, y;
     } mouse;
+    // time of the first mouse motion not yet seen by a frame
+    unsigned long long motion_time;
 };
 
 static void error_callback(const char *msg, void *userdata)
@@ -73,6 +120,12 @@ static void key_callback(GLWTWindow *window, int down, int keysym, int scancode,
     
     if(keysym == GLWT_KEY_SPACE && down)
         userdata->tesselation = !userdata->tesselation;
+    
+    if(keysym == GLWT_KEY_L && down)
+        userdata->quadtree = !userdata->quadtree;
+    
+    if(keysym == GLWT_KEY_T && down)
+        userdata->screen_space = !userdata->screen_space;
                 
     switch(keysym)
     {
@@ -103,46 +156,270 @@ static void motion_callback(GLWTWindow *window, int x, int y, int buttons, void
     UserData *userdata = (UserData*)void_userdata;
     userdata->mouse.x = x;
     userdata->mouse.y = y;
+    if(userdata->motion_time == 0)
+        userdata->motion_time = glwtGetNanoTime();
 }
 
-// helper to check and display for shader compiler errors
-bool check_shader_compile_status(GLuint obj)
+// camera state advanced by the simulation thread. only the movement
+// ticks, the rotation follows the mouse on the render thread so looking
+// around isn't held back by a tick
+struct Camera {
+    glm::vec3 position;
+};
+
+// the part of UserData the simulation reads, with the rotation of the
+// frame that handed it over to move along
+struct CameraInput {
+    float up, right, forward;
+    glm::mat4 rotation;
+};
+
+// turns the camera by a mouse movement and the roll keys, called by the
+// render thread right after the events were handled
+void rotate_camera(glm::mat4 &rotation, glm::vec2 mousediff, float roll, float dt)
 {
-    GLint status;
-    glGetShaderiv(obj, GL_COMPILE_STATUS, &status);
-    if(status == GL_FALSE)
-    {
-        GLint length;
-        glGetShaderiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetShaderInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;
-    }
-    return true;
+    // find up, forward and right vector
+    glm::mat3 rotation3(rotation);
+    glm::vec3 up = glm::transpose(rotation3)*glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 right = glm::transpose(rotation3)*glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 forward = glm::transpose(rotation3)*glm::vec3(0.0f, 0.0f,-1.0f);
+    
+    // apply mouse rotation
+    rotation = glm::rotate(rotation,  0.2f*mousediff.x, up);
+    rotation = glm::rotate(rotation,  0.2f*mousediff.y, right);
+    
+    // roll
+    rotation = glm::rotate(rotation, 180.0f*dt*roll, forward); 
+}
+
+// advances the camera by one tick
+void step_camera(Camera &camera, const CameraInput &input, float dt)
+{
+    // find up, forward and right vector
+    glm::mat3 rotation3(input.rotation);
+    glm::vec3 up = glm::transpose(rotation3)*glm::vec3(0.0f, 1.0f, 0.0f);
+    glm::vec3 right = glm::transpose(rotation3)*glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::vec3 forward = glm::transpose(rotation3)*glm::vec3(0.0f, 0.0f,-1.0f);
+    
+    // movement
+    camera.position += 0.5f*dt*forward*input.forward;
+    camera.position += 0.5f*dt*right*input.right;
+    camera.position += 0.5f*dt*up*input.up;
 }
 
-// helper to check and display for shader linker error
-bool check_program_link_status(GLuint obj)
+// storage formats of the displacement texture
+struct TerrainFormat {
+    const char *name;
+    GLenum internal_format, format, type;
+    int bytes; // per texel
+};
+
+const TerrainFormat terrain_formats[] = {
+    { "rgb32f", GL_RGB32F, GL_RGB, GL_FLOAT, 12 },
+    { "rgb16f", GL_RGB16F, GL_RGB, GL_HALF_FLOAT, 6 },
+    { "r16", GL_R16, GL_RED, GL_UNSIGNED_SHORT, 2 },
+};
+const int terrain_format_count = sizeof(terrain_formats)/sizeof(terrain_formats[0]);
+
+// the r16 heightmap stores heights in [bias, bias+scale]
+const float height_bias = -0.25f;
+const float height_scale = 0.5f;
+
+// fills the rows [begin,end) of the terrain displacement in format.
+// the r16 heightmap only keeps the height, x and y are the texture
+// coordinate
+void generate_displacement(int begin, int end, int terrainwidth, int terrainheight, int format, void *displacementData)
 {
-    GLint status;
-    glGetProgramiv(obj, GL_LINK_STATUS, &status);
-    if(status == GL_FALSE)
+    glm::vec3 layernorm = glm::normalize(glm::vec3(0.1f,0.3f,1.0f));
+    glm::vec3 layerdir(0,0,1);
+    layerdir -= layernorm*glm::dot(layernorm, layerdir);
+    layerdir = glm::normalize(layerdir);
+    
+    for(int y = begin;y<end;++y)
+        for(int x = 0;x<terrainwidth;++x)
+        {
+            size_t i = size_t(y)*terrainwidth+x;
+            glm::vec2 pos(float(x)/terrainwidth,float(y)/terrainheight);
+            glm::vec3 tmp = glm::vec3( pos, 0.15f*glm::perlin(5.0f*pos));
+            glm::vec3 value = tmp + 0.04f*layerdir*glm::perlin(glm::vec2(30.0f*glm::dot(layernorm, tmp), 0.5f));
+            
+            if(format == 0)
+            {
+                ((glm::vec3*)displacementData)[i] = value;
+            }
+            else if(format == 1)
+            {
+                for(int c = 0;c<3;++c)
+                    ((GLushort*)displacementData)[3*i+c] = float_to_half(value[c]);
+            }
+            else
+            {
+                float height = glm::clamp((value.z-height_bias)/height_scale, 0.0f, 1.0f);
+                ((GLushort*)displacementData)[i] = GLushort(height*65535.0f + 0.5f);
+            }
+        }
+}
+
+// a terrain patch as read by the vertex shader. mask has a bit set for
+// each side where the neighbor is twice as large (1 left, 2 right,
+// 4 bottom, 8 top)
+struct TerrainPatch {
+    GLfloat x, y, size, mask;
+};
+
+// layout of the command read by glDrawArraysIndirect
+struct DrawArraysIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint first;
+    GLuint baseInstance;
+};
+
+// selects the terrain patches to draw. a node is split while the viewer
+// is closer to it than range times its size, this keeps the sizes of
+// neighboring patches within a factor of two
+class TerrainQuadtree {
+public:
+    TerrainQuadtree(int depth, float split_range) : max_depth(depth), range(split_range),
+        cells(1 << depth), depths((1 << depth)*(1 << depth)) { }
+
+    // fills patches with the visible leaves. with fixed_depth >= 0 the
+    // whole terrain is split down to that depth and nothing is culled
+    void select(const glm::mat4 &ViewProjection, glm::vec3 position, int fixed_depth, std::vector<TerrainPatch> &patches)
     {
-        GLint length;
-        glGetProgramiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetProgramInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;   
+        frustum_planes(ViewProjection, planes);
+        viewer = position;
+        forced_depth = fixed_depth;
+        culled = 0;
+        patches.clear();
+        leaves.clear();
+        visit(0, 0, 0);
+        
+        // the neighbor masks need the depth of every leaf, including
+        // the culled ones
+        for(size_t i = 0;i<leaves.size();++i)
+        {
+            const Leaf &leaf = leaves[i];
+            if(!leaf.visible)
+                continue;
+            int size = cells >> leaf.depth;
+            int mask = 0;
+            if(leaf.x > 0 && depth_at(leaf.x-1, leaf.y) < leaf.depth)
+                mask |= 1;
+            if(leaf.x+size < cells && depth_at(leaf.x+size, leaf.y) < leaf.depth)
+                mask |= 2;
+            if(leaf.y > 0 && depth_at(leaf.x, leaf.y-1) < leaf.depth)
+                mask |= 4;
+            if(leaf.y+size < cells && depth_at(leaf.x, leaf.y+size) < leaf.depth)
+                mask |= 8;
+            TerrainPatch patch = { float(leaf.x)/cells, float(leaf.y)/cells, float(size)/cells, float(mask) };
+            patches.push_back(patch);
+        }
     }
-    return true;
-}
 
-int main()
+    // number of leaves dropped by the last select
+    int culled_count() const { return culled; }
+
+private:
+    // a leaf in units of the cells of the finest level
+    struct Leaf {
+        int x, y, depth;
+        bool visible;
+    };
+
+    // the patch bounds are grown by the largest displacement
+    static void bounds(float x, float y, float size, glm::vec3 &lo, glm::vec3 &hi)
+    {
+        const float margin = 0.05f;
+        lo = glm::vec3(x-margin, y-margin, height_bias);
+        hi = glm::vec3(x+size+margin, y+size+margin, height_bias+height_scale);
+    }
+
+    bool in_frustum(const glm::vec3 &lo, const glm::vec3 &hi) const
+    {
+        // test the corner furthest along each plane normal
+        for(int i = 0;i<6;++i)
+        {
+            glm::vec3 corner(planes[i].x > 0 ? hi.x : lo.x, planes[i].y > 0 ? hi.y : lo.y, planes[i].z > 0 ? hi.z : lo.z);
+            if(glm::dot(glm::vec3(planes[i]), corner) + planes[i].w < 0)
+                return false;
+        }
+        return true;
+    }
+
+    void visit(int x, int y, int depth)
+    {
+        int size = cells >> depth;
+        glm::vec3 lo, hi;
+        bounds(float(x)/cells, float(y)/cells, float(size)/cells, lo, hi);
+        
+        bool split;
+        if(forced_depth >= 0)
+        {
+            split = depth < forced_depth;
+        }
+        else
+        {
+            glm::vec3 nearest = glm::clamp(viewer, lo, hi);
+            split = depth < max_depth && glm::distance(nearest, viewer) < range*size/cells;
+        }
+        
+        if(split)
+        {
+            int half = size/2;
+            visit(x, y, depth+1);
+            visit(x+half, y, depth+1);
+            visit(x, y+half, depth+1);
+            visit(x+half, y+half, depth+1);
+            return;
+        }
+        
+        Leaf leaf = { x, y, depth, forced_depth >= 0 || in_frustum(lo, hi) };
+        leaves.push_back(leaf);
+        if(!leaf.visible)
+            ++culled;
+        for(int j = 0;j<size;++j)
+            std::fill(&depths[(y+j)*cells + x], &depths[(y+j)*cells + x] + size, depth);
+    }
+
+    int depth_at(int x, int y) const { return depths[y*cells + x]; }
+
+    int max_depth;
+    float range;
+    int cells;
+    std::vector<int> depths;
+    std::vector<Leaf> leaves;
+    glm::vec4 planes[6];
+    glm::vec3 viewer;
+    int forced_depth;
+    int culled;
+};
+
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
+    FramePacer pacer(argc, argv);
+   
+    // displacement texture format and size
+    std::string format_name = string_option(argc, argv, "--terrain-format", "rgb32f");
+    int format = 0;
+    while(format<terrain_format_count && format_name != terrain_formats[format].name)
+        ++format;
+    if(format == terrain_format_count)
+    {
+        std::cerr << "unknown terrain format " << format_name << ", use rgb32f, rgb16f or r16" << std::endl;
+        return 1;
+    }
+    int terrainsize = glm::clamp(int_option(argc, argv, "--terrain-size", 1024), 64, 16384);
+    
+    // target edge length and triangle budget of the screen space mode
+    float edge_pixels = std::max(1, int_option(argc, argv, "--edge-pixels", 8));
+    GLuint triangle_budget = std::max(1000, int_option(argc, argv, "--triangle-budget", 1000000));
    
     UserData userdata;
     userdata.running = true;
@@ -156,7 +433,7 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
     glwt_config.api_version_major = 4;
     glwt_config.api_version_minor = 0;
     
@@ -199,59 +476,108 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    pacer.init(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
 
 	GLuint vao;
 	glGenVertexArrays(1, &vao);
 	glBindVertexArray(vao);
 
     // shader source code
+    // the patch instance attribute holds corner, size and neighbor mask
     std::string vertex_source =
         "#version 400\n"
-        "uniform uint width;\n"
-        "uniform uint height;\n"
+        "layout(location = 0) in vec4 patchdata;\n"
         "out vec4 tposition;\n"
+        "out vec4 tpatch;\n"
         "const vec2 quad_offsets[6] = vec2[](\n"
         "   vec2(0,0),vec2(1,0),vec2(1,1),\n"
         "   vec2(0,0),vec2(1,1),vec2(0,1)\n"
         ");\n"
         "void main() {\n"
-        "   vec2 base = vec2(gl_InstanceID/width, gl_InstanceID%width);\n"
         "   vec2 offset = quad_offsets[gl_VertexID];\n"
-        "   vec2 pos = (base + offset)/vec2(width+1, height+1);\n"
-        "   tposition = vec4(pos,0,1);\n"
+        "   tposition = vec4(patchdata.xy + patchdata.z*offset,0,1);\n"
+        "   tpatch = patchdata;\n"
         "}\n";    
 
+    // the edge levels only depend on the end points of the edge, so
+    // both patches sharing an edge compute the same level for it
     std::string tess_control_source =
         "#version 400\n"
         "uniform vec3 ViewPosition;\n"
         "uniform float tess_scale;\n"
+        "uniform float lod_scale;\n"
         "layout(vertices = 3) out;\n"
         "in vec4 tposition[];\n"
+        "in vec4 tpatch[];\n"
         "out vec4 tcposition[];\n"
+        "vec3 terrainpos;\n"
+        "float edge_level(vec2 a, vec2 b) {\n"
+        "   float level = tess_scale*lod_scale*distance(a, b)/max(1e-4, distance(vec3(0.5*(a+b), 0), terrainpos));\n"
+        "   return exp2(clamp(round(log2(max(level, 1e-4))), 0.0, 6.0));\n"
+        "}\n"
+        "float patch_edge_level(int i) {\n"
+        "   vec2 a = tposition[(i+1)%3].xy;\n"
+        "   vec2 b = tposition[(i+2)%3].xy;\n"
+        "   vec4 patchdata = tpatch[0];\n"
+        "   int mask = int(patchdata.w);\n"
+        "   int side = 0;\n"
+        "   if(a.x == b.x) side = a.x == patchdata.x ? 1 : 2;\n"
+        "   else if(a.y == b.y) side = a.y == patchdata.y ? 4 : 8;\n"
+        "   if((mask & side) == 0)\n"
+        "       return edge_level(a, b);\n"
+        // the neighbor's edge is twice as long and starts on a multiple of
+        // its size. at level 1 it can't be halved, which leaves a small
+        // t-junction only on the coarsest edges
+        "   vec2 axis = abs(b-a)/patchdata.z;\n"
+        "   vec2 lo = min(a, b);\n"
+        "   lo -= axis*mod(dot(lo, axis), 2*patchdata.z);\n"
+        "   return max(1.0, 0.5*edge_level(lo, lo+2*patchdata.z*axis));\n"
+        "}\n"
         "void main()\n"
         "{\n"
         "   tcposition[gl_InvocationID] = tposition[gl_InvocationID];\n"
         "   if(gl_InvocationID == 0) {\n"
-        "       vec3 terrainpos = ViewPosition;\n"
+        "       terrainpos = ViewPosition;\n"
         "       terrainpos.z -= clamp(terrainpos.z,-0.1, 0.1);\n"        
-        "       vec4 center = (tcposition[1]+tcposition[2])/2.0;\n"
-        "       gl_TessLevelOuter[0] = min(7.0, 1+tess_scale*0.5/distance(center.xyz, terrainpos));\n"
-        "       center = (tcposition[2]+tcposition[0])/2.0;\n"
-        "       gl_TessLevelOuter[1] = min(7.0, 1+tess_scale*0.5/distance(center.xyz, terrainpos));\n"
-        "       center = (tcposition[0]+tcposition[1])/2.0;\n"
-        "       gl_TessLevelOuter[2] = min(7.0, 1+tess_scale*0.5/distance(center.xyz, terrainpos));\n"
-        "       center = (tcposition[0]+tcposition[1]+tcposition[2])/3.0;\n"
-        "       gl_TessLevelInner[0] = min(8.0, 1+tess_scale*0.7/distance(center.xyz, terrainpos));\n"
+        // tessellation is off, draw the plain patches
+        "       if(tess_scale == 0) {\n"
+        "           gl_TessLevelOuter[0] = gl_TessLevelOuter[1] = gl_TessLevelOuter[2] = 1;\n"
+        "           gl_TessLevelInner[0] = 1;\n"
+        "           return;\n"
+        "       }\n"
+        "       gl_TessLevelOuter[0] = patch_edge_level(0);\n"
+        "       gl_TessLevelOuter[1] = patch_edge_level(1);\n"
+        "       gl_TessLevelOuter[2] = patch_edge_level(2);\n"
+        "       gl_TessLevelInner[0] = max(gl_TessLevelOuter[0], max(gl_TessLevelOuter[1], gl_TessLevelOuter[2]));\n"
         "   }\n"
         "}\n";
 
+    // decodes the displacement texture, shared by the evaluation and
+    // fragment shaders
+    std::string terrain_source =
+        std::string(terrain_formats[format].format == GL_RED ? "#define HEIGHTMAP\n" : "") +
+        "uniform sampler2D displacement;\n"
+        "uniform float height_bias;\n"
+        "uniform float height_scale;\n"
+        "vec3 terrain(vec2 coord, float lod) {\n"
+        "#ifdef HEIGHTMAP\n"
+        "   return vec3(coord, height_bias + height_scale*textureLod(displacement, coord, lod).r);\n"
+        "#else\n"
+        "   return textureLod(displacement, coord, lod).xyz;\n"
+        "#endif\n"
+        "}\n";
+
+    // the mip level is chosen so that the texels are about as far apart
+    // as the generated vertices at this distance
     std::string tess_eval_source =
-        "#version 400\n"
+        "#version 400\n" + terrain_source +
         "uniform mat4 ViewProjection;\n"        
-        "uniform sampler2D displacement;\n"
+        "uniform vec3 ViewPosition;\n"
+        "uniform float lod_scale;\n"
         "layout(triangles, equal_spacing, cw) in;\n"
         "in vec4 tcposition[];\n"
         "out vec2 tecoord;\n"
@@ -262,22 +588,28 @@ int main()
         "   teposition += gl_TessCoord.y * tcposition[1];\n"
         "   teposition += gl_TessCoord.z * tcposition[2];\n"
         "   tecoord = teposition.xy;\n"
-        "   vec3 offset = texture(displacement, tecoord).xyz;\n"
-        "   teposition.xyz = offset;\n"
+        "   vec3 terrainpos = ViewPosition;\n"
+        "   terrainpos.z -= clamp(terrainpos.z,-0.1, 0.1);\n"
+        "   float spacing = distance(teposition.xyz, terrainpos)/lod_scale;\n"
+        "   float lod = max(0.0, log2(float(textureSize(displacement, 0).x)*spacing));\n"
+        "   teposition.xyz = terrain(tecoord, lod);\n"
         "   gl_Position = ViewProjection*teposition;\n"
         "}\n";
         
+    // the normal is computed from the neighboring texels of the mip
+    // level the fragment would sample
     std::string fragment_source =
-        "#version 400\n"
+        "#version 400\n" + terrain_source +
         "uniform vec3 ViewPosition;\n"
-        "uniform sampler2D displacement;\n"
         "in vec4 teposition;\n"
         "in vec2 tecoord;\n"
         "layout(location = 0) out vec4 FragColor;\n"
         "void main() {\n"
-        "   vec3 x = textureOffset(displacement, tecoord, ivec2(0,0)).xyz;\n"
-        "   vec3 t0 = x-textureOffset(displacement, tecoord, ivec2(1,0)).xyz;\n"
-        "   vec3 t1 = x-textureOffset(displacement, tecoord, ivec2(0,1)).xyz;\n"
+        "   float lod = textureQueryLod(displacement, tecoord).x;\n"
+        "   vec2 texel = exp2(lod)/vec2(textureSize(displacement, 0));\n"
+        "   vec3 x = terrain(tecoord, lod);\n"
+        "   vec3 t0 = x-terrain(tecoord+vec2(texel.x, 0), lod);\n"
+        "   vec3 t1 = x-terrain(tecoord+vec2(0, texel.y), lod);\n"
         "   vec3 normal = (gl_FrontFacing?1:-1)*normalize(cross(t0, t1));\n"
         "   vec3 light = normalize(vec3(2, -1, 3));\n"
         "   vec3 reflected = reflect(normalize(ViewPosition-teposition.xyz), normal);\n"
@@ -287,93 +619,43 @@ int main()
         "   FragColor = vec4(vec3(ambient + 0.5*diffuse + 0.4*specular), 1);\n"
         "}\n";
 
-    // program and shader handles
-    GLuint shader_program, vertex_shader, tess_control_shader, tess_eval_shader, fragment_shader;
-    
-    // we need these to properly pass the strings
-    const char *source;
-    int length;
-
-    // create and compiler vertex shader
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = vertex_source.c_str();
-    length = vertex_source.size();
-    glShaderSource(vertex_shader, 1, &source, &length); 
-    glCompileShader(vertex_shader);
-    if(!check_shader_compile_status(vertex_shader))
-    {
-        return 1;
-    }
-
-    // create and compiler tesselation control shader
-    tess_control_shader = glCreateShader(GL_TESS_CONTROL_SHADER);
-    source = tess_control_source.c_str();
-    length = tess_control_source.size();
-    glShaderSource(tess_control_shader, 1, &source, &length); 
-    glCompileShader(tess_control_shader);
-    if(!check_shader_compile_status(tess_control_shader))
+    // compile and link the program, see shader_program.hpp
+    ShaderProgram shader_program;
+    shader_program.add(GL_VERTEX_SHADER, vertex_source)
+                  .add(GL_TESS_CONTROL_SHADER, tess_control_source)
+                  .add(GL_TESS_EVALUATION_SHADER, tess_eval_source)
+                  .add(GL_FRAGMENT_SHADER, fragment_source);
+    if(!shader_program.link())
     {
         return 1;
     }
-    
-    // create and compiler tesselation evaluation shader
-    tess_eval_shader = glCreateShader(GL_TESS_EVALUATION_SHADER);
-    source = tess_eval_source.c_str();
-    length = tess_eval_source.size();
-    glShaderSource(tess_eval_shader, 1, &source, &length); 
-    glCompileShader(tess_eval_shader);
-    if(!check_shader_compile_status(tess_eval_shader))
-    {
-        return 1;
-    }
- 
-    // create and compiler fragment shader
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = fragment_source.c_str();
-    length = fragment_source.size();
-    glShaderSource(fragment_shader, 1, &source, &length);   
-    glCompileShader(fragment_shader);
-    if(!check_shader_compile_status(fragment_shader))
-    {
-        return 1;
-    }
-
-    // create program
-    shader_program = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, tess_control_shader);
-    glAttachShader(shader_program, tess_eval_shader);
-    glAttachShader(shader_program, fragment_shader);
-    
-    // link the program and check for errors
-    glLinkProgram(shader_program);
-    check_program_link_status(shader_program);
 
-    GLint width_Location = glGetUniformLocation(shader_program, "width");
-    GLint height_Location = glGetUniformLocation(shader_program, "height");
-    GLint ViewProjection_Location = glGetUniformLocation(shader_program, "ViewProjection");
-    GLint ViewPosition_Location = glGetUniformLocation(shader_program, "ViewPosition");
-    GLint displacement_Location = glGetUniformLocation(shader_program, "displacement");
-    GLint tess_scale_Location = glGetUniformLocation(shader_program, "tess_scale");
+    GLint ViewProjection_Location = shader_program.uniform("ViewProjection");
+    GLint ViewPosition_Location = shader_program.uniform("ViewPosition");
+    GLint displacement_Location = shader_program.uniform("displacement");
+    GLint tess_scale_Location = shader_program.uniform("tess_scale");
+    GLint lod_scale_Location = shader_program.uniform("lod_scale");
+    GLint height_bias_Location = shader_program.uniform("height_bias");
+    GLint height_scale_Location = shader_program.uniform("height_scale");
 
 
-    int terrainwidth = 1024, terrainheight = 1024;
-    std::vector<glm::vec3> displacementData(terrainwidth*terrainheight);
-    
-    glm::vec3 layernorm = glm::normalize(glm::vec3(0.1f,0.3f,1.0f));
-    glm::vec3 layerdir(0,0,1);
-    layerdir -= layernorm*glm::dot(layernorm, layerdir);
-    layerdir = glm::normalize(layerdir);
+    int terrainwidth = terrainsize, terrainheight = terrainsize;
+    const TerrainFormat &terrain_format = terrain_formats[format];
+    size_t terrain_bytes = size_t(terrain_format.bytes)*terrainwidth*terrainheight;
     
-    for(int y = 0;y<terrainheight;++y)
-        for(int x = 0;x<terrainwidth;++x)
-        {
-            glm::vec2 pos(float(x)/terrainwidth,float(y)/terrainheight);
-            glm::vec3 tmp = glm::vec3( pos, 0.15f*glm::perlin(5.0f*pos));
-            displacementData[y*terrainwidth+x] = tmp + 0.04f*layerdir*glm::perlin(glm::vec2(30.0f*glm::dot(layernorm, tmp), 0.5f));
-        }
+    // generate the rows in parallel or map them from the cache
+    unsigned long long generation_start = glwtGetNanoTime();
+    AssetKey displacement_key("11displacement");
+    displacement_key.add(terrainwidth).add(terrainheight).add(format).add(1); // bump when changing generate_displacement
+    CachedAsset displacementData;
+    bool cached = displacementData.load_or_generate(displacement_key, terrain_bytes, [&](void *data) {
+        parallel_for(terrainheight, [&](int begin, int end) {
+            generate_displacement(begin, end, terrainwidth, terrainheight, format, data);
+        });
+    });
+    std::cout << (cached ? "loaded" : "generated") << " " << terrainwidth << "x" << terrainheight << " " << terrain_format.name
+              << " terrain (" << terrain_bytes*4/3/(1024*1024) << " MB with mips) in "
+              << (glwtGetNanoTime()-generation_start)*1.e-6 << " ms" << std::endl;
 
      // texture handle
     GLuint displacement;
@@ -385,74 +667,131 @@ int main()
     glBindTexture(GL_TEXTURE_2D, displacement);
     
     // set texture parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     
-    // set texture content
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, terrainwidth, terrainheight, 0, GL_RGB, GL_FLOAT, &displacementData[0]);
-
-    // camera position and orientation
-    glm::vec3 position;
-    glm::mat4 rotation = glm::mat4(1.0f);
+    // set texture content, the rows of the 16 bit formats aren't
+    // necessarily 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, terrain_format.internal_format, terrainwidth, terrainheight, 0,
+                 terrain_format.format, terrain_format.type, displacementData.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    displacementData.close();
     
+    // the smaller levels are read by the distant patches
+    glGenerateMipmap(GL_TEXTURE_2D);
 
+    // the patches are split down to 1/128 of the terrain
+    TerrainQuadtree quadtree(7, 2.0f);
+    std::vector<TerrainPatch> patches;
+    const int max_patches = 128*128;
+    
+    // edge tessellation level of a patch of size s at distance d is
+    // about lod_scale*s/d (before rounding)
+    const float distance_lod_scale = 16.0f;
     
+    // the triangle counts are read back a few frames later so the
+    // queries never stall
+    const int query_count = 4;
+    GLuint primitive_queries[query_count];
+    glGenQueries(query_count, primitive_queries);
+    unsigned query_frame = 0;
+    GLuint triangles = 0;
+    float budget_scale = 1.0f;
+    
+    // the patches are streamed to the gpu every frame
+    StreamBuffer patch_stream;
+    patch_stream.init(GL_ARRAY_BUFFER, sizeof(TerrainPatch)*max_patches);
+    glBindVertexArray(vao);
+    glEnableVertexAttribArray(0);
+    glVertexAttribDivisor(0, 1);
+    
+    // the indirect command only changes its instance count
+    GLuint indirect_buffer;
+    glGenBuffers(1, &indirect_buffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+    DrawArraysIndirectCommand command = { 6, 0, 0, 0 };
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(command), &command, GL_DYNAMIC_DRAW);
+    
+    unsigned long long last_report = glwtGetNanoTime();
+
     glEnable(GL_DEPTH_TEST);
     
-    float t = glwtGetNanoTime()*1.e-9f;
     userdata.tesselation = true;
+    userdata.quadtree = true;
+    userdata.screen_space = false;
     userdata.move.forward = 0;
     userdata.move.right = 0;
     userdata.move.up = 0;
     userdata.move.roll = 0;
     userdata.mouse.x = 0;
     userdata.mouse.y = 0;
+    userdata.motion_time = 0;
+    
+    // the camera moves on its own thread at a fixed rate and turns on
+    // this one every frame
+    Camera initial_camera;
+    glm::mat4 rotation(1.0f);
+    int mousex = userdata.mouse.x, mousey = userdata.mouse.y;
+    unsigned long long last_frame = glwtGetNanoTime();
+    FixedStepSimulation<Camera, CameraInput> simulation;
+    simulation.start(initial_camera, std::max(1, int_option(argc, argv, "--tick-rate", 120)),
+                     [](const Camera &previous, Camera &camera, const CameraInput &input, double dt) {
+        camera = previous;
+        step_camera(camera, input, dt);
+    });
     
-    int mousex = userdata.mouse.x;
-    int mousey = userdata.mouse.y;
     while(userdata.running)
     {   
-        // calculate timestep
-        float new_t = glwtGetNanoTime()*1.e-9f;
-        float dt = new_t - t;
-        t = new_t;
+        // wait for the gpu to catch up and sleep until the frame is due
+        pacer.begin_frame();
+        bench.begin_frame();
 
         // update events
         glwtEventHandle(0);
 
-        // update mouse differential
-        int tmpx = userdata.mouse.x;
-        int tmpy = userdata.mouse.y;
-        glm::vec2 mousediff(tmpx-mousex, tmpy-mousey);
-        mousex = tmpx;
-        mousey = tmpy;
-        
-        // find up, forward and right vector
-        glm::mat3 rotation3(rotation);
-        glm::vec3 up = glm::transpose(rotation3)*glm::vec3(0.0f, 1.0f, 0.0f);
-        glm::vec3 right = glm::transpose(rotation3)*glm::vec3(1.0f, 0.0f, 0.0f);
-        glm::vec3 forward = glm::transpose(rotation3)*glm::vec3(0.0f, 0.0f,-1.0f);
-        
-        // apply mouse rotation
-        rotation = glm::rotate(rotation,  0.2f*mousediff.x, up);
-        rotation = glm::rotate(rotation,  0.2f*mousediff.y, right);
-        
-        // roll
-        rotation = glm::rotate(rotation, 180.0f*dt*userdata.move.roll, forward); 
- 
-        
-        // movement
-        position += 0.5f*dt*forward*userdata.move.forward;
-        position += 0.5f*dt*right*userdata.move.right;
-        position += 0.5f*dt*up*userdata.move.up;
+        // turn by the mouse movement since the last frame. the motion is
+        // drawn by this frame, so the latency is measured from it here
+        unsigned long long now = glwtGetNanoTime();
+        float frame_dt = (now-last_frame)*1.e-9f;
+        last_frame = now;
+        glm::vec2 mousediff(userdata.mouse.x-mousex, userdata.mouse.y-mousey);
+        mousex = userdata.mouse.x;
+        mousey = userdata.mouse.y;
+        rotate_camera(rotation, mousediff, userdata.move.roll, frame_dt);
+        pacer.input_sampled(userdata.motion_time);
+        userdata.motion_time = 0;
+
+        // hand the input to the simulation and interpolate the newest
+        // camera positions for drawing
+        CameraInput input = { userdata.move.up, userdata.move.right, userdata.move.forward, rotation };
+        simulation.set_input(input);
+        const Camera *previous_camera, *current_camera;
+        float alpha = simulation.acquire(previous_camera, current_camera);
+        glm::vec3 position = glm::mix(previous_camera->position, current_camera->position, alpha);
         
         // calculate ViewProjection matrix
         glm::mat4 Projection = glm::perspective(60.0f, float(width) / height, 0.001f, 10.f);
         glm::mat4 View = rotation*glm::translate(glm::mat4(1.0f), -position);
         glm::mat4 ViewProjection = Projection*View;
         
+        // select the patches and stream them to the instance buffer
+        profiler.push_cpu("select");
+        quadtree.select(ViewProjection, position, userdata.quadtree ? -1 : 6, patches);
+        profiler.pop();
+        
+        TerrainPatch *mapped = (TerrainPatch*)patch_stream.begin_write();
+        std::copy(patches.begin(), patches.end(), mapped);
+        GLintptr patch_offset = patch_stream.end_write();
+        glBindVertexArray(vao);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(TerrainPatch), (char*)0 + patch_offset);
+        
+        command.instanceCount = patches.size();
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(command), &command);
+        
         // clear first
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
@@ -460,9 +799,33 @@ int main()
         glBindTexture(GL_TEXTURE_2D, displacement);
         
         // use the shader program
-        glUseProgram(shader_program);
-        glUniform1ui(width_Location, 64); // 64x64 base grid without tessellation
-        glUniform1ui(height_Location, 64);
+        glUseProgram(shader_program.id());
+        
+        // the oldest query is done by now, in screen space mode the
+        // level scale follows the triangle count. the count grows with
+        // the square of the scale, the 4th root halves the correction
+        // to keep it from oscillating
+        GLuint query = primitive_queries[query_frame%query_count];
+        GLint available = 0;
+        if(query_frame >= (unsigned)query_count)
+            glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if(available)
+        {
+            glGetQueryObjectuiv(query, GL_QUERY_RESULT, &triangles);
+        }
+        if(available && userdata.screen_space)
+        {
+            float ratio = 0.9f*triangle_budget/std::max(1u, triangles);
+            budget_scale = glm::clamp(budget_scale*std::pow(ratio, 0.25f), 0.01f, 1.0f);
+        }
+        ++query_frame;
+        
+        // an edge of length l at distance d covers about
+        // l/d*Projection[1][1]*height/2 pixels
+        float lod_scale = distance_lod_scale;
+        if(userdata.screen_space)
+            lod_scale = budget_scale*Projection[1][1]*0.5f*height/edge_pixels;
+        glUniform1f(lod_scale_Location, lod_scale);
         glUniformMatrix4fv(ViewProjection_Location, 1, GL_FALSE, glm::value_ptr(ViewProjection));
         glUniform3fv(ViewPosition_Location, 1, glm::value_ptr(position));
         
@@ -473,34 +836,60 @@ int main()
         
         // set texture uniform
         glUniform1i(displacement_Location, 0);
+        glUniform1f(height_bias_Location, height_bias);
+        glUniform1f(height_scale_Location, height_scale);
         
         // draw
-        glDrawArraysInstanced(GL_PATCHES, 0, 6, 64*64);
+        profiler.push_gpu("terrain");
+        glBeginQuery(GL_PRIMITIVES_GENERATED, query);
+        glDrawArraysIndirect(GL_PATCHES, 0);
+        glEndQuery(GL_PRIMITIVES_GENERATED);
+        profiler.pop();
+        
+        // the region can be reused once the draw is done
+        patch_stream.fence();
         
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
+        // display the patch counts once per second
+        if(!bench.benchmarking() && glwtGetNanoTime()-last_report > 1000000000ull)
         {
-            userdata.running = false;       
+            std::cout << patches.size() << " patches (" << (userdata.quadtree ? "quadtree" : "grid") << "), "
+                      << quadtree.culled_count() << " culled, " << triangles << " triangles";
+            if(userdata.screen_space)
+                std::cout << " (scale " << budget_scale << ")";
+            std::cout << ", terrain " << profiler.stats("terrain").avg << " ms" << std::endl;
+            LatencyStats latency = pacer.latency();
+            if(latency.samples > 0)
+                std::cout << "mouse to gpu done " << latency.avg << " ms (max " << latency.max << "), "
+                          << pacer.frames_in_flight() << " frames in flight, swap interval " << pacer.swap_interval()
+                          << (pacer.jit_sleep() ? ", jit sleep" : "") << std::endl;
+            last_report = glwtGetNanoTime();
         }
         
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
-        glwtSwapBuffers(window);       
+        pacer.swap(window);
     }
+    
+    simulation.stop();
 
     // delete the created objects
 
     glDeleteVertexArrays(1, &vao);
-    glDetachShader(shader_program, vertex_shader);
-    glDetachShader(shader_program, tess_control_shader);
-    glDetachShader(shader_program, tess_eval_shader);
-    glDetachShader(shader_program, fragment_shader);
-    glDeleteShader(vertex_shader);
-    glDeleteShader(tess_control_shader);
-    glDeleteShader(tess_eval_shader);
-    glDeleteShader(fragment_shader);
-    glDeleteProgram(shader_program);
+    glDeleteBuffers(1, &indirect_buffer);
+    glDeleteQueries(query_count, primitive_queries);
+    patch_stream.destroy();
+    shader_program.destroy();
     
+    pacer.shutdown();
+    bench.shutdown();
+    profiler.shutdown();
+
     glwtWindowDestroy(window);
     glwtQuit();
     return 0;
@@ -3,6 +3,20 @@
  * This example solves the electromagnetic wave equation with a FDTD
  * scheme (finite difference time domain). Updates of the texture
  * representing the grid are done in place by use of image objects.
+ * Memory barriers between the passes make the image stores of one pass
+ * visible to the next one.
+ * With --compute (needs GL 4.3) a compute shader solves the same system
+ * instead. Each work group loads a tile of the grid plus a halo into
+ * shared memory, advances it by several substeps (--fuse N, default 5)
+ * without touching global memory and writes the inner tile to a second
+ * image. The two images are swapped after every dispatch.
+ * The grid doesn't have to match the window, --grid N simulates an N*N
+ * grid and a display pass scales the result to the window. --half
+ * stores the fields as RGBA16F which halves the memory traffic. The
+ * number of substeps per frame adapts to a gpu frame time of
+ * --target-ms (default 12), --substeps N uses a fixed count instead.
+ * The initial field is generated and uploaded by the texture loader,
+ * the simulation starts once it has arrived.
  * 
  * Autor: Jakob Progsch
  */
@@ -10,13 +24,39 @@
 #include <GLXW/glxw.h>
 #include <GLWT/glwt.h>
 
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "debug_output.hpp"
+#include "asset_cache.hpp"
+#include "shader_program.hpp"
+#include "gl_state.hpp"
+#include "texture_loader.hpp"
+#include "options.hpp"
+
 #include <glm/glm.hpp>
 #include <glm/gtx/noise.hpp> 
 
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
 
+#include <time.h>
+unsigned long long raw_time()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (unsigned long long)t.tv_sec * (unsigned long long)1000000000 + (unsigned long long)t.tv_nsec;
+}
+unsigned long long glwtGetNanoTime()
+{
+   static unsigned long long base = 0;
+   if(base == 0)
+      base = raw_time();
+   return raw_time() - base;
+}
 
 struct UserData {
     bool running;
@@ -41,48 +81,41 @@ static void key_callback(GLWTWindow *window, int down, int keysym, int scancode,
         ((UserData*)userdata)->running = false;
 }
 
-// helper to check and display for shader compiler errors
-bool check_shader_compile_status(GLuint obj)
-{
-    GLint status;
-    glGetShaderiv(obj, GL_COMPILE_STATUS, &status);
-    if(status == GL_FALSE)
-    {
-        GLint length;
-        glGetShaderiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetShaderInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;
-    }
-    return true;
-}
-
-// helper to check and display for shader linker error
-bool check_program_link_status(GLuint obj)
-{
-    GLint status;
-    glGetProgramiv(obj, GL_LINK_STATUS, &status);
-    if(status == GL_FALSE)
-    {
-        GLint length;
-        glGetProgramiv(obj, GL_INFO_LOG_LENGTH, &length);
-        std::vector<char> log(length);
-        glGetProgramInfoLog(obj, length, &length, &log[0]);
-        std::cerr << &log[0];
-        return false;   
-    }
-    return true;
-}
-
-int main()
+int main(int argc, char *argv[])
 {
     int width = 640;
     int height = 480;
+
+    Profiler profiler;
+    Benchmark bench(argc, argv, profiler);
+    DebugOutput debug(argc, argv, profiler);
    
     UserData userdata;
     userdata.running = true;
     
+    // the compute solver needs GL 4.3, image load/store itself is
+    // core since 4.2
+    bool compute = has_flag(argc, argv, "--compute");
+    
+    // number of substeps advanced per dispatch, this is also the width
+    // of the halo each work group loads around its tile
+    int fused = glm::clamp(int_option(argc, argv, "--fuse", 5), 1, 8);
+    
+    // simulation grid, defaults to the window size
+    int gridsize = int_option(argc, argv, "--grid", 0);
+    int gridwidth = gridsize > 0 ? glm::clamp(gridsize, 16, 16384) : width;
+    int gridheight = gridsize > 0 ? glm::clamp(gridsize, 16, 16384) : height;
+    
+    // field storage format
+    bool half = has_flag(argc, argv, "--half");
+    GLenum field_format = half ? GL_RGBA16F : GL_RGBA32F;
+    std::string field_define = std::string("#define FIELD_FORMAT ") + (half ? "rgba16f" : "rgba32f") + "\n";
+    
+    // a fixed substep count disables the adaptation, benchmark runs use
+    // one by default so their results are comparable
+    int fixed_substeps = int_option(argc, argv, "--substeps", bench.benchmarking() ? 5 : 0);
+    double target_ms = glm::clamp(int_option(argc, argv, "--target-ms", 12), 1, 1000);
+    
     GLWTConfig glwt_config;
     glwt_config.red_bits = 8;
     glwt_config.green_bits = 8;
@@ -92,9 +125,9 @@ int main()
     glwt_config.stencil_bits = 8;
     glwt_config.samples = 0;
     glwt_config.sample_buffers = 0;
-    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE;
+    glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
     glwt_config.api_version_major = 4;
-    glwt_config.api_version_minor = 0;
+    glwt_config.api_version_minor = compute ? 3 : 2;
     
     GLWTAppCallbacks app_callbacks;
     app_callbacks.error_callback = error_callback;
@@ -135,9 +168,11 @@ int main()
         return 1;
     }
     
-    glwtWindowShow(window, 1);
+    glwtWindowShow(window, bench.show_window());
     glwtMakeCurrent(window);
-    glwtSwapInterval(window, 1);
+    glwtSwapInterval(window, bench.swap_interval());
+    bench.init(width, height);
+    debug.init();
     
 
     // shader source code
@@ -155,8 +190,7 @@ int main()
         "#version 400\n"
         "uniform float dt;\n"
         "uniform ivec2 image_size;\n"
-        "uniform layout(rgba32f) coherent image2D image;\n"
-        "layout(location = 0) out vec4 FragColor;\n"
+        "uniform layout(FIELD_FORMAT) coherent image2D image;\n"
         "void main() {\n"
         "   ivec2 coords = ivec2(gl_FragCoord.xy);\n"
         "	vec4 HE = imageLoad(image, coords);\n"
@@ -167,15 +201,14 @@ int main()
         "}\n";
     
         
-    // the second fragment shader also outputs the frag color for display
-    // purposes
+    // the second fragment shader doesn't output anything either, the
+    // display pass draws the result
     std::string fragment2_source =
         "#version 400\n"
         "uniform float t;\n"
         "uniform float dt;\n"
         "uniform ivec2 image_size;\n"
-        "uniform layout(rgba32f) image2D image;\n"
-        "layout(location = 0) out vec4 FragColor;\n"
+        "uniform layout(FIELD_FORMAT) image2D image;\n"
         "void main() {\n"
         "   ivec2 coords = ivec2(gl_FragCoord.xy);\n"
 		
@@ -196,83 +229,140 @@ int main()
         "	}\n"
         
         "   imageStore(image, coords, HE);\n"
-        "   FragColor = vec4(HE.z, HE.w, -HE.z, 1);\n"
         "}\n";
-   
-    // program and shader handles
-    GLuint shader1_program, shader2_program, vertex_shader, fragment1_shader, fragment2_shader;
     
-    // we need these to properly pass the strings
-    const char *source;
-    int length;
+    // the image format is inserted after the version line
+    fragment1_source.insert(fragment1_source.find('\n')+1, field_define);
+    fragment2_source.insert(fragment2_source.find('\n')+1, field_define);
+   
+    // the programs are linked together below
+    ShaderProgram shader1_program, shader2_program, display_program, compute_program;
+    shader1_program.add(GL_VERTEX_SHADER, vertex_source).add(GL_FRAGMENT_SHADER, fragment1_source);
+    shader2_program.add(GL_VERTEX_SHADER, vertex_source).add(GL_FRAGMENT_SHADER, fragment2_source);
 
-    // create and compiler vertex shader
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    source = vertex_source.c_str();
-    length = vertex_source.size();
-    glShaderSource(vertex_shader, 1, &source, &length); 
-    glCompileShader(vertex_shader);
-    if(!check_shader_compile_status(vertex_shader))
-    {
-        return 1;
-    }
- 
-    // create and compiler fragment shader
-    fragment1_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = fragment1_source.c_str();
-    length = fragment1_source.size();
-    glShaderSource(fragment1_shader, 1, &source, &length);   
-    glCompileShader(fragment1_shader);
-    if(!check_shader_compile_status(fragment1_shader))
+    // the display shader scales the grid to the window
+    std::string display_source =
+        "#version 400\n"
+        "uniform sampler2D field;\n"
+        "uniform vec2 inv_viewport;\n"
+        "layout(location = 0) out vec4 FragColor;\n"
+        "void main() {\n"
+        "   vec4 HE = texture(field, gl_FragCoord.xy*inv_viewport);\n"
+        "   FragColor = vec4(HE.z, HE.w, -HE.z, 1);\n"
+        "}\n";
+    
+    display_program.add(GL_VERTEX_SHADER, vertex_source).add(GL_FRAGMENT_SHADER, display_source);
+    
+    // size of the tile each work group writes
+    const int tile = 16;
+    
+    if(compute)
     {
-        return 1;
+        // the shared array holds the tile plus a halo of STEPS cells on
+        // every side. each substep the H update needs the E values left
+        // and below a cell and the E update the H values right and above
+        // it, so the valid region shrinks by one cell per side and
+        // substep. after STEPS substeps exactly the inner tile is left.
+        // cells outside the image stay zero like the out of range
+        // imageLoads of the fragment shaders
+        std::string compute_source =
+            "#version 430\n"
+            "#define TILE 16\n"
+            "#define SIZE (TILE+2*STEPS)\n"
+            "layout(local_size_x = TILE, local_size_y = TILE) in;\n"
+            "layout(FIELD_FORMAT, binding = 0) readonly uniform image2D src;\n"
+            "layout(FIELD_FORMAT, binding = 1) writeonly uniform image2D dst;\n"
+            "uniform ivec2 image_size;\n"
+            "uniform float dt;\n"
+            "uniform float t;\n"
+            "uniform float tstep;\n"
+            "uniform int steps;\n"
+            "shared vec4 HE[SIZE*SIZE];\n"
+            
+            "bool inside(ivec2 c) {\n"
+            "   return all(greaterThanEqual(c, ivec2(0))) && all(lessThan(c, image_size));\n"
+            "}\n"
+            
+            "void main() {\n"
+            "   ivec2 origin = ivec2(gl_WorkGroupID.xy)*TILE - STEPS;\n"
+            "   int first = int(gl_LocalInvocationIndex);\n"
+            "   ivec2 source = image_size/2;\n"
+            
+            "   for(int i = first;i<SIZE*SIZE;i += TILE*TILE) {\n"
+            "       ivec2 c = origin + ivec2(i%SIZE, i/SIZE);\n"
+            "       HE[i] = inside(c) ? imageLoad(src, c) : vec4(0);\n"
+            "   }\n"
+            "   barrier();\n"
+            
+            "   for(int s = 0;s<steps;++s) {\n"
+            // H update, only reads E so it can be done in place
+            "       for(int i = first;i<SIZE*SIZE;i += TILE*TILE) {\n"
+            "           ivec2 p = ivec2(i%SIZE, i/SIZE);\n"
+            "           if(p.x == 0 || p.y == 0 || !inside(origin+p)) continue;\n"
+            "           float Ez = HE[i].z;\n"
+            "           float Ezdx = Ez-HE[i-1].z;\n"
+            "           float Ezdy = Ez-HE[i-SIZE].z;\n"
+            "           HE[i].xy += dt*vec2(-Ezdy, Ezdx);\n"
+            "       }\n"
+            "       barrier();\n"
+            
+            // E update, only reads H
+            "       for(int i = first;i<SIZE*SIZE;i += TILE*TILE) {\n"
+            "           ivec2 p = ivec2(i%SIZE, i/SIZE);\n"
+            "           if(p.x == SIZE-1 || p.y == SIZE-1 || !inside(origin+p)) continue;\n"
+            "           float e = 1;\n"
+            "           vec4 he = HE[i];\n"
+            "           float Hydx = HE[i+1].y-he.y;\n"
+            "           float Hxdy = HE[i+SIZE].x-he.x;\n"
+            "           he.z = he.z*(1-dt*he.w/e) + dt*(Hydx-Hxdy)/e;\n"
+            // the source is also added in the halos of the neighbouring
+            // groups since they compute the same cells
+            "           if(origin+p == source) {\n"
+            "               float ts = t+s*tstep;\n"
+            "               he.z += 30*sin(15*ts)*exp(-10*(ts-2)*(ts-2));\n"
+            "           }\n"
+            "           HE[i].z = he.z;\n"
+            "       }\n"
+            "       barrier();\n"
+            "   }\n"
+            
+            "   ivec2 p = ivec2(gl_LocalInvocationID.xy) + STEPS;\n"
+            "   if(inside(origin+p))\n"
+            "       imageStore(dst, origin+p, HE[p.y*SIZE+p.x]);\n"
+            "}\n";
+        
+        // the halo width is a compile time constant since it determines
+        // the size of the shared array
+        compute_source.insert(compute_source.find('\n')+1, "#define STEPS " + std::to_string(fused) + "\n" + field_define);
+        
+        compute_program.add(GL_COMPUTE_SHADER, compute_source);
     }
-
-    // create and compiler fragment shader
-    fragment2_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    source = fragment2_source.c_str();
-    length = fragment2_source.size();
-    glShaderSource(fragment2_shader, 1, &source, &length);   
-    glCompileShader(fragment2_shader);
-    if(!check_shader_compile_status(fragment2_shader))
+    
+    // only the programs of the selected solver are built
+    bool linked = compute ? link_programs({&display_program, &compute_program})
+                          : link_programs({&shader1_program, &shader2_program, &display_program});
+    if(!linked)
     {
         return 1;
     }
     
-    // create program
-    shader1_program = glCreateProgram();
-    
-    // attach shaders
-    glAttachShader(shader1_program, vertex_shader);
-    glAttachShader(shader1_program, fragment1_shader);
-    
-    // link the program and check for errors
-    glLinkProgram(shader1_program);
-    check_program_link_status(shader1_program);
-    
-    // get texture uniform location
-    GLint image_size_location1 = glGetUniformLocation(shader1_program, "image_size");
-    GLint image_location1 = glGetUniformLocation(shader1_program, "image");
-    GLint dt_location1 = glGetUniformLocation(shader1_program, "dt");
-
-    
-    // create program
-    shader2_program = glCreateProgram();
+    GLint image_size_location1 = shader1_program.uniform("image_size");
+    GLint image_location1 = shader1_program.uniform("image");
+    GLint dt_location1 = shader1_program.uniform("dt");
     
-    // attach shaders
-    glAttachShader(shader2_program, vertex_shader);
-    glAttachShader(shader2_program, fragment2_shader);
+    GLint image_size_location2 = shader2_program.uniform("image_size");
+    GLint image_location2 = shader2_program.uniform("image");
+    GLint t_location2 = shader2_program.uniform("t");
+    GLint dt_location2 = shader2_program.uniform("dt");
     
-    // link the program and check for errors
-    glLinkProgram(shader2_program);
-    check_program_link_status(shader2_program);
+    GLint field_location = display_program.uniform("field");
+    GLint inv_viewport_location = display_program.uniform("inv_viewport");
     
-    // get texture uniform location
-    GLint image_size_location2 = glGetUniformLocation(shader2_program, "image_size");
-    GLint image_location2 = glGetUniformLocation(shader2_program, "image");
-    GLint t_location2 = glGetUniformLocation(shader2_program, "t");
-    GLint dt_location2 = glGetUniformLocation(shader2_program, "dt");
-
+    GLint compute_image_size_location = compute_program.uniform("image_size");
+    GLint compute_dt_location = compute_program.uniform("dt");
+    GLint compute_t_location = compute_program.uniform("t");
+    GLint compute_tstep_location = compute_program.uniform("tstep");
+    GLint compute_steps_location = compute_program.uniform("steps");
     
     // vao and vbo handle
     GLuint vao, vbo, ibo;
@@ -318,125 +408,233 @@ int main()
     // "unbind" vao
     glBindVertexArray(0);
 
-    // texture handle
-    GLuint texture;
+    // the loader generates the initial field on its own thread, large
+    // grids take a while so the rows are spread over all cores
+    TextureLoader loader;
+    loader.start();
     
-    // generate texture
-    glGenTextures(1, &texture);
-
-    // bind the texture
-    glBindTexture(GL_TEXTURE_2D, texture);
-
-    // create some image data
-    std::vector<GLfloat> image(4*width*height);
-    for(int j = 0;j<height;++j)
-        for(int i = 0;i<width;++i)
+    // texture handles, the fragment shaders update the first one in
+    // place, the compute solver ping-pongs between both. the second one
+    // is always written before it is read, it only needs storage
+    GLuint textures[2];
+    int current = 0;
+    
+    textures[0] = loader.load(gridwidth, gridheight, TextureFormat::rgba_float(field_format), false, false,
+        [=](int begin, int end, void *data) {
+            GLfloat *image = (GLfloat*)data;
+            for(int j = begin;j<end;++j)
+                for(int i = 0;i<gridwidth;++i)
+                {
+                    size_t index = size_t(j)*gridwidth + i;
+                    image[4*index + 0] = 0.0f;
+                    image[4*index + 1] = 0.0f;
+                    image[4*index + 2] = 0.0f;
+                    image[4*index + 3] = 20.0f*glm::clamp(glm::perlin(0.008f*glm::vec2(i,j+70)),0.0f,0.1f);
+                }
+        });
+    textures[1] = loader.load(gridwidth, gridheight, TextureFormat::rgba_float(field_format), false, false, TextureLoader::Generator());
+    
+    for(int i = 0;i<2;++i)
+    {
+        // bind the texture
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        
+        // set texture parameters
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
+    }
+    
+    // the fragment passes need a framebuffer of the grid size. the
+    // second texture is unused by them and the color writes are masked
+    // so it's only attached to make the framebuffer complete
+    GLuint grid_fbo = 0;
+    if(!compute)
+    {
+        glGenFramebuffers(1, &grid_fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, grid_fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[1], 0);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
         {
-            size_t index = j*width + i;
-            image[4*index + 0] = 0.0f;
-            image[4*index + 1] = 0.0f;
-            image[4*index + 2] = 0.0f;
-            image[4*index + 3] = 20.0f*glm::clamp(glm::perlin(0.008f*glm::vec2(i,j+70)),0.0f,0.1f);
+            std::cerr << "grid framebuffer incomplete" << std::endl;
+            return 1;
         }
+        glBindFramebuffer(GL_FRAMEBUFFER, bench.framebuffer());
+    }
     
+    // every substep advances the simulation by the same time so the
+    // adaptation only changes how fast it runs and not its stability
+    const float tstep = 1.0f/300.0f;
+    const float step = 50*tstep;
+    double substep_rate = fixed_substeps > 0 ? fixed_substeps : 5;
     
-    // set texture parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
+    // the uniforms that don't change are set once
+    if(compute)
+    {
+        glUseProgram(compute_program.id());
+        glUniform2i(compute_image_size_location, gridwidth, gridheight);
+        glUniform1f(compute_dt_location, step);
+        glUniform1f(compute_tstep_location, tstep);
+    }
+    else
+    {
+        glUseProgram(shader1_program.id());
+        glUniform2i(image_size_location1, gridwidth, gridheight);
+        glUniform1i(image_location1, 0);
+        glUniform1f(dt_location1, step);
+        
+        glUseProgram(shader2_program.id());
+        glUniform2i(image_size_location2, gridwidth, gridheight);
+        glUniform1i(image_location2, 0);
+        glUniform1f(dt_location2, step);
+    }
+    glUseProgram(display_program.id());
+    glUniform1i(field_location, 0);
+    
+    // the fragment solver alternates two programs every substep, the
+    // state cache drops the binds that repeat between frames
+    GLState gl;
     
-    // set texture content
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, &image[0]);
+    unsigned long long last_report = glwtGetNanoTime();
     
     float t = 0;
-    float dt = 1.0f/60.0f;
     while(userdata.running)
     {   
-        t += dt;
-        
-        // reset time every 10 seconds to repeat the sequence
-        if(t>10) t -= 10;
+        bench.begin_frame();
+        gl.begin_frame();
         
         // update events
         glwtEventHandle(0);
         
-        // clear first
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        // nothing to simulate until the initial field is uploaded
+        loader.update();
+        if(!loader.ready(textures[0]))
+        {
+            glClear(GL_COLOR_BUFFER_BIT);
+            if(!bench.end_frame())
+                userdata.running = false;
+            glwtSwapBuffers(window);
+            continue;
+        }
         
         // bind the vao
-        glBindVertexArray(vao);
+        gl.bind_vertex_array(vao);
 
-        int substeps = 5;
+        int substeps = std::max(1, int(substep_rate+0.5));
         
-        glUseProgram(shader1_program);
+        profiler.push_gpu("simulate");
+        if(compute)
+        {
+            gl.use_program(compute_program.id());
             
-        glUniform2i(image_size_location1, width, height);
-        glUniform1i(image_location1, 0);
-        glUniform1f(dt_location1, 50*dt/substeps);
-
-        glUseProgram(shader2_program);
-
-        glUniform2i(image_size_location2, width, height);
-        glUniform1i(image_location2, 0);
-        glUniform1f(dt_location2, 50*dt/substeps);
-
-        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-        int i = 0;
-        for(;i<substeps-1;++i)
+            for(int i = 0;i<substeps;i += fused)
+            {
+                glBindImageTexture(0, textures[current], 0, GL_FALSE, 0, GL_READ_ONLY, field_format);
+                glBindImageTexture(1, textures[1-current], 0, GL_FALSE, 0, GL_WRITE_ONLY, field_format);
+                glUniform1f(compute_t_location, t+i*tstep);
+                glUniform1i(compute_steps_location, std::min(fused, substeps-i));
+                glDispatchCompute((gridwidth+tile-1)/tile, (gridheight+tile-1)/tile, 1);
+                
+                // the next dispatch reads what this one wrote
+                glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+                current = 1-current;
+            }
+        }
+        else
         {
-            glUseProgram(shader1_program);
+            gl.bind_framebuffer(GL_FRAMEBUFFER, grid_fbo);
+            glViewport(0, 0, gridwidth, gridheight);
+            
+            glBindImageTexture(0, textures[0], 0, GL_FALSE, 0, GL_READ_WRITE, field_format);
 
-            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+            gl.color_mask(false);
+            for(int i = 0;i<substeps;++i)
+            {
+                gl.use_program(shader1_program.id());
+
+                glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+                gl.count_draw();
+                glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+            
+                gl.use_program(shader2_program.id());
+                glUniform1f(t_location2, t+i*tstep);
             
-            glUseProgram(shader2_program);
-            glUniform1f(t_location2, t+i*dt/substeps);
+                glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+                gl.count_draw();
+                glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+            }
+            gl.color_mask(true);
             
-            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+            gl.bind_framebuffer(GL_FRAMEBUFFER, bench.framebuffer());
+            glViewport(0, 0, width, height);
         }
+        profiler.pop();
         
+        t += substeps*tstep;
         
-        glUseProgram(shader1_program);
-
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        // reset time every 10 seconds to repeat the sequence
+        if(t>10) t -= 10;
         
-        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-            
-        glUseProgram(shader2_program);
-        glUniform1f(t_location2, t+i*dt/substeps);
-            
+        // the display pass fetches the result as a texture
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        
+        profiler.push_gpu("display");
+        
+        gl.bind_texture(0, GL_TEXTURE_2D, textures[current]);
+        gl.use_program(display_program.id());
+        glUniform2f(inv_viewport_location, 1.0f/width, 1.0f/height);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-         
-        // check for errors
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
+        gl.count_draw();
+        
+        profiler.pop();
+        
+        // scale the substeps towards the target frame time. the measured
+        // times are a few frames old so the correction is damped
+        ScopeStats frame = profiler.stats("frame");
+        if(fixed_substeps <= 0 && frame.samples > 0 && frame.last > 0)
+            substep_rate = glm::clamp(substep_rate*std::pow(target_ms/frame.last, 0.25), 1.0, 256.0);
+        
+        if(!bench.benchmarking() && glwtGetNanoTime()-last_report > 1000000000ull)
         {
-            userdata.running = false;       
+            std::cout << (compute ? "compute" : "fragment") << " solver, " << gridwidth << "x" << gridheight
+                      << (half ? " rgba16f" : " rgba32f") << ", " << substeps << " substeps, simulate "
+                      << profiler.stats("simulate").avg << " ms, frame " << frame.avg << " ms" << std::endl;
+            GLState::Counters counters = gl.frame_counters();
+            std::cout << counters.draws << " draws, " << counters.issued << " state calls issued, "
+                      << counters.elided << " elided" << std::endl;
+            last_report = glwtGetNanoTime();
         }
-        
+         
+        // errors are reported by the debug output (see debug_output.hpp)
+        if(!debug.check())
+            userdata.running = false;
+
+        if(!bench.end_frame())
+            userdata.running = false;
+
         // finally swap buffers
         glwtSwapBuffers(window);       
     }
     
     // delete the created objects
     
-    glDeleteTextures(1, &texture);
+    loader.stop();
+    glDeleteTextures(2, textures);
+    if(grid_fbo != 0)
+        glDeleteFramebuffers(1, &grid_fbo);
     
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &vbo);
     glDeleteBuffers(1, &ibo);
     
-    glDetachShader(shader1_program, vertex_shader);	
-    glDetachShader(shader1_program, fragment1_shader);
-    glDetachShader(shader2_program, vertex_shader);	
-    glDetachShader(shader2_program, fragment2_shader);
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment1_shader);
-    glDeleteProgram(shader1_program);
-    glDeleteShader(fragment2_shader);
-    glDeleteProgram(shader2_program);
+    shader1_program.destroy();
+    shader2_program.destroy();
+    display_program.destroy();
+    compute_program.destroy();
+
+    bench.shutdown();
+    profiler.shutdown();
 
     glwtWindowDestroy(window);
     glwtQuit();
@@ -0,0 +1,272 @@
+/* OpenGL example code - asset cache
+ *
+ * Procedurally generated data that never changes between runs (the
+ * galaxy, the terrain displacement, the voxel world meshes) is stored
+ * in binary files keyed by a hash of the generator parameters. Later
+ * runs map the file and hand the mapped memory straight to
+ * glBufferData or glTexImage2D instead of generating the data again.
+ * parallel_for spreads the generation over all cores for the runs
+ * that don't find a cache file.
+ * The files live in the directory given by ASSET_CACHE_DIR (default
+ * "asset_cache" in the working directory). ASSET_CACHE=0 disables the
+ * cache, the data is then always generated into memory.
+ *
+ * usage:
+ *     AssetKey key("galaxy");
+ *     key.add(particles);  // everything the data depends on
+ *     CachedAsset asset;
+ *     asset.load_or_generate(key, bytes, [&](void *data) {
+ *         parallel_for(rows, [&](int begin, int end) { ... });
+ *     });
+ *     glBufferData(GL_ARRAY_BUFFER, asset.size(), asset.data(), GL_STATIC_DRAW);
+ *     asset.close();
+ */
+
+#ifndef ASSET_CACHE_HPP
+#define ASSET_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// calls f(begin, end) for disjoint ranges covering [0,count) on up to
+// threads threads, the calling thread takes the first range
+template<class F>
+void parallel_for(int count, F f, int threads = 0)
+{
+    if(threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1, std::min(threads, count));
+
+    std::vector<std::thread> workers;
+    for(int i = 1;i<threads;++i)
+        workers.push_back(std::thread(f, int((long long)count*i/threads), int((long long)count*(i+1)/threads)));
+    f(0, int((long long)count/threads));
+    for(size_t i = 0;i<workers.size();++i)
+        workers[i].join();
+}
+
+// 64 bit FNV-1a hash of the name and the parameters of a generator.
+// changing the generator code should also change one of the parameters
+// so old cache files aren't used anymore
+class AssetKey {
+public:
+    AssetKey(const char *asset_name) : name(asset_name), hash(14695981039346656037ull)
+    {
+        add_bytes(asset_name, std::strlen(asset_name));
+    }
+
+    // adds a parameter, T has to be a plain value type like int or float
+    template<class T>
+    AssetKey& add(const T &value)
+    {
+        add_bytes(&value, sizeof(T));
+        return *this;
+    }
+
+    AssetKey& add_bytes(const void *data, size_t size)
+    {
+        const unsigned char *bytes = (const unsigned char*)data;
+        for(size_t i = 0;i<size;++i)
+            hash = (hash ^ bytes[i])*1099511628211ull;
+        return *this;
+    }
+
+    // file name of the asset, the name makes them easy to tell apart
+    std::string filename() const
+    {
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", hash);
+        return name + "-" + hex + ".bin";
+    }
+
+    std::string name;
+    unsigned long long hash;
+};
+
+class CachedAsset {
+public:
+    CachedAsset() : mapped(0), mapped_bytes(0), bytes(0), writable(false), from_cache(false) { }
+    ~CachedAsset() { close(); }
+
+    // maps the cache file of key, returns false if there is none or it
+    // doesn't belong to key
+    bool open(const AssetKey &key)
+    {
+        close();
+        if(!enabled())
+            return false;
+
+        int fd = ::open(path(key).c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat info;
+        if(fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(Header))
+        {
+            ::close(fd);
+            return false;
+        }
+        void *ptr = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(ptr == MAP_FAILED)
+            return false;
+
+        const Header *header = (const Header*)ptr;
+        if(std::memcmp(header->magic, magic(), sizeof(header->magic)) != 0 || header->key != key.hash ||
+           header->bytes != size_t(info.st_size)-sizeof(Header))
+        {
+            munmap(ptr, info.st_size);
+            return false;
+        }
+
+        mapped = (char*)ptr;
+        mapped_bytes = info.st_size;
+        bytes = header->bytes;
+        writable = false;
+        from_cache = true;
+        return true;
+    }
+
+    // returns size bytes of writable memory for a new asset. the memory
+    // is a mapping of a temporary cache file if possible, commit makes
+    // it the cache file of key
+    void* create(const AssetKey &key, size_t size)
+    {
+        close();
+        bytes = size;
+        writable = true;
+        from_cache = false;
+        if(enabled())
+        {
+            make_directory();
+            temp = path(key) + ".tmp";
+            final_path = path(key);
+            int fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if(fd >= 0)
+            {
+                size_t total = sizeof(Header)+size;
+                void *ptr = MAP_FAILED;
+                if(ftruncate(fd, total) == 0)
+                    ptr = mmap(0, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if(ptr != MAP_FAILED)
+                {
+                    mapped = (char*)ptr;
+                    mapped_bytes = total;
+                    Header *header = (Header*)ptr;
+                    std::memset(header, 0, sizeof(Header));
+                    std::memcpy(header->magic, magic(), sizeof(header->magic));
+                    header->key = key.hash;
+                    header->bytes = size;
+                    return data();
+                }
+                std::remove(temp.c_str());
+            }
+            std::cerr << "asset cache: could not create " << temp << std::endl;
+            temp.clear();
+        }
+        // without a cache file the asset is just kept in memory
+        memory.assign(sizeof(Header)+size, 0);
+        return data();
+    }
+
+    // writes the asset created with create to the cache
+    void commit()
+    {
+        if(mapped != 0 && writable && !temp.empty())
+        {
+            msync(mapped, mapped_bytes, MS_SYNC);
+            if(std::rename(temp.c_str(), final_path.c_str()) != 0)
+                std::remove(temp.c_str());
+            temp.clear();
+        }
+    }
+
+    // maps the asset of key if it is cached, otherwise calls
+    // generate(void *data) to fill size bytes and caches the result.
+    // returns true if the asset came from the cache
+    template<class F>
+    bool load_or_generate(const AssetKey &key, size_t size, F generate)
+    {
+        if(open(key) && bytes == size)
+            return true;
+        generate(create(key, size));
+        commit();
+        return false;
+    }
+
+    void close()
+    {
+        if(mapped != 0)
+            munmap(mapped, mapped_bytes);
+        // a temporary file that was never committed is incomplete
+        if(!temp.empty())
+            std::remove(temp.c_str());
+        temp.clear();
+        mapped = 0;
+        mapped_bytes = 0;
+        bytes = 0;
+        from_cache = false;
+        std::vector<char>().swap(memory);
+    }
+
+    void* data()
+    {
+        if(mapped != 0)
+            return mapped + sizeof(Header);
+        return memory.empty() ? 0 : &memory[0] + sizeof(Header);
+    }
+    size_t size() const { return bytes; }
+    bool cached() const { return from_cache; }
+
+    static bool enabled()
+    {
+        const char *env = std::getenv("ASSET_CACHE");
+        return env == 0 || std::atoi(env) != 0;
+    }
+
+    static std::string directory()
+    {
+        const char *env = std::getenv("ASSET_CACHE_DIR");
+        return env && *env ? env : "asset_cache";
+    }
+
+private:
+    // the header is padded to 64 bytes so the data is aligned for any
+    // vertex or texel format
+    struct Header {
+        char magic[8];
+        unsigned long long key;
+        unsigned long long bytes;
+        char padding[40];
+    };
+
+    static const char* magic() { return "GLASSET1"; }
+
+    static std::string path(const AssetKey &key) { return directory() + "/" + key.filename(); }
+
+    static void make_directory() { mkdir(directory().c_str(), 0755); }
+
+    CachedAsset(const CachedAsset&);
+    CachedAsset& operator=(const CachedAsset&);
+
+    char *mapped;
+    size_t mapped_bytes;
+    size_t bytes;
+    bool writable;
+    bool from_cache;
+    std::string temp, final_path;
+    std::vector<char> memory;
+};
+
+#endif
@@ -0,0 +1,37 @@
+# runs the examples in benchmark mode one after another and collects
+# their summaries in OUTPUT, one json object per line. invoked by the
+# bench target:
+#     cmake -DEXAMPLES=a,b,c -DBINARY_DIR=... -DOUTPUT=... -DWARMUP=60
+#           -DFRAMES=600 -DOFFSCREEN=ON -P bench.cmake
+
+string(REPLACE "," ";" EXAMPLES "${EXAMPLES}")
+
+set(ARGS --bench --novsync --warmup ${WARMUP} --frames ${FRAMES} --bench-output ${OUTPUT})
+if(OFFSCREEN)
+    list(APPEND ARGS --offscreen)
+endif()
+
+file(REMOVE ${OUTPUT})
+
+set(FAILED "")
+foreach(EXAMPLE ${EXAMPLES})
+    message(STATUS "bench: ${EXAMPLE}")
+    execute_process(COMMAND ${BINARY_DIR}/${EXAMPLE} ${ARGS}
+        RESULT_VARIABLE RESULT
+        OUTPUT_QUIET)
+    # keep going so one broken example doesn't hide the others
+    if(NOT RESULT EQUAL 0)
+        message(WARNING "bench: ${EXAMPLE} failed (${RESULT})")
+        list(APPEND FAILED ${EXAMPLE})
+    endif()
+endforeach()
+
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} RESULTS)
+    message("${RESULTS}")
+endif()
+message(STATUS "bench: results written to ${OUTPUT}")
+
+if(FAILED)
+    message(FATAL_ERROR "bench: failed examples: ${FAILED}")
+endif()
@@ -0,0 +1,256 @@
+/* OpenGL example code - benchmark mode
+ *
+ * Shared benchmark options for the examples. Normally an example runs
+ * until it is closed with vsync on. In benchmark mode it renders a
+ * number of warmup frames followed by a fixed number of measured frames
+ * and then prints a one line JSON summary and quits.
+ *
+ * options (command line arguments override the environment variables):
+ *     --bench              run in benchmark mode (BENCH=1)
+ *     --warmup N           warmup frames, default 60 (BENCH_WARMUP)
+ *     --frames M           measured frames, default 600 (BENCH_FRAMES)
+ *     --vsync, --novsync   vsync is on by default and off in benchmark
+ *                          mode (BENCH_VSYNC=0/1)
+ *     --offscreen          don't show the window and render to an fbo
+ *                          instead, implies --bench (BENCH_OFFSCREEN=1)
+ *     --bench-output FILE  also append the summary to FILE (BENCH_OUTPUT)
+ *
+ * The summary contains the frames per second, the average cpu time
+ * spent between begin_frame and end_frame (so everything except the
+ * buffer swap) and the average gpu time of the frame measured with the
+ * profiler. The gpu p99 is taken over the last Profiler::window frames:
+ *     {"example":"05fbo_fxaa","renderer":"...","version":"...",
+ *      "frames":600,"fps":...,"frame_ms":...,"cpu_ms":...,"gpu_ms":...,
+ *      "gpu_p99_ms":...}
+ *
+ * usage:
+ *     Profiler profiler;
+ *     Benchmark bench(argc, argv, profiler);
+ *     ... create the window ...
+ *     glwtWindowShow(window, bench.show_window());
+ *     glwtMakeCurrent(window);
+ *     glwtSwapInterval(window, bench.swap_interval());
+ *     bench.init(width, height);
+ *     while(running) {
+ *         bench.begin_frame();
+ *         ... draw to bench.framebuffer() instead of 0 ...
+ *         if(!bench.end_frame())
+ *             running = false;
+ *         glwtSwapBuffers(window);
+ *     }
+ *     bench.shutdown();
+ *     profiler.shutdown();
+ */
+
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <GLXW/glxw.h>
+
+#include "profiler.hpp"
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+class Benchmark {
+public:
+    Benchmark(int argc, char *argv[], Profiler &p)
+        : profiler(p), enabled(false), vsync(-1), offscreen(false), warmup(60), frames(600),
+          frame(0), fbo(0), color_rbf(0), depth_rbf(0),
+          frame_start(0), first_start(0), last_start(0), cpu_total(0)
+    {
+        // the example name is the executable name without its path
+        name = argc > 0 ? argv[0] : "example";
+        size_t slash = name.find_last_of("/\\");
+        if(slash != std::string::npos)
+            name = name.substr(slash+1);
+
+        const char *env;
+        if((env = std::getenv("BENCH")))
+            enabled = std::atoi(env) != 0;
+        if((env = std::getenv("BENCH_WARMUP")))
+            warmup = std::atoi(env);
+        if((env = std::getenv("BENCH_FRAMES")))
+            frames = std::atoi(env);
+        if((env = std::getenv("BENCH_VSYNC")))
+            vsync = std::atoi(env) != 0;
+        if((env = std::getenv("BENCH_OFFSCREEN")))
+            offscreen = std::atoi(env) != 0;
+        if((env = std::getenv("BENCH_OUTPUT")))
+            output = env;
+
+        // unknown arguments are left to the example
+        for(int i = 1;i<argc;++i)
+        {
+            if(std::strcmp(argv[i], "--bench") == 0)
+                enabled = true;
+            else if(std::strcmp(argv[i], "--warmup") == 0 && i+1<argc)
+                warmup = std::atoi(argv[++i]);
+            else if(std::strcmp(argv[i], "--frames") == 0 && i+1<argc)
+                frames = std::atoi(argv[++i]);
+            else if(std::strcmp(argv[i], "--vsync") == 0)
+                vsync = 1;
+            else if(std::strcmp(argv[i], "--novsync") == 0)
+                vsync = 0;
+            else if(std::strcmp(argv[i], "--offscreen") == 0)
+                offscreen = true;
+            else if(std::strcmp(argv[i], "--bench-output") == 0 && i+1<argc)
+                output = argv[++i];
+        }
+
+        // a hidden window can't be closed, so always stop on our own
+        if(offscreen)
+            enabled = true;
+        if(vsync < 0)
+            vsync = enabled ? 0 : 1;
+        if(warmup < 0)
+            warmup = 0;
+        if(frames < 2)
+            frames = 2;
+    }
+
+    bool benchmarking() const { return enabled; }
+    int show_window() const { return offscreen ? 0 : 1; }
+    int swap_interval() const { return vsync; }
+
+    // framebuffer the example should render its final image to
+    GLuint framebuffer() const { return fbo; }
+
+    // creates the offscreen framebuffer if needed and binds it,
+    // has to be called once the context is current
+    void init(int width, int height)
+    {
+        if(!offscreen)
+            return;
+
+        glGenRenderbuffers(1, &color_rbf);
+        glBindRenderbuffer(GL_RENDERBUFFER, color_rbf);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+        glGenRenderbuffers(1, &depth_rbf);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth_rbf);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_rbf);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth_rbf);
+
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "bench: offscreen framebuffer is incomplete" << std::endl;
+    }
+
+    void begin_frame()
+    {
+        // start measuring with the first frame after the warmup. waiting
+        // for the warmup frames still in flight keeps them out of the
+        // gpu times
+        if(enabled && frame == (unsigned)warmup)
+        {
+            profiler.flush();
+            profiler.reset();
+            cpu_total = 0;
+        }
+
+        frame_start = glwtGetNanoTime();
+        if(frame == (unsigned)warmup)
+            first_start = frame_start;
+        last_start = frame_start;
+
+        profiler.begin_frame();
+        profiler.push_gpu("frame");
+    }
+
+    // returns false once all measured frames are done
+    bool end_frame()
+    {
+        profiler.pop();
+        profiler.end_frame();
+
+        if(frame >= (unsigned)warmup)
+            cpu_total += glwtGetNanoTime() - frame_start;
+        ++frame;
+
+        if(!enabled || frame < (unsigned)(warmup + frames))
+            return true;
+
+        profiler.flush();
+        report();
+        return false;
+    }
+
+    void shutdown()
+    {
+        if(fbo != 0)
+        {
+            glDeleteFramebuffers(1, &fbo);
+            glDeleteRenderbuffers(1, &color_rbf);
+            glDeleteRenderbuffers(1, &depth_rbf);
+            fbo = 0;
+        }
+    }
+
+private:
+    // escapes a string for use in the json summary
+    static std::string quote(const char *str)
+    {
+        std::string result = "\"";
+        for(;str && *str;++str)
+        {
+            if(*str == '"' || *str == '\\')
+                result += '\\';
+            if((unsigned char)*str >= 32)
+                result += *str;
+        }
+        return result + "\"";
+    }
+
+    void report()
+    {
+        // the swap of the last frame isn't part of the measurement, so
+        // the frame time is taken between the starts of the frames
+        double frame_ms = (last_start - first_start)*1.e-6/(frames-1);
+        ScopeStats gpu = profiler.stats("frame");
+
+        std::ostringstream line;
+        line.setf(std::ios::fixed);
+        line.precision(4);
+        line << "{\"example\":" << quote(name.c_str())
+             << ",\"renderer\":" << quote((const char*)glGetString(GL_RENDERER))
+             << ",\"version\":" << quote((const char*)glGetString(GL_VERSION))
+             << ",\"frames\":" << frames
+             << ",\"fps\":" << (frame_ms > 0 ? 1000.0/frame_ms : 0.0)
+             << ",\"frame_ms\":" << frame_ms
+             << ",\"cpu_ms\":" << cpu_total*1.e-6/frames
+             << ",\"gpu_ms\":" << gpu.mean
+             << ",\"gpu_p99_ms\":" << gpu.p99 << "}";
+
+        std::cout << line.str() << std::endl;
+        if(!output.empty())
+        {
+            std::ofstream file(output.c_str(), std::ios::app);
+            if(file)
+                file << line.str() << "\n";
+            else
+                std::cerr << "bench: could not open " << output << std::endl;
+        }
+    }
+
+    Profiler &profiler;
+    std::string name;
+    std::string output;
+    bool enabled;
+    int vsync;
+    bool offscreen;
+    int warmup, frames;
+
+    unsigned frame;
+    GLuint fbo, color_rbf, depth_rbf;
+    unsigned long long frame_start, first_start, last_start, cpu_total;
+};
+
+#endif
@@ -0,0 +1,157 @@
+/* OpenGL example code - debug output
+ *
+ * Replaces the glGetError call every example made after each frame.
+ * Reading the error flag can make the driver synchronize with its
+ * worker thread, and all it says is that something failed somewhere.
+ * With debug output the driver instead reports errors and performance
+ * warnings (buffer stalls, shader recompiles, redundant state changes
+ * and whatever else it detects) through a KHR_debug callback. The
+ * output is synchronous so the callback runs inside the GL call that
+ * caused the message, which means the innermost open profiler scope is
+ * the one to blame. Warnings are printed once per message id with that
+ * scope and every occurrence is added to the profiler output as a mark.
+ * An error stops the example like glGetError did.
+ * The callback is only compiled in if the build is configured with
+ * -DDEBUG_OUTPUT=ON and is only enabled with --gl-debug (GL_DEBUG=1),
+ * which also requests a debug context. Otherwise check() just reads
+ * the error flag once every poll_interval frames.
+ *
+ * usage:
+ *     Profiler profiler;
+ *     DebugOutput debug(argc, argv, profiler);
+ *     glwt_config.api = GLWT_API_OPENGL | GLWT_PROFILE_CORE | debug.context_flags();
+ *     ... create the window and make it current ...
+ *     debug.init();
+ *     while(running) {
+ *         ... draw ...
+ *         if(!debug.check())
+ *             running = false;
+ *     }
+ */
+
+#ifndef DEBUG_OUTPUT_HPP
+#define DEBUG_OUTPUT_HPP
+
+#include <GLXW/glxw.h>
+#include <GLWT/glwt.h>
+
+#include "profiler.hpp"
+#include "gl_support.hpp"
+
+#include <string>
+#include <map>
+#include <set>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+class DebugOutput {
+public:
+    // frames between two reads of the error flag without debug output
+    static const unsigned poll_interval = 64;
+
+    DebugOutput(int argc, char *argv[], Profiler &p)
+        : profiler(p), requested(false), active(false), failed(false), frame(0), warnings(0)
+    {
+        const char *env = std::getenv("GL_DEBUG");
+        if(env)
+            requested = std::atoi(env) != 0;
+        for(int i = 1;i<argc;++i)
+            if(std::strcmp(argv[i], "--gl-debug") == 0)
+                requested = true;
+#ifndef EXAMPLES_DEBUG_OUTPUT
+        if(requested)
+            std::cerr << "debug output is not compiled in, configure with -DDEBUG_OUTPUT=ON" << std::endl;
+        requested = false;
+#endif
+    }
+
+    // flags to add to GLWTConfig::api
+    int context_flags() const { return requested ? GLWT_PROFILE_DEBUG : 0; }
+
+    // installs the callback, has to be called once the context is current
+    void init()
+    {
+#ifdef EXAMPLES_DEBUG_OUTPUT
+        if(!requested)
+            return;
+        if(!version_at_least(4, 3) && !has_extension("GL_KHR_debug"))
+        {
+            std::cerr << "debug output: KHR_debug is not supported, reading the error flag instead" << std::endl;
+            return;
+        }
+        glEnable(GL_DEBUG_OUTPUT);
+        glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+        glDebugMessageCallback(callback, this);
+        // notifications are mostly chatter about where buffers live
+        glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, 0, GL_FALSE);
+        active = true;
+#endif
+    }
+
+    // call once per frame, returns false if an error was reported
+    bool check()
+    {
+        ++frame;
+        if(active)
+            return !failed;
+        if(frame%poll_interval != 0)
+            return true;
+        return glGetError() == GL_NO_ERROR;
+    }
+
+    bool enabled() const { return active; }
+
+    // warnings reported so far, counted per scope
+    unsigned long long warning_count() const { return warnings; }
+    const std::map<std::string, unsigned long long>& scope_warnings() const { return per_scope; }
+
+private:
+#ifdef EXAMPLES_DEBUG_OUTPUT
+    static void APIENTRY callback(GLenum source, GLenum type, GLuint id, GLenum severity,
+                                  GLsizei length, const GLchar *message, const void *user)
+    {
+        (void)source; (void)severity;
+        ((DebugOutput*)user)->report(type, id, std::string(message, length < 0 ? std::strlen(message) : length));
+    }
+
+    void report(GLenum type, GLuint id, const std::string &message)
+    {
+        const char *current = profiler.current_scope();
+        std::string scope = current ? current : "outside of any scope";
+        if(type == GL_DEBUG_TYPE_ERROR)
+        {
+            std::cerr << "gl error in " << scope << ": " << message << std::endl;
+            failed = true;
+            return;
+        }
+        ++warnings;
+        ++per_scope[scope];
+        profiler.mark(message);
+        if(reported.insert(id).second)
+            std::cerr << "gl " << type_name(type) << " in " << scope << ": " << message << std::endl;
+    }
+
+    static const char* type_name(GLenum type)
+    {
+        switch(type)
+        {
+            case GL_DEBUG_TYPE_PERFORMANCE: return "performance warning";
+            case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated behavior";
+            case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR: return "undefined behavior";
+            case GL_DEBUG_TYPE_PORTABILITY: return "portability warning";
+            default: return "message";
+        }
+    }
+
+    std::set<GLuint> reported;
+#endif
+
+    Profiler &profiler;
+    bool requested, active, failed;
+    unsigned frame;
+    unsigned long long warnings;
+    std::map<std::string, unsigned long long> per_scope;
+};
+
+#endif
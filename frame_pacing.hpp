@@ -0,0 +1,280 @@
+/* OpenGL example code - frame pacing
+ *
+ * Keeps the CPU from queueing frames far ahead of the GPU, which is
+ * where most of the input lag of an interactive example comes from
+ * once the GPU is the bottleneck. After every swap a fence is inserted,
+ * before the next frame starts the fence of the frame max_frames frames
+ * back is waited for.
+ * With vsync on the pacer can sleep at the start of a frame so the
+ * input is sampled as late as possible: the next swap is expected one
+ * refresh after the last one and the frame starts just early enough to
+ * make it, judged by how long the recent frames took.
+ * Adaptive vsync (swap interval -1) syncs to the refresh when the frame
+ * is on time and tears instead of dropping to half the rate when it's
+ * late. It needs the swap_control_tear extension of the window system,
+ * without it the interval falls back to 1.
+ * The latency is measured from the oldest input event a frame consumed
+ * to a GL_TIMESTAMP query placed after its swap, which is when the GPU
+ * is done with the frame. Scanout comes after that and can't be seen
+ * from GL, so the real latency is up to one refresh higher.
+ *
+ * options:
+ *     --max-frames-in-flight N  frames the CPU may be ahead, 0 leaves it to
+ *                               the driver (default)
+ *     --adaptive-vsync          swap interval -1 instead of 1
+ *     --jit-sleep               sleep before sampling input
+ *     --low-latency             all of the above with one frame in flight
+ *
+ * usage:
+ *     FramePacer pacer(argc, argv);
+ *     ... create the window and make it current ...
+ *     pacer.init(window, bench.swap_interval());
+ *     while(running) {
+ *         pacer.begin_frame();
+ *         bench.begin_frame();
+ *         glwtEventHandle(0);
+ *         pacer.input_sampled(oldest_event_time);
+ *         ... draw ...
+ *         bench.end_frame();
+ *         pacer.swap(window);
+ *     }
+ *     pacer.shutdown();
+ */
+
+#ifndef FRAME_PACING_HPP
+#define FRAME_PACING_HPP
+
+#include <GLXW/glxw.h>
+#include <GLWT/glwt.h>
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+// defined by every example
+unsigned long long glwtGetNanoTime();
+
+// latencies of the last FramePacer::window frames in milliseconds
+struct LatencyStats {
+    double avg, max;
+    int samples;
+};
+
+class FramePacer {
+public:
+    static const int window = 120;
+
+    FramePacer(int argc, char *argv[])
+        : max_frames(0), adaptive(false), jit(false), interval(0),
+          input_time(0), last_swap(0), period(0), work(0), frame_start(0),
+          clock_offset(0), last_calibration(0)
+    {
+        for(int i = 1;i<argc;++i)
+        {
+            if(std::strcmp(argv[i], "--max-frames-in-flight") == 0 && i+1<argc)
+                max_frames = std::max(0, std::atoi(argv[++i]));
+            else if(std::strcmp(argv[i], "--adaptive-vsync") == 0)
+                adaptive = true;
+            else if(std::strcmp(argv[i], "--jit-sleep") == 0)
+                jit = true;
+            else if(std::strcmp(argv[i], "--low-latency") == 0)
+            {
+                max_frames = 1;
+                adaptive = true;
+                jit = true;
+            }
+        }
+    }
+
+    // sets the swap interval, vsync is the interval the example would
+    // use otherwise. has to be called once the context is current
+    void init(GLWTWindow *win, int vsync)
+    {
+        interval = vsync;
+        if(vsync != 0 && adaptive)
+        {
+            // glwtSwapInterval returns non zero if the interval is rejected
+            if(glwtSwapInterval(win, -1) == 0)
+                interval = -1;
+            else
+                adaptive = false;
+        }
+        if(interval != -1)
+            glwtSwapInterval(win, interval);
+        calibrate();
+    }
+
+    // waits until no more than max_frames frames are queued and sleeps
+    // until the frame has to start, call it before polling events
+    void begin_frame()
+    {
+        while(max_frames > 0 && fences.size() >= (size_t)max_frames)
+        {
+            // flush on the first try so the fence is guaranteed to signal
+            GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+            for(;;)
+            {
+                GLenum result = glClientWaitSync(fences.front(), flags, 1000000);
+                if(result != GL_TIMEOUT_EXPIRED)
+                    break;
+                flags = 0;
+            }
+            glDeleteSync(fences.front());
+            fences.pop_front();
+        }
+
+        if(jit && interval != 0 && period > 0 && last_swap != 0)
+        {
+            // leave the frame some headroom over its recent average
+            unsigned long long margin = 1500000ull + work/4;
+            unsigned long long start = last_swap + period;
+            if(start > work + margin)
+            {
+                start -= work + margin;
+                unsigned long long now = glwtGetNanoTime();
+                if(start > now)
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(start-now));
+            }
+        }
+        frame_start = glwtGetNanoTime();
+        input_time = 0;
+    }
+
+    // time of the oldest input event the frame consumed, in
+    // glwtGetNanoTime units. 0 if there was none. only pass events whose
+    // effect this frame draws, input a simulation thread picks up later
+    // would be measured too short
+    void input_sampled(unsigned long long event_time)
+    {
+        if(event_time != 0 && (input_time == 0 || event_time < input_time))
+            input_time = event_time;
+    }
+
+    // swaps the buffers and places the fence and latency query behind it
+    void swap(GLWTWindow *win)
+    {
+        unsigned long long before = glwtGetNanoTime();
+        glwtSwapBuffers(win);
+        unsigned long long after = glwtGetNanoTime();
+
+        // smoothed estimates of the refresh period and the frame's work
+        if(last_swap != 0)
+            period = period == 0 ? after-last_swap : (7*period + (after-last_swap))/8;
+        work = work == 0 ? before-frame_start : (7*work + (before-frame_start))/8;
+        last_swap = after;
+
+        if(max_frames > 0)
+            fences.push_back(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+
+        if(input_time != 0)
+        {
+            Pending pending = { next_query(), input_time };
+            glQueryCounter(pending.query, GL_TIMESTAMP);
+            queries.push_back(pending);
+        }
+        read_queries();
+
+        // the gpu and cpu clocks drift apart, so calibrate now and then
+        if(after - last_calibration > 1000000000ull)
+            calibrate();
+    }
+
+    LatencyStats latency() const
+    {
+        LatencyStats stats = { 0.0, 0.0, (int)samples.size() };
+        for(size_t i = 0;i<samples.size();++i)
+        {
+            stats.avg += samples[i];
+            stats.max = std::max(stats.max, samples[i]);
+        }
+        if(!samples.empty())
+            stats.avg /= samples.size();
+        return stats;
+    }
+
+    int frames_in_flight() const { return max_frames; }
+    int swap_interval() const { return interval; }
+    bool jit_sleep() const { return jit; }
+
+    void shutdown()
+    {
+        for(size_t i = 0;i<fences.size();++i)
+            glDeleteSync(fences[i]);
+        fences.clear();
+        for(size_t i = 0;i<queries.size();++i)
+            free_queries.push_back(queries[i].query);
+        queries.clear();
+        if(!free_queries.empty())
+            glDeleteQueries(free_queries.size(), &free_queries[0]);
+        free_queries.clear();
+    }
+
+private:
+    struct Pending {
+        GLuint query;
+        unsigned long long input_time;
+    };
+
+    GLuint next_query()
+    {
+        GLuint query;
+        if(free_queries.empty())
+            glGenQueries(1, &query);
+        else
+        {
+            query = free_queries.back();
+            free_queries.pop_back();
+        }
+        return query;
+    }
+
+    // collects the finished queries without waiting for any
+    void read_queries()
+    {
+        while(!queries.empty())
+        {
+            GLint available = 0;
+            glGetQueryObjectiv(queries.front().query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if(!available)
+                break;
+            GLuint64 timestamp = 0;
+            glGetQueryObjectui64v(queries.front().query, GL_QUERY_RESULT, &timestamp);
+            long long done = (long long)timestamp + clock_offset;
+            double ms = (done - (long long)queries.front().input_time)*1.e-6;
+            samples.push_back(std::max(0.0, ms));
+            if(samples.size() > (size_t)window)
+                samples.pop_front();
+            free_queries.push_back(queries.front().query);
+            queries.pop_front();
+        }
+    }
+
+    // offset that turns gpu timestamps into glwtGetNanoTime values
+    void calibrate()
+    {
+        GLint64 gpu = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpu);
+        last_calibration = glwtGetNanoTime();
+        clock_offset = (long long)last_calibration - (long long)gpu;
+    }
+
+    int max_frames;
+    bool adaptive, jit;
+    int interval;
+
+    unsigned long long input_time;
+    unsigned long long last_swap, period, work, frame_start;
+    long long clock_offset;
+    unsigned long long last_calibration;
+
+    std::deque<GLsync> fences;
+    std::deque<Pending> queries;
+    std::vector<GLuint> free_queries;
+    std::deque<double> samples;
+};
+
+#endif
@@ -0,0 +1,175 @@
+/* OpenGL example code - frame scheduler
+ *
+ * Runs a simulation on its own thread at a fixed tick rate, independent
+ * of how fast frames are rendered. An expensive frame doesn't slow the
+ * simulation down and a fast one doesn't speed it up.
+ * The render thread hands the latest input to the simulation with
+ * set_input. After every tick the simulation publishes the state before
+ * and after the tick through a triple buffer, so neither thread ever
+ * waits for the other to finish copying. The render thread interpolates
+ * between the two states of the newest tick, which shows the simulation
+ * one tick behind but without the stutter of drawing whole ticks.
+ * The step function writes the state after the tick into next, reading
+ * the one before from previous. The states are written in place in the
+ * triple buffer, each tick copies the state just once (the published
+ * previous state), so keep State to what drawing needs and leave the
+ * rest of the simulation in the step function. The step function runs
+ * on the simulation thread and must not call GL.
+ *
+ * usage:
+ *     FixedStepSimulation<State, Input> simulation;
+ *     simulation.start(initial_state, 120.0, [](const State &previous, State &next, const Input &input, double dt) { ... });
+ *     while(running) {
+ *         glwtEventHandle(0);
+ *         simulation.set_input(input);
+ *         const State *previous, *current;
+ *         float alpha = simulation.acquire(previous, current);
+ *         ... draw a mix of *previous and *current ...
+ *     }
+ *     simulation.stop();
+ */
+
+#ifndef FRAME_SCHEDULER_HPP
+#define FRAME_SCHEDULER_HPP
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+template<class State, class Input>
+class FixedStepSimulation {
+public:
+    typedef std::function<void(const State &previous, State &next, const Input &input, double dt)> StepFunction;
+    typedef std::chrono::steady_clock Clock;
+
+    FixedStepSimulation() : running(false), tick_count(0), dropped_count(0), input(), back(0), ready(1), front(2), fresh(false) { }
+    ~FixedStepSimulation() { stop(); }
+
+    // starts ticking rate times per second from state
+    void start(const State &state, double rate, StepFunction step_function)
+    {
+        stop();
+        step = step_function;
+        tick = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0/rate));
+        Clock::time_point now = Clock::now();
+        for(int i = 0;i<3;++i)
+        {
+            slots[i].previous = state;
+            slots[i].current = state;
+            slots[i].time = now;
+        }
+        fresh = false;
+        tick_count = 0;
+        dropped_count = 0;
+        running = true;
+        thread = std::thread(&FixedStepSimulation::run, this, state, now);
+    }
+
+    void stop()
+    {
+        running = false;
+        if(thread.joinable())
+            thread.join();
+    }
+
+    // the simulation uses the latest input at its next tick
+    void set_input(const Input &new_input)
+    {
+        std::lock_guard<std::mutex> lock(input_mutex);
+        input = new_input;
+    }
+
+    // sets previous and current to the states around the newest tick
+    // and returns how far to interpolate between them. the pointers stay
+    // valid until the next call
+    float acquire(const State *&previous, const State *&current)
+    {
+        {
+            std::lock_guard<std::mutex> lock(slot_mutex);
+            if(fresh)
+            {
+                std::swap(front, ready);
+                fresh = false;
+            }
+        }
+        const Slot &slot = slots[front];
+        previous = &slot.previous;
+        current = &slot.current;
+        double alpha = std::chrono::duration<double>(Clock::now()-slot.time).count()/std::chrono::duration<double>(tick).count();
+        return float(std::max(0.0, std::min(1.0, alpha)));
+    }
+
+    // seconds per tick
+    double dt() const { return std::chrono::duration<double>(tick).count(); }
+
+    // ticks done so far and ticks skipped because a step took too long
+    unsigned long long ticks() const { return tick_count; }
+    unsigned long long dropped() const { return dropped_count; }
+
+private:
+    struct Slot {
+        State previous, current;
+        Clock::time_point time;
+    };
+
+    void run(State state, Clock::time_point next)
+    {
+        double seconds = dt();
+        // the newest state, after the first tick it is the current state
+        // of the slot published last. the simulation never writes that
+        // slot before it has published another one
+        const State *last = &state;
+        while(running)
+        {
+            next += tick;
+            std::this_thread::sleep_until(next);
+
+            Input current_input;
+            {
+                std::lock_guard<std::mutex> lock(input_mutex);
+                current_input = input;
+            }
+
+            // the back slot is only touched by this thread
+            Slot &slot = slots[back];
+            slot.previous = *last;
+            step(slot.previous, slot.current, current_input, seconds);
+            slot.time = next;
+            last = &slot.current;
+            ++tick_count;
+            {
+                std::lock_guard<std::mutex> lock(slot_mutex);
+                std::swap(back, ready);
+                fresh = true;
+            }
+
+            // a slow step is caught up with by ticking without sleeping,
+            // if it is more than five ticks behind the missed time is dropped
+            Clock::time_point now = Clock::now();
+            if(now-next > 5*tick)
+            {
+                dropped_count += (now-next)/tick;
+                next = now;
+            }
+        }
+    }
+
+    StepFunction step;
+    Clock::duration tick;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<unsigned long long> tick_count, dropped_count;
+
+    std::mutex input_mutex;
+    Input input;
+
+    std::mutex slot_mutex;
+    Slot slots[3];
+    int back, ready, front;
+    bool fresh;
+};
+
+#endif
@@ -0,0 +1,426 @@
+/* OpenGL example code - state cache and command bucket
+ *
+ * GLState remembers the bindings and render state it has set and skips
+ * calls that wouldn't change anything. Every call counts as issued or
+ * elided, the counters of the last frame show how much was saved.
+ * State changed without going through GLState (by other helpers or
+ * direct GL calls) isn't seen by the cache, call invalidate() after such
+ * code so the next calls are issued again.
+ * The cache is kept in flat arrays indexed by target, binding point,
+ * texture unit and capability. Targets, units and capabilities outside
+ * of them are simply not cached, those calls are always issued.
+ * CommandBucket records draws together with the state they need and
+ * submits them sorted by layer, program and vertex array, so draws that
+ * share state run back to back. Layers keep an order where it matters
+ * (for example occlusion queries before the draws they control). The
+ * draws are plain parameters, recording one doesn't allocate once the
+ * bucket has grown to the size of a frame. The sort only saves binds if
+ * the draws share vertex arrays, so draw many objects from one buffer
+ * with a base vertex each instead of giving each its own vertex array.
+ *
+ * usage:
+ *     GLState gl;
+ *     CommandBucket bucket;
+ *     while(running) {
+ *         gl.begin_frame();
+ *         DrawState state(program, vao);
+ *         DrawCommand draw(GL_TRIANGLES, count);
+ *         draw.index_type = GL_UNSIGNED_INT;
+ *         draw.base_vertex = first_vertex;
+ *         bucket.add(0, state, draw);
+ *         bucket.submit(gl);
+ *         GLState::Counters counters = gl.frame_counters();
+ *     }
+ */
+
+#ifndef GL_STATE_HPP
+#define GL_STATE_HPP
+
+#include <GLXW/glxw.h>
+
+#include <vector>
+#include <algorithm>
+
+class GLState {
+public:
+    struct Counters {
+        unsigned issued, elided, draws;
+    };
+
+    GLState() : program(unknown), vertex_array(unknown), read_framebuffer(unknown), draw_framebuffer(unknown),
+                active_unit(unknown), depth_write(-1), color_write(-1)
+    {
+        current.issued = current.elided = current.draws = 0;
+        last = current;
+        invalidate();
+    }
+
+    // forgets everything, the following calls are issued again
+    void invalidate()
+    {
+        program = vertex_array = unknown;
+        read_framebuffer = draw_framebuffer = unknown;
+        active_unit = unknown;
+        depth_write = color_write = -1;
+        std::fill(buffers, buffers+buffer_targets, GLuint(unknown));
+        Range none = { unknown, 0, 0 };
+        std::fill(&indexed_buffers[0][0], &indexed_buffers[0][0]+indexed_targets*indexed_bindings, none);
+        std::fill(&textures[0][0], &textures[0][0]+texture_units*texture_targets, GLuint(unknown));
+        std::fill(capabilities, capabilities+capability_count, -1);
+    }
+
+    // keeps the counters of the finished frame and starts new ones
+    void begin_frame()
+    {
+        last = current;
+        current.issued = current.elided = current.draws = 0;
+    }
+
+    Counters frame_counters() const { return last; }
+
+    // counts draw calls issued by the caller
+    void count_draw() { ++current.draws; }
+
+    void use_program(GLuint name)
+    {
+        if(changed(program, name))
+            glUseProgram(name);
+    }
+
+    // binding a vertex array also changes the element array binding,
+    // which is why GL_ELEMENT_ARRAY_BUFFER isn't cached by bind_buffer
+    void bind_vertex_array(GLuint name)
+    {
+        if(changed(vertex_array, name))
+            glBindVertexArray(name);
+    }
+
+    void bind_buffer(GLenum target, GLuint name)
+    {
+        int t = buffer_target(target);
+        if(t < 0)
+        {
+            ++current.issued;
+            glBindBuffer(target, name);
+            return;
+        }
+        if(changed(buffers[t], name))
+            glBindBuffer(target, name);
+    }
+
+    // glBindBufferBase and glBindBufferRange also bind the generic
+    // target, the cache follows that
+    void bind_buffer_base(GLenum target, GLuint index, GLuint name)
+    {
+        bind_buffer_range(target, index, name, 0, -1);
+    }
+
+    void bind_buffer_range(GLenum target, GLuint index, GLuint name, GLintptr offset, GLsizeiptr size)
+    {
+        int t = indexed_target(target);
+        if(t >= 0 && index < GLuint(indexed_bindings))
+        {
+            Range &cached = indexed_buffers[t][index];
+            if(cached.name == name && cached.offset == offset && cached.size == size)
+            {
+                ++current.elided;
+                return;
+            }
+            Range range = { name, offset, size };
+            cached = range;
+        }
+        ++current.issued;
+        int generic = buffer_target(target);
+        if(generic >= 0)
+            buffers[generic] = name;
+        if(size < 0)
+            glBindBufferBase(target, index, name);
+        else
+            glBindBufferRange(target, index, name, offset, size);
+    }
+
+    void bind_framebuffer(GLenum target, GLuint name)
+    {
+        bool read = target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER;
+        bool draw = target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER;
+        if((!read || read_framebuffer == name) && (!draw || draw_framebuffer == name))
+        {
+            ++current.elided;
+            return;
+        }
+        ++current.issued;
+        if(read)
+            read_framebuffer = name;
+        if(draw)
+            draw_framebuffer = name;
+        glBindFramebuffer(target, name);
+    }
+
+    void bind_texture(GLuint unit, GLenum target, GLuint name)
+    {
+        int t = texture_target(target);
+        bool cached = t >= 0 && unit < GLuint(texture_units);
+        if(cached && textures[unit][t] == name)
+        {
+            ++current.elided;
+            return;
+        }
+        if(changed(active_unit, unit))
+            glActiveTexture(GL_TEXTURE0+unit);
+        ++current.issued;
+        if(cached)
+            textures[unit][t] = name;
+        glBindTexture(target, name);
+    }
+
+    void set_capability(GLenum capability, bool enabled)
+    {
+        int c = capability_index(capability);
+        if(c >= 0 && capabilities[c] == (enabled ? 1 : 0))
+        {
+            ++current.elided;
+            return;
+        }
+        ++current.issued;
+        if(c >= 0)
+            capabilities[c] = enabled ? 1 : 0;
+        if(enabled)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+
+    void depth_mask(bool enabled)
+    {
+        if(changed(depth_write, enabled ? 1 : 0))
+            glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+    }
+
+    // all four channels at once, that is all the examples need
+    void color_mask(bool enabled)
+    {
+        GLboolean value = enabled ? GL_TRUE : GL_FALSE;
+        if(changed(color_write, enabled ? 1 : 0))
+            glColorMask(value, value, value, value);
+    }
+
+private:
+    static const GLuint unknown = 0xFFFFFFFFu;
+    static const int buffer_targets = 12;
+    static const int indexed_targets = 4;
+    static const int indexed_bindings = 16;
+    static const int texture_units = 16;
+    static const int texture_targets = 9;
+    static const int capability_count = 12;
+
+    static int buffer_target(GLenum target)
+    {
+        switch(target)
+        {
+        case GL_ARRAY_BUFFER: return 0;
+        case GL_COPY_READ_BUFFER: return 1;
+        case GL_COPY_WRITE_BUFFER: return 2;
+        case GL_DRAW_INDIRECT_BUFFER: return 3;
+        case GL_DISPATCH_INDIRECT_BUFFER: return 4;
+        case GL_PIXEL_PACK_BUFFER: return 5;
+        case GL_PIXEL_UNPACK_BUFFER: return 6;
+        case GL_TEXTURE_BUFFER: return 7;
+        case GL_UNIFORM_BUFFER: return 8;
+        case GL_SHADER_STORAGE_BUFFER: return 9;
+        case GL_TRANSFORM_FEEDBACK_BUFFER: return 10;
+        case GL_ATOMIC_COUNTER_BUFFER: return 11;
+        default: return -1;
+        }
+    }
+
+    static int indexed_target(GLenum target)
+    {
+        switch(target)
+        {
+        case GL_UNIFORM_BUFFER: return 0;
+        case GL_SHADER_STORAGE_BUFFER: return 1;
+        case GL_TRANSFORM_FEEDBACK_BUFFER: return 2;
+        case GL_ATOMIC_COUNTER_BUFFER: return 3;
+        default: return -1;
+        }
+    }
+
+    static int texture_target(GLenum target)
+    {
+        switch(target)
+        {
+        case GL_TEXTURE_1D: return 0;
+        case GL_TEXTURE_2D: return 1;
+        case GL_TEXTURE_3D: return 2;
+        case GL_TEXTURE_1D_ARRAY: return 3;
+        case GL_TEXTURE_2D_ARRAY: return 4;
+        case GL_TEXTURE_RECTANGLE: return 5;
+        case GL_TEXTURE_CUBE_MAP: return 6;
+        case GL_TEXTURE_BUFFER: return 7;
+        case GL_TEXTURE_2D_MULTISAMPLE: return 8;
+        default: return -1;
+        }
+    }
+
+    static int capability_index(GLenum capability)
+    {
+        switch(capability)
+        {
+        case GL_CULL_FACE: return 0;
+        case GL_DEPTH_TEST: return 1;
+        case GL_BLEND: return 2;
+        case GL_STENCIL_TEST: return 3;
+        case GL_SCISSOR_TEST: return 4;
+        case GL_RASTERIZER_DISCARD: return 5;
+        case GL_PROGRAM_POINT_SIZE: return 6;
+        case GL_POLYGON_OFFSET_FILL: return 7;
+        case GL_PRIMITIVE_RESTART: return 8;
+        case GL_MULTISAMPLE: return 9;
+        case GL_FRAMEBUFFER_SRGB: return 10;
+        case GL_DEPTH_CLAMP: return 11;
+        default: return -1;
+        }
+    }
+
+    struct Range {
+        GLuint name;
+        GLintptr offset;
+        GLsizeiptr size;
+    };
+
+    template<class T>
+    bool changed(T &cached, T value)
+    {
+        if(cached == value)
+        {
+            ++current.elided;
+            return false;
+        }
+        ++current.issued;
+        cached = value;
+        return true;
+    }
+
+    GLuint program, vertex_array;
+    GLuint read_framebuffer, draw_framebuffer;
+    GLuint active_unit;
+    int depth_write, color_write;
+    GLuint buffers[buffer_targets];
+    Range indexed_buffers[indexed_targets][indexed_bindings];
+    GLuint textures[texture_units][texture_targets];
+    signed char capabilities[capability_count];
+    Counters current, last;
+};
+
+// the state a recorded draw needs
+struct DrawState {
+    DrawState(GLuint program_name = 0, GLuint vertex_array_name = 0)
+        : program(program_name), vertex_array(vertex_array_name), cull_face(true), depth_write(true), color_write(true) { }
+
+    GLuint program, vertex_array;
+    bool cull_face, depth_write, color_write;
+};
+
+// the parameters of a recorded draw. with an index type the elements
+// [first, first+count) of the bound index buffer are drawn with
+// base_vertex added to each index, without one the vertices
+// [first, first+count). the draw can be wrapped in a query, made
+// conditional on another query and get a vec3 uniform of its own (an
+// object offset for example), a zero query or a location of -1 leaves
+// that out
+struct DrawCommand {
+    DrawCommand(GLenum draw_mode = GL_TRIANGLES, GLsizei draw_count = 0)
+        : mode(draw_mode), count(draw_count), first(0), base_vertex(0), index_type(0),
+          query_target(GL_ANY_SAMPLES_PASSED), query(0), condition_mode(GL_QUERY_WAIT), condition(0),
+          uniform_location(-1)
+    {
+        uniform[0] = uniform[1] = uniform[2] = 0.0f;
+    }
+
+    GLenum mode;
+    GLsizei count;
+    GLint first, base_vertex;
+    GLenum index_type;
+    GLenum query_target;
+    GLuint query;
+    GLenum condition_mode;
+    GLuint condition;
+    GLint uniform_location;
+    GLfloat uniform[3];
+};
+
+class CommandBucket {
+public:
+    void add(unsigned layer, const DrawState &state, const DrawCommand &draw)
+    {
+        Command command = { layer, state, draw };
+        commands.push_back(command);
+    }
+
+    // sets the state of each command through gl and runs it. the sort
+    // is stable, so commands with equal keys keep the order of add
+    void submit(GLState &gl)
+    {
+        std::stable_sort(commands.begin(), commands.end(), CommandOrder());
+        for(size_t i = 0;i<commands.size();++i)
+        {
+            const DrawState &state = commands[i].state;
+            gl.use_program(state.program);
+            gl.bind_vertex_array(state.vertex_array);
+            gl.set_capability(GL_CULL_FACE, state.cull_face);
+            gl.depth_mask(state.depth_write);
+            gl.color_mask(state.color_write);
+            execute(commands[i].draw);
+            gl.count_draw();
+        }
+        commands.clear();
+    }
+
+    size_t size() const { return commands.size(); }
+
+private:
+    struct Command {
+        unsigned layer;
+        DrawState state;
+        DrawCommand draw;
+    };
+
+    static void execute(const DrawCommand &draw)
+    {
+        if(draw.uniform_location >= 0)
+            glUniform3fv(draw.uniform_location, 1, draw.uniform);
+        if(draw.condition != 0)
+            glBeginConditionalRender(draw.condition, draw.condition_mode);
+        if(draw.query != 0)
+            glBeginQuery(draw.query_target, draw.query);
+        if(draw.index_type == 0)
+            glDrawArrays(draw.mode, draw.first, draw.count);
+        else
+            glDrawElementsBaseVertex(draw.mode, draw.count, draw.index_type,
+                                     (char*)0 + draw.first*index_size(draw.index_type), draw.base_vertex);
+        if(draw.query != 0)
+            glEndQuery(draw.query_target);
+        if(draw.condition != 0)
+            glEndConditionalRender();
+    }
+
+    static int index_size(GLenum type)
+    {
+        return type == GL_UNSIGNED_BYTE ? 1 : type == GL_UNSIGNED_SHORT ? 2 : 4;
+    }
+
+    struct CommandOrder {
+        bool operator()(const Command &a, const Command &b) const
+        {
+            if(a.layer != b.layer)
+                return a.layer < b.layer;
+            if(a.state.program != b.state.program)
+                return a.state.program < b.state.program;
+            return a.state.vertex_array < b.state.vertex_array;
+        }
+    };
+
+    std::vector<Command> commands;
+};
+
+#endif
@@ -0,0 +1,39 @@
+/* OpenGL example code - feature checks
+ *
+ * Queries the version and extensions of the current context, so a
+ * feature can be used if either the core version or an extension
+ * provides it. Both need a current context.
+ *
+ * usage:
+ *     if(version_at_least(4, 3) || has_extension("GL_KHR_debug")) { ... }
+ */
+
+#ifndef GL_SUPPORT_HPP
+#define GL_SUPPORT_HPP
+
+#include <GLXW/glxw.h>
+
+#include <cstring>
+
+inline bool version_at_least(GLint want_major, GLint want_minor)
+{
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    return major > want_major || (major == want_major && minor >= want_minor);
+}
+
+inline bool has_extension(const char *extension)
+{
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for(GLint i = 0;i<count;++i)
+    {
+        const char *name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if(name && std::strcmp(name, extension) == 0)
+            return true;
+    }
+    return false;
+}
+
+#endif
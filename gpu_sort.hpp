@@ -0,0 +1,412 @@
+/* OpenGL example code - gpu particle sort
+ *
+ * Sorts particles on the gpu with compute shaders (needs GL 4.3). The
+ * result is a buffer of particle indices that can be bound as element
+ * array buffer (or read as R32UI buffer texture) to draw the particles
+ * in sorted order.
+ * The sort key is either the view space depth, which gives back to
+ * front order for alpha blending, or the morton code of the position,
+ * which keeps particles that are close together also close in the
+ * draw order and so helps the texture and raster caches.
+ * The keys are sorted with a least significant digit radix sort in
+ * four passes of eight bits. Each pass builds a histogram per block of
+ * keys, scans all histograms to find where each block writes its keys
+ * for each digit and then scatters the keys stably. The four passes are
+ * built with ShaderProgram (see shader_program.hpp), so they are linked
+ * in parallel and come from the binary cache in later runs.
+ * Sorting leaves one of the sort programs bound, so the draw program
+ * has to be bound again afterwards. Back to front order allows
+ * blending the particles "over" each other, with premultiplied output
+ * that is glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA). The morton order
+ * doesn't depend on the view, static particles only need to be sorted
+ * once.
+ *
+ * usage:
+ *     int mode = GPUSort::parse_mode(argc, argv); // --sort depth|morton
+ *     GPUSort sorter;
+ *     sorter.init(particles);
+ *     ...
+ *     sorter.sort(vbo, stride, offset, mode, glm::value_ptr(View), lo, hi);
+ *     glUseProgram(draw_program);
+ *     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sorter.indices());
+ *     glDrawElements(GL_POINTS, particles, GL_UNSIGNED_INT, 0);
+ *     ...
+ *     sorter.destroy();
+ */
+
+#ifndef GPU_SORT_HPP
+#define GPU_SORT_HPP
+
+#include <GLXW/glxw.h>
+
+#include "shader_program.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+class GPUSort {
+public:
+    enum Mode { NONE = -1, DEPTH = 0, MORTON = 1 };
+
+    // elements per block and threads per work group of the sort passes
+    static const int block_size = 4096;
+    static const int group_size = 256;
+
+    // returns the mode given with --sort depth or --sort morton
+    static int parse_mode(int argc, char *argv[])
+    {
+        for(int i = 1;i+1<argc;++i)
+        {
+            if(std::string("--sort") != argv[i])
+                continue;
+            if(std::string("depth") == argv[i+1])
+                return DEPTH;
+            if(std::string("morton") == argv[i+1])
+                return MORTON;
+            std::cerr << "unknown sort mode " << argv[i+1] << std::endl;
+        }
+        return NONE;
+    }
+
+    GPUSort() : count(0), blocks(0), histogram(0)
+    {
+        keys[0] = keys[1] = values[0] = values[1] = 0;
+    }
+
+    // compiles the shaders and creates the buffers for sorting up to
+    // n elements, returns false if a shader failed to compile
+    bool init(int n)
+    {
+        count = n;
+        blocks = (count+block_size-1)/block_size;
+
+        key_program.add(GL_COMPUTE_SHADER, key_source());
+        histogram_program.add(GL_COMPUTE_SHADER, histogram_source());
+        scan_program.add(GL_COMPUTE_SHADER, scan_source());
+        scatter_program.add(GL_COMPUTE_SHADER, scatter_source());
+        if(!link_programs({&key_program, &histogram_program, &scan_program, &scatter_program}))
+            return false;
+
+        // look up the uniforms once instead of on every sort
+        key_uniforms.count = key_program.uniform("count");
+        key_uniforms.stride = key_program.uniform("stride");
+        key_uniforms.offset = key_program.uniform("offset");
+        key_uniforms.mode = key_program.uniform("mode");
+        key_uniforms.view = key_program.uniform("View");
+        key_uniforms.lo = key_program.uniform("lo");
+        key_uniforms.inv_extent = key_program.uniform("inv_extent");
+        histogram_uniforms = pass_uniforms(histogram_program);
+        scatter_uniforms = pass_uniforms(scatter_program);
+        scan_n = scan_program.uniform("n");
+
+        glGenBuffers(2, keys);
+        glGenBuffers(2, values);
+        for(int i = 0;i<2;++i)
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, keys[i]);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint)*count, 0, GL_DYNAMIC_COPY);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, values[i]);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint)*count, 0, GL_DYNAMIC_COPY);
+        }
+        glGenBuffers(1, &histogram);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, histogram);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint)*256*blocks, 0, GL_DYNAMIC_COPY);
+        return true;
+    }
+
+    void destroy()
+    {
+        glDeleteBuffers(2, keys);
+        glDeleteBuffers(2, values);
+        glDeleteBuffers(1, &histogram);
+        key_program.destroy();
+        histogram_program.destroy();
+        scan_program.destroy();
+        scatter_program.destroy();
+        keys[0] = keys[1] = values[0] = values[1] = histogram = 0;
+    }
+
+    // sorts the positions in buffer. position i is read from the floats
+    // offset+i*stride to offset+i*stride+2. view is the column major view
+    // matrix used for DEPTH and lo/hi are the bounds for MORTON, positions
+    // outside of them are clamped
+    void sort(GLuint buffer, int stride, int offset, int mode, const GLfloat *view, const GLfloat *lo, const GLfloat *hi)
+    {
+        // the positions may have just been written by a shader
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        GLfloat inv_extent[3];
+        for(int k = 0;k<3;++k)
+            inv_extent[k] = hi[k] > lo[k] ? 1.0f/(hi[k]-lo[k]) : 0.0f;
+
+        // compute the keys and the initial order
+        glUseProgram(key_program.id());
+        glUniform1i(key_uniforms.count, count);
+        glUniform1i(key_uniforms.stride, stride);
+        glUniform1i(key_uniforms.offset, offset);
+        glUniform1i(key_uniforms.mode, mode);
+        glUniformMatrix4fv(key_uniforms.view, 1, GL_FALSE, view);
+        glUniform3fv(key_uniforms.lo, 1, lo);
+        glUniform3fv(key_uniforms.inv_extent, 1, inv_extent);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, keys[0]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, values[0]);
+        dispatch((count+group_size-1)/group_size);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        // four passes, so the result ends up in the first buffers again
+        for(int pass = 0;pass<4;++pass)
+        {
+            int src = pass%2, dst = 1-src;
+
+            glUseProgram(histogram_program.id());
+            glUniform1i(histogram_uniforms.count, count);
+            glUniform1i(histogram_uniforms.shift, 8*pass);
+            glUniform1i(histogram_uniforms.blocks, blocks);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, keys[src]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, histogram);
+            dispatch(blocks);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            glUseProgram(scan_program.id());
+            glUniform1i(scan_n, 256*blocks);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, histogram);
+            glDispatchCompute(1, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            glUseProgram(scatter_program.id());
+            glUniform1i(scatter_uniforms.count, count);
+            glUniform1i(scatter_uniforms.shift, 8*pass);
+            glUniform1i(scatter_uniforms.blocks, blocks);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, keys[src]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, histogram);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, values[src]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, keys[dst]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, values[dst]);
+            dispatch(blocks);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+
+        // the indices are read as element array or buffer texture next
+        glMemoryBarrier(GL_ELEMENT_ARRAY_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+
+    // sorted particle indices, back to front for DEPTH
+    GLuint indices() const { return values[0]; }
+
+private:
+    struct KeyUniforms {
+        GLint count, stride, offset, mode, view, lo, inv_extent;
+    };
+
+    // the histogram and scatter passes take the same uniforms
+    struct PassUniforms {
+        GLint count, shift, blocks;
+    };
+
+    static PassUniforms pass_uniforms(const ShaderProgram &program)
+    {
+        PassUniforms uniforms;
+        uniforms.count = program.uniform("count");
+        uniforms.shift = program.uniform("shift");
+        uniforms.blocks = program.uniform("blocks");
+        return uniforms;
+    }
+
+    // runs groups work groups, spread over y once there are too many for x
+    static void dispatch(int groups)
+    {
+        int groups_x = std::max(1, std::min(groups, 65535));
+        glDispatchCompute(groups_x, (groups+groups_x-1)/groups_x, 1);
+    }
+
+    // index of the current work group for one dimensional work spread
+    // over two dimensions by dispatch
+    static std::string group_index()
+    {
+        return "uint group_index() { return gl_WorkGroupID.x + gl_WorkGroupID.y*gl_NumWorkGroups.x; }\n";
+    }
+
+    static std::string key_source()
+    {
+        return
+            "#version 430\n"
+            "layout(local_size_x = 256) in;\n"
+            "layout(std430, binding = 0) readonly buffer Positions { float position[]; };\n"
+            "layout(std430, binding = 1) writeonly buffer Keys { uint key[]; };\n"
+            "layout(std430, binding = 2) writeonly buffer Values { uint value[]; };\n"
+            "uniform int count;\n"
+            "uniform int stride;\n"
+            "uniform int offset;\n"
+            "uniform int mode;\n"
+            "uniform mat4 View;\n"
+            "uniform vec3 lo;\n"
+            "uniform vec3 inv_extent;\n"
+            + group_index() +
+            // spreads the lower 10 bits of x out to every third bit
+            "uint spread(uint x) {\n"
+            "   x &= 0x3ffu;\n"
+            "   x = (x | (x << 16)) & 0x030000ffu;\n"
+            "   x = (x | (x <<  8)) & 0x0300f00fu;\n"
+            "   x = (x | (x <<  4)) & 0x030c30c3u;\n"
+            "   x = (x | (x <<  2)) & 0x09249249u;\n"
+            "   return x;\n"
+            "}\n"
+            "void main() {\n"
+            "   uint i = group_index()*gl_WorkGroupSize.x + gl_LocalInvocationID.x;\n"
+            "   if(i >= uint(count))\n"
+            "       return;\n"
+            "   int base = offset + int(i)*stride;\n"
+            "   vec3 p = vec3(position[base], position[base+1], position[base+2]);\n"
+            "   uint k;\n"
+            "   if(mode == 0) {\n"
+            // view space z is negative in front of the camera so
+            // ascending order is back to front. flipping the bits turns
+            // the float into an unsigned integer with the same order
+            "       uint u = floatBitsToUint((View*vec4(p, 1)).z);\n"
+            "       k = (u & 0x80000000u) != 0u ? ~u : u | 0x80000000u;\n"
+            "   } else {\n"
+            "       uvec3 q = uvec3(clamp((p-lo)*inv_extent, 0.0, 1.0)*1023.0);\n"
+            "       k = spread(q.x) | (spread(q.y) << 1) | (spread(q.z) << 2);\n"
+            "   }\n"
+            "   key[i] = k;\n"
+            "   value[i] = i;\n"
+            "}\n";
+    }
+
+    // counts the digits of one block of keys. the histograms are stored
+    // digit major so scanning them gives the output offset of every
+    // digit in every block
+    static std::string histogram_source()
+    {
+        return
+            "#version 430\n"
+            "layout(local_size_x = 256) in;\n"
+            "layout(std430, binding = 0) readonly buffer Keys { uint key[]; };\n"
+            "layout(std430, binding = 1) writeonly buffer Histogram { uint histogram[]; };\n"
+            "uniform int count;\n"
+            "uniform int shift;\n"
+            "uniform int blocks;\n"
+            "shared uint local_histogram[256];\n"
+            + group_index() +
+            "void main() {\n"
+            "   uint block = group_index();\n"
+            "   if(block >= uint(blocks))\n"
+            "       return;\n"
+            "   uint l = gl_LocalInvocationID.x;\n"
+            "   local_histogram[l] = 0u;\n"
+            "   barrier();\n"
+            "   for(uint k = 0u;k<16u;++k) {\n"
+            "       uint i = block*4096u + k*256u + l;\n"
+            "       if(i < uint(count))\n"
+            "           atomicAdd(local_histogram[(key[i] >> shift) & 0xffu], 1u);\n"
+            "   }\n"
+            "   barrier();\n"
+            "   histogram[l*uint(blocks) + block] = local_histogram[l];\n"
+            "}\n";
+    }
+
+    // exclusive prefix sum over all histograms in a single work group.
+    // every invocation sums a contiguous range, the range sums are
+    // scanned in shared memory and then written back as offsets
+    static std::string scan_source()
+    {
+        return
+            "#version 430\n"
+            "layout(local_size_x = 1024) in;\n"
+            "layout(std430, binding = 1) buffer Histogram { uint histogram[]; };\n"
+            "uniform int n;\n"
+            "shared uint sums[1024];\n"
+            "void main() {\n"
+            "   uint l = gl_LocalInvocationID.x;\n"
+            "   uint per = (uint(n)+1023u)/1024u;\n"
+            "   uint begin = min(l*per, uint(n));\n"
+            "   uint end = min(begin+per, uint(n));\n"
+            "   uint sum = 0u;\n"
+            "   for(uint i = begin;i<end;++i)\n"
+            "       sum += histogram[i];\n"
+            "   sums[l] = sum;\n"
+            "   barrier();\n"
+            "   for(uint d = 1u;d<1024u;d <<= 1) {\n"
+            "       uint v = l >= d ? sums[l-d] : 0u;\n"
+            "       barrier();\n"
+            "       sums[l] += v;\n"
+            "       barrier();\n"
+            "   }\n"
+            "   uint prefix = sums[l] - sum;\n"
+            "   for(uint i = begin;i<end;++i) {\n"
+            "       uint h = histogram[i];\n"
+            "       histogram[i] = prefix;\n"
+            "       prefix += h;\n"
+            "   }\n"
+            "}\n";
+    }
+
+    // moves the keys of a block to their sorted position. the block is
+    // processed in rounds of one key per invocation. within a round a
+    // key goes after the keys with the same digit from lower
+    // invocations, which keeps the sort stable
+    static std::string scatter_source()
+    {
+        return
+            "#version 430\n"
+            "layout(local_size_x = 256) in;\n"
+            "layout(std430, binding = 0) readonly buffer KeysIn { uint key_in[]; };\n"
+            "layout(std430, binding = 1) readonly buffer Histogram { uint histogram[]; };\n"
+            "layout(std430, binding = 2) readonly buffer ValuesIn { uint value_in[]; };\n"
+            "layout(std430, binding = 3) writeonly buffer KeysOut { uint key_out[]; };\n"
+            "layout(std430, binding = 4) writeonly buffer ValuesOut { uint value_out[]; };\n"
+            "uniform int count;\n"
+            "uniform int shift;\n"
+            "uniform int blocks;\n"
+            "shared uint digit_base[256];\n"
+            "shared uint digits[256];\n"
+            + group_index() +
+            "void main() {\n"
+            "   uint block = group_index();\n"
+            "   if(block >= uint(blocks))\n"
+            "       return;\n"
+            "   uint l = gl_LocalInvocationID.x;\n"
+            "   digit_base[l] = histogram[l*uint(blocks) + block];\n"
+            "   for(uint k = 0u;k<16u;++k) {\n"
+            "       uint i = block*4096u + k*256u + l;\n"
+            "       bool valid = i < uint(count);\n"
+            "       uint key = valid ? key_in[i] : 0u;\n"
+            // 256 marks invocations without a key
+            "       uint d = valid ? (key >> shift) & 0xffu : 256u;\n"
+            "       digits[l] = d;\n"
+            "       barrier();\n"
+            "       uint rank = 0u;\n"
+            "       bool last = true;\n"
+            "       for(uint j = 0u;j<256u;++j) {\n"
+            "           if(digits[j] == d) {\n"
+            "               if(j < l) ++rank;\n"
+            "               if(j > l) last = false;\n"
+            "           }\n"
+            "       }\n"
+            "       if(valid) {\n"
+            "           uint dst = digit_base[d] + rank;\n"
+            "           key_out[dst] = key;\n"
+            "           value_out[dst] = value_in[i];\n"
+            "       }\n"
+            "       barrier();\n"
+            // the last invocation with a digit moves its base on
+            "       if(valid && last)\n"
+            "           digit_base[d] += rank + 1u;\n"
+            "   }\n"
+            "}\n";
+    }
+
+    int count;
+    int blocks;
+    GLuint keys[2], values[2];
+    GLuint histogram;
+    ShaderProgram key_program, histogram_program, scan_program, scatter_program;
+    KeyUniforms key_uniforms;
+    PassUniforms histogram_uniforms, scatter_uniforms;
+    GLint scan_n;
+};
+
+#endif
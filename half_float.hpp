@@ -0,0 +1,34 @@
+/* OpenGL example code - half floats
+ *
+ * Converts floats to the 16 bit format of GL_HALF_FLOAT and
+ * unpackHalf2x16. The examples only convert small values, so there is
+ * no inf/nan handling and denormals are flushed to zero.
+ *
+ * usage:
+ *     GLushort h = float_to_half(0.5f);
+ */
+
+#ifndef HALF_FLOAT_HPP
+#define HALF_FLOAT_HPP
+
+#include <GLXW/glxw.h>
+
+#include <cstring>
+
+inline GLushort float_to_half(float value)
+{
+    GLuint bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    GLuint sign = (bits >> 16) & 0x8000;
+    int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    GLuint mantissa = bits & 0x7fffff;
+    if(exponent <= 0)
+        return sign;
+    if(exponent >= 31)
+        return sign | 0x7c00;
+    // round to nearest, a carry correctly moves on to the exponent
+    GLuint half = sign | (exponent << 10) | (mantissa >> 13);
+    return half + ((mantissa >> 12) & 1);
+}
+
+#endif
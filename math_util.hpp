@@ -0,0 +1,57 @@
+/* OpenGL example code - math helpers
+ *
+ * Small helpers several examples share: extracting the frustum planes
+ * for culling and stateless hashes for placing and sizing objects. The
+ * hashes have no state, so all threads can use them at the same time
+ * and the results don't depend on the thread count.
+ *
+ * usage:
+ *     glm::vec4 planes[6];
+ *     frustum_planes(ViewProjection, planes);
+ *     bool outside = glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius;
+ *     unsigned bits = hash(i);
+ *     float r = hash(x, id, seed);
+ */
+
+#ifndef MATH_UTIL_HPP
+#define MATH_UTIL_HPP
+
+#include <glm/glm.hpp>
+
+// extracts the six clip planes from a view projection matrix. the plane
+// normals point to the inside of the frustum and are normalized so the
+// distance test works with bounding spheres
+inline void frustum_planes(const glm::mat4 &ViewProjection, glm::vec4 planes[6])
+{
+    glm::mat4 rows = glm::transpose(ViewProjection);
+    planes[0] = rows[3] + rows[0];
+    planes[1] = rows[3] - rows[0];
+    planes[2] = rows[3] + rows[1];
+    planes[3] = rows[3] - rows[1];
+    planes[4] = rows[3] + rows[2];
+    planes[5] = rows[3] - rows[2];
+    for(int i = 0;i<6;++i)
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+}
+
+// integer hash with well mixed bits
+inline unsigned hash(unsigned x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// counter based random number in [0,1], the same hash the transform
+// feedback example uses in its shaders
+inline float hash(unsigned x, unsigned id, unsigned seed)
+{
+    x = x*1235167u + id*948737u + seed*9284365u;
+    x = (x >> 13) ^ x;
+    return ((x * (x * x * 60493u + 19990303u) + 1376312589u) & 0x7fffffffu)/float(0x7fffffff-1);
+}
+
+#endif
@@ -0,0 +1,45 @@
+/* OpenGL example code - command line options
+ *
+ * The lookups the examples use for their own command line options.
+ * Options that take a value expect it as the next argument.
+ *
+ * usage:
+ *     bool animated = has_flag(argc, argv, "--animated");
+ *     int count = int_option(argc, argv, "--instances", 1024);
+ *     std::string name = string_option(argc, argv, "--storage", "ssbo");
+ */
+
+#ifndef OPTIONS_HPP
+#define OPTIONS_HPP
+
+#include <string>
+#include <cstdlib>
+
+// returns true if flag is one of the command line arguments
+inline bool has_flag(int argc, char *argv[], const std::string &flag)
+{
+    for(int i = 1;i<argc;++i)
+        if(flag == argv[i])
+            return true;
+    return false;
+}
+
+// returns the integer following flag on the command line or fallback
+inline int int_option(int argc, char *argv[], const std::string &flag, int fallback)
+{
+    for(int i = 1;i+1<argc;++i)
+        if(flag == argv[i])
+            return std::atoi(argv[i+1]);
+    return fallback;
+}
+
+// returns the string following flag on the command line or fallback
+inline std::string string_option(int argc, char *argv[], const std::string &flag, const std::string &fallback)
+{
+    for(int i = 1;i+1<argc;++i)
+        if(flag == argv[i])
+            return argv[i+1];
+    return fallback;
+}
+
+#endif
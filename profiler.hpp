@@ -0,0 +1,507 @@
+/* OpenGL example code - frame profiler
+ *
+ * Shared profiler for the examples. GPU scopes are measured with pairs
+ * of GL_TIMESTAMP queries and CPU scopes with glwtGetNanoTime. Scopes
+ * can be nested and are identified by name.
+ * Query results are read back from a ring of frames so that getting
+ * them never stalls the pipeline. Every scope keeps rolling min/avg/p99
+ * statistics over its last samples. If an output file is set (or given
+ * by the PROFILER_OUTPUT environment variable) all samples are written
+ * by a background thread, as Chrome trace JSON if the file name ends in
+ * .json and as CSV otherwise.
+ * Marks are instant events attached to the innermost open scope, they
+ * only show up in the output file (see debug_output.hpp).
+ *
+ * usage:
+ *     Profiler profiler;
+ *     while(running) {
+ *         profiler.begin_frame();
+ *         {
+ *             GPUScope scope(profiler, "draw");
+ *             ...
+ *         }
+ *         profiler.end_frame();
+ *     }
+ *     profiler.shutdown(); // while the context still exists
+ */
+
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <GLXW/glxw.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdlib>
+
+// defined by every example
+unsigned long long glwtGetNanoTime();
+
+// rolling statistics of a scope in milliseconds. mean and count cover
+// all samples since the last reset and not just the rolling window
+struct ScopeStats {
+    double min, avg, p99, last;
+    int samples;
+    double mean;
+    unsigned long long count;
+};
+
+class Profiler {
+public:
+    // number of frames between issuing a query and reading it back
+    static const int latency = 5;
+
+    // number of samples the rolling statistics are computed over
+    static const int window = 128;
+
+    Profiler() : frame(0), gpu_offset(0), clock_synced(false), writer_running(false), json(false), first_event(true)
+    {
+        const char *output = std::getenv("PROFILER_OUTPUT");
+        if(output)
+            set_output(output);
+    }
+
+    ~Profiler()
+    {
+        stop_writer();
+    }
+
+    // write all samples to a file. must be called before the first frame
+    void set_output(const std::string &filename)
+    {
+        stop_writer();
+        file.open(filename.c_str());
+        if(!file)
+        {
+            std::cerr << "profiler: could not open " << filename << std::endl;
+            return;
+        }
+        json = filename.size()>=5 && filename.compare(filename.size()-5, 5, ".json") == 0;
+        if(json)
+            file << "{\"traceEvents\":[\n";
+        else
+            file << "frame,scope,kind,depth,start_ms,duration_ms,text\n";
+        first_event = true;
+        writer_running = true;
+        writer = std::thread(&Profiler::writer_loop, this);
+    }
+
+    void begin_frame()
+    {
+        // timestamps are on the gpu clock, find its offset to the cpu
+        // clock once so both kinds of scopes share a time base
+        if(!clock_synced)
+        {
+            GLint64 gpu_now;
+            glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+            gpu_offset = (long long)glwtGetNanoTime() - (long long)gpu_now;
+            clock_synced = true;
+        }
+
+        // the slot we are about to reuse was issued latency frames ago
+        FrameSlot &slot = slots[frame%latency];
+        if(slot.used)
+            collect(slot);
+        slot.used = true;
+        slot.frame = frame;
+        slot.records.clear();
+        slot.marks.clear();
+        slot.next_query = 0;
+        stack.clear();
+    }
+
+    void end_frame()
+    {
+        ++frame;
+    }
+
+    // gpu scope, measured between the commands issued before and after
+    void push_gpu(const char *name)
+    {
+        FrameSlot &slot = slots[frame%latency];
+        Record record;
+        record.scope = scope_id(name, true);
+        record.depth = stack.size();
+        record.begin = slot.query();
+        record.end = 0;
+        glQueryCounter(record.begin, GL_TIMESTAMP);
+        stack.push_back(slot.records.size());
+        slot.records.push_back(record);
+    }
+
+    // cpu scope, measured with glwtGetNanoTime
+    void push_cpu(const char *name)
+    {
+        FrameSlot &slot = slots[frame%latency];
+        Record record;
+        record.scope = scope_id(name, false);
+        record.depth = stack.size();
+        record.begin = glwtGetNanoTime();
+        record.end = 0;
+        stack.push_back(slot.records.size());
+        slot.records.push_back(record);
+    }
+
+    // closes the innermost open scope
+    void pop()
+    {
+        if(stack.empty())
+            return;
+        FrameSlot &slot = slots[frame%latency];
+        Record &record = slot.records[stack.back()];
+        stack.pop_back();
+        if(scopes[record.scope].gpu)
+        {
+            record.end = slot.query();
+            glQueryCounter(record.end, GL_TIMESTAMP);
+        }
+        else
+        {
+            record.end = glwtGetNanoTime();
+        }
+    }
+
+    // name of the innermost open scope or 0 if there is none
+    const char* current_scope() const
+    {
+        if(stack.empty())
+            return 0;
+        const FrameSlot &slot = slots[frame%latency];
+        return scopes[slot.records[stack.back()].scope].name.c_str();
+    }
+
+    // records an instant event with text in the innermost open scope
+    void mark(const std::string &text)
+    {
+        if(!writer_running)
+            return;
+        const char *scope = current_scope();
+        Mark m = { scope ? scope : "", text, (int)stack.size(), glwtGetNanoTime() };
+        slots[frame%latency].marks.push_back(m);
+    }
+
+    // statistics of a scope, samples is 0 if there are none yet
+    ScopeStats stats(const std::string &name, bool gpu = true) const
+    {
+        ScopeStats result = { 0, 0, 0, 0, 0, 0, 0 };
+        std::map<std::pair<std::string, bool>, int>::const_iterator i = scope_ids.find(std::make_pair(name, gpu));
+        if(i != scope_ids.end())
+            result = compute_stats(scopes[i->second]);
+        return result;
+    }
+
+    // prints one line per scope, meant to be called every few seconds
+    // rather than every frame
+    void print(std::ostream &out) const
+    {
+        for(size_t i = 0;i<scopes.size();++i)
+        {
+            ScopeStats s = compute_stats(scopes[i]);
+            out << (scopes[i].gpu ? "gpu " : "cpu ") << scopes[i].name
+                << ": avg " << s.avg << " ms, min " << s.min
+                << " ms, p99 " << s.p99 << " ms" << std::endl;
+        }
+    }
+
+    // waits for and reads back all frames that are still in flight.
+    // this stalls, so only call it between frames when exact results
+    // are needed (see bench.hpp)
+    void flush()
+    {
+        // oldest frame first
+        for(int i = 0;i<latency;++i)
+        {
+            FrameSlot &slot = slots[(frame+i)%latency];
+            if(slot.used)
+                collect(slot);
+            slot.used = false;
+        }
+    }
+
+    // forgets all samples collected so far
+    void reset()
+    {
+        for(size_t i = 0;i<scopes.size();++i)
+        {
+            scopes[i].samples.clear();
+            scopes[i].total = 0;
+            scopes[i].count = 0;
+        }
+    }
+
+    // deletes the queries and flushes the output, has to be called
+    // while the context is still current
+    void shutdown()
+    {
+        flush();
+        for(int i = 0;i<latency;++i)
+        {
+            FrameSlot &slot = slots[i];
+            if(!slot.queries.empty())
+                glDeleteQueries(slot.queries.size(), &slot.queries[0]);
+            slot.queries.clear();
+        }
+        stop_writer();
+    }
+
+private:
+    struct Scope {
+        std::string name;
+        bool gpu;
+        std::deque<double> samples; // milliseconds
+        double total;
+        unsigned long long count;
+    };
+
+    // an open or finished scope within a frame. begin and end are query
+    // names for gpu scopes and nanoseconds for cpu scopes
+    struct Record {
+        int scope;
+        int depth;
+        unsigned long long begin, end;
+    };
+
+    struct Mark {
+        std::string scope, text;
+        int depth;
+        unsigned long long time;
+    };
+
+    struct FrameSlot {
+        FrameSlot() : used(false), frame(0), next_query(0) { }
+
+        // returns an unused query of this slot, creating more if needed
+        GLuint query()
+        {
+            if(next_query == queries.size())
+            {
+                GLuint q;
+                glGenQueries(1, &q);
+                queries.push_back(q);
+            }
+            return queries[next_query++];
+        }
+
+        bool used;
+        unsigned long long frame;
+        std::vector<GLuint> queries;
+        size_t next_query;
+        std::vector<Record> records;
+        std::vector<Mark> marks;
+    };
+
+    int scope_id(const char *name, bool gpu)
+    {
+        std::pair<std::string, bool> key(name, gpu);
+        std::map<std::pair<std::string, bool>, int>::iterator i = scope_ids.find(key);
+        if(i != scope_ids.end())
+            return i->second;
+        Scope scope;
+        scope.name = name;
+        scope.gpu = gpu;
+        scope.total = 0;
+        scope.count = 0;
+        scopes.push_back(scope);
+        scope_ids[key] = scopes.size()-1;
+        return scopes.size()-1;
+    }
+
+    // reads back the results of a frame and hands them to the writer
+    void collect(FrameSlot &slot)
+    {
+        // print with fixed precision, timestamps are large numbers
+        std::ostringstream lines;
+        lines.setf(std::ios::fixed);
+        lines.precision(json ? 3 : 6);
+        for(size_t i = 0;i<slot.records.size();++i)
+        {
+            Record &record = slot.records[i];
+            Scope &scope = scopes[record.scope];
+
+            // skip scopes that were never closed
+            if(record.end == 0)
+                continue;
+
+            long long begin, end;
+            if(scope.gpu)
+            {
+                GLuint64 b, e;
+                glGetQueryObjectui64v(record.begin, GL_QUERY_RESULT, &b);
+                glGetQueryObjectui64v(record.end, GL_QUERY_RESULT, &e);
+                begin = (long long)b + gpu_offset;
+                end = (long long)e + gpu_offset;
+            }
+            else
+            {
+                begin = record.begin;
+                end = record.end;
+            }
+
+            double ms = (end-begin)*1.e-6;
+            scope.samples.push_back(ms);
+            if(scope.samples.size() > window)
+                scope.samples.pop_front();
+            scope.total += ms;
+            ++scope.count;
+
+            if(writer_running)
+            {
+                if(json)
+                {
+                    if(!first_event)
+                        lines << ",\n";
+                    first_event = false;
+                    lines << "{\"name\":" << quote(scope.name, '\\') << ",\"ph\":\"X\",\"pid\":0,\"tid\":" << (scope.gpu ? 1 : 0)
+                          << ",\"ts\":" << begin*1.e-3 << ",\"dur\":" << (end-begin)*1.e-3 << "}";
+                }
+                else
+                {
+                    lines << slot.frame << "," << quote(scope.name, '"') << "," << (scope.gpu ? "gpu" : "cpu") << ","
+                          << record.depth << "," << begin*1.e-6 << "," << ms << "\n";
+                }
+            }
+        }
+
+        for(size_t i = 0;writer_running && i<slot.marks.size();++i)
+        {
+            const Mark &mark = slot.marks[i];
+            if(json)
+            {
+                if(!first_event)
+                    lines << ",\n";
+                first_event = false;
+                lines << "{\"name\":" << quote(mark.text, '\\') << ",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":0"
+                      << ",\"ts\":" << mark.time*1.e-3 << ",\"args\":{\"scope\":" << quote(mark.scope, '\\') << "}}";
+            }
+            else
+            {
+                lines << slot.frame << "," << quote(mark.scope, '"') << ",mark," << mark.depth << ","
+                      << mark.time*1.e-6 << ",0," << quote(mark.text, '"') << "\n";
+            }
+        }
+
+        if(writer_running)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending += lines.str();
+            pending_available.notify_one();
+        }
+    }
+
+    // quotes a string for json (escape is a backslash) or csv (escape
+    // is a doubled quote), control characters are dropped
+    static std::string quote(const std::string &str, char escape)
+    {
+        std::string result = "\"";
+        for(size_t i = 0;i<str.size();++i)
+        {
+            if(str[i] == '"' || (escape == '\\' && str[i] == '\\'))
+                result += escape;
+            if((unsigned char)str[i] >= 32)
+                result += str[i];
+        }
+        return result + "\"";
+    }
+
+    ScopeStats compute_stats(const Scope &scope) const
+    {
+        ScopeStats result = { 0, 0, 0, 0, 0, 0, 0 };
+        if(scope.count > 0)
+        {
+            result.mean = scope.total/scope.count;
+            result.count = scope.count;
+        }
+        if(scope.samples.empty())
+            return result;
+        std::vector<double> sorted(scope.samples.begin(), scope.samples.end());
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0;
+        for(size_t i = 0;i<sorted.size();++i)
+            sum += sorted[i];
+        result.min = sorted.front();
+        result.avg = sum/sorted.size();
+        result.p99 = sorted[std::min(sorted.size()-1, (sorted.size()*99)/100)];
+        result.last = scope.samples.back();
+        result.samples = sorted.size();
+        return result;
+    }
+
+    // background thread that writes the collected lines to the file
+    void writer_loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;)
+        {
+            while(writer_running && pending.empty())
+                pending_available.wait(lock);
+            std::string chunk;
+            chunk.swap(pending);
+            bool running = writer_running;
+            lock.unlock();
+            file << chunk;
+            lock.lock();
+            if(!running && pending.empty())
+                break;
+        }
+    }
+
+    void stop_writer()
+    {
+        if(!writer.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            writer_running = false;
+            pending_available.notify_one();
+        }
+        writer.join();
+        if(json)
+            file << "\n]}\n";
+        file.close();
+    }
+
+    FrameSlot slots[latency];
+    unsigned long long frame;
+    long long gpu_offset;
+    bool clock_synced;
+    std::vector<size_t> stack; // open scopes as indices into the records
+    std::vector<Scope> scopes;
+    std::map<std::pair<std::string, bool>, int> scope_ids;
+
+    std::ofstream file;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable pending_available;
+    std::string pending;
+    bool writer_running;
+    bool json;
+    bool first_event;
+};
+
+// scoped helpers that close the scope at the end of the block
+class GPUScope {
+public:
+    GPUScope(Profiler &p, const char *name) : profiler(p) { profiler.push_gpu(name); }
+    ~GPUScope() { profiler.pop(); }
+private:
+    Profiler &profiler;
+};
+
+class CPUScope {
+public:
+    CPUScope(Profiler &p, const char *name) : profiler(p) { profiler.push_cpu(name); }
+    ~CPUScope() { profiler.pop(); }
+private:
+    Profiler &profiler;
+};
+
+#endif
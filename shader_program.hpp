@@ -0,0 +1,326 @@
+/* OpenGL example code - shader programs
+ *
+ * Compiles and links shader programs and keeps their uniform locations.
+ * link_programs starts compiling and linking all given programs before
+ * it checks the first result, so drivers that compile on background
+ * threads (KHR_parallel_shader_compile or ARB_parallel_shader_compile
+ * raise the thread count) build them concurrently.
+ * Linked programs are stored as program binaries in the asset cache
+ * (see asset_cache.hpp), keyed by the sources and the driver strings.
+ * Later runs load the binary instead of compiling. A driver update
+ * changes the key, a binary the driver rejects anyway is just rebuilt.
+ *
+ * usage:
+ *     ShaderProgram program;
+ *     program.add(GL_VERTEX_SHADER, vertex_source);
+ *     program.add(GL_FRAGMENT_SHADER, fragment_source);
+ *     if(!link_programs({&program, &other_program}))
+ *         return 1;
+ *     GLint location = program.uniform("ViewProjection");
+ *
+ * Outputs captured by transform feedback have to be named before
+ * linking with feedback_varyings, they are part of the cache key.
+ *     glUseProgram(program.id());
+ *     ...
+ *     program.destroy();
+ */
+
+#ifndef SHADER_PROGRAM_HPP
+#define SHADER_PROGRAM_HPP
+
+#include <GLXW/glxw.h>
+
+#include "asset_cache.hpp"
+#include "gl_support.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <cstring>
+#include <initializer_list>
+
+class ShaderProgram {
+public:
+    ShaderProgram() : program(0), from_cache(false), feedback_mode(GL_INTERLEAVED_ATTRIBS), key("program") { }
+
+    // adds a stage, has to be called before linking
+    ShaderProgram& add(GLenum type, const std::string &source)
+    {
+        Stage stage = { type, source, 0 };
+        stages.push_back(stage);
+        return *this;
+    }
+
+    // outputs to capture with transform feedback, in buffer order for
+    // GL_INTERLEAVED_ATTRIBS. has to be called before linking
+    ShaderProgram& feedback_varyings(const std::vector<std::string> &names, GLenum mode)
+    {
+        varyings = names;
+        feedback_mode = mode;
+        return *this;
+    }
+
+    // loads the cached binary or issues the compile and link commands
+    // without waiting for their results
+    void begin_link()
+    {
+        enable_parallel_compile();
+
+        program = glCreateProgram();
+        from_cache = false;
+
+        key = AssetKey("program");
+        std::string driver = driver_string();
+        key.add_bytes(driver.data(), driver.size());
+        for(size_t i = 0;i<stages.size();++i)
+        {
+            key.add(stages[i].type);
+            key.add_bytes(stages[i].source.data(), stages[i].source.size());
+        }
+        if(!varyings.empty())
+        {
+            key.add(feedback_mode);
+            for(size_t i = 0;i<varyings.size();++i)
+                key.add_bytes(varyings[i].c_str(), varyings[i].size()+1);
+        }
+
+        bool binaries = supports_binaries();
+        if(binaries && load_binary())
+        {
+            from_cache = true;
+            return;
+        }
+        if(binaries)
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+        for(size_t i = 0;i<stages.size();++i)
+        {
+            const char *source = stages[i].source.c_str();
+            GLint length = stages[i].source.size();
+            stages[i].shader = glCreateShader(stages[i].type);
+            glShaderSource(stages[i].shader, 1, &source, &length);
+            glCompileShader(stages[i].shader);
+            glAttachShader(program, stages[i].shader);
+        }
+        if(!varyings.empty())
+        {
+            std::vector<const char*> names;
+            for(size_t i = 0;i<varyings.size();++i)
+                names.push_back(varyings[i].c_str());
+            glTransformFeedbackVaryings(program, names.size(), &names[0], feedback_mode);
+        }
+        glLinkProgram(program);
+    }
+
+    // waits for the link started by begin_link, prints the logs of
+    // failed stages and caches the binary. returns false on errors
+    bool finish_link()
+    {
+        bool ok = true;
+        if(!from_cache)
+        {
+            for(size_t i = 0;i<stages.size();++i)
+                if(!check_status(stages[i].shader, false))
+                    ok = false;
+            if(ok && !check_status(program, true))
+                ok = false;
+            if(ok && supports_binaries())
+                store_binary();
+
+            // the stages aren't needed once the program is linked
+            for(size_t i = 0;i<stages.size();++i)
+            {
+                glDetachShader(program, stages[i].shader);
+                glDeleteShader(stages[i].shader);
+                stages[i].shader = 0;
+            }
+        }
+        if(ok)
+            read_uniforms();
+        return ok;
+    }
+
+    bool link()
+    {
+        begin_link();
+        return finish_link();
+    }
+
+    void destroy()
+    {
+        for(size_t i = 0;i<stages.size();++i)
+            if(stages[i].shader != 0)
+                glDeleteShader(stages[i].shader);
+        stages.clear();
+        if(program != 0)
+            glDeleteProgram(program);
+        program = 0;
+        locations.clear();
+    }
+
+    GLuint id() const { return program; }
+
+    // location of a uniform, -1 if the program doesn't use it. arrays
+    // can be looked up with or without [0]
+    GLint uniform(const std::string &name) const
+    {
+        std::map<std::string, GLint>::const_iterator i = locations.find(name);
+        return i == locations.end() ? -1 : i->second;
+    }
+
+    // true if the program was loaded from a cached binary
+    bool cached() const { return from_cache; }
+
+    static bool supports_binaries()
+    {
+        if(!CachedAsset::enabled())
+            return false;
+        if(!version_at_least(4, 1) && !has_extension("GL_ARB_get_program_binary"))
+            return false;
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        return formats > 0;
+    }
+
+private:
+    struct Stage {
+        GLenum type;
+        std::string source;
+        GLuint shader;
+    };
+
+    bool load_binary()
+    {
+        CachedAsset asset;
+        if(!asset.open(key) || asset.size() <= sizeof(GLenum))
+            return false;
+        GLenum format;
+        std::memcpy(&format, asset.data(), sizeof(GLenum));
+        glProgramBinary(program, format, (const char*)asset.data()+sizeof(GLenum), asset.size()-sizeof(GLenum));
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        return status == GL_TRUE;
+    }
+
+    // the cache file holds the binary format followed by the binary
+    void store_binary()
+    {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if(length <= 0)
+            return;
+        CachedAsset asset;
+        char *data = (char*)asset.create(key, sizeof(GLenum)+length);
+        GLenum format = 0;
+        glGetProgramBinary(program, length, &length, &format, data+sizeof(GLenum));
+        std::memcpy(data, &format, sizeof(GLenum));
+        asset.commit();
+    }
+
+    void read_uniforms()
+    {
+        locations.clear();
+        GLint count = 0, max_length = 0;
+        glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+        std::vector<char> name(max_length+1);
+        for(GLint i = 0;i<count;++i)
+        {
+            GLsizei length = 0;
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(program, i, name.size(), &length, &size, &type, &name[0]);
+            std::string uniform_name(&name[0], length);
+            // block members have no location
+            GLint location = glGetUniformLocation(program, uniform_name.c_str());
+            if(location < 0)
+                continue;
+            locations[uniform_name] = location;
+            if(uniform_name.size() > 3 && uniform_name.compare(uniform_name.size()-3, 3, "[0]") == 0)
+                locations[uniform_name.substr(0, uniform_name.size()-3)] = location;
+        }
+    }
+
+    // prints the info log of a shader or program if it failed
+    static bool check_status(GLuint obj, bool is_program)
+    {
+        GLint status;
+        if(is_program)
+            glGetProgramiv(obj, GL_LINK_STATUS, &status);
+        else
+            glGetShaderiv(obj, GL_COMPILE_STATUS, &status);
+        if(status == GL_FALSE)
+        {
+            GLint length = 0;
+            if(is_program)
+                glGetProgramiv(obj, GL_INFO_LOG_LENGTH, &length);
+            else
+                glGetShaderiv(obj, GL_INFO_LOG_LENGTH, &length);
+            std::vector<char> log(length+1);
+            if(is_program)
+                glGetProgramInfoLog(obj, length, &length, &log[0]);
+            else
+                glGetShaderInfoLog(obj, length, &length, &log[0]);
+            std::cerr << &log[0];
+            return false;
+        }
+        return true;
+    }
+
+    // lets the driver use as many compiler threads as it likes
+    static void enable_parallel_compile()
+    {
+        static bool done = false;
+        if(done)
+            return;
+        done = true;
+#ifdef GL_KHR_parallel_shader_compile
+        if(has_extension("GL_KHR_parallel_shader_compile"))
+        {
+            glMaxShaderCompilerThreadsKHR(0xFFFFFFFFu);
+            return;
+        }
+#endif
+#ifdef GL_ARB_parallel_shader_compile
+        if(has_extension("GL_ARB_parallel_shader_compile"))
+            glMaxShaderCompilerThreadsARB(0xFFFFFFFFu);
+#endif
+    }
+
+    static std::string driver_string()
+    {
+        const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+        std::string result;
+        for(size_t i = 0;i<sizeof(names)/sizeof(names[0]);++i)
+        {
+            const char *value = (const char*)glGetString(names[i]);
+            result += value ? value : "";
+            result += '\n';
+        }
+        return result;
+    }
+
+    GLuint program;
+    bool from_cache;
+    std::vector<std::string> varyings;
+    GLenum feedback_mode;
+    AssetKey key;
+    std::vector<Stage> stages;
+    std::map<std::string, GLint> locations;
+};
+
+// starts linking all programs before waiting for any of them, returns
+// false if one of them failed
+inline bool link_programs(std::initializer_list<ShaderProgram*> programs)
+{
+    for(std::initializer_list<ShaderProgram*>::const_iterator i = programs.begin();i!=programs.end();++i)
+        (*i)->begin_link();
+    bool ok = true;
+    for(std::initializer_list<ShaderProgram*>::const_iterator i = programs.begin();i!=programs.end();++i)
+        if(!(*i)->finish_link())
+            ok = false;
+    return ok;
+}
+
+#endif
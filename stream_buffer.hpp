@@ -0,0 +1,176 @@
+/* OpenGL example code - stream buffer
+ *
+ * Ring buffer for data that is rewritten every frame. The buffer is
+ * split into regions that are written one after another. The gpu may
+ * still read a region while the cpu writes the next one, a fence per
+ * region makes sure a region is only reused after the draw calls
+ * reading it have finished.
+ * If ARB_buffer_storage is available the whole buffer is mapped once
+ * persistently and coherently, so writing is just writing to memory.
+ * Otherwise each region is mapped unsynchronized while writing, which
+ * still avoids orphaning the buffer every frame.
+ *
+ * usage:
+ *     StreamBuffer stream;
+ *     stream.init(GL_ARRAY_BUFFER, bytes_per_frame);
+ *     while(running) {
+ *         char *ptr = (char*)stream.begin_write();
+ *         ... write up to bytes_per_frame bytes to ptr ...
+ *         GLintptr offset = stream.end_write();
+ *         ... draw with the data at offset in stream.buffer() ...
+ *         stream.fence();
+ *     }
+ *     stream.destroy();
+ */
+
+#ifndef STREAM_BUFFER_HPP
+#define STREAM_BUFFER_HPP
+
+#include <GLXW/glxw.h>
+
+#include "gl_support.hpp"
+
+#include <vector>
+#include <cstring>
+
+class StreamBuffer {
+public:
+    StreamBuffer() : target(GL_ARRAY_BUFFER), buffer_name(0), region_bytes(0), current(0), writing(false),
+                     persistent_map(false), mapped(0), stall_count(0) { }
+
+    // creates a buffer of regions*size bytes. size is rounded up to the
+    // offset alignment of uniform buffers if target is GL_UNIFORM_BUFFER
+    void init(GLenum buffer_target, GLsizeiptr size, int regions = 3)
+    {
+        target = buffer_target;
+        if(target == GL_UNIFORM_BUFFER)
+        {
+            GLint alignment;
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+            size = (size+alignment-1)/alignment*alignment;
+        }
+        region_bytes = size;
+        fences.assign(regions, (GLsync)0);
+        current = 0;
+        writing = false;
+        stall_count = 0;
+
+        glGenBuffers(1, &buffer_name);
+        glBindBuffer(target, buffer_name);
+
+        persistent_map = supports_persistent();
+        if(persistent_map)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(target, region_bytes*regions, 0, flags);
+            mapped = (char*)glMapBufferRange(target, 0, region_bytes*regions, flags);
+        }
+        else
+        {
+            glBufferData(target, region_bytes*regions, 0, GL_STREAM_DRAW);
+            mapped = 0;
+        }
+    }
+
+    void destroy()
+    {
+        for(size_t i = 0;i<fences.size();++i)
+            if(fences[i] != 0)
+                glDeleteSync(fences[i]);
+        fences.clear();
+        if(buffer_name != 0)
+        {
+            if(persistent_map)
+            {
+                glBindBuffer(target, buffer_name);
+                glUnmapBuffer(target);
+            }
+            glDeleteBuffers(1, &buffer_name);
+        }
+        buffer_name = 0;
+        mapped = 0;
+    }
+
+    // waits until the next region is no longer read by the gpu and
+    // returns a pointer to it
+    void* begin_write()
+    {
+        current = (current+1)%fences.size();
+        wait(fences[current]);
+        writing = true;
+        if(persistent_map)
+            return mapped + current*region_bytes;
+
+        glBindBuffer(target, buffer_name);
+        return glMapBufferRange(target, current*region_bytes, region_bytes,
+                                GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+    }
+
+    // finishes writing and returns the offset of the written region in
+    // bytes. leaves the buffer bound to the target
+    GLintptr end_write()
+    {
+        glBindBuffer(target, buffer_name);
+        if(!persistent_map && writing)
+            glUnmapBuffer(target);
+        writing = false;
+        return offset();
+    }
+
+    // has to be called after the commands reading the current region
+    void fence()
+    {
+        if(fences[current] != 0)
+            glDeleteSync(fences[current]);
+        fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    GLuint buffer() const { return buffer_name; }
+    GLintptr offset() const { return current*region_bytes; }
+    GLsizeiptr region_size() const { return region_bytes; }
+    bool persistent() const { return persistent_map; }
+
+    // number of times begin_write had to wait for the gpu
+    int stalls() const { return stall_count; }
+
+    // persistent mapping needs GL 4.4 or ARB_buffer_storage
+    static bool supports_persistent()
+    {
+        return version_at_least(4, 4) || has_extension("GL_ARB_buffer_storage");
+    }
+
+private:
+    void wait(GLsync &sync)
+    {
+        if(sync == 0)
+            return;
+        // flush on the first try so the fence is guaranteed to signal
+        GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+        for(;;)
+        {
+            GLenum result = glClientWaitSync(sync, flags, 1000000);
+            if(result == GL_ALREADY_SIGNALED || result == GL_WAIT_FAILED)
+                break;
+            if(result == GL_CONDITION_SATISFIED)
+            {
+                ++stall_count;
+                break;
+            }
+            flags = 0;
+        }
+        glDeleteSync(sync);
+        sync = 0;
+    }
+
+    GLenum target;
+    GLuint buffer_name;
+    GLsizeiptr region_bytes;
+    size_t current;
+    bool writing;
+    bool persistent_map;
+    char *mapped;
+    std::vector<GLsync> fences;
+    int stall_count;
+};
+
+#endif
@@ -0,0 +1,445 @@
+/* OpenGL example code - texture loader
+ *
+ * Creates textures whose data is generated (or decoded) off the render
+ * thread. load allocates the texture right away, with immutable storage
+ * (glTexStorage2D) where GL 4.2 or ARB_texture_storage is available, and
+ * maps a pixel buffer object for its data. A loader thread fills the
+ * mapped memory, the rows of one texture are spread over all cores with
+ * parallel_for. update, called once per frame on the render thread,
+ * copies finished textures from their pixel buffer with glTexSubImage2D,
+ * which returns without waiting for the copy, and generates the mip
+ * levels.
+ * Textures loaded with compress set are stored as BC1 (S3TC DXT1) if
+ * EXT_texture_compression_s3tc is available. The loader thread builds
+ * the mip levels and encodes them itself since compressed textures
+ * can't use glGenerateMipmap. The data has to be GL_RGBA/GL_UNSIGNED_BYTE
+ * then, its alpha is dropped.
+ *
+ * usage:
+ *     TextureLoader loader;
+ *     loader.start();
+ *     GLuint texture = loader.load(width, height, TextureFormat::rgba8(), true, false,
+ *         [&](int begin, int end, void *data) { ... fill rows [begin,end) ... });
+ *     while(running) {
+ *         loader.update();
+ *         if(loader.ready(texture))
+ *             ... draw with texture ...
+ *     }
+ *     loader.stop();
+ */
+
+#ifndef TEXTURE_LOADER_HPP
+#define TEXTURE_LOADER_HPP
+
+#include <GLXW/glxw.h>
+
+#include "asset_cache.hpp"
+#include "gl_support.hpp"
+
+#include <list>
+#include <deque>
+#include <vector>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+// the sized storage format and the format of the generated data
+struct TextureFormat {
+    GLenum internal_format;
+    GLenum format, type;
+    int bytes_per_pixel;
+
+    static TextureFormat rgba8()
+    {
+        TextureFormat result = { GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4 };
+        return result;
+    }
+
+    // internal_format can also be a 16 bit float format, the data is
+    // converted during the upload
+    static TextureFormat rgba_float(GLenum internal_format = GL_RGBA32F)
+    {
+        TextureFormat result = { internal_format, GL_RGBA, GL_FLOAT, 16 };
+        return result;
+    }
+};
+
+class TextureLoader {
+public:
+    // fills the rows [begin,end) of the first level, data points to the
+    // start of the level and rows are width*bytes_per_pixel apart
+    typedef std::function<void(int begin, int end, void *data)> Generator;
+
+    TextureLoader() : running(false), compression(false), storage(false) { }
+
+    void start()
+    {
+        storage = supports_storage();
+        compression = supports_bc1();
+        running = true;
+        thread = std::thread(&TextureLoader::worker, this);
+    }
+
+    // waits for the loader thread, the textures stay valid. unfinished
+    // loads are dropped
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+            queue_cv.notify_all();
+        }
+        if(thread.joinable())
+            thread.join();
+        for(std::list<Job>::iterator i = jobs.begin();i!=jobs.end();++i)
+            release(*i);
+        jobs.clear();
+        queue.clear();
+    }
+
+    // allocates a texture and starts filling it in the background. the
+    // texture is left bound to GL_TEXTURE_2D so the caller can set its
+    // parameters. without generate only the storage is allocated
+    GLuint load(int width, int height, TextureFormat format, bool mipmaps, bool compress, Generator generate)
+    {
+        Job job;
+        job.width = width;
+        job.height = height;
+        job.format = format;
+        job.compressed = compress && compression && format.type == GL_UNSIGNED_BYTE && format.bytes_per_pixel == 4;
+        job.levels = mipmaps ? level_count(width, height) : 1;
+        job.generate = generate;
+        job.buffer = 0;
+        job.mapped = 0;
+        job.done = false;
+
+        GLenum internal_format = job.compressed ? GLenum(GL_COMPRESSED_RGB_S3TC_DXT1_EXT) : format.internal_format;
+        glGenTextures(1, &job.texture);
+        glBindTexture(GL_TEXTURE_2D, job.texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, job.levels-1);
+        allocate(job, internal_format);
+
+        if(!generate)
+            return job.texture;
+
+        // the compressed levels follow each other in the buffer, the
+        // uncompressed path only uploads the first level
+        size_t bytes = 0;
+        for(int level = 0;level<(job.compressed ? job.levels : 1);++level)
+        {
+            job.offsets.push_back(bytes);
+            bytes += level_bytes(job, level);
+        }
+        glGenBuffers(1, &job.buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job.buffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, 0, GL_STREAM_DRAW);
+        job.mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        jobs.push_back(job);
+        loading.insert(job.texture);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(&jobs.back());
+            queue_cv.notify_one();
+        }
+        return job.texture;
+    }
+
+    // uploads the textures the loader thread has finished. returns the
+    // number of textures that are still loading
+    size_t update()
+    {
+        for(std::list<Job>::iterator i = jobs.begin();i!=jobs.end();)
+        {
+            bool done;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done = i->done;
+            }
+            if(!done)
+            {
+                ++i;
+                continue;
+            }
+            upload(*i);
+            loading.erase(i->texture);
+            i = jobs.erase(i);
+        }
+        return jobs.size();
+    }
+
+    bool ready(GLuint texture) const { return loading.count(texture) == 0; }
+
+    // true if compress actually gives BC1 textures
+    bool compressed_supported() const { return compression; }
+
+    static bool supports_storage() { return version_at_least(4, 2) || has_extension("GL_ARB_texture_storage"); }
+
+    static bool supports_bc1() { return has_extension("GL_EXT_texture_compression_s3tc"); }
+
+    static int level_count(int width, int height)
+    {
+        int levels = 1;
+        while((width|height) >> levels)
+            ++levels;
+        return levels;
+    }
+
+private:
+    struct Job {
+        GLuint texture, buffer;
+        int width, height, levels;
+        TextureFormat format;
+        bool compressed;
+        Generator generate;
+        void *mapped;
+        std::vector<size_t> offsets;
+        bool done;
+    };
+
+    void allocate(const Job &job, GLenum internal_format)
+    {
+        if(storage)
+        {
+            glTexStorage2D(GL_TEXTURE_2D, job.levels, internal_format, job.width, job.height);
+            return;
+        }
+        for(int level = 0;level<job.levels;++level)
+        {
+            int w = std::max(1, job.width >> level);
+            int h = std::max(1, job.height >> level);
+            if(job.compressed)
+                glCompressedTexImage2D(GL_TEXTURE_2D, level, internal_format, w, h, 0, level_bytes(job, level), 0);
+            else
+                glTexImage2D(GL_TEXTURE_2D, level, internal_format, w, h, 0, job.format.format, job.format.type, 0);
+        }
+    }
+
+    size_t level_bytes(const Job &job, int level) const
+    {
+        size_t w = std::max(1, job.width >> level);
+        size_t h = std::max(1, job.height >> level);
+        if(job.compressed)
+            return (w+3)/4*((h+3)/4)*8;
+        return w*h*job.format.bytes_per_pixel;
+    }
+
+    // issues the copies from the pixel buffer, they run asynchronously
+    // and the buffer is only deleted once they are done
+    void upload(Job &job)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job.buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        job.mapped = 0;
+        glBindTexture(GL_TEXTURE_2D, job.texture);
+        if(job.compressed)
+        {
+            for(int level = 0;level<job.levels;++level)
+                glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, std::max(1, job.width >> level), std::max(1, job.height >> level),
+                                          GL_COMPRESSED_RGB_S3TC_DXT1_EXT, level_bytes(job, level), (char*)0 + job.offsets[level]);
+        }
+        else
+        {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, job.width, job.height, job.format.format, job.format.type, 0);
+            if(job.levels > 1)
+                glGenerateMipmap(GL_TEXTURE_2D);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &job.buffer);
+        job.buffer = 0;
+    }
+
+    void release(Job &job)
+    {
+        if(job.buffer == 0)
+            return;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job.buffer);
+        if(job.mapped != 0)
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &job.buffer);
+        job.buffer = 0;
+        loading.erase(job.texture);
+    }
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;)
+        {
+            while(running && queue.empty())
+                queue_cv.wait(lock);
+            if(!running)
+                return;
+            Job *job = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            fill(*job);
+            lock.lock();
+            job->done = true;
+        }
+    }
+
+    // runs on the loader thread, doesn't touch gl
+    static void fill(Job &job)
+    {
+        const Generator &generate = job.generate;
+        if(!job.compressed)
+        {
+            void *data = job.mapped;
+            parallel_for(job.height, [&](int begin, int end) { generate(begin, end, data); });
+            return;
+        }
+
+        // generate the first level in memory, then box filter the
+        // others from it and encode each one
+        std::vector<GLubyte> image(4*size_t(job.width)*job.height);
+        parallel_for(job.height, [&](int begin, int end) { generate(begin, end, &image[0]); });
+        int w = job.width, h = job.height;
+        for(int level = 0;level<job.levels;++level)
+        {
+            GLubyte *out = (GLubyte*)job.mapped + job.offsets[level];
+            int block_rows = (h+3)/4;
+            parallel_for(block_rows, [&](int begin, int end) { encode_bc1(&image[0], w, h, begin, end, out); });
+            if(level+1 < job.levels)
+            {
+                int nw = std::max(1, w/2), nh = std::max(1, h/2);
+                std::vector<GLubyte> next(4*size_t(nw)*nh);
+                downsample(&image[0], w, h, &next[0], nw, nh);
+                image.swap(next);
+                w = nw;
+                h = nh;
+            }
+        }
+    }
+
+    // averages 2x2 pixels, odd sizes clamp at the edge
+    static void downsample(const GLubyte *src, int w, int h, GLubyte *dst, int nw, int nh)
+    {
+        for(int y = 0;y<nh;++y)
+            for(int x = 0;x<nw;++x)
+            {
+                int x0 = std::min(2*x, w-1), x1 = std::min(2*x+1, w-1);
+                int y0 = std::min(2*y, h-1), y1 = std::min(2*y+1, h-1);
+                for(int c = 0;c<4;++c)
+                {
+                    int sum = src[4*(y0*w+x0)+c] + src[4*(y0*w+x1)+c] + src[4*(y1*w+x0)+c] + src[4*(y1*w+x1)+c];
+                    dst[4*(y*nw+x)+c] = (sum+2)/4;
+                }
+            }
+    }
+
+    // encodes the block rows [begin,end) of a w*h rgba8 image
+    static void encode_bc1(const GLubyte *image, int w, int h, int begin, int end, GLubyte *out)
+    {
+        int block_columns = (w+3)/4;
+        for(int by = begin;by<end;++by)
+            for(int bx = 0;bx<block_columns;++bx)
+            {
+                // pixels outside the image repeat the edge
+                GLubyte block[16][3];
+                for(int i = 0;i<16;++i)
+                {
+                    int x = std::min(4*bx + i%4, w-1);
+                    int y = std::min(4*by + i/4, h-1);
+                    std::memcpy(block[i], image + 4*(size_t(y)*w+x), 3);
+                }
+                encode_bc1_block(block, out + 8*(size_t(by)*block_columns+bx));
+            }
+    }
+
+    // a range fit: the end points are the corners of the bounding box
+    // of the block colors, slightly inset, and every pixel takes the
+    // closest of the four palette colors
+    static void encode_bc1_block(const GLubyte block[16][3], GLubyte out[8])
+    {
+        int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+        for(int i = 0;i<16;++i)
+            for(int c = 0;c<3;++c)
+            {
+                lo[c] = std::min(lo[c], int(block[i][c]));
+                hi[c] = std::max(hi[c], int(block[i][c]));
+            }
+        for(int c = 0;c<3;++c)
+        {
+            int inset = (hi[c]-lo[c]) >> 4;
+            lo[c] += inset;
+            hi[c] -= inset;
+        }
+
+        // hi >= lo in every channel so c0 >= c1, which selects the four
+        // color mode unless both are equal
+        GLushort c0 = to_565(hi), c1 = to_565(lo);
+        int palette[4][3];
+        from_565(c0, palette[0]);
+        from_565(c1, palette[1]);
+        for(int c = 0;c<3;++c)
+        {
+            palette[2][c] = (2*palette[0][c] + palette[1][c])/3;
+            palette[3][c] = (palette[0][c] + 2*palette[1][c])/3;
+        }
+
+        GLuint indices = 0;
+        if(c0 != c1)
+        {
+            for(int i = 0;i<16;++i)
+            {
+                int best = 0, best_error = 1 << 30;
+                for(int p = 0;p<4;++p)
+                {
+                    int error = 0;
+                    for(int c = 0;c<3;++c)
+                    {
+                        int d = int(block[i][c]) - palette[p][c];
+                        error += d*d;
+                    }
+                    if(error < best_error)
+                    {
+                        best = p;
+                        best_error = error;
+                    }
+                }
+                indices |= GLuint(best) << (2*i);
+            }
+        }
+
+        out[0] = c0 & 0xff; out[1] = c0 >> 8;
+        out[2] = c1 & 0xff; out[3] = c1 >> 8;
+        for(int i = 0;i<4;++i)
+            out[4+i] = (indices >> (8*i)) & 0xff;
+    }
+
+    static GLushort to_565(const int color[3])
+    {
+        return GLushort(((color[0]*31+127)/255 << 11) | ((color[1]*63+127)/255 << 5) | ((color[2]*31+127)/255));
+    }
+
+    static void from_565(GLushort value, int color[3])
+    {
+        int r = (value >> 11) & 31, g = (value >> 5) & 63, b = value & 31;
+        color[0] = (r << 3) | (r >> 2);
+        color[1] = (g << 2) | (g >> 4);
+        color[2] = (b << 3) | (b >> 2);
+    }
+
+    std::list<Job> jobs;
+    std::set<GLuint> loading;
+    std::deque<Job*> queue;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable queue_cv;
+    bool running;
+    bool compression;
+    bool storage;
+};
+
+#endif
@@ -0,0 +1,143 @@
+/* OpenGL example code - thread pool
+ *
+ * A few persistent worker threads that split a range of work between
+ * them. Starting threads every frame costs more than the work itself
+ * for small ranges, these threads just wait on a condition variable
+ * between tasks.
+ * run splits the range between the workers and the calling thread and
+ * returns once all of it is done. begin only hands the range to the
+ * workers and returns right away, so the calling thread can do other
+ * work (like drawing) until wait.
+ * Several threads can share a pool through run, their calls take turns.
+ * begin and wait are meant for a pool only one thread uses.
+ *
+ * usage:
+ *     ThreadPool pool;
+ *     pool.start(std::thread::hardware_concurrency()-1);
+ *     pool.run([&](int begin, int end) { ... }, count);
+ *     pool.begin([=](int begin, int end) { ... }, count);
+ *     ... draw ...
+ *     pool.wait();
+ *     pool.stop();
+ */
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class ThreadPool {
+public:
+    typedef std::function<void(int, int)> Task;
+
+    ThreadPool() : count(0), parts(0), pending(0), generation(0), running(false) { }
+    ~ThreadPool() { stop(); }
+
+    void start(int threadcount)
+    {
+        running = true;
+        for(int i = 0;i<threadcount;++i)
+            threads.push_back(std::thread(&ThreadPool::worker, this, i));
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+            start_cv.notify_all();
+        }
+        for(size_t i = 0;i<threads.size();++i)
+            threads[i].join();
+        threads.clear();
+    }
+
+    // calls f(begin, end) for ranges covering [0, n) and waits until
+    // all are done. the ranges start at multiples of four
+    void run(const Task &f, int n)
+    {
+        std::lock_guard<std::mutex> lock(run_mutex);
+        dispatch(f, n, threads.size()+1);
+        run_range(f, n, threads.size(), threads.size()+1);
+        wait();
+    }
+
+    // like run but only the workers call f, wait has to be called
+    // before the next task. without workers f runs right here
+    void begin(const Task &f, int n)
+    {
+        if(threads.empty())
+            f(0, n);
+        else
+            dispatch(f, n, threads.size());
+    }
+
+    // waits until the last task is done
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(pending > 0)
+            done_cv.wait(lock);
+    }
+
+    int size() const { return threads.size(); }
+
+private:
+    void dispatch(const Task &f, int n, int part_count)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = f;
+        count = n;
+        parts = part_count;
+        pending = threads.size();
+        ++generation;
+        start_cv.notify_all();
+    }
+
+    static void run_range(const Task &f, int n, int index, int parts)
+    {
+        int begin = (n/4)*index/parts*4;
+        int end = index+1 == parts ? n : (n/4)*(index+1)/parts*4;
+        if(begin < end)
+            f(begin, end);
+    }
+
+    void worker(int index)
+    {
+        unsigned long long seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;)
+        {
+            while(running && generation == seen)
+                start_cv.wait(lock);
+            if(!running)
+                return;
+            seen = generation;
+            // the task isn't replaced before pending drops to zero
+            const Task &f = task;
+            int n = count, p = parts;
+            lock.unlock();
+            run_range(f, n, index, p);
+            lock.lock();
+            if(--pending == 0)
+                done_cv.notify_all();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable start_cv, done_cv;
+    Task task;
+    int count;
+    int parts;
+    int pending;
+    unsigned long long generation;
+    bool running;
+};
+
+#endif